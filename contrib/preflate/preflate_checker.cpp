@@ -127,7 +127,7 @@ bool preflate_checker(const std::vector<unsigned char>& deflate_raw) {
       pcodecE.encodeValue(remaining_bits & ((1 << (bitsToSave - 1)) - 1), bitsToSave - 1);
     }
   }
-  if (!codecE.endMetaBlock(pcodecE, unpacked_output.size())) {
+  if (!codecE.endMetaBlock(pcodecE, unpacked_output.size(), 0)) {
     return false;
   }
   std::vector<unsigned char> preflate_diff = codecE.finish();
@@ -20,7 +20,7 @@
 PreflateCompLevelEstimatorState::PreflateCompLevelEstimatorState(
     const int wbits,
     const int mbits,
-    const std::vector<unsigned char>& unpacked_output_,
+    const std::span<const unsigned char> unpacked_output_,
     const size_t off0_,
     const std::vector<PreflateTokenBlock>& blocks_)
   : slowHash(unpacked_output_, mbits)
@@ -210,7 +210,7 @@ void PreflateCompLevelEstimatorState::recommend() {
 PreflateCompLevelInfo estimatePreflateCompLevel(
     const int wbits, 
     const int mbits,
-    const std::vector<unsigned char>& unpacked_output,
+    const std::span<const unsigned char> unpacked_output,
     const size_t off0,
     const std::vector<PreflateTokenBlock>& blocks,
     const bool early_out) {
@@ -45,7 +45,7 @@ struct PreflateCompLevelEstimatorState {
   size_t off0;
 
   PreflateCompLevelEstimatorState(const int wbits, const int mbits,
-                                  const std::vector<unsigned char>& unpacked_output,
+                                  const std::span<const unsigned char> unpacked_output,
                                   const size_t off0,
                                   const std::vector<PreflateTokenBlock>& blocks);
   void updateHash(const unsigned len);
@@ -68,7 +68,7 @@ private:
 PreflateCompLevelInfo estimatePreflateCompLevel(
     const int wbits, 
     const int mbits,
-    const std::vector<unsigned char>& unpacked_output,
+    const std::span<const unsigned char> unpacked_output,
     const size_t off0,
     const std::vector<PreflateTokenBlock>& blocks,
     const bool early_out);
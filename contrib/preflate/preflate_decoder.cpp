@@ -13,6 +13,7 @@
    limitations under the License. */
 
 #include <string.h>
+#include <atomic>
 #include <functional>
 #include "preflate_block_decoder.h"
 #include "preflate_decoder.h"
@@ -37,20 +38,27 @@ public:
     return encoder.error();
   }
 
-  virtual uint32_t setModel(const PreflateStatisticsCounter& counters, const PreflateParameters& parameters) {
+  virtual uint32_t setModel(const uint32_t metaBlockId, const PreflateStatisticsCounter& counters, const PreflateParameters& parameters) {
+    if (metaBlockId == 0) {
+      firstParameters = parameters;
+      hasFirstParameters = true;
+    }
     return encoder.addModel(counters, parameters);
   }
   virtual bool beginEncoding(const uint32_t metaBlockId, PreflatePredictionEncoder& codec, const uint32_t modelId) {
     return encoder.beginMetaBlockWithModel(codec, modelId);
   }
   virtual bool endEncoding(const uint32_t metaBlockId, PreflatePredictionEncoder& codec, const size_t uncompressedSize) {
-    return encoder.endMetaBlock(codec, uncompressedSize);
+    return encoder.endMetaBlock(codec, uncompressedSize, metaBlockId);
   }
   virtual void markProgress() {
     std::unique_lock<std::mutex> lock(this->_mutex);
     progressCallback();
   }
 
+  bool hasFirstParameters = false;
+  PreflateParameters firstParameters;
+
 private:
   PreflateMetaEncoder encoder;
   std::function<void(void)> progressCallback;
@@ -60,24 +68,24 @@ private:
 PreflateDecoderTask::PreflateDecoderTask(PreflateDecoderTask::Handler& handler_,
                                          const uint32_t metaBlockId_,
                                          std::vector<PreflateTokenBlock>&& tokenData_,
-                                         std::vector<uint8_t>&& uncompressedData_,
+                                         OutputCacheView&& uncompressedData_,
                                          const size_t uncompressedOffset_,
                                          const bool lastMetaBlock_,
                                          const uint32_t paddingBits_)
   : handler(handler_)
   , metaBlockId(metaBlockId_)
-  , tokenData(tokenData_)
-  , uncompressedData(uncompressedData_)
+  , tokenData(std::move(tokenData_))
+  , uncompressedData(std::move(uncompressedData_))
   , uncompressedOffset(uncompressedOffset_)
   , lastMetaBlock(lastMetaBlock_)
   , paddingBits(paddingBits_) {
 }
 
 bool PreflateDecoderTask::analyze() {
-  params = estimatePreflateParameters(uncompressedData, uncompressedOffset, tokenData);
+  params = estimatePreflateParameters(uncompressedData.data, uncompressedOffset, tokenData);
   memset(&counter, 0, sizeof(counter));
-  tokenPredictor.reset(new PreflateTokenPredictor(params, uncompressedData, uncompressedOffset));
-  treePredictor.reset(new PreflateTreePredictor(uncompressedData, uncompressedOffset));
+  tokenPredictor.reset(new PreflateTokenPredictor(params, uncompressedData.data, uncompressedOffset));
+  treePredictor.reset(new PreflateTreePredictor(uncompressedData.data, uncompressedOffset));
   for (unsigned i = 0, n = tokenData.size(); i < n; ++i) {
     tokenPredictor->analyzeBlock(i, tokenData[i]);
     treePredictor->analyzeBlock(i, tokenData[i]);
@@ -94,7 +102,7 @@ bool PreflateDecoderTask::analyze() {
 
 bool PreflateDecoderTask::encode() {
   PreflatePredictionEncoder pcodec;
-  unsigned modelId = handler.setModel(counter, params);
+  unsigned modelId = handler.setModel(metaBlockId, counter, params);
   if (!handler.beginEncoding(metaBlockId, pcodec, modelId)) {
     return false;
   }
@@ -118,7 +126,7 @@ bool PreflateDecoderTask::encode() {
       }
     }
   }
-  return handler.endEncoding(metaBlockId, pcodec, uncompressedData.size() - uncompressedOffset);
+  return handler.endEncoding(metaBlockId, pcodec, uncompressedData.data.size() - uncompressedOffset);
 }
 
 bool preflate_decode(OutputStream& unpacked_output,
@@ -127,7 +135,8 @@ bool preflate_decode(OutputStream& unpacked_output,
                      InputStream& deflate_raw,
                      std::function<void(void)> block_callback,
                      const size_t min_deflate_size,
-                     const size_t metaBlockSize) {
+                     const size_t metaBlockSize,
+                     PreflateParameters* estimatedParameters) {
   deflate_size = 0;
   uint64_t deflate_bits = 0;
   size_t prevBitPos = 0;
@@ -151,7 +160,7 @@ bool preflate_decode(OutputStream& unpacked_output,
 
   std::queue<std::future<std::shared_ptr<PreflateDecoderTask>>> futureQueue;
   size_t queueLimit = std::min(2 * globalTaskPool.extraThreadCount(), (1 << 26) / MBThreshold);
-  bool fail = false;
+  std::atomic<bool> fail = false;
 
   do {
     PreflateTokenBlock newBlock;
@@ -205,9 +214,9 @@ bool preflate_decode(OutputStream& unpacked_output,
 
       size_t uncompressedOffset = MBcount == 0 ? 0 : 1 << 15;
 
-      std::vector<uint8_t> uncompressedDataForMeta(
-        decOutCache.cacheData(uncompressedMetaStart - uncompressedOffset),
-        decOutCache.cacheData(uncompressedMetaStart - uncompressedOffset) + blockSizeSum + uncompressedOffset);
+      // the task works directly on the cache, which keeps the viewed memory alive until the task is done
+      OutputCacheView uncompressedDataForMeta = decOutCache.cacheView(
+        uncompressedMetaStart - uncompressedOffset, uncompressedMetaStart + blockSizeSum);
       uncompressedMetaStart += blockSizeSum;
 
       size_t paddingBits = 0;
@@ -233,7 +242,7 @@ bool preflate_decode(OutputStream& unpacked_output,
           std::future<std::shared_ptr<PreflateDecoderTask>> first = std::move(futureQueue.front());
           futureQueue.pop();
           std::shared_ptr<PreflateDecoderTask> data = first.get();
-          if (!data || !data->encode()) {
+          if (!data) {
             fail = true;
             break;
           }
@@ -244,8 +253,9 @@ bool preflate_decode(OutputStream& unpacked_output,
                                             std::move(uncompressedDataForMeta),
                                             uncompressedOffset,
                                             last, paddingBits));
-        futureQueue.push(globalTaskPool.addTask([ptask,&fail]() {
-          if (!fail && ptask->analyze()) {
+        // each meta block is encoded into its own buffer, the meta encoder puts them back in order
+        futureQueue.push(globalTaskPool.addTask("preflate analyze/encode", [ptask,&fail]() {
+          if (!fail && ptask->analyze() && ptask->encode()) {
             return ptask;
           } else {
             return std::shared_ptr<PreflateDecoderTask>();
@@ -262,7 +272,7 @@ bool preflate_decode(OutputStream& unpacked_output,
     std::future<std::shared_ptr<PreflateDecoderTask>> first = std::move(futureQueue.front());
     futureQueue.pop();
     std::shared_ptr<PreflateDecoderTask> data = first.get();
-    if (fail || !data || !data->encode()) {
+    if (fail || !data) {
       fail = true;
     }
   }
@@ -271,6 +281,9 @@ bool preflate_decode(OutputStream& unpacked_output,
   if (deflate_size < min_deflate_size) {
     return false;
   }
+  if (estimatedParameters && encoder.hasFirstParameters) {
+    *estimatedParameters = encoder.firstParameters;
+  }
   return !fail && encoder.finish(preflate_diff);
 }
 
@@ -20,6 +20,7 @@
 #include <vector>
 #include "preflate_statistical_codec.h"
 #include "preflate_token.h"
+#include "support/outputcachestream.h"
 #include "support/stream.h"
 #include "support/task_pool.h"
 
@@ -31,7 +32,7 @@ public:
   class Handler {
   public:
     virtual ~Handler() {}
-    virtual uint32_t setModel(const PreflateStatisticsCounter&, const PreflateParameters&) = 0;
+    virtual uint32_t setModel(const uint32_t metaBlockId, const PreflateStatisticsCounter&, const PreflateParameters&) = 0;
     virtual bool beginEncoding(const uint32_t metaBlockId, PreflatePredictionEncoder&, const uint32_t modelId) = 0;
     virtual bool endEncoding(const uint32_t metaBlockId, PreflatePredictionEncoder&, const size_t uncompressedSize) = 0;
     virtual void markProgress() = 0;
@@ -40,7 +41,7 @@ public:
   PreflateDecoderTask(Handler& handler,
                       const uint32_t metaBlockId, 
                       std::vector<PreflateTokenBlock>&& tokenData,
-                      std::vector<uint8_t>&& uncompressedData,
+                      OutputCacheView&& uncompressedData,
                       const size_t uncompressedOffset,
                       const bool lastMetaBlock,
                       const uint32_t paddingBits);
@@ -55,7 +56,7 @@ private:
   Handler& handler;
   uint32_t metaBlockId;
   std::vector<PreflateTokenBlock> tokenData;
-  std::vector<uint8_t> uncompressedData;
+  OutputCacheView uncompressedData;
   size_t uncompressedOffset;
   bool lastMetaBlock;
   uint32_t paddingBits;
@@ -72,7 +73,8 @@ bool preflate_decode(OutputStream& unpacked_output,
                      InputStream& deflate_raw,
                      std::function<void(void)> block_callback,
                      const size_t min_deflate_size,
-                     const size_t metaBlockSize = INT32_MAX);
+                     const size_t metaBlockSize = INT32_MAX,
+                     PreflateParameters* estimatedParameters = nullptr);
 
 bool preflate_decode(std::vector<unsigned char>& unpacked_output,
                      std::vector<unsigned char>& preflate_diff,
@@ -17,8 +17,14 @@
 #include "preflate_constants.h"
 #include "preflate_hash_chain.h"
 
+void* (*preflateHashChainMemoryHook)(void* token, long long bytes) = nullptr;
+
+static long long hashChainTablesSize(const unsigned short hashMask) {
+  return sizeof(short) * (hashMask + 1) + sizeof(short) * (1 << 16) + sizeof(unsigned) * (1 << 16);
+}
+
 PreflateHashChainExt::PreflateHashChainExt(
-    const std::vector<unsigned char>& input_,
+    const std::span<const unsigned char> input_,
     const unsigned char memLevel)
   : _input(input_)
   , totalShift(-8) {
@@ -31,6 +37,7 @@ PreflateHashChainExt::PreflateHashChainExt(
   memset(head, 0, sizeof(short) * (hashMask + 1));
   memset(prev, 0, sizeof(short) * (1 << 16));
   memset(chainDepth, 0, sizeof(unsigned) * (1 << 16));
+  memoryHookToken = preflateHashChainMemoryHook != nullptr ? preflateHashChainMemoryHook(nullptr, hashChainTablesSize(hashMask)) : nullptr;
   runningHash = 0;
   if (_input.remaining() > 2) {
     updateRunningHash(_input.curChar(0));
@@ -38,6 +45,7 @@ PreflateHashChainExt::PreflateHashChainExt(
   }
 }
 PreflateHashChainExt::~PreflateHashChainExt() {
+  if (preflateHashChainMemoryHook != nullptr) preflateHashChainMemoryHook(memoryHookToken, -hashChainTablesSize(hashMask));
   delete[] head;
   delete[] chainDepth;
   delete[] prev;
@@ -64,6 +64,10 @@ struct PreflateHashIterator {
   }
 };
 
+// If set, called when a hash chain allocates its tables, with their size in bytes and a null token, and when it frees them, with the negated size and
+// whatever the first call returned as token, so the embedding application can account for the memory they use
+extern void* (*preflateHashChainMemoryHook)(void* token, long long bytes);
+
 struct PreflateHashChainExt {
   PreflateInput _input;
   unsigned short* head;
@@ -72,8 +76,9 @@ struct PreflateHashChainExt {
   unsigned char hashBits, hashShift;
   unsigned short runningHash, hashMask;
   unsigned totalShift;
+  void* memoryHookToken;
 
-  PreflateHashChainExt(const std::vector<unsigned char>& input_, const unsigned char memLevel);
+  PreflateHashChainExt(const std::span<const unsigned char> input_, const unsigned char memLevel);
   ~PreflateHashChainExt();
 
   unsigned nextHash(const unsigned char b) const {
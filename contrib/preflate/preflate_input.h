@@ -15,12 +15,13 @@
 #ifndef PREFLATE_INPUT_H
 #define PREFLATE_INPUT_H
 
+#include <span>
 #include <vector>
 
 class PreflateInput {
 public:
-  PreflateInput(const std::vector<unsigned char>& v)
-    : _data(v.size() > 0 ? &v[0] : nullptr), _size(v.size()), _pos(0) {}
+  PreflateInput(const std::span<const unsigned char> v)
+    : _data(v.size() > 0 ? v.data() : nullptr), _size(v.size()), _pos(0) {}
 
   const unsigned pos() const {
     return _pos;
@@ -61,7 +61,7 @@ PreflateHuffStrategy estimatePreflateHuffStrategy(const PreflateStreamInfo& info
   return PREFLATE_HUFF_MIXED;
 }
 
-PreflateParameters estimatePreflateParameters(const std::vector<unsigned char>& unpacked_output,
+PreflateParameters estimatePreflateParameters(const std::span<const unsigned char> unpacked_output,
                                               const size_t off0,
                                               const std::vector<PreflateTokenBlock>& blocks) {
   PreflateStreamInfo info = extractPreflateInfo(blocks);
@@ -48,6 +48,7 @@
 * possible, but not planned right now.
 */
 
+#include <span>
 #include "preflate_info.h"
 #include "preflate_parser_config.h"
 #include "preflate_token.h"
@@ -103,7 +104,7 @@ PreflateStrategy estimatePreflateStrategy(const PreflateStreamInfo&);
 PreflateHuffStrategy estimatePreflateHuffStrategy(const PreflateStreamInfo&);
 unsigned char estimatePreflateWindowBits(const unsigned maxDist);
 
-PreflateParameters estimatePreflateParameters(const std::vector<unsigned char>& unpacked_output,
+PreflateParameters estimatePreflateParameters(const std::span<const unsigned char> unpacked_output,
                                               const size_t off0,
                                               const std::vector<PreflateTokenBlock>& blocks);
 
@@ -12,6 +12,7 @@
    See the License for the specific language governing permissions and
    limitations under the License. */
 
+#include <atomic>
 #include <functional>
 #include "preflate_block_reencoder.h"
 #include "preflate_reencoder.h"
@@ -154,7 +155,7 @@ bool preflate_reencode(OutputStream& os,
     maxMetaBlockSize = std::max(maxMetaBlockSize, decoder.metaBlockUncompressedSize(j));
   }
   size_t queueLimit = std::min(2 * globalTaskPool.extraThreadCount(), (1 << 26) / maxMetaBlockSize);
-  bool fail = false;
+  std::atomic<bool> fail = false;
   for (size_t j = 0, n = decoder.metaBlockCount(); j < n; ++j) {
     size_t curUncSize = uncompressedData.size();
     size_t newSize = decoder.metaBlockUncompressedSize(j);
@@ -180,7 +181,7 @@ bool preflate_reencode(OutputStream& os,
       std::shared_ptr<PreflateReencoderTask> ptask;
       ptask.reset(new PreflateReencoderTask(decoder, j, std::vector<uint8_t>(uncompressedData),
                                             curUncSize, j + 1 == n));
-      futureQueue.push(globalTaskPool.addTask([ptask, &fail]() {
+      futureQueue.push(globalTaskPool.addTask("preflate reencode", [ptask, &fail]() {
         if (!fail && ptask->decodeAndRepredict()) {
           return ptask;
         } else {
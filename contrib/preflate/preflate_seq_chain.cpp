@@ -18,7 +18,7 @@
 #include "preflate_seq_chain.h"
 
 PreflateSeqChain::PreflateSeqChain(
-    const std::vector<unsigned char>& input_)
+    const std::span<const unsigned char> input_)
   : _input(input_)
   , totalShift(-8)
   , curPos(0) {
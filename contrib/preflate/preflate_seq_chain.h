@@ -62,7 +62,7 @@ struct PreflateSeqChain {
   unsigned curPos;
   uint16_t heads[256];
 
-  PreflateSeqChain(const std::vector<unsigned char>& input_);
+  PreflateSeqChain(const std::span<const unsigned char> input_);
   ~PreflateSeqChain();
 
   bool valid(const unsigned refPos) const {
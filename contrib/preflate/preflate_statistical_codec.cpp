@@ -390,7 +390,6 @@ void PreflateTokenPredictionModel::writeToStream(const PreflateModelCodec& cc) {
 }
 
 
-PreflatePredictionModel::PreflatePredictionModel() {}
 PreflatePredictionModel::~PreflatePredictionModel() {}
 
 void PreflatePredictionModel::read(const PreflateStatisticsCounter& model, const PreflateModelCodec& cc) {
@@ -421,7 +420,6 @@ void PreflatePredictionModel::writeToStream(const PreflateModelCodec& cc) {
 
 // ------------------------------------
 
-PreflateModelCodec::PreflateModelCodec() {}
 void PreflateModelCodec::initDefault() {
   blockFullDefault = true;
   treecodeFullDefault = true;
@@ -565,35 +563,40 @@ PreflateMetaEncoder::PreflateMetaEncoder()
 PreflateMetaEncoder::~PreflateMetaEncoder() {}
 
 unsigned PreflateMetaEncoder::addModel(const PreflateStatisticsCounter& counter, const PreflateParameters& params) {
-  unsigned modelId = modelList.size();
   modelType m;
   m.counter = counter;
   m.mcodec.read(counter);
   m.model.read(counter, m.mcodec);
   m.params = params;
   m.writtenId = 0;
+  std::unique_lock<std::mutex> lock(mutex);
+  unsigned modelId = modelList.size();
   modelList.push_back(m);
   return modelId;
 }
 
 bool PreflateMetaEncoder::beginMetaBlockWithModel(PreflatePredictionEncoder& encoder, const unsigned modelId) {
+  std::unique_lock<std::mutex> lock(mutex);
   if (modelId >= modelList.size()) {
     return false;
   }
   encoder.start(modelList[modelId].model, modelList[modelId].params, modelId);
   return true;
 }
-bool PreflateMetaEncoder::endMetaBlock(PreflatePredictionEncoder& encoder, const size_t uncompressed) {
+bool PreflateMetaEncoder::endMetaBlock(PreflatePredictionEncoder& encoder, const size_t uncompressed, const size_t metaBlockId) {
+  std::vector<uint8_t> result = encoder.end();
+  std::unique_lock<std::mutex> lock(mutex);
   if (encoder.modelId() >= modelList.size()) {
     return false;
   }
-  metaBlockInfo m;
-  std::vector<uint8_t> result = encoder.end();
+  if (metaBlockId >= blockList.size()) {
+    blockList.resize(metaBlockId + 1);
+  }
+  metaBlockInfo& m = blockList[metaBlockId];
+  m.present = true;
   m.modelId = encoder.modelId();
-  m.reconSize = result.size();
   m.uncompressedSize = uncompressed;
-  blockList.push_back(m);
-  reconData.insert(reconData.end(), result.begin(), result.end());
+  m.reconData = std::move(result);
   return true;
 }
 std::vector<unsigned char> PreflateMetaEncoder::finish() {
@@ -607,6 +610,12 @@ std::vector<unsigned char> PreflateMetaEncoder::finish() {
   enum Mode {
     CREATE_NEW_MODEL /*, REUSE_LAST_MODEL, REUSE_PREVIOUS_MODEL*/
   };
+  for (const auto& mb : blockList) {
+    if (!mb.present) {
+      inError = true;
+      return std::vector<unsigned char>();
+    }
+  }
   for (unsigned i = 0, n = blockList.size(); i < n; ++i) {
     const metaBlockInfo& mb = blockList[i];
     Mode mode = CREATE_NEW_MODEL;
@@ -655,13 +664,15 @@ std::vector<unsigned char> PreflateMetaEncoder::finish() {
     // is implicitly going to end of stream
     // -------------------
     if (i != n - 1) {
-      bos.putVLI(mb.reconSize);
+      bos.putVLI(mb.reconData.size());
       bos.putVLI(mb.uncompressedSize);
     }
   }
   bos.flush();
   std::vector<uint8_t> result = mem.extractData();
-  result.insert(result.end(), reconData.begin(), reconData.end());
+  for (const auto& mb : blockList) {
+    result.insert(result.end(), mb.reconData.begin(), mb.reconData.end());
+  }
   return result;
 }
 
@@ -704,8 +715,8 @@ PreflateMetaDecoder::PreflateMetaDecoder(const std::vector<uint8_t>& reconData_,
     switch (mode) {
     case CREATE_NEW_MODEL:
     {
-      modelType mt;
-      memset(&mt, 0, sizeof(mt));
+      // value-initialized, so everything not read below starts out zeroed
+      modelType mt{};
       bool perfectZLIB = bis.get(1) == 0;
       mt.params.compLevel = bis.get(4);
       mt.params.memLevel = bis.get(4);
@@ -723,20 +734,12 @@ PreflateMetaDecoder::PreflateMetaDecoder(const std::vector<uint8_t>& reconData_,
           mt.params.matchesToStartDetected = bis.get(1);
         }
         mt.params.log2OfMaxChainDepthM1 = bis.get(4);
-        // read length (vli) and model data
+        // read length (vli) and model data, it is interpreted in beginMetaBlock,
+        // which runs on the worker decoding that meta block
         size_t res_size = bis.getVLI();
-        // interpret model data
-        {
-          MemStream tmp_mem;
-          bis.copyBytesTo(tmp_mem, res_size);
-          tmp_mem.seek(0);
-          BitInputStream tmp_bis(tmp_mem);
-          ArithmeticDecoder tmp_codec(tmp_bis);
-          mt.mcodec.readFromStream(tmp_codec);
-          mt.model.setDecoderStream(&tmp_codec);
-          mt.model.readFromStream(mt.mcodec);
-          mt.model.setDecoderStream(nullptr);
-        }
+        MemStream tmp_mem;
+        bis.copyBytesTo(tmp_mem, res_size);
+        mt.modelData = tmp_mem.extractData();
       }
       mb.modelId = modelList.size();
       modelList.push_back(mt);
@@ -784,7 +787,23 @@ bool PreflateMetaDecoder::beginMetaBlock(PreflatePredictionDecoder& decoder, Pre
   }
   const auto& model = modelList[mb.modelId];
   params = model.params;
-  decoder.start(model.model, model.params, reconData, mb.reconStartOfs, mb.reconSize);
+  if (model.modelData.empty()) {
+    decoder.start(model.model, model.params, reconData, mb.reconStartOfs, mb.reconSize);
+    return true;
+  }
+  // interpret model data
+  PreflateModelCodec mcodec = model.mcodec;
+  PreflatePredictionModel predictionModel = model.model;
+  {
+    MemStream tmp_mem(model.modelData);
+    BitInputStream tmp_bis(tmp_mem);
+    ArithmeticDecoder tmp_codec(tmp_bis);
+    mcodec.readFromStream(tmp_codec);
+    predictionModel.setDecoderStream(&tmp_codec);
+    predictionModel.readFromStream(mcodec);
+    predictionModel.setDecoderStream(nullptr);
+  }
+  decoder.start(predictionModel, model.params, reconData, mb.reconStartOfs, mb.reconSize);
   return true;
 }
 bool PreflateMetaDecoder::endMetaBlock(PreflatePredictionDecoder& decoder) {
@@ -15,6 +15,8 @@
 #ifndef PREFLATE_STATISTICAL_CODEC_H
 #define PREFLATE_STATISTICAL_CODEC_H
 
+#include <deque>
+#include <mutex>
 #include <vector>
 #include "support/arithmetic_coder.h"
 #include "support/bit_helper.h"
@@ -170,7 +172,8 @@ struct PreflateModelCodec {
   bool tokenFullDefault;
   unsigned totalModels, defaultingModels;
 
-  PreflateModelCodec();
+  // defaulted, so value-initializing it zeroes it
+  PreflateModelCodec() = default;
   void initDefault();
   void read(const PreflateStatisticsCounter&);
   void readFromStream(ArithmeticDecoder&);
@@ -381,7 +384,8 @@ private:
 };
 
 struct PreflatePredictionModel {
-  PreflatePredictionModel();
+  // defaulted, so value-initializing it zeroes it
+  PreflatePredictionModel() = default;
   ~PreflatePredictionModel();
 
   void read(const PreflateStatisticsCounter& model, const PreflateModelCodec& cc);
@@ -556,8 +560,10 @@ struct PreflateMetaEncoder {
   }
   unsigned addModel(const PreflateStatisticsCounter&, const PreflateParameters&);
 
+  // Models and meta blocks may be added from several threads at once,
+  // meta blocks are concatenated in metaBlockId order by finish()
   bool beginMetaBlockWithModel(PreflatePredictionEncoder&, const unsigned modelId);
-  bool endMetaBlock(PreflatePredictionEncoder&, const size_t uncompressed);
+  bool endMetaBlock(PreflatePredictionEncoder&, const size_t uncompressed, const size_t metaBlockId);
   std::vector<unsigned char> finish();
 
 private:
@@ -569,15 +575,16 @@ private:
     PreflateModelCodec mcodec;
   };
   struct metaBlockInfo {
+    bool present = false;
     unsigned modelId;
-    size_t reconSize;
     size_t uncompressedSize;
+    std::vector<uint8_t> reconData;
   };
 
   bool inError;
-  std::vector<modelType> modelList;
+  std::deque<modelType> modelList;
   std::vector<metaBlockInfo> blockList;
-  std::vector<uint8_t> reconData;
+  std::mutex mutex;
 };
 
 struct PreflateMetaDecoder {
@@ -606,6 +613,8 @@ private:
     PreflatePredictionModel model;
     PreflateParameters params;
     PreflateModelCodec mcodec;
+    // arithmetic coded model, only interpreted when its meta block is decoded
+    std::vector<uint8_t> modelData;
   };
   struct metaBlockInfo {
     unsigned modelId;
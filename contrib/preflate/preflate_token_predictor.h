@@ -49,7 +49,7 @@ struct PreflateTokenPredictor {
   std::vector<BlockAnalysisResult> analysisResults;
 
   PreflateTokenPredictor(const PreflateParameters& params,
-                        const std::vector<unsigned char>& uncompressed,
+                        const std::span<const unsigned char> uncompressed,
                         const size_t offset);
   void analyzeBlock(const unsigned blockno, 
                     const PreflateTokenBlock& block);
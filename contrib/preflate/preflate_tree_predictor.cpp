@@ -20,7 +20,7 @@
 #include "preflate_tree_predictor.h"
 
 PreflateTreePredictor::PreflateTreePredictor(
-    const std::vector<unsigned char>& dump,
+    const std::span<const unsigned char> dump,
     const size_t off)
   : input(dump)
   , predictionFailure(false) {
@@ -85,7 +85,7 @@ struct PreflateTreePredictor {
                       const unsigned symLCount,
                       const unsigned symDCount);
 
-  PreflateTreePredictor(const std::vector<unsigned char>& dump, const size_t offset);
+  PreflateTreePredictor(const std::span<const unsigned char> dump, const size_t offset);
   void analyzeBlock(const unsigned blockno,
                     const PreflateTokenBlock& block);
   void updateCounters(PreflateStatisticsCounter*,
@@ -17,13 +17,31 @@
 
 OutputCacheStream::OutputCacheStream(OutputStream& os)
   : _os(os)
+  , _cache(std::make_shared<std::vector<unsigned char>>())
+  , _cacheOffset(0)
   , _cacheStartPos(0) {}
 OutputCacheStream::~OutputCacheStream() {
 }
 
 void OutputCacheStream::flushUpTo(const uint64_t newStartPos) {
-  size_t toWrite = std::min(newStartPos - _cacheStartPos, (uint64_t)_cache.size());
-  size_t written = _os.write(_cache.data(), toWrite);
+  size_t toWrite = std::min(newStartPos - _cacheStartPos, (uint64_t)cacheSize());
+  size_t written = _os.write(_cache->data() + _cacheOffset, toWrite);
   _cacheStartPos += written;
-  _cache.erase(_cache.begin(), _cache.begin() + written);
+  _cacheOffset += written;
+}
+
+void OutputCacheStream::_grow(const size_t len) {
+  // Views may still point into the current buffer, so the unflushed data moves to a new one
+  // instead of being shifted down in place. The old buffer goes away with its last view.
+  // Keep the buffer well above the unflushed size, so that this copy stays a small part of all written data.
+  size_t live = cacheSize();
+  size_t cap = _cache->capacity();
+  if (live + len > (cap >> 2)) {
+    cap += std::max(cap >> 1, len);
+  }
+  auto newCache = std::make_shared<std::vector<unsigned char>>();
+  newCache->reserve(std::max(live + len, cap));
+  newCache->insert(newCache->end(), _cache->begin() + _cacheOffset, _cache->end());
+  _cache = std::move(newCache);
+  _cacheOffset = 0;
 }
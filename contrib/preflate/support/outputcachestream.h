@@ -16,26 +16,33 @@
 #define OUTPUTCACHESTREAM_H
 
 #include <algorithm>
+#include <memory>
+#include <span>
 #include <vector>
 #include "stream.h"
 
+// Read-only window into an OutputCacheStream. It shares ownership of the cache buffer it points into,
+// so the memory stays valid while the cache moves on to a fresh buffer.
+struct OutputCacheView {
+  std::shared_ptr<const std::vector<unsigned char>> buffer;
+  std::span<const unsigned char> data;
+};
+
 class OutputCacheStream : public OutputStream {
 public:
   OutputCacheStream(OutputStream& os);
   virtual ~OutputCacheStream();
 
   size_t write(const unsigned char* buffer, const size_t size) {
-/*    if (size == 1) {
-      _cache.push_back(*buffer);
-      return 1;
-    }*/
-    _cache.insert(_cache.end(), buffer, buffer + size);
+    if (_cache->size() + size > _cache->capacity()) {
+      _grow(size);
+    }
+    _cache->insert(_cache->end(), buffer, buffer + size);
     return size;
   }
   void reserve(const size_t len) {
-    size_t cap = _cache.capacity();
-    if (_cache.size() + len > cap) {
-      _cache.reserve(cap + std::max(cap >> 1, len));
+    if (_cache->size() + len > _cache->capacity()) {
+      _grow(len);
     }
   }
   void flush() {
@@ -46,21 +53,28 @@ public:
     return _cacheStartPos;
   }
   uint64_t cacheEndPos() const {
-    return _cacheStartPos + _cache.size();
+    return _cacheStartPos + cacheSize();
   }
   const unsigned char* cacheData(const uint64_t pos) const {
-    return _cache.data() + (std::ptrdiff_t)(pos - _cacheStartPos);
+    return _cache->data() + _cacheOffset + (std::ptrdiff_t)(pos - _cacheStartPos);
   }
   const unsigned char* cacheEnd() const {
-    return _cache.data() + _cache.size();
+    return _cache->data() + _cache->size();
   }
   const size_t cacheSize() const {
-    return _cache.size();
+    return _cache->size() - _cacheOffset;
+  }
+  // The cache only ever appends to its current buffer, and it never moves or reuses memory a view points into
+  OutputCacheView cacheView(const uint64_t startPos, const uint64_t endPos) const {
+    return OutputCacheView { _cache, std::span<const unsigned char>(cacheData(startPos), endPos - startPos) };
   }
 
 private:
+  void _grow(const size_t len);
+
   OutputStream& _os;
-  std::vector<unsigned char> _cache;
+  std::shared_ptr<std::vector<unsigned char>> _cache;
+  size_t _cacheOffset;
   uint64_t _cacheStartPos;
 };
 
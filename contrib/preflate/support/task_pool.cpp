@@ -17,6 +17,8 @@
 #include <memory>
 
 TaskPool globalTaskPool;
+void (*TaskPool::taskRunner)(const char* name, void* context, const std::function<void()>& task) = nullptr;
+void* (*TaskPool::taskContextCapture)() = nullptr;
 
 TaskPool::TaskPool()
   : _state(INIT)
@@ -48,7 +50,10 @@ void TaskPool::_init() {
 }
 
 TaskPool::~TaskPool() {
-  _state = FINISH;
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _state = FINISH;
+  }
   _condition.notify_all();
   for (auto& thr : _workers) {
     if (thr.joinable()) {
@@ -29,20 +29,34 @@ public:
   TaskPool();
   ~TaskPool();
 
+  // If set, every task is run through this along with the name it was added with (which must be a string literal), so the embedding
+  // application can trace them. Set it before adding any tasks.
+  static void (*taskRunner)(const char* name, void* context, const std::function<void()>& task);
+  // If set, this is called on the thread adding each task, and what it returns is given to taskRunner as context when the task is run,
+  // so tasks can carry along something about whoever added them
+  static void* (*taskContextCapture)();
+
   template<class F, class... Args>
-  auto addTask(F&& f, Args&&... args)
+  auto addTask(const char* name, F&& f, Args&&... args)
     -> std::future<typename std::invoke_result<F, Args...>::type> {
     using R = typename std::invoke_result<F, Args...>::type;
     auto task = std::make_shared<std::packaged_task<R()>>(
       std::bind(std::forward<F>(f), std::forward<Args>(args)...));
 
-    if (_state == INIT) {
-      _init();
-    }
+    // Tasks might be added from several threads at once
+    std::call_once(_initFlag, [this]() { _init(); });
     std::future<R> res = task->get_future();
+    void* context = taskContextCapture != nullptr ? taskContextCapture() : nullptr;
     {
       std::unique_lock<std::mutex> lock(_mutex);
-      _tasks.emplace([task]() { (*task)(); });
+      _tasks.emplace([task, name, context]() {
+        if (taskRunner != nullptr) {
+          taskRunner(name, context, [&task]() { (*task)(); });
+        }
+        else {
+          (*task)();
+        }
+      });
     }
     _condition.notify_one();
     return res;
@@ -58,6 +72,7 @@ private:
   void _init();
 
   State _state;
+  std::once_flag _initFlag;
   size_t _threadLimit;
   std::vector<std::thread> _workers;
   std::mutex _mutex;
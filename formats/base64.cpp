@@ -1,4 +1,5 @@
 #include "base64.h"
+#include "precomp_compare.h"
 
 #include <cstddef>
 #include <cstring>
@@ -32,12 +33,11 @@ public:
 
     explicit base64_precompression_result() : precompression_result(D_BASE64) {}
 
-    void dump_to_outfile(OStreamLike& outfile) const override {
+    void dump_record_header_to_outfile(OStreamLike& outfile) const override {
         dump_header_to_outfile(outfile);
         dump_base64_header(outfile);
         dump_penaltybytes_to_outfile(outfile);
         dump_stream_sizes_to_outfile(outfile);
-        dump_precompressed_data_to_outfile(outfile);
     }
 };
 
@@ -137,10 +137,8 @@ void base64_reencode(IStreamLike& file_in, OStreamLike& file_out, const std::vec
 unsigned long long compare_files(Precomp& precomp_mgr, IStreamLike& file1, IStreamLike& file2, unsigned int pos1, unsigned int pos2) {
     unsigned char input_bytes1[COMP_CHUNK];
     unsigned char input_bytes2[COMP_CHUNK];
-    long long same_byte_count = 0;
-    long long size1, size2, minsize;
-    int i;
-    bool endNow = false;
+    unsigned long long same_byte_count = 0;
+    size_t minsize, matched;
 
     file1.seekg(pos1, std::ios_base::beg);
     file2.seekg(pos2, std::ios_base::beg);
@@ -149,19 +147,12 @@ unsigned long long compare_files(Precomp& precomp_mgr, IStreamLike& file1, IStre
         precomp_mgr.call_progress_callback();
 
         file1.read(reinterpret_cast<char*>(input_bytes1), COMP_CHUNK);
-        size1 = file1.gcount();
         file2.read(reinterpret_cast<char*>(input_bytes2), COMP_CHUNK);
-        size2 = file2.gcount();
+        minsize = static_cast<size_t>(std::min(file1.gcount(), file2.gcount()));
 
-        minsize = std::min(size1, size2);
-        for (i = 0; i < minsize; i++) {
-            if (input_bytes1[i] != input_bytes2[i]) {
-                endNow = true;
-                break;
-            }
-            same_byte_count++;
-        }
-    } while ((minsize == COMP_CHUNK) && (!endNow));
+        matched = find_first_mismatch(input_bytes1, input_bytes2, minsize);
+        same_byte_count += matched;
+    } while ((minsize == COMP_CHUNK) && (matched == minsize));
 
     return same_byte_count;
 }
@@ -309,12 +300,13 @@ std::unique_ptr<precompression_result> try_decompression_base64(Precomp& precomp
   if (compressed_size > precomp_mgr.switches.min_ident_size) {
     precomp_mgr.statistics.recompressed_streams_count++;
     precomp_mgr.statistics.recompressed_base64_count++;
-    print_to_log(PRECOMP_DEBUG_LOG, "Match: encoded to %lli bytes\n");
+    print_to_log(PRECOMP_DEBUG_LOG, "Match: encoded to %lli bytes\n", compressed_size);
 
     result->success = true;
 
     // write compressed data header (Base64)
     result->flags = std::byte{ 0b1 } | (line_case << 2);
+    result->line_case = static_cast<int>(line_case);
     result->base64_header = std::vector(checkbuf, checkbuf + base64_header_length);
 
     result->original_size = compressed_size;
@@ -368,7 +360,7 @@ public:
 std::unique_ptr<PrecompFormatHeaderData> Base64FormatHandler::read_format_header(RecursionContext& context, std::byte precomp_hdr_flags, SupportedFormats precomp_hdr_format) {
   auto fmt_hdr = std::make_unique<Base64FormatHeaderData>();
 
-  int line_case = static_cast<int>(precomp_hdr_flags & std::byte{ 0b1100 });
+  int line_case = static_cast<int>(precomp_hdr_flags & std::byte{ 0b1100 }) >> 2;
 
   // restore Base64 "header"
   auto base64_header_length = fin_fget_vlint(*context.fin);
@@ -423,5 +415,5 @@ void Base64FormatHandler::recompress(IStreamLike& precompressed_input, OStreamLi
     print_to_log(PRECOMP_DEBUG_LOG, "Encoded length: %lli - decoded length: %lli\n", precomp_b64_hdr_data.original_size, precomp_b64_hdr_data.precompressed_size);
   }
 
-  base64_reencode(precompressed_input, recompressed_stream, precomp_b64_hdr_data.base64_line_len, precomp_b64_hdr_data.original_size, precomp_b64_hdr_data.precompressed_size);
+  base64_reencode(precompressed_input, recompressed_stream, precomp_b64_hdr_data.base64_line_len, precomp_b64_hdr_data.precompressed_size, precomp_b64_hdr_data.original_size);
 }
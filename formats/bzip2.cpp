@@ -11,12 +11,11 @@ public:
 
     explicit bzip2_precompression_result(int compression_level) : precompression_result(D_BZIP2), compression_level(compression_level) {}
 
-    void dump_to_outfile(OStreamLike& outfile) const override {
+    void dump_record_header_to_outfile(OStreamLike& outfile) const override {
         dump_header_to_outfile(outfile);
         outfile.put(compression_level);
         dump_penaltybytes_to_outfile(outfile);
         dump_stream_sizes_to_outfile(outfile);
-        dump_precompressed_data_to_outfile(outfile);
     }
 };
 
@@ -204,6 +203,20 @@ std::unique_ptr<precompression_result> BZip2FormatHandler::attempt_precompressio
     print_to_log(PRECOMP_DEBUG_LOG, "Can be decompressed to %lli bytes\n", tmpfile->tellg());
   }
 
+  // When analyzing the decompressed stream is taken as is, without trying to recompress it
+  if (precomp_mgr.ctx->comp_decomp_state == P_ANALYZE) {
+    result->success = true;
+    result->original_size = compressed_stream_size;
+    result->precompressed_size = decompressed_stream_size;
+    return result;
+  }
+
+  // Recompressing it already failed to give back this very same stream
+  if (precomp_mgr.failed_candidates->find(D_BZIP2, *precomp_mgr.ctx->fin, original_input_pos, compressed_stream_size, compressed_stream_size).has_value()) {
+    print_to_log(PRECOMP_DEBUG_LOG, "Identical to a bZip2 stream that already failed\n");
+    return result;
+  }
+
   tmpfile->reopen();
   if (!tmpfile->is_open()) {
     throw PrecompError(ERR_TEMP_FILE_DISAPPEARED);
@@ -228,6 +241,7 @@ std::unique_ptr<precompression_result> BZip2FormatHandler::attempt_precompressio
     identical_bytes != compressed_stream_size  // reject: doesn't recover the whole original BZip2 stream
   ) {
     print_to_log(PRECOMP_DEBUG_LOG, "No matches\n");
+    precomp_mgr.failed_candidates->add(D_BZIP2, *precomp_mgr.ctx->fin, original_input_pos, compressed_stream_size, { compressed_stream_size, decompressed_stream_size });
     return result;
   }
 
@@ -311,7 +325,9 @@ void BZip2FormatHandler::recompress(IStreamLike& precompressed_input, OStreamLik
     print_to_log(PRECOMP_DEBUG_LOG, "Recompressed length: %lli - decompressed length: %lli\n", bzip2_precomp_hdr_data.original_size, bzip2_precomp_hdr_data.precompressed_size);
   }
 
-  int retval = def_part_bzip2(precompressed_input, recompressed_stream, bzip2_precomp_hdr_data.level, bzip2_precomp_hdr_data.precompressed_size, bzip2_precomp_hdr_data.original_size, tmp_out, tools.progress_callback);
+  // Records might be recompressed on several threads at once with this same handler, so tmp_out can't be used here
+  std::vector<unsigned char> recompress_out(CHUNK);
+  int retval = def_part_bzip2(precompressed_input, recompressed_stream, bzip2_precomp_hdr_data.level, bzip2_precomp_hdr_data.precompressed_size, bzip2_precomp_hdr_data.original_size, recompress_out, tools.progress_callback);
   if (retval != BZ_OK) {
     print_to_log(PRECOMP_DEBUG_LOG, "BZIP2 retval = %lli\n", retval);
     throw PrecompError(ERR_DURING_RECOMPRESSION);
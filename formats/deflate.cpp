@@ -1,11 +1,38 @@
 #include "deflate.h"
+#include "precomp_compare.h"
 
 #include "contrib/preflate/preflate.h"
+#include "contrib/preflate/preflate_hash_chain.h"
+#include "contrib/preflate/support/task_pool.h"
 #include "contrib/zlib/zlib.h"
 
+#include <algorithm>
+#include <array>
 #include <cstddef>
+#include <cstring>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <sstream>
+#include <tuple>
+
+void install_preflate_hooks() {
+  static std::once_flag hooks_installed;
+  std::call_once(hooks_installed, []() {
+    TaskPool::taskContextCapture = []() -> void* { return current_memory_account(); };
+    TaskPool::taskRunner = [](const char* name, void* context, const std::function<void()>& task) {
+      MemoryAccountScope memory_scope(static_cast<MemoryAccount*>(context));
+      TraceSpan span("preflate", name);
+      task();
+    };
+    preflateHashChainMemoryHook = [](void* token, long long bytes) -> void* {
+      // Frees give back the token their allocation got, if that's null nothing was ever added
+      auto account = token != nullptr ? static_cast<MemoryAccount*>(token) : (bytes > 0 ? current_memory_account() : nullptr);
+      if (account != nullptr) account->add(bytes);
+      return account;
+    };
+  });
+}
 
 std::byte make_deflate_pcf_hdr_flags(const recompress_deflate_result& rdres) {
   return std::byte{ 0b1 } | (rdres.zlib_perfect ? static_cast<std::byte>(rdres.zlib_comp_level) << 2 : std::byte{ 0b10 });
@@ -34,12 +61,11 @@ void deflate_precompression_result::dump_header_to_outfile(OStreamLike& outfile)
     outfile.put(zlib_header[zlib_header.size() - 1] + 1);
   }
 }
-void deflate_precompression_result::dump_to_outfile(OStreamLike& outfile) const {
+void deflate_precompression_result::dump_record_header_to_outfile(OStreamLike& outfile) const {
   dump_header_to_outfile(outfile);
   dump_penaltybytes_to_outfile(outfile);
   dump_recon_data_to_outfile(outfile);
   dump_stream_sizes_to_outfile(outfile);
-  dump_precompressed_data_to_outfile(outfile);
 }
 
 void fin_fget_recon_data(IStreamLike& input, recompress_deflate_result& rdres) {
@@ -89,6 +115,7 @@ public:
   OStreamLike& ftempout;
   Precomp* precomp_mgr;
   std::vector<unsigned char> decomp_io_buf;
+  TrackedMemory decomp_io_buf_tracking;
 
   UncompressedOutStream(OStreamLike& tmpfile, Precomp* precomp_mgr) : ftempout(tmpfile), precomp_mgr(precomp_mgr) {}
   ~UncompressedOutStream() override = default;
@@ -102,9 +129,12 @@ public:
         auto memstream = memiostream::make(decomp_io_buf_ptr, decomp_io_buf_ptr + _written);
         fast_copy(*memstream, ftempout, _written);
         decomp_io_buf.clear();
+        decomp_io_buf.shrink_to_fit();
+        decomp_io_buf_tracking.set_size(0);
       }
       else {
         decomp_io_buf.resize(decomp_io_buf.size() + size);
+        decomp_io_buf_tracking.set_size(decomp_io_buf.capacity());
         memcpy(decomp_io_buf.data() + _written, buffer, size);
         _written += size;
         return size;
@@ -125,22 +155,224 @@ public:
 
 };
 
-recompress_deflate_result try_recompression_deflate(Precomp& precomp_mgr, IStreamLike& file, long long file_deflate_stream_pos, PrecompTmpFile& tmpfile) {
+class VectorIStream : public InputStream {
+public:
+  explicit VectorIStream(const std::vector<unsigned char>& data) : _data(data) {}
+
+  [[nodiscard]] bool eof() const override {
+    return _pos >= _data.size();
+  }
+  size_t read(unsigned char* buffer, const size_t size) override {
+    const size_t res = std::min(size, _data.size() - _pos);
+    memcpy(buffer, _data.data() + _pos, res);
+    _pos += res;
+    return res;
+  }
+private:
+  const std::vector<unsigned char>& _data;
+  size_t _pos = 0;
+};
+// Compares everything written to it with the original deflate stream, failing the write on the first mismatching chunk
+class DeflateCompareOStream : public OutputStream {
+public:
+  DeflateCompareOStream(IStreamLike& original, uint64_t original_size) : _comparator(original), _remaining(original_size) {}
+
+  size_t write(const unsigned char* buffer, const size_t size) override {
+    if (_mismatch || size > _remaining || !_comparator.compare(buffer, size)) {
+      _mismatch = true;
+      return 0;
+    }
+    _remaining -= size;
+    return size;
+  }
+
+  [[nodiscard]] bool matched() const {
+    return !_mismatch && _remaining == 0;
+  }
+private:
+  IStreamComparator _comparator;
+  uint64_t _remaining;
+  bool _mismatch = false;
+};
+
+bool zlib_reencode(OutputStream& output, InputStream& input, const uint64_t uncompressed_size, const int comp_level, const int mem_level, const int window_bits, const std::function<void()>& progress_callback) {
+  z_stream strm;
+  strm.zalloc = Z_NULL;
+  strm.zfree = Z_NULL;
+  strm.opaque = Z_NULL;
+  if (deflateInit2(&strm, comp_level, Z_DEFLATED, -window_bits, mem_level, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+
+  const size_t in_buf_size = std::max<size_t>(1, std::min<uint64_t>(CHUNK, uncompressed_size));
+  std::unique_ptr<unsigned char[]> in_buf(new unsigned char[in_buf_size]);
+  // output goes out in small pieces so a mismatching candidate is rejected as soon as possible
+  std::array<unsigned char, COMP_CHUNK * 32> out_buf;
+  uint64_t remaining = uncompressed_size;
+  bool ok = true;
+  int flush;
+  do {
+    const size_t to_read = std::min<uint64_t>(in_buf_size, remaining);
+    if (to_read > 0 && input.read(in_buf.get(), to_read) != to_read) {
+      ok = false;
+      break;
+    }
+    remaining -= to_read;
+    flush = remaining == 0 ? Z_FINISH : Z_NO_FLUSH;
+    strm.next_in = in_buf.get();
+    strm.avail_in = to_read;
+
+    do {
+      strm.next_out = out_buf.data();
+      strm.avail_out = out_buf.size();
+      deflate(&strm, flush);
+      const size_t have = out_buf.size() - strm.avail_out;
+      if (have > 0 && output.write(out_buf.data(), have) != have) {
+        ok = false;
+        break;
+      }
+    } while (strm.avail_out == 0);
+    progress_callback();
+  } while (ok && flush != Z_FINISH);
+
+  (void)deflateEnd(&strm);
+  return ok;
+}
+
+bool zlib_reencode(OutputStream& output, InputStream& input, const recompress_deflate_result& rdres, const std::function<void()>& progress_callback) {
+  return zlib_reencode(output, input, rdres.uncompressed_stream_size, rdres.zlib_comp_level, rdres.zlib_mem_level, rdres.zlib_window_bits, progress_callback);
+}
+
+// Checks if plain zlib reproduces the deflate stream bit by bit, starting from the parameters preflate estimated for its first meta block.
+// If one of the candidates matches, restoring the stream only needs those parameters and no reconstruction data.
+void detect_zlib_perfect(Precomp& precomp_mgr, IStreamLike& file, long long file_deflate_stream_pos, const UncompressedOutStream& uos, PrecompTmpFile& tmpfile,
+  const PreflateParameters& params, recompress_deflate_result& result) {
+  if (params.compLevel < 1 || params.compLevel > 9) return;
+  // preflate needs hardly any corrections for streams zlib can reproduce, so don't spend trial deflates on the others
+  if (result.recon_data.size() > static_cast<size_t>(result.compressed_stream_size / 64) + 32) return;
+
+  // zlib refuses 256 byte windows for raw deflate, and memLevel 9 is the highest it accepts
+  const int est_window_bits = std::clamp<int>(params.windowBits, 9, 15);
+  const int est_mem_level = std::clamp<int>(params.memLevel, 1, 9);
+  // the estimate is the lowest level that explains the first meta block, higher levels with the same
+  // match finder (1-3 or 4-9) often produce identical tokens there and only diverge later
+  const int max_comp_level = params.compLevel <= 3 ? 3 : 9;
+  std::vector<std::tuple<int, int, int>> candidates;
+  for (int comp_level = params.compLevel; comp_level <= max_comp_level; comp_level++) {
+    candidates.emplace_back(comp_level, est_window_bits, est_mem_level);
+  }
+  for (const auto& candidate : { std::tuple{ static_cast<int>(params.compLevel), 15, est_mem_level }, std::tuple{ static_cast<int>(params.compLevel), 15, 8 } }) {
+    if (std::find(candidates.begin(), candidates.end(), candidate) == candidates.end()) candidates.push_back(candidate);
+  }
+
+  for (const auto& [comp_level, window_bits, mem_level] : candidates) {
+    file.seekg(file_deflate_stream_pos, std::ios_base::beg);
+    DeflateCompareOStream compare(file, result.compressed_stream_size);
+    const auto progress_callback = [&precomp_mgr]() { precomp_mgr.call_progress_callback(); };
+    bool reencoded;
+    if (uos.in_memory()) {
+      VectorIStream uncompressed(uos.decomp_io_buf);
+      reencoded = zlib_reencode(compare, uncompressed, result.uncompressed_stream_size, comp_level, mem_level, window_bits, progress_callback);
+    }
+    else {
+      tmpfile.seekg(0, std::ios_base::beg);
+      OwnIStream uncompressed(&tmpfile);
+      reencoded = zlib_reencode(compare, uncompressed, result.uncompressed_stream_size, comp_level, mem_level, window_bits, progress_callback);
+    }
+    if (reencoded && compare.matched()) {
+      result.zlib_perfect = true;
+      result.zlib_comp_level = static_cast<char>(comp_level);
+      result.zlib_mem_level = static_cast<char>(mem_level);
+      result.zlib_window_bits = static_cast<char>(window_bits);
+      result.recon_data.clear();
+      return;
+    }
+  }
+}
+
+// When analyzing we only want to know if the stream inflates and how big it is, which plain zlib can tell us much faster than preflate.
+// Nothing is kept, and the stream is taken as accepted if it inflates up to its end, so the odd stream preflate would reject is counted anyways.
+recompress_deflate_result probe_deflate_stream(Precomp& precomp_mgr, IStreamLike& file, long long file_deflate_stream_pos) {
+  recompress_deflate_result result;
+  z_stream strm;
+  strm.zalloc = Z_NULL;
+  strm.zfree = Z_NULL;
+  strm.opaque = Z_NULL;
+  strm.avail_in = 0;
+  strm.next_in = Z_NULL;
+  if (inflateInit2(&strm, -15) != Z_OK) return result;
+
+  TraceSpan span("analyze", "inflate probe");
   file.seekg(file_deflate_stream_pos, std::ios_base::beg);
+  std::vector<unsigned char> in_buf(CHUNK);
+  std::vector<unsigned char> out_buf(CHUNK);
+  long long compressed_size = 0;
+  long long uncompressed_size = 0;
+  int ret = Z_OK;
+  while (ret == Z_OK) {
+    if (strm.avail_in == 0) {
+      file.read(reinterpret_cast<char*>(in_buf.data()), in_buf.size());
+      strm.avail_in = file.gcount();
+      strm.next_in = in_buf.data();
+      if (strm.avail_in == 0) break;
+      compressed_size += strm.avail_in;
+    }
+    strm.avail_out = out_buf.size();
+    strm.next_out = out_buf.data();
+    ret = inflate(&strm, Z_NO_FLUSH);
+    uncompressed_size += out_buf.size() - strm.avail_out;
+    precomp_mgr.call_progress_callback();
+  }
+  // Whatever was read past the end of the stream is still there
+  compressed_size -= strm.avail_in;
+  (void)inflateEnd(&strm);
+
+  result.accepted = ret == Z_STREAM_END;
+  result.compressed_stream_size = compressed_size;
+  result.uncompressed_stream_size = uncompressed_size;
+  return result;
+}
+
+recompress_deflate_result try_recompression_deflate(Precomp& precomp_mgr, IStreamLike& file, long long file_deflate_stream_pos, PrecompTmpFile& tmpfile) {
+  if (precomp_mgr.ctx->comp_decomp_state == P_ANALYZE) return probe_deflate_stream(precomp_mgr, file, file_deflate_stream_pos);
 
   recompress_deflate_result result;
+  // Deflate streams are handled the same whatever format they are in, so they share their failures under D_RAW
+  const auto known_failure = precomp_mgr.failed_candidates->find(D_RAW, file, file_deflate_stream_pos, 0, std::numeric_limits<long long>::max());
+  if (known_failure.has_value()) {
+    print_to_log(PRECOMP_DEBUG_LOG, "Identical to a deflate stream preflate already failed on\n");
+    result.compressed_stream_size = known_failure->compressed_size;
+    result.uncompressed_stream_size = known_failure->decompressed_size;
+    return result;
+  }
+  file.seekg(file_deflate_stream_pos, std::ios_base::beg);
+
   OwnIStream is(&file);
   UncompressedOutStream uos(tmpfile, &precomp_mgr);
   uint64_t compressed_stream_size = 0;
-
-  result.accepted = preflate_decode(uos, result.recon_data,
-    compressed_stream_size, is, [&precomp_mgr]() { precomp_mgr.call_progress_callback(); },
-    0,
-    precomp_mgr.switches.preflate_meta_block_size); // you can set a minimum deflate stream size here
+  PreflateParameters params {};
+
+  {
+    TraceSpan span("preflate", "preflate decode", [&]() { return make_cstyle_format_string("\"offset\": %lli", file_deflate_stream_pos); });
+    result.accepted = preflate_decode(uos, result.recon_data,
+      compressed_stream_size, is, [&precomp_mgr]() { precomp_mgr.call_progress_callback(); },
+      0,
+      precomp_mgr.switches.preflate_meta_block_size, // you can set a minimum deflate stream size here
+      &params);
+  }
   result.compressed_stream_size = compressed_stream_size;
   result.uncompressed_stream_size = uos.written();
+  // preflate read exactly up to where the file is now, so unless it ran into the end of the file, the same data anywhere else fails the same way
+  if (!result.accepted && !is.eof()) {
+    const long long read_end = file.tellg();
+    precomp_mgr.failed_candidates->add(D_RAW, file, file_deflate_stream_pos, read_end - file_deflate_stream_pos,
+      { result.compressed_stream_size, result.uncompressed_stream_size });
+  }
+
+  if (result.accepted) {
+    if (!uos.in_memory()) tmpfile.flush();
+    detect_zlib_perfect(precomp_mgr, file, file_deflate_stream_pos, uos, tmpfile, params, result);
+  }
 
-  if (precomp_mgr.switches.preflate_verify && result.accepted) {
+  if (precomp_mgr.switches.preflate_verify && result.accepted && !result.zlib_perfect) {
     file.seekg(file_deflate_stream_pos, std::ios_base::beg);
     OwnIStream is2(&file);
     std::vector<uint8_t> orgdata(result.compressed_stream_size);
@@ -174,6 +406,7 @@ recompress_deflate_result try_recompression_deflate(Precomp& precomp_mgr, IStrea
 
   if (uos.in_memory()) {
     result.uncompressed_stream_mem = std::move(uos.decomp_io_buf);
+    result.uncompressed_stream_mem_tracking = std::move(uos.decomp_io_buf_tracking);
   }
   return result;
 }
@@ -187,7 +420,7 @@ void debug_deflate_detected(RecursionContext& context, const recompress_deflate_
 
   if (rdres.accepted) {
     if (rdres.zlib_perfect) {
-      ss << "Detect ZLIB parameters: comp level " << rdres.zlib_comp_level << ", mem level " << rdres.zlib_mem_level << ", " << rdres.zlib_window_bits << "window bits" << std::endl;
+      ss << "Detect ZLIB parameters: comp level " << static_cast<int>(rdres.zlib_comp_level) << ", mem level " << static_cast<int>(rdres.zlib_mem_level) << ", " << static_cast<int>(rdres.zlib_window_bits) << " window bits" << std::endl;
     }
     else {
       ss << "Non-ZLIB reconstruction data size: " << rdres.recon_data.size() << " bytes" << std::endl;
@@ -395,6 +628,10 @@ std::unique_ptr<precompression_result> DeflateFormatHandler::attempt_precompress
 bool try_reconstructing_deflate(IStreamLike& fin, OStreamLike& fout, const recompress_deflate_result& rdres, const std::function<void()>& progress_callback) {
   OwnOStream os(&fout);
   OwnIStream is(&fin);
+  if (rdres.zlib_perfect) {
+    return zlib_reencode(os, is, rdres, progress_callback);
+  }
+  TraceSpan span("preflate", "preflate reencode");
   bool result = preflate_reencode(os, rdres.recon_data, is, rdres.uncompressed_stream_size, progress_callback);
   return result;
 }
@@ -440,6 +677,11 @@ bool try_reconstructing_deflate_skip(IStreamLike& fin, OStreamLike& fout, const
     return false;
   }
   OwnOStream os(&fout);
+  if (rdres.zlib_perfect) {
+    VectorIStream is(unpacked_output);
+    return zlib_reencode(os, is, rdres, progress_callback);
+  }
+  TraceSpan span("preflate", "preflate reencode");
   return preflate_reencode(os, rdres.recon_data, unpacked_output, progress_callback);
 }
 
@@ -451,7 +693,7 @@ void fin_fget_deflate_hdr(IStreamLike& input, recompress_deflate_result& rdres,
     const auto zlib_params = static_cast<std::byte>(input.get());
     rdres.zlib_comp_level = static_cast<char>((flags & std::byte{ 0b00111100 }) >> 2);
     rdres.zlib_mem_level = static_cast<char>(zlib_params & std::byte{ 0b00001111 });
-    rdres.zlib_window_bits = static_cast<char>(static_cast<int>(zlib_params & std::byte{ 0b01110000 }) + 8);
+    rdres.zlib_window_bits = static_cast<char>((static_cast<int>(zlib_params & std::byte{ 0b01110000 }) >> 4) + 8);
   }
   hdr_length = fin_fget_vlint(input);
   if (!inc_last_hdr_byte) {
@@ -476,9 +718,9 @@ void debug_deflate_reconstruct(const recompress_deflate_result& rdres, const cha
   ss << "Decompressed data - " << type << std::endl;
   ss << "Header length: " << hdr_length << std::endl;
   if (rdres.zlib_perfect) {
-    ss << "ZLIB Parameters: compression level " << rdres.zlib_comp_level
-      << " memory level " << rdres.zlib_mem_level
-      << " window bits " << rdres.zlib_window_bits << std::endl;
+    ss << "ZLIB Parameters: compression level " << static_cast<int>(rdres.zlib_comp_level)
+      << " memory level " << static_cast<int>(rdres.zlib_mem_level)
+      << " window bits " << static_cast<int>(rdres.zlib_window_bits) << std::endl;
   }
   else {
     ss << "Reconstruction data size: " << rdres.recon_data.size() << std::endl;
@@ -499,6 +741,7 @@ std::unique_ptr<PrecompFormatHeaderData> read_deflate_format_header(IStreamLike&
 
   fin_fget_deflate_rec(precompressed_input, recompressed_stream, fmt_hdr->rdres, precomp_hdr_flags, fmt_hdr->stream_hdr.data(), hdr_length, inc_last_hdr_byte);
   fmt_hdr->stream_hdr.resize(hdr_length);
+  fmt_hdr->precompressed_size = fmt_hdr->rdres.uncompressed_stream_size;
   if ((precomp_hdr_flags & std::byte{ 0b10000000 }) == std::byte{ 0b10000000 }) {
     fmt_hdr->recursion_data_size = fin_fget_vlint(precompressed_input);
   }
@@ -519,7 +762,7 @@ void recompress_deflate(IStreamLike& precompressed_input, OStreamLike& recompres
 }
 
 void DeflateFormatHandler::write_pre_recursion_data(RecursionContext& context, PrecompFormatHeaderData& precomp_hdr_data) {
-  auto precomp_deflate_hdr_data = static_cast<DeflateFormatHeaderData&>(precomp_hdr_data);
+  auto& precomp_deflate_hdr_data = static_cast<DeflateFormatHeaderData&>(precomp_hdr_data);
   // Write zlib_header
   // TODO: wait a second, this is brute mode, so there should never be a header here... confirm and delete if true
   context.fout->write(reinterpret_cast<char*>(precomp_deflate_hdr_data.stream_hdr.data()), precomp_deflate_hdr_data.stream_hdr.size());
@@ -10,6 +10,7 @@ struct recompress_deflate_result {
   std::vector<unsigned char> recon_data;
   bool accepted = false;
   std::vector<unsigned char> uncompressed_stream_mem;
+  TrackedMemory uncompressed_stream_mem_tracking;
   bool zlib_perfect = false;
   char zlib_comp_level = 0;
   char zlib_mem_level = 0;
@@ -27,7 +28,7 @@ public:
   explicit deflate_precompression_result(SupportedFormats format);
 
   void dump_header_to_outfile(OStreamLike& outfile) const override;
-  void dump_to_outfile(OStreamLike& outfile) const override;
+  void dump_record_header_to_outfile(OStreamLike& outfile) const override;
 };
 
 struct DeflateHistogramFalsePositiveDetector {
@@ -42,6 +43,9 @@ struct DeflateHistogramFalsePositiveDetector {
 	int prev_i;
 };
 
+// Has preflate's tasks show up on traces too, and account for the memory they use in whatever added them. Only does anything the first time.
+void install_preflate_hooks();
+
 void fin_fget_recon_data(IStreamLike& input, recompress_deflate_result&);
 
 recompress_deflate_result try_recompression_deflate(Precomp& precomp_mgr, IStreamLike& file, long long file_deflate_stream_pos, PrecompTmpFile& tmpfile);
@@ -4,6 +4,7 @@
 
 #include <cstddef>
 #include <cstring>
+#include <mutex>
 
 class gif_precompression_result : public precompression_result {
     void dump_gif_diff_to_outfile(OStreamLike& outfile) const {
@@ -20,12 +21,11 @@ public:
 
     explicit gif_precompression_result() : precompression_result(D_GIF) {}
 
-    void dump_to_outfile(OStreamLike& outfile) const override {
+    void dump_record_header_to_outfile(OStreamLike& outfile) const override {
         dump_header_to_outfile(outfile);
         dump_gif_diff_to_outfile(outfile);
         dump_penaltybytes_to_outfile(outfile);
         dump_stream_sizes_to_outfile(outfile);
-        dump_precompressed_data_to_outfile(outfile);
     }
 };
 
@@ -40,6 +40,8 @@ int DGifGetLineByte(GifFileType* GifFile, GifPixelType* Line, int LineLen, GifCo
   return result;
 }
 
+// giflib callbacks and error reporting go through globals, so only one GIF can be processed at a time
+std::mutex gif_mtx;
 bool newgif_may_write;
 OStreamLike* frecompress_gif = nullptr;
 IStreamLike* freadfunc = nullptr;
@@ -129,6 +131,7 @@ bool decompress_gif(IStreamLike& srcfile, OStreamLike& dstfile, long long src_po
   long long srcfile_pos;
   long long last_pos = -1;
 
+  std::lock_guard lock(gif_mtx);
   freadfunc = &srcfile;
   myGifFile = DGifOpen(nullptr, readFunc);
   if (myGifFile == nullptr) {
@@ -259,6 +262,7 @@ bool recompress_gif(IStreamLike& srcfile, OStreamLike& dstfile, unsigned char bl
   GifRecordType RecordType;
   GifByteType* Extension;
 
+  std::lock_guard lock(gif_mtx);
   freadfunc = &srcfile;
   frecompress_gif = &dstfile;
   newgif_may_write = false;
@@ -490,6 +494,16 @@ std::unique_ptr<precompression_result> GifFormatHandler::attempt_precompression(
   precomp_mgr.statistics.decompressed_streams_count++;
   precomp_mgr.statistics.decompressed_gif_count++;
 
+  // When analyzing the decompressed GIF is taken as is, without trying to recompress it
+  if (precomp_mgr.ctx->comp_decomp_state == P_ANALYZE) {
+    result->success = true;
+    result->original_size = gif_length;
+    result->precompressed_size = decomp_length;
+    GifDiffFree(&gDiff);
+    GifCodeFree(&gCode);
+    return result;
+  }
+
   std::string tempfile2 = tmpfile->file_path + "_rec_";
   tmpfile->reopen();
   PrecompTmpFile frecomp;
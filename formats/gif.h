@@ -10,6 +10,7 @@ public:
 		: PrecompFormatHandler(_header_bytes, _depth_limit) {}
 
 	bool quick_check(const std::span<unsigned char> buffer, uintptr_t current_input_id, const long long original_input_pos) override;
+	std::vector<MagicSignature> get_magic_signatures() const override { return { { "GIF8" } }; }
 
 	std::unique_ptr<precompression_result> attempt_precompression(Precomp& precomp_instance, std::span<unsigned char> buffer, long long input_stream_pos) override;
 
@@ -81,7 +81,7 @@ std::unique_ptr<PrecompFormatHeaderData> GZipFormatHandler::read_format_header(R
 }
 
 void GZipFormatHandler::write_pre_recursion_data(RecursionContext& context, PrecompFormatHeaderData& precomp_hdr_data) {
-  auto precomp_deflate_hdr_data = static_cast<DeflateFormatHeaderData&>(precomp_hdr_data);
+  auto& precomp_deflate_hdr_data = static_cast<DeflateFormatHeaderData&>(precomp_hdr_data);
   // GZIP header
   context.fout->put(31);
   context.fout->put(139);
@@ -10,8 +10,12 @@
 #include <cstddef>
 #include <cstring>
 #include <memory>
+#include <mutex>
 #include <optional>
 
+// packJPG keeps its state in globals, so only one conversion can run at a time
+std::mutex packjpg_mtx;
+
 const char* packjpg_version_info() {
   return pjglib_version_info();
 }
@@ -47,6 +51,26 @@ std::unique_ptr<precompression_result> try_decompression_jpg(Precomp& precomp_mg
     print_to_log(PRECOMP_DEBUG_LOG, "Skipping (only progressive JPGs mode set)\n");
     return result;
   }
+  // When analyzing neither brunsli nor packJPG are run, they usually get JPGs down to about 78% of their size
+  if (precomp_mgr.ctx->comp_decomp_state == P_ANALYZE) {
+    if (!precomp_mgr.switches.use_brunsli && !precomp_mgr.switches.use_packjpg_fallback) return result;
+    result->success = true;
+    result->original_size = jpg_length;
+    result->precompressed_size = jpg_length * 78 / 100;
+    return result;
+  }
+  // brunsli and packJPG already failed on this very same JPG, no need to go through that again
+  if (precomp_mgr.failed_candidates->find(D_JPG, *precomp_mgr.ctx->fin, jpg_start_pos, jpg_length, jpg_length).has_value()) {
+    print_to_log(PRECOMP_DEBUG_LOG, "Identical to a JPG that already failed\n");
+    precomp_mgr.statistics.decompressed_streams_count++;
+    if (progressive_jpg) {
+      precomp_mgr.statistics.decompressed_jpg_prog_count++;
+    }
+    else {
+      precomp_mgr.statistics.decompressed_jpg_count++;
+    }
+    return result;
+  }
 
   bool jpg_success = false;
   bool recompress_success = false;
@@ -56,11 +80,13 @@ std::unique_ptr<precompression_result> try_decompression_jpg(Precomp& precomp_mg
   std::vector<unsigned char> jpg_mem_in {};
   std::unique_ptr<unsigned char[]> jpg_mem_out;
   unsigned int jpg_mem_out_size = -1;
+  TrackedMemory jpg_mem_tracking;
   bool in_memory = ((jpg_length + MJPGDHT_LEN) <= JPG_MAX_MEMORY_SIZE);
 
   if (in_memory) { // small stream => do everything in memory
     precomp_mgr.ctx->fin->seekg(jpg_start_pos, std::ios_base::beg);
     jpg_mem_in.resize(jpg_length + MJPGDHT_LEN);
+    jpg_mem_tracking.set_size(jpg_mem_in.size());
     auto memstream = memiostream::make(jpg_mem_in.data(), jpg_mem_in.data() + jpg_length);
     fast_copy(*precomp_mgr.ctx->fin, *memstream, jpg_length);
 
@@ -144,11 +170,13 @@ std::unique_ptr<precompression_result> try_decompression_jpg(Precomp& precomp_mg
 
     if ((!precomp_mgr.switches.use_brunsli || !brunsli_success) && precomp_mgr.switches.use_packjpg_fallback) {
       unsigned char* mem = nullptr;
+      std::lock_guard lock(packjpg_mtx);
       pjglib_init_streams(jpg_mem_in.data(), 1, jpg_length, mem, 1);
       recompress_success = pjglib_convert_stream2mem(&mem, &jpg_mem_out_size, recompress_msg);
       brunsli_used = false;
       jpg_mem_out = std::unique_ptr<unsigned char[]>(mem);
     }
+    if (jpg_mem_out) jpg_mem_tracking.set_size(jpg_mem_in.size() + jpg_mem_out_size);
   }
   else if (precomp_mgr.switches.use_packjpg_fallback) { // large stream => use temporary files
     print_to_log(PRECOMP_DEBUG_LOG, "JPG too large for brunsli, using packJPG fallback...\n");
@@ -171,6 +199,7 @@ std::unique_ptr<precompression_result> try_decompression_jpg(Precomp& precomp_mg
       fworkaround.close();
     }
 
+    std::lock_guard lock(packjpg_mtx);
     recompress_success = pjglib_convert_file2file(const_cast<char*>(decompressed_jpg_filename.c_str()), const_cast<char*>(tmpfile->file_path.c_str()), recompress_msg);
     brunsli_used = false;
   }
@@ -200,6 +229,7 @@ std::unique_ptr<precompression_result> try_decompression_jpg(Precomp& precomp_mg
         memcpy(jpg_mem_in.data() + (ffda_pos - 1), MJPGDHT, MJPGDHT_LEN);
 
         unsigned char* mem = nullptr;
+        std::lock_guard lock(packjpg_mtx);
         pjglib_init_streams(jpg_mem_in.data(), 1, jpg_length + MJPGDHT_LEN, mem, 1);
         recompress_success = pjglib_convert_stream2mem(&mem, &jpg_mem_out_size, recompress_msg);
         jpg_mem_out = std::unique_ptr<unsigned char[]>(mem);
@@ -234,6 +264,7 @@ std::unique_ptr<precompression_result> try_decompression_jpg(Precomp& precomp_mg
         fast_copy(decompressed_jpg, decompressed_jpg_w_MJPGDHT, jpg_length - (ffda_pos - 1));
       }
       decompressed_jpg.close();
+      std::lock_guard lock(packjpg_mtx);
       recompress_success = pjglib_convert_file2file(const_cast<char*>(mjpgdht_tempfile.c_str()), const_cast<char*>(tmpfile->file_path.c_str()), recompress_msg);
     }
 
@@ -306,6 +337,7 @@ std::unique_ptr<precompression_result> try_decompression_jpg(Precomp& precomp_mg
   }
   else {
     print_to_log(PRECOMP_DEBUG_LOG, "No matches\n");
+    precomp_mgr.failed_candidates->add(D_JPG, *precomp_mgr.ctx->fin, jpg_start_pos, jpg_length, { jpg_length, 0 });
   }
 
   return result;
@@ -319,11 +351,22 @@ std::unique_ptr<precompression_result> JpegFormatHandler::attempt_precompression
 
   long long jpg_end_pos = jpg_start_pos + 2;  // skip header
 
+  // With memory mapped input the markers and entropy coded data are looked at right where they are, instead of seeking and copying them around
+  const auto mapped_input = precomp_mgr.ctx->fin->mapped_data();
+  const long long mapped_size = mapped_input.size();
+
   unsigned char in_buf[5];
   do {
-    precomp_mgr.ctx->fin->seekg(jpg_end_pos, std::ios_base::beg);
-    precomp_mgr.ctx->fin->read(reinterpret_cast<char*>(in_buf), 5);
-    if ((precomp_mgr.ctx->fin->gcount() != 5) || (in_buf[0] != 0xFF))
+    if (!mapped_input.empty()) {
+      if (jpg_end_pos + 5 > mapped_size) break;
+      std::memcpy(in_buf, mapped_input.data() + jpg_end_pos, 5);
+    }
+    else {
+      precomp_mgr.ctx->fin->seekg(jpg_end_pos, std::ios_base::beg);
+      precomp_mgr.ctx->fin->read(reinterpret_cast<char*>(in_buf), 5);
+      if (precomp_mgr.ctx->fin->gcount() != 5) break;
+    }
+    if (in_buf[0] != 0xFF)
       break;
     int length = (int)in_buf[2] * 256 + (int)in_buf[3];
     switch (in_buf[1]) {
@@ -359,25 +402,33 @@ std::unique_ptr<precompression_result> JpegFormatHandler::attempt_precompression
     jpg_end_pos += 5;
 
     bool isMarker = (in_buf[4] == 0xFF);
-    size_t bytesRead = 0;
-    std::vector<unsigned char> in_buf_chunk{};
-    in_buf_chunk.resize(CHUNK);
-    for (;;) {
-      if (done) break;
-      precomp_mgr.ctx->fin->read(reinterpret_cast<char*>(in_buf_chunk.data()), CHUNK);
-      bytesRead = precomp_mgr.ctx->fin->gcount();
-      if (!bytesRead) break;
+    const auto scan_chunk = [&](const unsigned char* chunk, size_t bytesRead) {
       for (size_t i = 0; !done && (i < bytesRead); i++) {
         jpg_end_pos++;
         if (!isMarker) {
-          isMarker = (in_buf_chunk[i] == 0xFF);
+          isMarker = (chunk[i] == 0xFF);
         }
         else {
-          done = (in_buf_chunk[i] && ((in_buf_chunk[i] & 0xF8) != 0xD0) && ((progressive_flag) ? (in_buf_chunk[i] != 0xC4) && (in_buf_chunk[i] != 0xDA) : true));
-          found = (in_buf_chunk[i] == 0xD9);
+          done = (chunk[i] && ((chunk[i] & 0xF8) != 0xD0) && ((progressive_flag) ? (chunk[i] != 0xC4) && (chunk[i] != 0xDA) : true));
+          found = (chunk[i] == 0xD9);
           isMarker = false;
         }
       }
+    };
+    if (!mapped_input.empty()) {
+      scan_chunk(mapped_input.data() + jpg_end_pos, mapped_size - jpg_end_pos);
+    }
+    else {
+      size_t bytesRead = 0;
+      std::vector<unsigned char> in_buf_chunk{};
+      in_buf_chunk.resize(CHUNK);
+      for (;;) {
+        if (done) break;
+        precomp_mgr.ctx->fin->read(reinterpret_cast<char*>(in_buf_chunk.data()), CHUNK);
+        bytesRead = precomp_mgr.ctx->fin->gcount();
+        if (!bytesRead) break;
+        scan_chunk(in_buf_chunk.data(), bytesRead);
+      }
     }
   }
 
@@ -432,11 +483,13 @@ void JpegFormatHandler::recompress(IStreamLike& precompressed_input, OStreamLike
   std::vector<unsigned char> jpg_mem_in {};
   std::unique_ptr<unsigned char[]> jpg_mem_out;
   unsigned int jpg_mem_out_size = -1;
+  TrackedMemory jpg_mem_tracking;
   bool in_memory = jpeg_format_hdr_data.original_size <= JPG_MAX_MEMORY_SIZE;
   bool recompress_success = false;
 
   if (in_memory) {
     jpg_mem_in.resize(jpeg_format_hdr_data.precompressed_size);
+    jpg_mem_tracking.set_size(jpg_mem_in.size());
     auto memstream = memiostream::make(jpg_mem_in.data(), jpg_mem_in.data() + jpeg_format_hdr_data.precompressed_size);
     fast_copy(precompressed_input, *memstream, jpeg_format_hdr_data.precompressed_size);
 
@@ -462,16 +515,19 @@ void JpegFormatHandler::recompress(IStreamLike& precompressed_input, OStreamLike
     }
     else {
       unsigned char* mem = nullptr;
+      std::lock_guard lock(packjpg_mtx);
       pjglib_init_streams(jpg_mem_in.data(), 1, jpeg_format_hdr_data.precompressed_size, mem, 1);
       recompress_success = pjglib_convert_stream2mem(&mem, &jpg_mem_out_size, recompress_msg);
       jpg_mem_out = std::unique_ptr<unsigned char[]>(mem);
     }
+    if (recompress_success) jpg_mem_tracking.set_size(jpg_mem_in.size() + jpg_mem_out_size);
   }
   else {
     dump_to_file(precompressed_input, precompressed_filename, jpeg_format_hdr_data.precompressed_size);
 
     remove(recompressed_filename.c_str());
 
+    std::lock_guard lock(packjpg_mtx);
     recompress_success = pjglib_convert_file2file(const_cast<char*>(precompressed_filename.c_str()), const_cast<char*>(recompressed_filename.c_str()), recompress_msg);
   }
 
@@ -3,9 +3,13 @@
 #include <cstring>
 #include <filesystem>
 #include <memory>
+#include <mutex>
 
 #include "contrib/packmp3/precomp_mp3.h"
 
+// packMP3 keeps its state in globals, so only one conversion can run at a time
+std::mutex packmp3_mtx;
+
 const char* packmp3_version_info() {
   return pmplib_version_info();
 }
@@ -35,6 +39,13 @@ public:
 
 std::unique_ptr<precompression_result> try_precompression_mp3(Precomp& precomp_mgr, long long original_input_pos, long long mp3_length, std::string tmp_filename, mp3_suppression_vars& suppression) {
   std::unique_ptr<precompression_result> result = std::make_unique<precompression_result>(D_MP3);
+  // When analyzing packMP3 isn't run, it usually gets MP3s down to about 90% of their size
+  if (precomp_mgr.ctx->comp_decomp_state == P_ANALYZE) {
+    result->success = true;
+    result->original_size = mp3_length;
+    result->precompressed_size = mp3_length * 90 / 100;
+    return result;
+  }
   std::unique_ptr<PrecompTmpFile> tmpfile = std::make_unique<PrecompTmpFile>();
   tmpfile->open(tmp_filename, std::ios_base::in | std::ios_base::out | std::ios_base::app | std::ios_base::binary);
   std::string decompressed_mp3_filename = tmp_filename + "_";
@@ -60,6 +71,7 @@ std::unique_ptr<precompression_result> try_precompression_mp3(Precomp& precomp_m
 
     attempt_precompression = [&]() {
       unsigned char* mem = nullptr;
+      std::lock_guard lock(packmp3_mtx);
       pmplib_init_streams(mp3_mem_in.data(), 1, mp3_length, mem, 1);
       recompress_success = pmplib_convert_stream2mem(&mem, &mp3_mem_out_size, recompress_msg);
       mp3_mem_out = std::unique_ptr<unsigned char[]>(mem);
@@ -84,6 +96,7 @@ std::unique_ptr<precompression_result> try_precompression_mp3(Precomp& precomp_m
         fworkaround.close();
       }
 
+      std::lock_guard lock(packmp3_mtx);
       recompress_success = pmplib_convert_file2file(const_cast<char*>(decompressed_mp3_filename.c_str()), const_cast<char*>(tmpfile->file_path.c_str()), recompress_msg);
     };
   }
@@ -259,7 +272,7 @@ std::unique_ptr<precompression_result> Mp3FormatHandler::attempt_precompression(
 
   // parse frames until first invalid frame is found or end-of-file
   std::array<unsigned char, 4> frame_hdr{};
-  auto memstream = memiostream::make(buffer.data(), buffer.data() + buffer.size());
+  auto memstream = make_input_memstream(*precomp_instance.ctx->fin, buffer, input_stream_pos);
 
   for (;;) {
     if (!read_with_memstream_buffer(*precomp_instance.ctx->fin, memstream, reinterpret_cast<char*>(frame_hdr.data()), 4, act_pos)) break;
@@ -413,6 +426,7 @@ void Mp3FormatHandler::recompress(IStreamLike& precompressed_input, OStreamLike&
 
     unsigned char* mp3_mem_out = nullptr;
 
+    std::lock_guard lock(packmp3_mtx);
     pmplib_init_streams(mp3_mem_in.data(), 1, precomp_hdr_data.precompressed_size, mp3_mem_out, 1);
     unsigned int mp3_mem_out_size = -1;
     recompress_success = pmplib_convert_stream2mem(&mp3_mem_out, &mp3_mem_out_size, recompress_msg);
@@ -427,6 +441,7 @@ void Mp3FormatHandler::recompress(IStreamLike& precompressed_input, OStreamLike&
   }
   else {
     dump_to_file(precompressed_input, precompressed_filename, precomp_hdr_data.precompressed_size);
+    std::lock_guard lock(packmp3_mtx);
     recompress_success = pmplib_convert_file2file(const_cast<char*>(precompressed_filename.c_str()), const_cast<char*>(recompressed_filename.c_str()), recompress_msg);
 
     if (recompress_success) {
@@ -93,6 +93,10 @@ public:
     explicit pdf_precompression_result(unsigned int img_width, unsigned int img_height)
         : deflate_precompression_result(D_PDF), img_width(img_width), img_height(img_height) {}
 
+    bool precompressed_data_is_verbatim() const override {
+        return deflate_precompression_result::precompressed_data_is_verbatim() && (bmp_header_type == BMP_HEADER_NONE || img_width_bytes() % 4 == 0);
+    }
+
     void dump_precompressed_data_to_outfile(OStreamLike& outfile) const override {
         bool must_pad_bmp = false;
         unsigned int width_bytes = img_width_bytes();
@@ -112,13 +116,12 @@ public:
             }
         }
     }
-    void dump_to_outfile(OStreamLike& outfile) const override {
+    void dump_record_header_to_outfile(OStreamLike& outfile) const override {
         dump_header_to_outfile(outfile);
         dump_penaltybytes_to_outfile(outfile);
         dump_recon_data_to_outfile(outfile);
         dump_stream_sizes_to_outfile(outfile);
         dump_bmp_hdr_to_outfile(outfile);
-        dump_precompressed_data_to_outfile(outfile);
     }
 };
 
@@ -354,6 +357,12 @@ std::unique_ptr<PrecompFormatHeaderData> PdfFormatHandler::read_format_header(Re
   return read_deflate_format_header(*context.fin, *context.fout, precomp_hdr_flags, false);
 }
 
+std::optional<unsigned long long> PdfFormatHandler::get_precompressed_data_size(const PrecompFormatHeaderData& precomp_hdr_data) {
+  // With a BMP header, recompress skips the line padding it added, which depends on the image width stored on the BMP header itself
+  if ((precomp_hdr_data.option_flags & std::byte{ 0b11000000 }) != std::byte{ 0 }) return std::nullopt;
+  return precomp_hdr_data.precompressed_size;
+}
+
 void PdfFormatHandler::recompress(IStreamLike& precompressed_input, OStreamLike& recompressed_stream, PrecompFormatHeaderData& precomp_hdr_data, SupportedFormats precomp_hdr_format, const Tools& tools) {
   auto& deflate_precomp_hdr_data = static_cast<DeflateFormatHeaderData&>(precomp_hdr_data);
 
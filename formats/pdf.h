@@ -10,12 +10,14 @@ public:
 		: PrecompFormatHandler(_header_bytes, _depth_limit) {}
 
 	bool quick_check(const std::span<unsigned char> buffer, uintptr_t current_input_id, const long long original_input_pos) override;
+	std::vector<MagicSignature> get_magic_signatures() const override { return { { "/FlateDecode" } }; }
 
 	std::unique_ptr<precompression_result> attempt_precompression(Precomp& precomp_instance, std::span<unsigned char> buffer, long long input_stream_pos) override;
 
 	std::unique_ptr<PrecompFormatHeaderData> read_format_header(RecursionContext& context, std::byte precomp_hdr_flags, SupportedFormats precomp_hdr_format) override;
 
 	void recompress(IStreamLike& precompressed_input, OStreamLike& recompressed_stream, PrecompFormatHeaderData& precomp_hdr_data, SupportedFormats precomp_hdr_format, const Tools& tools) override;
+	std::optional<unsigned long long> get_precompressed_data_size(const PrecompFormatHeaderData& precomp_hdr_data) override;
 
 	static PdfFormatHandler* create() {
 		return new PdfFormatHandler({ D_PDF });
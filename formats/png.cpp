@@ -47,13 +47,12 @@ public:
         return deflate_precompression_result::complete_original_size() + idat_add_offset;
     }
 
-    void dump_to_outfile(OStreamLike& outfile) const override {
+    void dump_record_header_to_outfile(OStreamLike& outfile) const override {
         dump_header_to_outfile(outfile);
         dump_penaltybytes_to_outfile(outfile);
         dump_idat_to_outfile(outfile);
         dump_recon_data_to_outfile(outfile);
         dump_stream_sizes_to_outfile(outfile);
-        dump_precompressed_data_to_outfile(outfile);
     }
 
     void calculate_idat_count() {
@@ -165,7 +164,7 @@ std::unique_ptr<precompression_result> PngFormatHandler::attempt_precompression(
 
   auto deflate_stream_pos = original_input_pos + 6;
 
-  auto memstream = memiostream::make(checkbuf.data(), checkbuf.data() + checkbuf.size());
+  auto memstream = make_input_memstream(*precomp_mgr.ctx->fin, checkbuf, original_input_pos);
 
   // get preceding length bytes
   std::array<unsigned char, 12> in_buf{};
@@ -384,6 +383,7 @@ std::unique_ptr<PrecompFormatHeaderData> PngFormatHandler::read_format_header(Re
     }
 
     fin_fget_recon_data(*context.fin, fmt_hdr->rdres);
+    fmt_hdr->precompressed_size = fmt_hdr->rdres.uncompressed_stream_size;
     return fmt_hdr;
   }
   default:
@@ -29,7 +29,7 @@ std::unique_ptr<PrecompFormatHeaderData> SwfFormatHandler::read_format_header(Re
 }
 
 void SwfFormatHandler::recompress(IStreamLike& precompressed_input, OStreamLike& recompressed_stream, PrecompFormatHeaderData& precomp_hdr_data, SupportedFormats precomp_hdr_format, const Tools& tools) {
-  auto precomp_deflate_hdr_data = static_cast<DeflateFormatHeaderData&>(precomp_hdr_data);
+  auto& precomp_deflate_hdr_data = static_cast<DeflateFormatHeaderData&>(precomp_hdr_data);
   recompressed_stream.put('C');
   recompressed_stream.put('W');
   recompressed_stream.put('S');
@@ -45,7 +45,7 @@ std::unique_ptr<PrecompFormatHeaderData> ZipFormatHandler::read_format_header(Re
 }
 
 void ZipFormatHandler::write_pre_recursion_data(RecursionContext& context, PrecompFormatHeaderData& precomp_hdr_data) {
-  auto precomp_deflate_hdr_data = static_cast<DeflateFormatHeaderData&>(precomp_hdr_data);
+  auto& precomp_deflate_hdr_data = static_cast<DeflateFormatHeaderData&>(precomp_hdr_data);
   // ZIP header
   context.fout->put('P');
   context.fout->put('K');
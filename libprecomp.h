@@ -62,6 +62,7 @@ ExternC LIBPRECOMP void PrecompSetLoggingCallback(void(*callback)(PrecompLogging
 #define P_NONE 0
 #define P_PRECOMPRESS 1
 #define P_RECOMPRESS 2
+#define P_ANALYZE 3
 
 ExternC LIBPRECOMP void PrecompGetCopyrightMsg(char* msg);
 
@@ -105,6 +106,31 @@ typedef struct {
   bool preflate_verify;
 
   int max_recursion_depth;
+
+  // Threads used to speculatively precompress streams ahead of the current position, 1 disables lookahead, 0 uses as many as the hardware supports (default: 1)
+  unsigned int thread_count;
+  // Split the input into independent segments of this size, which are precompressed in parallel and stored as separate blocks on the PCF, 0 disables it (default: 0)
+  uintmax_t segment_size;
+  // When recompressing with more than one thread, how many bytes of precompressed data can be read ahead of the oldest stream not yet written,
+  // and how many bytes of recompressed streams waiting to be written can be kept in memory, the rest goes to temporary files.
+  // When precompressing with more than one thread, also how much output held back while a stream is verified can be kept in memory (default: 64 MiB)
+  uintmax_t reorder_window;
+  // Append an index of the records to the PCF, which allows restoring just part of the original with PrecompRestoreRange (default: off)
+  bool write_index;
+  // When precompressing, the input is read ahead on a background thread into this many buffers of readahead_buffer_size bytes each,
+  // so reading it overlaps with the format handlers' work. Not used for memory mapped input, 0 disables it (default: 2 buffers of 4 MiB)
+  unsigned int readahead_buffer_count;
+  uintmax_t readahead_buffer_size;
+  // If the buffers Precomp keeps track of (see PrecompGetMemoryPeak) ever hold more than this many bytes at once, what is holding them gets logged.
+  // This is only a diagnostic, nothing is done to stay below it, 0 disables it (default: 0)
+  uintmax_t memory_limit;
+  // Streams identical to one of the latest ones, whose original sizes add up to at most this many bytes, are stored as references to it instead of
+  // being precompressed again. Recompression keeps those latest streams in memory, so it needs up to this much more memory too.
+  // Only streams of at least 1 KiB on the top level are considered, and it's not used with segment_size, 0 disables it (default: 0)
+  uintmax_t dedup_window;
+  // Uncompressed data blocks up to this size are kept in memory as the input is scanned and written from there, larger ones are read again from the input
+  // when written. It doesn't change the PCF, 0 always reads them again (default: 16 MiB)
+  uintmax_t uncompressed_buffer_size;
 } CSwitches;
 
 typedef struct {
@@ -151,13 +177,67 @@ typedef struct {
   unsigned int decompressed_zlib_count;    // intense mode
   unsigned int decompressed_brute_count;   // brute mode
 
+  // Streams stored as references to an identical earlier one (see dedup_window), and their total size
+  unsigned int repeated_streams_count;
+  uintmax_t repeated_streams_size;
+  // Streams whose precompression results were taken from the cache (see PrecompSetCacheDir)
+  unsigned int cached_streams_count;
+  // Streams whose records were copied from the base PCF (see PrecompSetBasePcf), and their total size
+  unsigned int base_streams_count;
+  uintmax_t base_streams_size;
+
   // recursion
   int max_recursion_depth_used;
   bool max_recursion_depth_reached;
 
   bool header_already_read;
+
+  // Set once precompression or recompression finishes: the most memory the buffers Precomp keeps track of held at once, and the peak resident set size
+  // of the whole process, in bytes
+  uintmax_t peak_tracked_memory;
+  uintmax_t peak_rss;
 } CResultStatistics;
 
+// Profiling of where the time goes for each format, counted across all threads and recursion levels.
+// Times are inclusive (a stream's recursion time includes attempts on streams inside it) and CPU time only counts the thread doing the work.
+typedef struct {
+  uintmax_t count;
+  uintmax_t wall_time_us;
+  uintmax_t cpu_time_us;
+} CProfilePhase;
+
+typedef struct {
+  uintmax_t quick_check_hits;
+  // Includes the attempts made ahead of time by lookahead threads (-t), so it can be more than quick_check_hits
+  uintmax_t attempts;
+  // Attempts that gave a stream that passed verification (if enabled), which doesn't mean it was written, as lookahead might have attempted it speculatively
+  uintmax_t successes;
+  // Failures by reason: no valid stream was found, the handler threw an error, or the stream failed verification
+  uintmax_t failures_no_stream;
+  uintmax_t failures_error;
+  uintmax_t failures_verification;
+  CProfilePhase attempt;
+  CProfilePhase verify;
+  CProfilePhase recursion;
+  CProfilePhase recompress;
+  // When precompressing, original and precompressed sizes of the written streams. When recompressing, precompressed and original sizes of the recompressed ones
+  uintmax_t bytes_in;
+  uintmax_t bytes_out;
+} CFormatProfile;
+
+// What a dry run (PrecompAnalyze) found for a format. Streams are only validated cheaply (their headers parsed, deflate streams inflated...) but not actually
+// precompressed, so sizes and times are estimates, and streams that would be found inside them on recursion aren't counted at all.
+typedef struct {
+  // Positions where the format's quick check succeeded, and how many of those turned out to be streams a real run would attempt to precompress in full
+  uintmax_t candidates;
+  uintmax_t streams;
+  uintmax_t original_bytes;
+  uintmax_t estimated_precompressed_bytes;
+  // Estimated time to precompress (and verify, if enabled) the streams on a single thread, and the longest any single one of them would take
+  uintmax_t estimated_time_us;
+  uintmax_t largest_stream_time_us;
+} CFormatAnalysis;
+
 typedef struct Precomp Precomp;
 
 void packjpg_mp3_dll_msg();
@@ -170,12 +250,40 @@ ExternC LIBPRECOMP CSwitches* PrecompGetSwitches(Precomp* precomp_mgr);
 ExternC LIBPRECOMP void PrecompSwitchesSetIgnoreList(CSwitches* precomp_switches, const long long* ignore_pos_list, size_t ignore_post_list_count);
 ExternC LIBPRECOMP CRecursionContext* PrecompGetRecursionContext(Precomp* precomp_mgr);
 ExternC LIBPRECOMP CResultStatistics* PrecompGetResultStatistics(Precomp* precomp_mgr);
+// Copies the profiling counters of the format handler identified by the given format byte (the SupportedFormats values) to profile, and its name to format_name.
+// Returns false if there is no such format handler. The counters are kept by each handler's first format byte, any others just give its counters and name.
+ExternC LIBPRECOMP bool PrecompGetFormatProfile(Precomp* precomp_mgr, unsigned char format, CFormatProfile* profile, const char** format_name);
+// Peak memory held by the biggest buffers (decompressed streams, JPG data, preflate hash chains...) allocated for the format handler identified by the given
+// format byte at the given recursion depth, in bytes. As with PrecompGetFormatProfile, handlers are identified by their first format byte.
+// Memory used at depth PRECOMP_MEMORY_TRACKED_DEPTHS - 1 or deeper is all added up together.
+#define PRECOMP_MEMORY_TRACKED_DEPTHS 16
+ExternC LIBPRECOMP uintmax_t PrecompGetMemoryPeak(Precomp* precomp_mgr, unsigned char format, unsigned int depth);
+// Results of the last PrecompAnalyze for the format handler identified by the given format byte, identified just like with PrecompGetFormatProfile
+ExternC LIBPRECOMP bool PrecompGetFormatAnalysis(Precomp* precomp_mgr, unsigned char format, CFormatAnalysis* analysis, const char** format_name);
+// Estimated time in microseconds a real precompression of the input analyzed by the last PrecompAnalyze would take with the given thread count (the thread_count switch,
+// 0 meaning as many as the hardware supports), from the time the scan took plus the streams' estimated times, as far as lookahead can spread them among the threads
+ExternC LIBPRECOMP uintmax_t PrecompEstimateRuntime(Precomp* precomp_mgr, unsigned int thread_count);
+// If set, precompression and recompression record a timeline of what every thread was doing to this file, in the Chrome trace_event JSON format (open it with Perfetto).
+// Only one trace can be recorded at a time in a process, if another Precomp instance is already tracing nothing is recorded. Set to nullptr to stop tracing.
+ExternC LIBPRECOMP void PrecompSetTraceFile(Precomp* precomp_mgr, const char* trace_file_name);
+// If set, precompression keeps the results for the streams it precompresses in this directory, and takes them from there when later precompressing identical streams
+// with the same switches, instead of precompressing them again. The directory can be shared by several processes at once. After precompressing, the least recently
+// used results are removed until the ones kept add up to at most size_limit bytes. Set to nullptr to stop using it.
+ExternC LIBPRECOMP void PrecompSetCacheDir(Precomp* precomp_mgr, const char* cache_dir, uintmax_t size_limit);
+// If set, precompression copies the records of this earlier PCF of (a previous version of) the input for the streams still on the input unchanged, instead of
+// precompressing them again. The base PCF has to be precompressed with the write_index switch by this same version. It isn't used with segment_size,
+// and nothing is copied from it if it was made with different switches affecting the streams' records (the formats used, recursion depth, PDF/JPG options...).
+// Returns 0 on success or an error code if the base PCF can't be used, set to nullptr to stop using it.
+ExternC LIBPRECOMP int PrecompSetBasePcf(Precomp* precomp_mgr, const char* base_pcf_file_name);
 
 // IMPORTANT!! Input streams for precompression HAVE to be seekable, else it WILL fail.
 // For recompression no seeking is done so in those cases its okay to have input streams that can't seek.
 ExternC LIBPRECOMP typedef void* PrecompIStream;
 ExternC LIBPRECOMP void PrecompSetInputStream(Precomp* precomp_mgr, PrecompIStream istream, const char* input_file_name);
 ExternC LIBPRECOMP void PrecompSetInputFile(Precomp* precomp_mgr, FILE* fhandle, const char* input_file_name);
+// Opens the file by itself, memory mapping it when possible so precompression can read it without copying, or reading it as a regular file otherwise.
+// Returns false if the file couldn't be opened.
+ExternC LIBPRECOMP bool PrecompSetInputFilePath(Precomp* precomp_mgr, const char* input_file_name);
 // This allows you to customize exactly how you would like data to be fed to Precomp.
 // You can use an instance ptr of anything you may want (Socket, Handle, something custom from your application) and functions you define about how to operate
 // with that instance to do all of the different operations a C++ IStream might do, which is what Precomp uses (sort of).
@@ -231,6 +339,12 @@ ExternC LIBPRECOMP void PrecompSetGenericOutputStream(
 
 ExternC LIBPRECOMP int PrecompPrecompress(Precomp* precomp_mgr);
 ExternC LIBPRECOMP int PrecompRecompress(Precomp* precomp_mgr);
+// Dry run of PrecompPrecompress: scans the input and cheaply validates the streams found, without precompressing them or writing any output,
+// see PrecompGetFormatAnalysis and PrecompEstimateRuntime for the results
+ExternC LIBPRECOMP int PrecompAnalyze(Precomp* precomp_mgr);
+// Writes only the original bytes in [original_pos, original_pos + length) to the output, recompressing just the streams that overlap them.
+// The input has to be a seekable PCF file precompressed with the write_index switch. Nothing past the end of the original is written.
+ExternC LIBPRECOMP int PrecompRestoreRange(Precomp* precomp_mgr, unsigned long long original_pos, unsigned long long length);
 ExternC LIBPRECOMP int PrecompReadHeader(Precomp* precomp_mgr, bool seek_to_beg);
 // Mostly useful to run after a successful PrecompReadHeader, to know the original filename of the precompressed file
 ExternC LIBPRECOMP const char* PrecompGetOutputFilename(Precomp* precomp_mgr);
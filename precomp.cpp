@@ -40,6 +40,7 @@
 #include <csignal>
 #include <random>
 #include <filesystem>
+#include <set>
 
 #ifdef __unix
 #include <time.h>
@@ -53,6 +54,11 @@
 
 std::string input_file_name;
 std::string output_file_name;
+// Set with -range, only that part of the original gets restored when recompressing
+std::optional<std::pair<long long, long long>> restore_range;
+// Set with -profile, the per format profiling counters get printed after the statistics, or written to stderr as JSON with -profile=json
+enum ProfileOutput { PROFILE_NONE, PROFILE_TEXT, PROFILE_JSON };
+ProfileOutput profile_output = PROFILE_NONE;
 
 void(*log_output_func)(const std::string&) = &print_to_console;
 
@@ -157,25 +163,28 @@ bool file_exists(const char* filename) {
 
 // nice time output, input t in ms
 // 2^32 ms maximum, so will display incorrect negative values after about 49 days
-void printf_time(long long t) {
-  log_output_func("Time: ");
+std::string time_text(long long t) {
   if (t < 1000) { // several milliseconds
-    log_output_func(make_cstyle_format_string("%li millisecond(s)\n", (long)t));
+    return make_cstyle_format_string("%li millisecond(s)", (long)t);
   }
   else if (t < 1000 * 60) { // several seconds
-    log_output_func(make_cstyle_format_string("%li second(s), %li millisecond(s)\n", (long)(t / 1000), (long)(t % 1000)));
+    return make_cstyle_format_string("%li second(s), %li millisecond(s)", (long)(t / 1000), (long)(t % 1000));
   }
   else if (t < 1000 * 60 * 60) { // several minutes
-    log_output_func(make_cstyle_format_string("%li minute(s), %li second(s)\n", (long)(t / (1000 * 60)), (long)((t / 1000) % 60)));
+    return make_cstyle_format_string("%li minute(s), %li second(s)", (long)(t / (1000 * 60)), (long)((t / 1000) % 60));
   }
   else if (t < 1000 * 60 * 60 * 24) { // several hours
-    log_output_func(make_cstyle_format_string("%li hour(s), %li minute(s), %li second(s)\n", (long)(t / (1000 * 60 * 60)), (long)((t / (1000 * 60)) % 60), (long)((t / 1000) % 60)));
+    return make_cstyle_format_string("%li hour(s), %li minute(s), %li second(s)", (long)(t / (1000 * 60 * 60)), (long)((t / (1000 * 60)) % 60), (long)((t / 1000) % 60));
   }
   else {
-    log_output_func(make_cstyle_format_string("%li day(s), %li hour(s), %li minute(s)\n", (long)(t / (1000 * 60 * 60 * 24)), (long)((t / (1000 * 60 * 60)) % 24), (long)((t / (1000 * 60)) % 60)));
+    return make_cstyle_format_string("%li day(s), %li hour(s), %li minute(s)", (long)(t / (1000 * 60 * 60 * 24)), (long)((t / (1000 * 60 * 60)) % 24), (long)((t / (1000 * 60)) % 60));
   }
 }
 
+void printf_time(long long t) {
+  log_output_func("Time: " + time_text(t) + "\n");
+}
+
 int work_sign_var = 0;
 static char work_signs[5] = "|/-\\";
 std::string next_work_sign() {
@@ -303,9 +312,152 @@ void print_statistics(Precomp& precomp_mgr, CSwitches& precomp_switches) {
     }
   }
 
+  if (precomp_statistics->cached_streams_count > 0) {
+    log_output_func(make_cstyle_format_string("Streams taken from cache: %u\n", precomp_statistics->cached_streams_count));
+  }
+
+  if (precomp_statistics->base_streams_count > 0) {
+    log_output_func(make_cstyle_format_string("Streams copied from base PCF: %u (%llu bytes)\n", precomp_statistics->base_streams_count,
+      static_cast<unsigned long long>(precomp_statistics->base_streams_size)));
+  }
+
+  if (precomp_statistics->repeated_streams_count > 0) {
+    log_output_func(make_cstyle_format_string("Repeated streams: %u (%llu bytes)\n", precomp_statistics->repeated_streams_count,
+      static_cast<unsigned long long>(precomp_statistics->repeated_streams_size)));
+  }
+
+  // Only of interest when memory use was asked about
+  if (profile_output != PROFILE_NONE || precomp_switches.memory_limit != 0) {
+    log_output_func(make_cstyle_format_string("Peak memory: %llu KiB in tracked buffers, %llu KiB RSS\n",
+      static_cast<unsigned long long>(precomp_statistics->peak_tracked_memory / 1024), static_cast<unsigned long long>(precomp_statistics->peak_rss / 1024)));
+  }
+
   if (!precomp_switches.level_switch_used) show_used_levels(precomp_mgr, precomp_switches);
 }
 
+// The format bytes identifying each format handler once, as the others of a handler just give the same counters
+std::vector<unsigned char> format_handler_bytes(Precomp& precomp_mgr) {
+  std::vector<unsigned char> formats;
+  std::set<std::string> format_names;
+  for (unsigned int format = 0; format < 256; format++) {
+    const char* format_name;
+    if (!PrecompGetFormatProfile(&precomp_mgr, static_cast<unsigned char>(format), nullptr, &format_name)) continue;
+    if (format_names.insert(format_name).second) formats.push_back(static_cast<unsigned char>(format));
+  }
+  return formats;
+}
+
+// Peak memory of the format handler identified by format at each recursion depth, up to the deepest one that used any
+std::vector<uintmax_t> format_memory_peaks(Precomp& precomp_mgr, unsigned char format) {
+  std::vector<uintmax_t> peaks;
+  for (unsigned int depth = 0; depth < PRECOMP_MEMORY_TRACKED_DEPTHS; depth++) {
+    peaks.push_back(PrecompGetMemoryPeak(&precomp_mgr, format, depth));
+  }
+  while (!peaks.empty() && peaks.back() == 0) peaks.pop_back();
+  return peaks;
+}
+
+void print_memory_peaks(Precomp& precomp_mgr) {
+  auto precomp_statistics = PrecompGetResultStatistics(&precomp_mgr);
+  log_output_func(make_cstyle_format_string("\nPeak memory by format and recursion depth (%llu KiB in total):\n", static_cast<unsigned long long>(precomp_statistics->peak_tracked_memory / 1024)));
+  for (const unsigned char format : format_handler_bytes(precomp_mgr)) {
+    const char* format_name;
+    if (!PrecompGetFormatProfile(&precomp_mgr, format, nullptr, &format_name)) continue;
+    const auto peaks = format_memory_peaks(precomp_mgr, format);
+    if (peaks.empty()) continue;
+    std::string peaks_text;
+    for (unsigned int depth = 0; depth < peaks.size(); depth++) {
+      if (peaks[depth] == 0) continue;
+      if (!peaks_text.empty()) peaks_text += ", ";
+      peaks_text += make_cstyle_format_string("depth %u: %llu KiB", depth, static_cast<unsigned long long>(peaks[depth] / 1024));
+    }
+    log_output_func(std::string(format_name) + ": " + peaks_text + "\n");
+  }
+}
+
+void print_analysis(Precomp& precomp_mgr, CSwitches& precomp_switches) {
+  log_output_func("\nAnalysis (streams were only validated, precompressed sizes and times are estimates):\n");
+  log_output_func(make_cstyle_format_string("%-20s %12s %10s %16s %16s %12s\n", "format", "candidates", "streams", "original", "precompressed", "time (s)"));
+  CFormatAnalysis total {};
+  for (const unsigned char format : format_handler_bytes(precomp_mgr)) {
+    CFormatAnalysis analysis;
+    const char* format_name;
+    if (!PrecompGetFormatAnalysis(&precomp_mgr, format, &analysis, &format_name)) continue;
+    if (analysis.candidates == 0) continue;
+    log_output_func(make_cstyle_format_string("%-20s %12llu %10llu %16llu %16llu %12.1f\n", format_name,
+      static_cast<unsigned long long>(analysis.candidates), static_cast<unsigned long long>(analysis.streams), static_cast<unsigned long long>(analysis.original_bytes),
+      static_cast<unsigned long long>(analysis.estimated_precompressed_bytes), analysis.estimated_time_us / 1000000.0));
+    total.candidates += analysis.candidates;
+    total.streams += analysis.streams;
+    total.original_bytes += analysis.original_bytes;
+    total.estimated_precompressed_bytes += analysis.estimated_precompressed_bytes;
+    total.estimated_time_us += analysis.estimated_time_us;
+  }
+  log_output_func(make_cstyle_format_string("%-20s %12llu %10llu %16llu %16llu %12.1f\n", "total",
+    static_cast<unsigned long long>(total.candidates), static_cast<unsigned long long>(total.streams), static_cast<unsigned long long>(total.original_bytes),
+    static_cast<unsigned long long>(total.estimated_precompressed_bytes), total.estimated_time_us / 1000000.0));
+
+  const long long input_length = PrecompGetRecursionContext(&precomp_mgr)->fin_length;
+  log_output_func(make_cstyle_format_string("\nEstimated output size: %lli instead of %lli (not counting streams found on recursion)\n",
+    input_length - static_cast<long long>(total.original_bytes) + static_cast<long long>(total.estimated_precompressed_bytes), input_length));
+  log_output_func("Estimated precompression time:\n");
+  log_output_func("  t1: " + time_text(PrecompEstimateRuntime(&precomp_mgr, 1) / 1000) + "\n");
+  if (precomp_switches.thread_count > 1) {
+    log_output_func(make_cstyle_format_string("  t%u: ", precomp_switches.thread_count) + time_text(PrecompEstimateRuntime(&precomp_mgr, precomp_switches.thread_count) / 1000) + "\n");
+  }
+  log_output_func("  t0: " + time_text(PrecompEstimateRuntime(&precomp_mgr, 0) / 1000) + "\n");
+}
+
+std::string profile_phase_text(const char* phase_name, const CProfilePhase& phase) {
+  return make_cstyle_format_string("%s %llu in %.3f/%.3f s", phase_name, static_cast<unsigned long long>(phase.count),
+    phase.wall_time_us / 1000000.0, phase.cpu_time_us / 1000000.0);
+}
+
+std::string profile_phase_json(const char* phase_name, const CProfilePhase& phase) {
+  return make_cstyle_format_string("\"%s\": {\"count\": %llu, \"wall_time_us\": %llu, \"cpu_time_us\": %llu}", phase_name,
+    static_cast<unsigned long long>(phase.count), static_cast<unsigned long long>(phase.wall_time_us), static_cast<unsigned long long>(phase.cpu_time_us));
+}
+
+void print_profile(Precomp& precomp_mgr) {
+  std::string json_formats;
+  if (profile_output == PROFILE_TEXT) log_output_func("\nFormat profile (wall/CPU time, inclusive of recursion):\n");
+  for (const unsigned char format : format_handler_bytes(precomp_mgr)) {
+    CFormatProfile profile;
+    const char* format_name;
+    if (!PrecompGetFormatProfile(&precomp_mgr, format, &profile, &format_name)) continue;
+    if (profile.quick_check_hits == 0 && profile.attempts == 0 && profile.recompress.count == 0) continue;
+
+    if (profile_output == PROFILE_TEXT) {
+      log_output_func(make_cstyle_format_string("%s: %llu quick check hits, %llu attempts, %llu successes, %llu/%llu/%llu failed (no stream/error/verification)\n", format_name,
+        static_cast<unsigned long long>(profile.quick_check_hits), static_cast<unsigned long long>(profile.attempts), static_cast<unsigned long long>(profile.successes),
+        static_cast<unsigned long long>(profile.failures_no_stream), static_cast<unsigned long long>(profile.failures_error), static_cast<unsigned long long>(profile.failures_verification)));
+      log_output_func("  " + profile_phase_text("attempt", profile.attempt) + ", " + profile_phase_text("verify", profile.verify) + ", "
+        + profile_phase_text("recursion", profile.recursion) + ", " + profile_phase_text("recompress", profile.recompress) + "\n");
+      log_output_func(make_cstyle_format_string("  %llu bytes in, %llu bytes out\n", static_cast<unsigned long long>(profile.bytes_in), static_cast<unsigned long long>(profile.bytes_out)));
+    }
+    else {
+      if (!json_formats.empty()) json_formats += ",\n";
+      json_formats += make_cstyle_format_string("    {\"format\": %u, \"name\": \"%s\", \"quick_check_hits\": %llu, \"attempts\": %llu, \"successes\": %llu, ", static_cast<unsigned int>(format), format_name,
+        static_cast<unsigned long long>(profile.quick_check_hits), static_cast<unsigned long long>(profile.attempts), static_cast<unsigned long long>(profile.successes));
+      json_formats += make_cstyle_format_string("\"failures\": {\"no_stream\": %llu, \"error\": %llu, \"verification\": %llu}, ",
+        static_cast<unsigned long long>(profile.failures_no_stream), static_cast<unsigned long long>(profile.failures_error), static_cast<unsigned long long>(profile.failures_verification));
+      json_formats += profile_phase_json("attempt", profile.attempt) + ", " + profile_phase_json("verify", profile.verify) + ", "
+        + profile_phase_json("recursion", profile.recursion) + ", " + profile_phase_json("recompress", profile.recompress) + ", ";
+      json_formats += make_cstyle_format_string("\"bytes_in\": %llu, \"bytes_out\": %llu, \"peak_memory_by_depth\": [", static_cast<unsigned long long>(profile.bytes_in), static_cast<unsigned long long>(profile.bytes_out));
+      const auto peaks = format_memory_peaks(precomp_mgr, static_cast<unsigned char>(format));
+      for (unsigned int depth = 0; depth < peaks.size(); depth++) {
+        json_formats += make_cstyle_format_string(depth == 0 ? "%llu" : ", %llu", static_cast<unsigned long long>(peaks[depth]));
+      }
+      json_formats += "]}";
+    }
+  }
+  if (profile_output == PROFILE_JSON) {
+    auto precomp_statistics = PrecompGetResultStatistics(&precomp_mgr);
+    std::cerr << "{\n  \"peak_tracked_memory\": " << precomp_statistics->peak_tracked_memory << ",\n  \"peak_rss\": " << precomp_statistics->peak_rss << ",\n";
+    std::cerr << "  \"formats\": [\n" << json_formats << (json_formats.empty() ? "" : "\n") << "  ]\n}\n";
+  }
+}
+
 void log_handler(PrecompLoggingLevels level, char* msg) {
   if (level >= PRECOMP_DEBUG_LOG) {
     // This way even with debug logging we keep the progress percent with work sign at the end
@@ -351,6 +503,9 @@ int init(Precomp& precomp_mgr, CSwitches& precomp_switches, int argc, char* argv
   bool long_help = false;
   bool preserve_extension = false;
   bool comfort_mode = false;
+  std::string cache_dir;
+  uintmax_t cache_size_limit = 1024ULL * 1024 * 1024;
+  std::string base_pcf_file_name;
 
   std::vector<long long> ignore_list;
 
@@ -368,6 +523,16 @@ int init(Precomp& precomp_mgr, CSwitches& precomp_switches, int argc, char* argv
         parse_on = false;
         break;
       }
+      case 'A':
+      {
+        if (parsePrefixText(argv[i] + 1, "analyze")) {
+          operation = P_ANALYZE;
+        }
+        else {
+          throw std::runtime_error(make_cstyle_format_string("ERROR: Unknown switch \"%s\"\n", argv[i]));
+        }
+        break;
+      }
       case 'I':
       {
         if (parsePrefixText(argv[i] + 1, "intense")) { // intense mode
@@ -376,6 +541,9 @@ int init(Precomp& precomp_mgr, CSwitches& precomp_switches, int argc, char* argv
             precomp_switches.intense_mode_depth_limit = parseIntUntilEnd(argv[i] + 8, "intense mode level limit", ERR_INTENSE_MODE_LIMIT_TOO_BIG);
           }
         }
+        else if (strlen(argv[i]) == 6 && parsePrefixText(argv[i] + 1, "index")) {
+          precomp_switches.write_index = true;
+        }
         else {
           long long ignore_pos = parseInt64UntilEnd(argv[i] + 2, "ignore position", ERR_IGNORE_POS_TOO_BIG);
           ignore_list.push_back(ignore_pos);
@@ -384,6 +552,17 @@ int init(Precomp& precomp_mgr, CSwitches& precomp_switches, int argc, char* argv
       }
       case 'D':
       {
+        if (parsePrefixText(argv[i] + 1, "dedup")) {
+          long long window_mib = 64;
+          if (strlen(argv[i]) > 6) {
+            window_mib = parseInt64UntilEnd(argv[i] + 6, "dedup window size");
+          }
+          if (window_mib == 0) {
+            throw std::runtime_error(make_cstyle_format_string("ERROR: Dedup window size must be at least 1 MiB\n"));
+          }
+          precomp_switches.dedup_window = static_cast<uintmax_t>(window_mib) * 1024 * 1024;
+          break;
+        }
         if (recursion_depth_set) {
           throw std::runtime_error(libprecomp_error_msg(ERR_ONLY_SET_RECURSION_DEPTH_ONCE));
         }
@@ -393,6 +572,17 @@ int init(Precomp& precomp_mgr, CSwitches& precomp_switches, int argc, char* argv
       }
       case 'S':
       {
+        if (parsePrefixText(argv[i] + 1, "segment")) {
+          long long segment_mib = 256;
+          if (strlen(argv[i]) > 8) {
+            segment_mib = parseInt64UntilEnd(argv[i] + 8, "segment size");
+          }
+          if (segment_mib == 0) {
+            throw std::runtime_error(make_cstyle_format_string("ERROR: Segment size must be at least 1 MiB\n"));
+          }
+          precomp_switches.segment_size = static_cast<uintmax_t>(segment_mib) * 1024 * 1024;
+          break;
+        }
         if (min_ident_size_set) {
           throw std::runtime_error(libprecomp_error_msg(ERR_ONLY_SET_MIN_SIZE_ONCE));
         }
@@ -402,7 +592,13 @@ int init(Precomp& precomp_mgr, CSwitches& precomp_switches, int argc, char* argv
       }
       case 'B':
       {
-        if (parsePrefixText(argv[i] + 1, "brute")) { // brute mode
+        if (parsePrefixText(argv[i] + 1, "base=")) {
+          if (argv[i][6] == 0) {
+            throw std::runtime_error(make_cstyle_format_string("ERROR: No base PCF given\n"));
+          }
+          base_pcf_file_name = argv[i] + 6;
+        }
+        else if (parsePrefixText(argv[i] + 1, "brute")) { // brute mode
           precomp_switches.brute_mode = true;
           if (strlen(argv[i]) > 6) {
             precomp_switches.brute_mode_depth_limit = parseIntUntilEnd(argv[i] + 6, "brute mode level limit", ERR_BRUTE_MODE_LIMIT_TOO_BIG);
@@ -425,6 +621,18 @@ int init(Precomp& precomp_mgr, CSwitches& precomp_switches, int argc, char* argv
       }
       case 'P':
       {
+        if (parsePrefixText(argv[i] + 1, "profile")) {
+          if (argv[i][8] == 0) {
+            profile_output = PROFILE_TEXT;
+          }
+          else if (strcmp(argv[i] + 8, "=json") == 0) {
+            profile_output = PROFILE_JSON;
+          }
+          else {
+            throw std::runtime_error(make_cstyle_format_string("ERROR: Unknown switch \"%s\"\n", argv[i]));
+          }
+          break;
+        }
         if (!parseSwitch(precomp_switches.pdf_bmp_mode, argv[i] + 1, "pdfbmp")
           && !parseSwitch(precomp_switches.prog_only, argv[i] + 1, "progonly")
           && !parseSwitch(precomp_switches.preflate_verify, argv[i] + 1, "pfverify")
@@ -444,6 +652,17 @@ int init(Precomp& precomp_mgr, CSwitches& precomp_switches, int argc, char* argv
       }
       case 'T':
       {
+        if (parsePrefixText(argv[i] + 1, "trace=")) {
+          if (argv[i][7] == 0) {
+            throw std::runtime_error(make_cstyle_format_string("ERROR: No trace file name given\n"));
+          }
+          PrecompSetTraceFile(&precomp_mgr, argv[i] + 7);
+          break;
+        }
+        if (argv[i][2] >= '0' && argv[i][2] <= '9') { // lookahead threads
+          precomp_switches.thread_count = parseIntUntilEnd(argv[i] + 2, "lookahead thread count");
+          break;
+        }
         bool set_to;
         switch (argv[i][2]) {
         case '+':
@@ -515,6 +734,21 @@ int init(Precomp& precomp_mgr, CSwitches& precomp_switches, int argc, char* argv
       }
       case 'C':
       {
+        if (parsePrefixText(argv[i] + 1, "cache=")) {
+          if (argv[i][7] == 0) {
+            throw std::runtime_error(make_cstyle_format_string("ERROR: No cache directory given\n"));
+          }
+          cache_dir = argv[i] + 7;
+          break;
+        }
+        if (parsePrefixText(argv[i] + 1, "cachesize")) {
+          const long long cache_size_mib = parseInt64UntilEnd(argv[i] + 10, "cache size");
+          if (cache_size_mib == 0) {
+            throw std::runtime_error(make_cstyle_format_string("ERROR: Cache size must be at least 1 MiB\n"));
+          }
+          cache_size_limit = static_cast<uintmax_t>(cache_size_mib) * 1024 * 1024;
+          break;
+        }
         if (strlen(argv[i]) == 8 && parsePrefixText(argv[i] + 1, "comfort")) {
           comfort_mode = true;
         }
@@ -548,12 +782,49 @@ int init(Precomp& precomp_mgr, CSwitches& precomp_switches, int argc, char* argv
       }
       case 'R':
       {
+        if (parsePrefixText(argv[i] + 1, "readahead")) {
+          const char* readahead_param = argv[i] + 10;
+          precomp_switches.readahead_buffer_count = parseInt(readahead_param, "read ahead buffer count");
+          if (*readahead_param == ',') {
+            const long long buffer_kib = parseInt64UntilEnd(readahead_param + 1, "read ahead buffer size");
+            if (buffer_kib == 0) {
+              throw std::runtime_error(make_cstyle_format_string("ERROR: Read ahead buffer size must be at least 1 KiB\n"));
+            }
+            precomp_switches.readahead_buffer_size = static_cast<uintmax_t>(buffer_kib) * 1024;
+          }
+          else if (*readahead_param != 0) {
+            throw std::runtime_error(make_cstyle_format_string("ERROR: Read ahead has to be given as count[,size]\n"));
+          }
+          break;
+        }
         operation = P_RECOMPRESS;
+        if (parsePrefixText(argv[i] + 1, "range")) {
+          const char* range_param = argv[i] + 6;
+          const long long range_start = parseInt64(range_param, "range start");
+          if (*range_param != ',') {
+            throw std::runtime_error(make_cstyle_format_string("ERROR: Range has to be given as start,length\n"));
+          }
+          const long long range_length = parseInt64UntilEnd(range_param + 1, "range length");
+          restore_range = { range_start, range_length };
+          break;
+        }
         if (argv[i][2] != 0) { // Extra Parameters?
           throw std::runtime_error(make_cstyle_format_string("ERROR: Unknown switch \"%s\"\n", argv[i]));
         }
         break;
       }
+      case 'W':
+      {
+        if (!parsePrefixText(argv[i] + 1, "window") || strlen(argv[i]) == 7) {
+          throw std::runtime_error(make_cstyle_format_string("ERROR: Unknown switch \"%s\"\n", argv[i]));
+        }
+        const long long window_mib = parseInt64UntilEnd(argv[i] + 7, "reorder window size");
+        if (window_mib == 0) {
+          throw std::runtime_error(make_cstyle_format_string("ERROR: Reorder window size must be at least 1 MiB\n"));
+        }
+        precomp_switches.reorder_window = static_cast<uintmax_t>(window_mib) * 1024 * 1024;
+        break;
+      }
       case 'Z':
       {
         if (toupper(argv[i][2]) == 'L') {
@@ -611,6 +882,14 @@ int init(Precomp& precomp_mgr, CSwitches& precomp_switches, int argc, char* argv
 
       case 'M':
       {
+        if (parsePrefixText(argv[i] + 1, "memlimit")) {
+          const long long memory_limit_mib = parseInt64UntilEnd(argv[i] + 9, "memory limit");
+          if (memory_limit_mib == 0) {
+            throw std::runtime_error(make_cstyle_format_string("ERROR: Memory limit must be at least 1 MiB\n"));
+          }
+          precomp_switches.memory_limit = static_cast<uintmax_t>(memory_limit_mib) * 1024 * 1024;
+          break;
+        }
         if (!parseSwitch(precomp_switches.use_mjpeg, argv[i] + 1, "mjpeg")) {
           throw std::runtime_error(make_cstyle_format_string("ERROR: Unknown switch \"%s\"\n", argv[i]));
         }
@@ -638,25 +917,20 @@ int init(Precomp& precomp_mgr, CSwitches& precomp_switches, int argc, char* argv
 
       input_file_given = true;
       input_file_name = argv[i];
-      std::istream* input_stream = nullptr;
 
       if (input_file_name == "stdin") {
         if (operation != P_RECOMPRESS) {
           throw std::runtime_error(make_cstyle_format_string("ERROR: Reading from stdin or writing to stdout only supported for recompressing.\n"));
         }
-        input_stream = &std::cin;
+        PrecompSetInputStream(&precomp_mgr, &std::cin, input_file_name.c_str());
       }
       else {
         precomp_context->fin_length = std::filesystem::file_size(argv[i]);
 
-        auto fin = new std::ifstream();
-        fin->open(argv[i], std::ios_base::in | std::ios_base::binary);
-        if (!fin->is_open()) {
+        if (!PrecompSetInputFilePath(&precomp_mgr, input_file_name.c_str())) {
           throw std::runtime_error(make_cstyle_format_string("ERROR: Input file \"%s\" doesn't exist\n", input_file_name.c_str()));
         }
-        input_stream = fin;
       }
-      PrecompSetInputStream(&precomp_mgr, input_stream, input_file_name.c_str());
 
       // output file given? If not, use input filename with .pcf extension
       if (operation == P_RECOMPRESS || comfort_mode) {
@@ -732,6 +1006,8 @@ int init(Precomp& precomp_mgr, CSwitches& precomp_switches, int argc, char* argv
     log_output_func("  comfort      Read input stream for a PCF header and recompress original stream if found\n");
     log_output_func("               (ignoring any compression parameters), if not precompress the stream instead\n");
     log_output_func("  r            \"Recompress\" PCF file (restore original file)\n");
+    log_output_func("  analyze      Only report what would be precompressed and estimate how long it would take,\n");
+    log_output_func("               without precompressing anything or writing any output\n");
     log_output_func("  o[filename]  Write output to [filename] <[input_file].pcf or file in header>\n");
     log_output_func("  e            preserve original extension of input name for output name <off>\n");
     log_output_func("  v            Verbose (debug) mode <off>\n");
@@ -751,6 +1027,7 @@ int init(Precomp& precomp_mgr, CSwitches& precomp_switches, int argc, char* argv
     log_output_func("              t+ = enable these types only, t- = enable all types except these\n");
     log_output_func("              P = PDF, Z = ZIP, G = GZip, N = PNG, F = GIF, J = JPG\n");
     log_output_func("              S = SWF, M = MIME Base64, B = bZip2, 3 = MP3\n");
+    log_output_func("  t[threads]   Precompress streams ahead on this many threads, 0 = all cores <1>\n");
 
     if (!long_help) {
       log_output_func("  longhelp     Show long help\n");
@@ -758,6 +1035,18 @@ int init(Precomp& precomp_mgr, CSwitches& precomp_switches, int argc, char* argv
     else {
       log_output_func("  i[pos]       Ignore stream at input file position [pos] <none>\n");
       log_output_func("  s[size]      Set minimal identical byte size to [size] <4 (64 intense mode)>\n");
+      log_output_func("  segment[size] Precompress in independent segments of [size] MiB, in parallel with t[threads] <off, 256>\n");
+      log_output_func("  window[size] Hold up to [size] MiB of streams in memory when working with t[threads] <64>\n");
+      log_output_func("  readahead[n],[size] Read the input ahead into [n] buffers of [size] KiB, 0 = off <2,4096>\n");
+      log_output_func("  profile[=json] Show time and counters for each format, or write them to stderr as JSON <off>\n");
+      log_output_func("  memlimit[size] Log what holds memory if tracked buffers exceed [size] MiB, show peaks <off>\n");
+      log_output_func("  trace=[file] Write a timeline of what each thread did to [file], viewable with Perfetto <off>\n");
+      log_output_func("  dedup[size]  Store repeats of streams in the last [size] MiB of them as references <off, 64>\n");
+      log_output_func("  cache=[dir]  Reuse precompressed streams kept in [dir] by earlier runs, and keep new ones there <off>\n");
+      log_output_func("  cachesize[size] Keep at most [size] MiB in the cache, dropping the least recently used <1024>\n");
+      log_output_func("  index        Append an index of the streams, needed for range and base <off>\n");
+      log_output_func("  base=[pcf]   Copy the streams still unchanged from [pcf], made with index from an earlier input <off>\n");
+      log_output_func("  range[s],[l] Only restore [l] bytes of the original from position [s], implies r\n");
       log_output_func("  pdfbmp[+-]   Wrap a BMP header around PDF images <off>\n");
       log_output_func("  progonly[+-] Recompress progressive JPGs only (useful for PAQ) <off>\n");
       log_output_func("  mjpeg[+-]    Insert huffman table for MJPEG recompression <on>\n");
@@ -774,6 +1063,13 @@ int init(Precomp& precomp_mgr, CSwitches& precomp_switches, int argc, char* argv
     exit(1);
   }
 
+  if (operation == P_ANALYZE) {
+    log_output_func(make_cstyle_format_string("Input file: %s\n\n", input_file_name.c_str()));
+    packjpg_mp3_dll_msg();
+    setSwitchesIgnoreList(precomp_switches, ignore_list);
+    return operation;
+  }
+
   std::ostream* output_stream;
   if (output_file_given && output_file_name == "stdout") {
     output_stream = &std::cout;
@@ -826,6 +1122,14 @@ int init(Precomp& precomp_mgr, CSwitches& precomp_switches, int argc, char* argv
 
   packjpg_mp3_dll_msg();
   setSwitchesIgnoreList(precomp_switches, ignore_list);
+  if (!cache_dir.empty()) PrecompSetCacheDir(&precomp_mgr, cache_dir.c_str(), cache_size_limit);
+  if (!base_pcf_file_name.empty() && operation == P_PRECOMPRESS) {
+    if (precomp_switches.segment_size != 0) {
+      throw std::runtime_error(make_cstyle_format_string("ERROR: Base PCF can't be used with segment\n"));
+    }
+    const int base_pcf_error = PrecompSetBasePcf(&precomp_mgr, base_pcf_file_name.c_str());
+    if (base_pcf_error != 0) throw std::runtime_error(libprecomp_error_msg(base_pcf_error));
+  }
 
   return operation;
 }
@@ -858,7 +1162,18 @@ int main(int argc, char* argv[])
 
     case P_RECOMPRESS:
     {
-      return_errorlevel = PrecompRecompress(precomp_mgr.get());
+      if (restore_range.has_value()) {
+        return_errorlevel = PrecompRestoreRange(precomp_mgr.get(), restore_range->first, restore_range->second);
+      }
+      else {
+        return_errorlevel = PrecompRecompress(precomp_mgr.get());
+      }
+      break;
+    }
+
+    case P_ANALYZE:
+    {
+      return_errorlevel = PrecompAnalyze(precomp_mgr.get());
       break;
     }
 
@@ -878,7 +1193,15 @@ int main(int argc, char* argv[])
         print_results(*precomp_mgr, false, start_time);
         break;
       }
+      case P_ANALYZE:
+      {
+        print_results(*precomp_mgr, false, start_time);
+        print_analysis(*precomp_mgr, *precomp_switches);
+        break;
+      }
     }
+    if (profile_output == PROFILE_TEXT || precomp_switches->memory_limit != 0) print_memory_peaks(*precomp_mgr);
+    if (profile_output != PROFILE_NONE) print_profile(*precomp_mgr);
   }
   catch (const std::runtime_error& err)
   {
@@ -0,0 +1,806 @@
+#include "libprecomp.h"
+
+// Generates a reproducible synthetic corpus with streams of every supported format, then times precompression and recompression of each of them.
+// Nothing is downloaded or read from elsewhere, the same seed and size always give the exact same files, so results can be compared between commits.
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "precomp_utils.h"
+#include "contrib/bzip2/bzlib.h"
+#include "contrib/zlib/zlib.h"
+
+using ByteVector = std::vector<unsigned char>;
+
+// splitmix64, so the corpus doesn't depend on the standard library's random number generators
+class BenchRandom {
+  uint64_t state;
+public:
+  explicit BenchRandom(uint64_t seed) : state(seed) {}
+
+  uint64_t next() {
+    uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+  }
+  // Uniform in [0, n)
+  unsigned int below(unsigned int n) { return static_cast<unsigned int>(next() % n); }
+  // Uniform in [min, max]
+  int between(int min, int max) { return min + static_cast<int>(below(static_cast<unsigned int>(max - min + 1))); }
+};
+
+void put_u16le(ByteVector& out, unsigned int value) {
+  out.push_back(value & 0xFF);
+  out.push_back((value >> 8) & 0xFF);
+}
+void put_u32le(ByteVector& out, uint32_t value) {
+  put_u16le(out, value & 0xFFFF);
+  put_u16le(out, value >> 16);
+}
+void put_u16be(ByteVector& out, unsigned int value) {
+  out.push_back((value >> 8) & 0xFF);
+  out.push_back(value & 0xFF);
+}
+void put_u32be(ByteVector& out, uint32_t value) {
+  put_u16be(out, value >> 16);
+  put_u16be(out, value & 0xFFFF);
+}
+void append(ByteVector& out, const ByteVector& data) {
+  out.insert(out.end(), data.cbegin(), data.cend());
+}
+void append(ByteVector& out, const std::string& text) {
+  out.insert(out.end(), text.cbegin(), text.cend());
+}
+
+ByteVector random_bytes(BenchRandom& rng, size_t size) {
+  ByteVector data(size);
+  for (auto& byte : data) byte = static_cast<unsigned char>(rng.next());
+  return data;
+}
+
+// English-like text made of a small vocabulary, compresses about as well as real text
+ByteVector make_text(BenchRandom& rng, size_t size) {
+  static const std::array<const char*, 48> words { {
+    "the", "of", "and", "to", "in", "is", "that", "for", "it", "as", "was", "with", "be", "by", "on", "not",
+    "stream", "data", "format", "compression", "archive", "image", "header", "block", "table", "level", "window", "file",
+    "precomp", "deflate", "recursion", "buffer", "length", "offset", "literal", "match", "distance", "huffman", "code", "tree",
+    "reconstruction", "verification", "benchmark", "throughput", "memory", "thread", "segment", "record"
+  } };
+  ByteVector text;
+  text.reserve(size + 32);
+  unsigned int words_in_line = 0;
+  while (text.size() < size) {
+    const char* word = words[std::min(rng.below(words.size()), rng.below(words.size()))];
+    text.insert(text.end(), word, word + strlen(word));
+    words_in_line++;
+    if (words_in_line >= 12 && rng.below(4) == 0) {
+      text.push_back('.');
+      text.push_back('\n');
+      words_in_line = 0;
+    }
+    else {
+      text.push_back(' ');
+    }
+  }
+  text.resize(size);
+  return text;
+}
+
+// Smooth gradients with a bit of noise, like a photo would be
+ByteVector make_image(BenchRandom& rng, unsigned int width, unsigned int height, unsigned int channels) {
+  ByteVector pixels(static_cast<size_t>(width) * height * channels);
+  std::vector<int> phase(channels);
+  for (auto& channel_phase : phase) channel_phase = rng.between(0, 255);
+  for (unsigned int y = 0; y < height; y++) {
+    for (unsigned int x = 0; x < width; x++) {
+      for (unsigned int c = 0; c < channels; c++) {
+        const int value = phase[c] + static_cast<int>((x * (c + 1) + y * (channels - c)) / 3) + rng.between(-3, 3);
+        pixels[(static_cast<size_t>(y) * width + x) * channels + c] = static_cast<unsigned char>(value & 0xFF);
+      }
+    }
+  }
+  return pixels;
+}
+
+// window_bits < 0 gives raw deflate, as in zlib's deflateInit2
+ByteVector zlib_compress(const ByteVector& data, int level, int mem_level = 8, int window_bits = 15) {
+  z_stream strm {};
+  if (deflateInit2(&strm, level, Z_DEFLATED, window_bits, mem_level, Z_DEFAULT_STRATEGY) != Z_OK) throw std::runtime_error("deflateInit2 failed");
+  ByteVector out(deflateBound(&strm, data.size()));
+  strm.next_in = const_cast<Bytef*>(data.data());
+  strm.avail_in = static_cast<uInt>(data.size());
+  strm.next_out = out.data();
+  strm.avail_out = static_cast<uInt>(out.size());
+  const int ret = deflate(&strm, Z_FINISH);
+  out.resize(strm.total_out);
+  deflateEnd(&strm);
+  if (ret != Z_STREAM_END) throw std::runtime_error("deflate failed");
+  return out;
+}
+
+uint32_t crc32_of(const ByteVector& data) {
+  return crc32(0, data.data(), static_cast<uInt>(data.size()));
+}
+
+ByteVector make_zlib_streams(BenchRandom& rng, size_t size) {
+  static const std::array<int, 4> mem_levels { 8, 9, 5, 2 };
+  ByteVector out;
+  unsigned int stream_nr = 0;
+  while (out.size() < size) {
+    append(out, random_bytes(rng, rng.between(256, 4096)));
+    const int level = 1 + static_cast<int>(stream_nr % 9);
+    const int mem_level = mem_levels[(stream_nr / 9) % mem_levels.size()];
+    append(out, zlib_compress(make_text(rng, rng.between(16 * 1024, 64 * 1024)), level, mem_level));
+    stream_nr++;
+  }
+  return out;
+}
+
+ByteVector make_gzip_files(BenchRandom& rng, size_t size) {
+  ByteVector out;
+  while (out.size() < size) {
+    append(out, random_bytes(rng, rng.between(256, 4096)));
+    // Several members one after the other make a single valid gzip file
+    const int members = rng.between(2, 4);
+    for (int member = 0; member < members; member++) {
+      const auto text = make_text(rng, rng.between(8 * 1024, 48 * 1024));
+      const int level = rng.between(1, 9);
+      out.insert(out.end(), { 0x1F, 0x8B, 8, 0 });
+      put_u32le(out, 0);
+      out.push_back(level == 9 ? 2 : level == 1 ? 4 : 0);
+      out.push_back(3);
+      append(out, zlib_compress(text, level, 8, -15));
+      put_u32le(out, crc32_of(text));
+      put_u32le(out, static_cast<uint32_t>(text.size()));
+    }
+  }
+  return out;
+}
+
+ByteVector make_zip_archives(BenchRandom& rng, size_t size) {
+  ByteVector out;
+  while (out.size() < size) {
+    append(out, random_bytes(rng, rng.between(256, 4096)));
+    ByteVector archive;
+    ByteVector central_directory;
+    const int entries = rng.between(6, 12);
+    for (int entry = 0; entry < entries; entry++) {
+      const auto contents = make_text(rng, rng.between(4 * 1024, 32 * 1024));
+      const bool stored = entry % 3 == 0;
+      const auto data = stored ? contents : zlib_compress(contents, rng.between(1, 9), 8, -15);
+      const std::string name = make_cstyle_format_string("file%03i.txt", entry);
+      const uint32_t local_header_offset = static_cast<uint32_t>(archive.size());
+
+      const auto put_common_fields = [&](ByteVector& header) {
+        put_u16le(header, 20);  // version needed to extract
+        put_u16le(header, 0);  // flags
+        put_u16le(header, stored ? 0 : 8);
+        put_u16le(header, 0);  // time
+        put_u16le(header, 0x21);  // date, 1980-01-01
+        put_u32le(header, crc32_of(contents));
+        put_u32le(header, static_cast<uint32_t>(data.size()));
+        put_u32le(header, static_cast<uint32_t>(contents.size()));
+        put_u16le(header, static_cast<unsigned int>(name.size()));
+        put_u16le(header, 0);  // extra field length
+      };
+      put_u32le(archive, 0x04034B50);
+      put_common_fields(archive);
+      append(archive, name);
+      append(archive, data);
+
+      put_u32le(central_directory, 0x02014B50);
+      put_u16le(central_directory, 20);  // version made by
+      put_common_fields(central_directory);
+      put_u16le(central_directory, 0);  // comment length
+      put_u16le(central_directory, 0);  // disk number
+      put_u16le(central_directory, 0);  // internal attributes
+      put_u32le(central_directory, 0);  // external attributes
+      put_u32le(central_directory, local_header_offset);
+      append(central_directory, name);
+    }
+    const uint32_t central_directory_offset = static_cast<uint32_t>(archive.size());
+    append(archive, central_directory);
+    put_u32le(archive, 0x06054B50);
+    put_u16le(archive, 0);
+    put_u16le(archive, 0);
+    put_u16le(archive, entries);
+    put_u16le(archive, entries);
+    put_u32le(archive, static_cast<uint32_t>(central_directory.size()));
+    put_u32le(archive, central_directory_offset);
+    put_u16le(archive, 0);
+    append(out, archive);
+  }
+  return out;
+}
+
+void put_png_chunk(ByteVector& out, const char* type, const ByteVector& data) {
+  put_u32be(out, static_cast<uint32_t>(data.size()));
+  ByteVector type_and_data(type, type + 4);
+  append(type_and_data, data);
+  append(out, type_and_data);
+  put_u32be(out, crc32_of(type_and_data));
+}
+
+ByteVector make_png_images(BenchRandom& rng, size_t size) {
+  ByteVector out;
+  unsigned int image_nr = 0;
+  while (out.size() < size) {
+    append(out, random_bytes(rng, rng.between(256, 4096)));
+    const unsigned int width = rng.between(96, 256);
+    const unsigned int height = rng.between(96, 256);
+    const auto pixels = make_image(rng, width, height, 3);
+    // Every row gets the Sub filter, which suits smooth images
+    ByteVector filtered;
+    for (unsigned int y = 0; y < height; y++) {
+      filtered.push_back(1);
+      const unsigned char* row = &pixels[static_cast<size_t>(y) * width * 3];
+      for (unsigned int x = 0; x < width * 3; x++) {
+        filtered.push_back(static_cast<unsigned char>(row[x] - (x >= 3 ? row[x - 3] : 0)));
+      }
+    }
+    const auto compressed = zlib_compress(filtered, rng.between(1, 9));
+
+    out.insert(out.end(), { 0x89, 'P', 'N', 'G', 13, 10, 26, 10 });
+    ByteVector ihdr;
+    put_u32be(ihdr, width);
+    put_u32be(ihdr, height);
+    ihdr.insert(ihdr.end(), { 8, 2, 0, 0, 0 });  // 8 bit RGB, not interlaced
+    put_png_chunk(out, "IHDR", ihdr);
+    // Most encoders split the image data into several IDAT chunks, a few don't
+    const size_t idat_size = image_nr % 4 == 3 ? compressed.size() : (image_nr % 2 == 0 ? 8192 : 4096);
+    for (size_t pos = 0; pos < compressed.size(); pos += idat_size) {
+      put_png_chunk(out, "IDAT", ByteVector(compressed.cbegin() + pos, compressed.cbegin() + std::min(compressed.size(), pos + idat_size)));
+    }
+    put_png_chunk(out, "IEND", {});
+    image_nr++;
+  }
+  return out;
+}
+
+class JpegBitWriter {
+  ByteVector& out;
+  uint32_t buffer = 0;
+  int bit_count = 0;
+public:
+  explicit JpegBitWriter(ByteVector& out_) : out(out_) {}
+
+  void write(uint32_t bits, int length) {
+    for (int i = length - 1; i >= 0; i--) {
+      buffer = (buffer << 1) | ((bits >> i) & 1);
+      if (++bit_count == 8) {
+        out.push_back(static_cast<unsigned char>(buffer));
+        if (buffer == 0xFF) out.push_back(0);  // byte stuffing
+        buffer = 0;
+        bit_count = 0;
+      }
+    }
+  }
+  // The last byte is padded with ones
+  void flush() {
+    while (bit_count != 0) write(1, 1);
+  }
+};
+
+// Synthetic grayscale JPEGs, made from quantized DCT coefficients directly. Every Huffman code has the same length, which is valid if not efficient,
+// baseline JPEGs use the standard set of symbols and progressive ones the same plus spectral selection (no successive approximation).
+class JpegGenerator {
+  static constexpr int dc_code_length = 4;
+  static constexpr int ac_code_length = 8;
+  std::vector<int> ac_symbols;
+  std::array<int, 256> ac_codes {};
+
+  static int magnitude_bits(int value) {
+    int bits = 0;
+    for (int abs_value = std::abs(value); abs_value != 0; abs_value >>= 1) bits++;
+    return bits;
+  }
+  static uint32_t magnitude_code(int value, int bits) {
+    return static_cast<uint32_t>(value > 0 ? value : value + (1 << bits) - 1);
+  }
+
+  void write_dc(JpegBitWriter& writer, int diff) const {
+    const int bits = magnitude_bits(diff);
+    writer.write(bits, dc_code_length);
+    writer.write(magnitude_code(diff, bits), bits);
+  }
+  void write_ac_band(JpegBitWriter& writer, const std::array<int16_t, 64>& block, int ss, int se) const {
+    int run = 0;
+    for (int k = ss; k <= se; k++) {
+      if (block[k] == 0) {
+        run++;
+        continue;
+      }
+      for (; run > 15; run -= 16) writer.write(ac_codes[0xF0], ac_code_length);
+      const int bits = magnitude_bits(block[k]);
+      writer.write(ac_codes[(run << 4) | bits], ac_code_length);
+      writer.write(magnitude_code(block[k], bits), bits);
+      run = 0;
+    }
+    if (run > 0) writer.write(ac_codes[0x00], ac_code_length);  // EOB, for progressive scans an end of band run of 1
+  }
+
+  static void put_marker_segment(ByteVector& out, unsigned char marker, const ByteVector& data) {
+    out.push_back(0xFF);
+    out.push_back(marker);
+    put_u16be(out, static_cast<unsigned int>(data.size() + 2));
+    append(out, data);
+  }
+  static void put_scan_header(ByteVector& out, int ss, int se) {
+    put_marker_segment(out, 0xDA, { 1, 1, 0x00, static_cast<unsigned char>(ss), static_cast<unsigned char>(se), 0 });
+  }
+
+public:
+  JpegGenerator() {
+    ac_symbols = { 0x00, 0xF0 };
+    for (int run = 0; run < 16; run++) {
+      for (int bits = 1; bits <= 10; bits++) ac_symbols.push_back((run << 4) | bits);
+    }
+    for (size_t i = 0; i < ac_symbols.size(); i++) ac_codes[ac_symbols[i]] = static_cast<int>(i);
+  }
+
+  ByteVector generate(BenchRandom& rng, unsigned int width_blocks, unsigned int height_blocks, bool progressive) const {
+    // Coefficients in zigzag order, smooth DC and fewer nonzero AC coefficients the higher their frequency
+    std::vector<std::array<int16_t, 64>> blocks(static_cast<size_t>(width_blocks) * height_blocks);
+    int dc = 0;
+    for (auto& block : blocks) {
+      dc = std::clamp(dc + rng.between(-6, 6), -120, 120);
+      block[0] = static_cast<int16_t>(dc);
+      for (int k = 1; k < 64; k++) {
+        const bool nonzero = k < 16 ? rng.below(k + 1) == 0 : rng.below(8 * k) == 0;
+        block[k] = nonzero ? static_cast<int16_t>((rng.below(2) ? 1 : -1) * rng.between(1, std::max(1, 48 / k))) : 0;
+      }
+    }
+
+    ByteVector out { 0xFF, 0xD8 };
+    put_marker_segment(out, 0xE0, { 'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0 });
+    ByteVector dqt { 0 };
+    for (int k = 0; k < 64; k++) dqt.push_back(static_cast<unsigned char>(2 + k / 2));
+    put_marker_segment(out, 0xDB, dqt);
+    ByteVector sof { 8 };
+    put_u16be(sof, height_blocks * 8);
+    put_u16be(sof, width_blocks * 8);
+    sof.insert(sof.end(), { 1, 1, 0x11, 0 });
+    put_marker_segment(out, progressive ? 0xC2 : 0xC0, sof);
+    ByteVector dht { 0x00 };
+    for (int length = 1; length <= 16; length++) dht.push_back(length == dc_code_length ? 12 : 0);
+    for (int symbol = 0; symbol < 12; symbol++) dht.push_back(static_cast<unsigned char>(symbol));
+    dht.push_back(0x10);
+    for (int length = 1; length <= 16; length++) dht.push_back(length == ac_code_length ? static_cast<unsigned char>(ac_symbols.size()) : 0);
+    for (const int symbol : ac_symbols) dht.push_back(static_cast<unsigned char>(symbol));
+    put_marker_segment(out, 0xC4, dht);
+
+    if (!progressive) {
+      put_scan_header(out, 0, 63);
+      JpegBitWriter writer(out);
+      int previous_dc = 0;
+      for (const auto& block : blocks) {
+        write_dc(writer, block[0] - previous_dc);
+        previous_dc = block[0];
+        write_ac_band(writer, block, 1, 63);
+      }
+      writer.flush();
+    }
+    else {
+      put_scan_header(out, 0, 0);
+      {
+        JpegBitWriter writer(out);
+        int previous_dc = 0;
+        for (const auto& block : blocks) {
+          write_dc(writer, block[0] - previous_dc);
+          previous_dc = block[0];
+        }
+        writer.flush();
+      }
+      for (const auto& [ss, se] : std::array<std::pair<int, int>, 2> { { { 1, 5 }, { 6, 63 } } }) {
+        put_scan_header(out, ss, se);
+        JpegBitWriter writer(out);
+        for (const auto& block : blocks) write_ac_band(writer, block, ss, se);
+        writer.flush();
+      }
+    }
+    out.insert(out.end(), { 0xFF, 0xD9 });
+    return out;
+  }
+};
+
+ByteVector make_jpeg_images(BenchRandom& rng, size_t size, bool progressive) {
+  static const JpegGenerator generator;
+  ByteVector out;
+  while (out.size() < size) {
+    append(out, random_bytes(rng, rng.between(256, 4096)));
+    append(out, generator.generate(rng, rng.between(12, 40), rng.between(12, 40), progressive));
+  }
+  return out;
+}
+
+// MPEG-1 Layer III frames of silence (no main data), 128 kbit/s at 44.1 kHz, which packMP3 handles just like any other
+ByteVector make_mp3_streams(BenchRandom& rng, size_t size) {
+  constexpr int frame_size = 417;
+  ByteVector out;
+  while (out.size() < size) {
+    append(out, random_bytes(rng, rng.between(256, 4096)));
+    const bool mono = rng.below(2) == 0;
+    const int frames = rng.between(20, 80);
+    for (int frame = 0; frame < frames; frame++) {
+      const size_t frame_start = out.size();
+      out.insert(out.end(), { 0xFF, 0xFB, 0x90, static_cast<unsigned char>(mono ? 0xC0 : 0x00) });
+      out.resize(frame_start + frame_size, 0);
+      // Only the global gains are set in the side information, they are 8 bits into each granule's channel info, after 12 bits of part2_3_length and 9 of big_values
+      const int channels = mono ? 1 : 2;
+      const int side_info_start_bits = 32 + (mono ? 18 : 20);
+      for (int granule_channel = 0; granule_channel < 2 * channels; granule_channel++) {
+        const int gain = rng.between(120, 200);
+        const int gain_bit_pos = side_info_start_bits + granule_channel * 59 + 21;
+        for (int bit = 0; bit < 8; bit++) {
+          if ((gain >> (7 - bit)) & 1) out[frame_start + (gain_bit_pos + bit) / 8] |= 0x80 >> ((gain_bit_pos + bit) % 8);
+        }
+      }
+    }
+  }
+  return out;
+}
+
+// LZW compressed exactly the way giflib's encoder does it
+ByteVector gif_lzw_compress(const ByteVector& pixels, int bits_per_pixel) {
+  const int clear_code = 1 << bits_per_pixel;
+  const int eof_code = clear_code + 1;
+  constexpr int max_code = 4095;
+  int running_code = eof_code + 1;
+  int running_bits = bits_per_pixel + 1;
+  int max_code1 = 1 << running_bits;
+  std::vector<int> table(4096 * 256, -1);  // (prefix code, pixel) -> code
+
+  ByteVector out;
+  uint32_t shift_register = 0;
+  int shift_state = 0;
+  const auto output_code = [&](int code) {
+    shift_register |= static_cast<uint32_t>(code) << shift_state;
+    shift_state += running_bits;
+    while (shift_state >= 8) {
+      out.push_back(shift_register & 0xFF);
+      shift_register >>= 8;
+      shift_state -= 8;
+    }
+    if (running_code >= max_code1 && code <= max_code) max_code1 = 1 << ++running_bits;
+  };
+
+  output_code(clear_code);
+  int current_code = pixels[0];
+  for (size_t i = 1; i < pixels.size(); i++) {
+    const int pixel = pixels[i];
+    int& entry = table[current_code * 256 + pixel];
+    if (entry >= 0) {
+      current_code = entry;
+      continue;
+    }
+    output_code(current_code);
+    current_code = pixel;
+    if (running_code >= max_code) {
+      output_code(clear_code);
+      running_code = eof_code + 1;
+      running_bits = bits_per_pixel + 1;
+      max_code1 = 1 << running_bits;
+      std::fill(table.begin(), table.end(), -1);
+    }
+    else {
+      entry = running_code++;
+    }
+  }
+  output_code(current_code);
+  output_code(eof_code);
+  if (shift_state > 0) out.push_back(shift_register & 0xFF);
+  return out;
+}
+
+ByteVector make_gif_images(BenchRandom& rng, size_t size) {
+  ByteVector out;
+  while (out.size() < size) {
+    append(out, random_bytes(rng, rng.between(256, 4096)));
+    const unsigned int width = rng.between(64, 200);
+    const unsigned int height = rng.between(64, 200);
+    append(out, std::string("GIF89a"));
+    put_u16le(out, width);
+    put_u16le(out, height);
+    out.insert(out.end(), { 0xF7, 0, 0 });  // 256 color global color table
+    for (int color = 0; color < 256; color++) {
+      out.insert(out.end(), { static_cast<unsigned char>(color), static_cast<unsigned char>(255 - color), static_cast<unsigned char>(color / 2) });
+    }
+    out.push_back(0x2C);
+    put_u16le(out, 0);
+    put_u16le(out, 0);
+    put_u16le(out, width);
+    put_u16le(out, height);
+    out.push_back(0);
+    out.push_back(8);  // LZW minimum code size
+    const auto compressed = gif_lzw_compress(make_image(rng, width, height, 1), 8);
+    for (size_t pos = 0; pos < compressed.size(); pos += 255) {
+      const size_t sub_block_size = std::min<size_t>(255, compressed.size() - pos);
+      out.push_back(static_cast<unsigned char>(sub_block_size));
+      out.insert(out.end(), compressed.cbegin() + pos, compressed.cbegin() + pos + sub_block_size);
+    }
+    out.push_back(0);
+    out.push_back(0x3B);
+  }
+  return out;
+}
+
+ByteVector make_bzip2_streams(BenchRandom& rng, size_t size) {
+  ByteVector out;
+  unsigned int stream_nr = 0;
+  while (out.size() < size) {
+    append(out, random_bytes(rng, rng.between(256, 4096)));
+    auto text = make_text(rng, rng.between(16 * 1024, 96 * 1024));
+    ByteVector compressed(text.size() + text.size() / 100 + 600);
+    auto compressed_size = static_cast<unsigned int>(compressed.size());
+    const int block_size = 1 + static_cast<int>(stream_nr % 9);
+    if (BZ2_bzBuffToBuffCompress(reinterpret_cast<char*>(compressed.data()), &compressed_size, reinterpret_cast<char*>(text.data()), static_cast<unsigned int>(text.size()), block_size, 0, 0) != BZ_OK) {
+      throw std::runtime_error("BZ2_bzBuffToBuffCompress failed");
+    }
+    compressed.resize(compressed_size);
+    append(out, compressed);
+    stream_nr++;
+  }
+  return out;
+}
+
+ByteVector make_base64_mime(BenchRandom& rng, size_t size) {
+  static const char base64_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  ByteVector out;
+  while (out.size() < size) {
+    append(out, make_text(rng, rng.between(256, 2048)));
+    append(out, std::string("\r\n--boundary\r\nContent-Type: application/octet-stream\r\nContent-Transfer-Encoding: base64\r\n\r\n"));
+    const auto data = make_text(rng, rng.between(8 * 1024, 48 * 1024));
+    std::string encoded;
+    for (size_t pos = 0; pos < data.size(); pos += 3) {
+      const uint32_t group = (data[pos] << 16) | ((pos + 1 < data.size() ? data[pos + 1] : 0) << 8) | (pos + 2 < data.size() ? data[pos + 2] : 0);
+      encoded += base64_alphabet[(group >> 18) & 63];
+      encoded += base64_alphabet[(group >> 12) & 63];
+      encoded += pos + 1 < data.size() ? base64_alphabet[(group >> 6) & 63] : '=';
+      encoded += pos + 2 < data.size() ? base64_alphabet[group & 63] : '=';
+    }
+    for (size_t pos = 0; pos < encoded.size(); pos += 76) {
+      append(out, encoded.substr(pos, 76) + "\r\n");
+    }
+    append(out, std::string("\r\n--boundary--\r\n"));
+  }
+  return out;
+}
+
+ByteVector make_pdf_files(BenchRandom& rng, size_t size) {
+  ByteVector out;
+  while (out.size() < size) {
+    append(out, random_bytes(rng, rng.between(256, 4096)));
+    append(out, std::string("%PDF-1.4\n"));
+    const int objects = rng.between(4, 12);
+    for (int object = 1; object <= objects; object++) {
+      const auto compressed = zlib_compress(make_text(rng, rng.between(4 * 1024, 32 * 1024)), rng.between(1, 9));
+      append(out, make_cstyle_format_string("%i 0 obj\n<< /Length %zu /Filter /FlateDecode >>\nstream\r\n", object, compressed.size()));
+      append(out, compressed);
+      append(out, std::string("\r\nendstream\nendobj\n"));
+    }
+    append(out, std::string("trailer\n<< /Root 1 0 R >>\n%%EOF\n"));
+  }
+  return out;
+}
+
+struct BenchFormat {
+  const char* name;
+  std::function<ByteVector(BenchRandom&, size_t)> generate;
+  // Raw zLib streams are only detected in intense mode
+  bool intense_mode = false;
+};
+
+const std::vector<BenchFormat> bench_formats {
+  { "zlib", make_zlib_streams, true },
+  { "gzip", make_gzip_files },
+  { "zip", make_zip_archives },
+  { "png", make_png_images },
+  { "jpg", [](BenchRandom& rng, size_t size) { return make_jpeg_images(rng, size, false); } },
+  { "jpg_prog", [](BenchRandom& rng, size_t size) { return make_jpeg_images(rng, size, true); } },
+  { "mp3", make_mp3_streams },
+  { "gif", make_gif_images },
+  { "bzip2", make_bzip2_streams },
+  { "base64", make_base64_mime },
+  { "pdf", make_pdf_files },
+  { "filler", random_bytes },
+};
+
+struct BenchSettings {
+  std::string corpus_dir = "precomp_bench_corpus";
+  uint64_t seed = 1;
+  size_t format_size = 4 * 1024 * 1024;
+  unsigned int repeat = 1;
+  unsigned int thread_count = 1;
+  bool verify = true;
+  bool keep_files = false;
+  std::vector<std::string> only_formats;
+};
+
+struct BenchRun {
+  int return_code = 0;
+  double seconds = 0;
+  uintmax_t peak_memory = 0;
+  unsigned int streams_found = 0;
+  unsigned int streams_recompressed = 0;
+};
+
+BenchRun run_precomp(const BenchSettings& settings, const BenchFormat& format, const std::string& input_file, const std::string& output_file, bool recompress) {
+  Precomp* precomp_mgr = PrecompCreate();
+  CSwitches* switches = PrecompGetSwitches(precomp_mgr);
+  switches->thread_count = settings.thread_count;
+  switches->verify_precompressed = settings.verify;
+  switches->intense_mode = format.intense_mode;
+  PrecompGetRecursionContext(precomp_mgr)->fin_length = std::filesystem::file_size(input_file);
+  if (!PrecompSetInputFilePath(precomp_mgr, input_file.c_str())) {
+    PrecompDestroy(precomp_mgr);
+    throw std::runtime_error(make_cstyle_format_string("ERROR: Can't open \"%s\"\n", input_file.c_str()));
+  }
+  auto fout = new std::ofstream();
+  fout->open(output_file, std::ios_base::out | std::ios_base::binary);
+  if (!fout->is_open()) {
+    delete fout;
+    PrecompDestroy(precomp_mgr);
+    throw std::runtime_error(make_cstyle_format_string("ERROR: Can't create \"%s\"\n", output_file.c_str()));
+  }
+  PrecompSetOutStream(precomp_mgr, fout, output_file.c_str());
+
+  BenchRun run;
+  const auto start = std::chrono::steady_clock::now();
+  run.return_code = recompress ? PrecompRecompress(precomp_mgr) : PrecompPrecompress(precomp_mgr);
+  run.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  const CResultStatistics* statistics = PrecompGetResultStatistics(precomp_mgr);
+  run.peak_memory = statistics->peak_tracked_memory;
+  run.streams_found = statistics->decompressed_streams_count;
+  run.streams_recompressed = statistics->recompressed_streams_count;
+  PrecompDestroy(precomp_mgr);  // also closes the output
+  return run;
+}
+
+bool files_equal(const std::string& file1, const std::string& file2) {
+  std::ifstream in1(file1, std::ios_base::binary);
+  std::ifstream in2(file2, std::ios_base::binary);
+  std::vector<char> buf1(1024 * 1024);
+  std::vector<char> buf2(1024 * 1024);
+  while (in1 && in2) {
+    in1.read(buf1.data(), buf1.size());
+    in2.read(buf2.data(), buf2.size());
+    if (in1.gcount() != in2.gcount() || memcmp(buf1.data(), buf2.data(), in1.gcount()) != 0) return false;
+  }
+  return !in1 && !in2;
+}
+
+double mib_per_second(uintmax_t bytes, double seconds) {
+  return seconds > 0 ? bytes / (1024.0 * 1024.0) / seconds : 0;
+}
+
+void print_syntax() {
+  std::cout << "Syntax: precomp_bench [switches]\n\n";
+  std::cout << "  o[dir]       Directory the corpus is written to <precomp_bench_corpus>\n";
+  std::cout << "  size[KiB]    Size of the corpus file of each format <4096>\n";
+  std::cout << "  seed[n]      Seed the corpus is generated from <1>\n";
+  std::cout << "  repeat[n]    Run each format [n] times and report the fastest <1>\n";
+  std::cout << "  t[threads]   Threads for precompression and recompression, 0 = all cores <1>\n";
+  std::cout << "  only[=f,...] Only these formats <all>\n";
+  std::cout << "  no-verify    Don't verify precompressed streams\n";
+  std::cout << "  keep         Keep the corpus, PCF and restored files\n\n";
+  std::cout << "Formats:";
+  for (const auto& format : bench_formats) std::cout << " " << format.name;
+  std::cout << "\n";
+}
+
+unsigned long long parse_bench_number(const char* text, const char* context) {
+  char* end;
+  const unsigned long long value = strtoull(text, &end, 10);
+  if (*text < '0' || *text > '9' || *end != 0) throw std::runtime_error(make_cstyle_format_string("ERROR: Number needed to set %s\n", context));
+  return value;
+}
+
+BenchSettings parse_bench_switches(int argc, char* argv[]) {
+  BenchSettings settings;
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if (arg.size() < 2 || arg[0] != '-') throw std::runtime_error(make_cstyle_format_string("ERROR: Unknown switch \"%s\"\n", argv[i]));
+    if (arg.rfind("-size", 0) == 0) settings.format_size = parse_bench_number(argv[i] + 5, "corpus size") * 1024;
+    else if (arg.rfind("-seed", 0) == 0) settings.seed = parse_bench_number(argv[i] + 5, "seed");
+    else if (arg.rfind("-repeat", 0) == 0) settings.repeat = std::max<unsigned int>(1, parse_bench_number(argv[i] + 7, "repeat count"));
+    else if (arg.rfind("-only", 0) == 0) {
+      size_t start = arg.size() > 5 && arg[5] == '=' ? 6 : 5;
+      while (start < arg.size()) {
+        const size_t end = std::min(arg.find(',', start), arg.size());
+        const std::string name = arg.substr(start, end - start);
+        if (std::none_of(bench_formats.cbegin(), bench_formats.cend(), [&name](const BenchFormat& format) { return name == format.name; })) {
+          throw std::runtime_error(make_cstyle_format_string("ERROR: Unknown format \"%s\"\n", name.c_str()));
+        }
+        settings.only_formats.push_back(name);
+        start = end + 1;
+      }
+    }
+    else if (arg == "-no-verify") settings.verify = false;
+    else if (arg == "-keep") settings.keep_files = true;
+    else if (arg.rfind("-o", 0) == 0 && arg.size() > 2) settings.corpus_dir = arg.substr(2);
+    else if (arg.rfind("-t", 0) == 0) settings.thread_count = parse_bench_number(argv[i] + 2, "thread count");
+    else if (arg == "-h" || arg == "-help") {
+      print_syntax();
+      exit(0);
+    }
+    else throw std::runtime_error(make_cstyle_format_string("ERROR: Unknown switch \"%s\"\n", argv[i]));
+  }
+  if (settings.format_size == 0) throw std::runtime_error("ERROR: Corpus size must be at least 1 KiB\n");
+  return settings;
+}
+
+int run_bench(const BenchSettings& settings) {
+  std::filesystem::create_directories(settings.corpus_dir);
+  std::cout << "precomp_bench: seed " << settings.seed << ", " << settings.format_size / 1024 << " KiB per format, " << settings.thread_count << " thread(s), "
+    << (settings.verify ? "verifying" : "not verifying") << ", fastest of " << settings.repeat << " run(s)\n\n";
+  std::cout << make_cstyle_format_string("%-9s %10s %10s %9s %11s %11s %10s %10s %s\n",
+    "format", "original", "pcf", "streams", "pre MiB/s", "rec MiB/s", "pre KiB", "rec KiB", "roundtrip");
+
+  bool all_ok = true;
+  for (size_t format_nr = 0; format_nr < bench_formats.size(); format_nr++) {
+    const auto& format = bench_formats[format_nr];
+    if (!settings.only_formats.empty() && std::find(settings.only_formats.cbegin(), settings.only_formats.cend(), format.name) == settings.only_formats.cend()) continue;
+
+    // Every format gets its own generator, so the corpus of a format doesn't depend on which others are generated
+    BenchRandom rng(settings.seed * 1000003 + format_nr);
+    const auto corpus = format.generate(rng, settings.format_size);
+    const auto base_path = (std::filesystem::path(settings.corpus_dir) / format.name).string();
+    const auto corpus_file = base_path + ".bin";
+    const auto pcf_file = base_path + ".pcf";
+    const auto restored_file = base_path + ".restored";
+    {
+      std::ofstream corpus_out(corpus_file, std::ios_base::out | std::ios_base::binary);
+      corpus_out.write(reinterpret_cast<const char*>(corpus.data()), corpus.size());
+    }
+
+    BenchRun precompress_run, recompress_run;
+    for (unsigned int repetition = 0; repetition < settings.repeat; repetition++) {
+      const auto precompress = run_precomp(settings, format, corpus_file, pcf_file, false);
+      const auto recompress = run_precomp(settings, format, pcf_file, restored_file, true);
+      if (repetition == 0 || precompress.seconds < precompress_run.seconds) precompress_run = precompress;
+      if (repetition == 0 || recompress.seconds < recompress_run.seconds) recompress_run = recompress;
+    }
+    // Precompress returns 2 when nothing was precompressed, which is expected for the filler
+    const bool ok = (precompress_run.return_code == 0 || precompress_run.return_code == 2) && recompress_run.return_code == 0 && files_equal(corpus_file, restored_file);
+    all_ok = all_ok && ok;
+
+    std::cout << make_cstyle_format_string("%-9s %10zu %10llu %4u/%-4u %11.2f %11.2f %10llu %10llu %s\n", format.name, corpus.size(),
+      static_cast<unsigned long long>(std::filesystem::file_size(pcf_file)), precompress_run.streams_recompressed, precompress_run.streams_found,
+      mib_per_second(corpus.size(), precompress_run.seconds), mib_per_second(corpus.size(), recompress_run.seconds),
+      static_cast<unsigned long long>(precompress_run.peak_memory / 1024), static_cast<unsigned long long>(recompress_run.peak_memory / 1024), ok ? "ok" : "FAILED");
+    std::cout.flush();
+
+    if (!settings.keep_files) {
+      std::filesystem::remove(corpus_file);
+      std::filesystem::remove(pcf_file);
+      std::filesystem::remove(restored_file);
+    }
+  }
+  if (!settings.keep_files) {
+    std::error_code ec;
+    std::filesystem::remove(settings.corpus_dir, ec);  // only if it's empty
+  }
+
+  std::cout << make_cstyle_format_string("\nPeak RSS: %llu KiB\n", static_cast<unsigned long long>(get_peak_rss_bytes() / 1024));
+  return all_ok ? 0 : 1;
+}
+
+int main(int argc, char* argv[]) {
+  try {
+    return run_bench(parse_bench_switches(argc, argv));
+  }
+  catch (const std::exception& err) {
+    std::cerr << err.what();
+    return 1;
+  }
+}
@@ -0,0 +1,241 @@
+#include "precomp_compare.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PRECOMP_COMPARE_SSE2
+#include <emmintrin.h>
+#endif
+
+size_t find_first_mismatch(const unsigned char* a, const unsigned char* b, size_t size) {
+  size_t i = 0;
+#ifdef PRECOMP_COMPARE_SSE2
+  // Four vectors at a time, only looking at which byte it was once a block of them didn't match
+  for (; i + 64 <= size; i += 64) {
+    const __m128i eq0 = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+    const __m128i eq1 = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i + 16)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i + 16)));
+    const __m128i eq2 = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i + 32)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i + 32)));
+    const __m128i eq3 = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i + 48)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i + 48)));
+    if (_mm_movemask_epi8(_mm_and_si128(_mm_and_si128(eq0, eq1), _mm_and_si128(eq2, eq3))) == 0xFFFF) continue;
+    for (const __m128i eq : { eq0, eq1, eq2, eq3 }) {
+      const unsigned int mismatch_mask = ~static_cast<unsigned int>(_mm_movemask_epi8(eq)) & 0xFFFF;
+      if (mismatch_mask != 0) return i + std::countr_zero(mismatch_mask);
+      i += 16;
+    }
+  }
+  for (; i + 16 <= size; i += 16) {
+    const __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+    const unsigned int mismatch_mask = ~static_cast<unsigned int>(_mm_movemask_epi8(eq)) & 0xFFFF;
+    if (mismatch_mask != 0) return i + std::countr_zero(mismatch_mask);
+  }
+#endif
+  if constexpr (std::endian::native == std::endian::little) {
+    for (; i + 8 <= size; i += 8) {
+      uint64_t word_a, word_b;
+      std::memcpy(&word_a, a + i, 8);
+      std::memcpy(&word_b, b + i, 8);
+      if (word_a != word_b) return i + std::countr_zero(word_a ^ word_b) / 8;
+    }
+  }
+  for (; i < size; i++) {
+    if (a[i] != b[i]) return i;
+  }
+  return size;
+}
+
+uint64_t common_prefix_length(IStreamLike& a, IStreamLike& b, uint64_t max_length) {
+  std::vector<unsigned char> buf_a(static_cast<size_t>(std::min<uint64_t>(CHUNK, max_length)));
+  std::vector<unsigned char> buf_b(buf_a.size());
+  uint64_t matched = 0;
+  while (matched < max_length) {
+    const auto chunk_size = static_cast<std::streamsize>(std::min<uint64_t>(buf_a.size(), max_length - matched));
+    a.read(reinterpret_cast<char*>(buf_a.data()), chunk_size);
+    b.read(reinterpret_cast<char*>(buf_b.data()), chunk_size);
+    const auto read_size = static_cast<size_t>(std::min(a.gcount(), b.gcount()));
+    const size_t chunk_matched = find_first_mismatch(buf_a.data(), buf_b.data(), read_size);
+    matched += chunk_matched;
+    if (chunk_matched != static_cast<size_t>(chunk_size)) break;
+  }
+  return matched;
+}
+
+bool IStreamComparator::compare(const unsigned char* data, size_t size) {
+  if (mismatch) return false;
+  original_buf.resize(size);
+  original.read(reinterpret_cast<char*>(original_buf.data()), static_cast<std::streamsize>(size));
+  const auto read_size = static_cast<size_t>(original.gcount());
+  const size_t chunk_matched = find_first_mismatch(original_buf.data(), data, read_size);
+  matched_length += chunk_matched;
+  mismatch = chunk_matched != size;
+  return !mismatch;
+}
+
+CompareOStream& CompareOStream::write(const char* buf, std::streamsize count) {
+  if (!comparator.compare(reinterpret_cast<const unsigned char*>(buf), count)) throw std::runtime_error("Written data doesn't match the original on CompareOStream");
+  return *this;
+}
+
+CompareOStream& CompareOStream::put(char chr) {
+  return write(&chr, 1);
+}
+
+CompareOStream& CompareOStream::seekp(std::ostream::off_type offset, std::ios_base::seekdir dir) {
+  throw std::runtime_error("Can't seek on CompareOStream");
+}
+
+namespace {
+  constexpr uint64_t XXH_PRIME64_1 = 0x9E3779B185EBCA87ULL;
+  constexpr uint64_t XXH_PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+  constexpr uint64_t XXH_PRIME64_3 = 0x165667B19E3779F9ULL;
+  constexpr uint64_t XXH_PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+  constexpr uint64_t XXH_PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+  // XXH64 reads its input as little endian words whatever the platform
+  uint64_t read_le64(const unsigned char* data) {
+    if constexpr (std::endian::native == std::endian::little) {
+      uint64_t value;
+      std::memcpy(&value, data, 8);
+      return value;
+    }
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--) value = (value << 8) | data[i];
+    return value;
+  }
+
+  uint32_t read_le32(const unsigned char* data) {
+    if constexpr (std::endian::native == std::endian::little) {
+      uint32_t value;
+      std::memcpy(&value, data, 4);
+      return value;
+    }
+    uint32_t value = 0;
+    for (int i = 3; i >= 0; i--) value = (value << 8) | data[i];
+    return value;
+  }
+
+  uint64_t xxh64_round(uint64_t accumulator, uint64_t input) {
+    accumulator += input * XXH_PRIME64_2;
+    accumulator = std::rotl(accumulator, 31);
+    return accumulator * XXH_PRIME64_1;
+  }
+
+  uint64_t xxh64_merge_round(uint64_t hash, uint64_t accumulator) {
+    hash ^= xxh64_round(0, accumulator);
+    return hash * XXH_PRIME64_1 + XXH_PRIME64_4;
+  }
+}
+
+Xxh64Ostream::Xxh64Ostream(uint64_t seed_) : seed(seed_) {
+  accumulators = { seed + XXH_PRIME64_1 + XXH_PRIME64_2, seed + XXH_PRIME64_2, seed, seed - XXH_PRIME64_1 };
+}
+
+void Xxh64Ostream::consume_stripes(const unsigned char* data, size_t stripe_count) {
+  auto [acc0, acc1, acc2, acc3] = accumulators;
+  for (size_t i = 0; i < stripe_count; i++, data += 32) {
+    acc0 = xxh64_round(acc0, read_le64(data));
+    acc1 = xxh64_round(acc1, read_le64(data + 8));
+    acc2 = xxh64_round(acc2, read_le64(data + 16));
+    acc3 = xxh64_round(acc3, read_le64(data + 24));
+  }
+  accumulators = { acc0, acc1, acc2, acc3 };
+}
+
+Xxh64Ostream& Xxh64Ostream::write(const char* buf, std::streamsize count) {
+  auto data = reinterpret_cast<const unsigned char*>(buf);
+  auto size = static_cast<size_t>(count);
+  dataLength += size;
+  if (stripe_buf_size > 0) {
+    const size_t buffered = std::min(size, stripe_buf.size() - stripe_buf_size);
+    std::memcpy(stripe_buf.data() + stripe_buf_size, data, buffered);
+    stripe_buf_size += buffered;
+    data += buffered;
+    size -= buffered;
+    if (stripe_buf_size < stripe_buf.size()) return *this;
+    consume_stripes(stripe_buf.data(), 1);
+    stripe_buf_size = 0;
+  }
+  const size_t stripe_count = size / 32;
+  consume_stripes(data, stripe_count);
+  stripe_buf_size = size - stripe_count * 32;
+  std::memcpy(stripe_buf.data(), data + stripe_count * 32, stripe_buf_size);
+  return *this;
+}
+
+Xxh64Ostream& Xxh64Ostream::put(char chr) {
+  return write(&chr, 1);
+}
+
+Xxh64Ostream& Xxh64Ostream::seekp(std::ostream::off_type offset, std::ios_base::seekdir dir) {
+  throw std::runtime_error("Can't seek on Xxh64Ostream");
+}
+
+uint64_t Xxh64Ostream::get_digest() const {
+  uint64_t hash;
+  if (dataLength >= 32) {
+    hash = std::rotl(accumulators[0], 1) + std::rotl(accumulators[1], 7) + std::rotl(accumulators[2], 12) + std::rotl(accumulators[3], 18);
+    for (const auto accumulator : accumulators) hash = xxh64_merge_round(hash, accumulator);
+  }
+  else {
+    hash = seed + XXH_PRIME64_5;
+  }
+  hash += dataLength;
+
+  const unsigned char* data = stripe_buf.data();
+  size_t remaining = stripe_buf_size;
+  for (; remaining >= 8; remaining -= 8, data += 8) {
+    hash ^= xxh64_round(0, read_le64(data));
+    hash = std::rotl(hash, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+  }
+  if (remaining >= 4) {
+    hash ^= static_cast<uint64_t>(read_le32(data)) * XXH_PRIME64_1;
+    hash = std::rotl(hash, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+    remaining -= 4;
+    data += 4;
+  }
+  for (; remaining > 0; remaining--, data++) {
+    hash ^= *data * XXH_PRIME64_5;
+    hash = std::rotl(hash, 11) * XXH_PRIME64_1;
+  }
+
+  hash ^= hash >> 33;
+  hash *= XXH_PRIME64_2;
+  hash ^= hash >> 29;
+  hash *= XXH_PRIME64_3;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+namespace {
+  // Writes length bytes of input at pos to digest, returns false if there aren't that many
+  bool digest_input(IStreamLike& input, long long pos, long long length, OStreamLike& digest) {
+    const auto mapped_input = input.mapped_data();
+    if (pos + length <= static_cast<long long>(mapped_input.size())) {
+      digest.write(reinterpret_cast<const char*>(mapped_input.data()) + pos, length);
+      return true;
+    }
+    std::vector<char> chunk(std::min<long long>(CHUNK, length));
+    input.seekg(pos, std::ios_base::beg);
+    for (long long digested = 0; digested < length; digested += CHUNK) {
+      const long long chunk_size = std::min<long long>(CHUNK, length - digested);
+      input.read(chunk.data(), chunk_size);
+      if (input.gcount() != chunk_size) return false;
+      digest.write(chunk.data(), chunk_size);
+    }
+    return true;
+  }
+}
+
+std::optional<uint64_t> calculate_input_digest(IStreamLike& input, long long pos, long long length) {
+  Xxh64Ostream digest;
+  if (!digest_input(input, pos, length, digest)) return std::nullopt;
+  return digest.get_digest();
+}
+
+std::optional<std::string> calculate_input_sha1(IStreamLike& input, long long pos, long long length) {
+  Sha1Ostream sha1;
+  if (!digest_input(input, pos, length, sha1)) return std::nullopt;
+  return sha1.get_digest();
+}
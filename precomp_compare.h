@@ -0,0 +1,91 @@
+#ifndef PRECOMP_COMPARE_H
+#define PRECOMP_COMPARE_H
+
+#include "precomp_io.h"
+
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Everything that checks whether some data is the same as some other data goes through here: finding where two buffers or streams stop matching,
+// and digesting data that is only compared against data that isn't around anymore.
+
+// Length of the common prefix of a and b, which are size bytes long. Identical runs are compared 64 bytes at a time with SSE2 when available,
+// or a machine word at a time otherwise, so they cost memory bandwidth rather than a branch per byte.
+size_t find_first_mismatch(const unsigned char* a, const unsigned char* b, size_t size);
+
+// Length of the common prefix of what's left to read on both streams, reading at most max_length bytes from each
+uint64_t common_prefix_length(IStreamLike& a, IStreamLike& b, uint64_t max_length = UINT64_MAX);
+
+// Compares data given to it piece by piece against the data read from an IStreamLike, stopping at the first mismatch
+class IStreamComparator {
+  IStreamLike& original;
+  std::vector<unsigned char> original_buf;
+  uint64_t matched_length = 0;
+  bool mismatch = false;
+public:
+  explicit IStreamComparator(IStreamLike& original_) : original(original_) {}
+
+  // Returns false if the data doesn't match (or the original ended before it), from then on without reading anything else from the original
+  bool compare(const unsigned char* data, size_t size);
+  bool matched() const { return !mismatch; }
+  // How much data matched before the first mismatch
+  uint64_t get_matched_length() const { return matched_length; }
+};
+
+// Compares the written bytes against the data read from the given IStreamLike, failing with an exception on the first mismatch instead of writting anything anywhere,
+// useful for verifying that recompressing some data gives back the original without storing it or hashing both sides
+class CompareOStream : public OStreamLike {
+  IStreamComparator comparator;
+public:
+  explicit CompareOStream(IStreamLike* original_) : comparator(*original_) {}
+
+  CompareOStream& write(const char* buf, std::streamsize count) override;
+  CompareOStream& put(char chr) override;
+  void flush() override {}
+  std::ostream::pos_type tellp() override { return comparator.get_matched_length(); }
+  CompareOStream& seekp(std::ostream::off_type offset, std::ios_base::seekdir dir) override;
+
+  bool eof() override { return false; }
+  bool good() override { return comparator.matched(); }
+  bool bad() override { return !comparator.matched(); }
+  void clear() override {}
+
+  bool matched() const { return comparator.matched(); }
+};
+
+// XXH64 digest of everything written to it, which is otherwise discarded. A fast non-cryptographic hash at a small fraction of the cost of a SHA1,
+// but one that can be made to collide, so only for where taking different data for the same costs some ratio and never the data itself.
+class Xxh64Ostream : public OStreamLike {
+  std::array<uint64_t, 4> accumulators;
+  std::array<unsigned char, 32> stripe_buf;
+  size_t stripe_buf_size = 0;
+  uint64_t dataLength = 0;
+  uint64_t seed;
+
+  void consume_stripes(const unsigned char* data, size_t stripe_count);
+public:
+  explicit Xxh64Ostream(uint64_t seed_ = 0);
+
+  Xxh64Ostream& write(const char* buf, std::streamsize count) override;
+  Xxh64Ostream& put(char chr) override;
+  void flush() override {}
+  std::ostream::pos_type tellp() override { return dataLength; }
+  Xxh64Ostream& seekp(std::ostream::off_type offset, std::ios_base::seekdir dir) override;
+
+  bool eof() override { return false; }
+  bool good() override { return true; }
+  bool bad() override { return false; }
+  void clear() override {}
+
+  uint64_t get_digest() const;
+};
+
+// XXH64 digest of length bytes of input at pos, if there are that many
+std::optional<uint64_t> calculate_input_digest(IStreamLike& input, long long pos, long long length);
+// SHA1 of length bytes of input at pos, if there are that many. For where data found to be unchanged by its digest is taken without any other check.
+std::optional<std::string> calculate_input_sha1(IStreamLike& input, long long pos, long long length);
+
+#endif // PRECOMP_COMPARE_H
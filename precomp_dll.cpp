@@ -36,11 +36,15 @@
 #include <cstdio>
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <array>
+#include <deque>
 #include <random>
+#include <sstream>
 #include <fcntl.h>
 #include <filesystem>
 #include <set>
+#include <atomic>
 
 #ifndef __unix
 #include <windows.h>
@@ -56,6 +60,7 @@
 #endif
 
 #include "precomp_dll.h"
+#include "precomp_compare.h"
 
 #include "formats/deflate.h"
 #include "formats/zlib.h"
@@ -139,10 +144,14 @@ void precompression_result::dump_precompressed_data_to_outfile(OStreamLike& outf
   fast_copy(*precompressed_stream, outfile, out_size);
 }
 
-void precompression_result::dump_to_outfile(OStreamLike& outfile) const {
+void precompression_result::dump_record_header_to_outfile(OStreamLike& outfile) const {
   dump_header_to_outfile(outfile);
   dump_penaltybytes_to_outfile(outfile);
   dump_stream_sizes_to_outfile(outfile);
+}
+
+void precompression_result::dump_to_outfile(OStreamLike& outfile) const {
+  dump_record_header_to_outfile(outfile);
   dump_precompressed_data_to_outfile(outfile);
 }
 
@@ -183,12 +192,110 @@ ResultStatistics::ResultStatistics(): CResultStatistics() {
   decompressed_zlib_count = 0;    // intense mode
   decompressed_brute_count = 0;   // brute mode
 
+  repeated_streams_count = 0;
+  repeated_streams_size = 0;
+  cached_streams_count = 0;
+  base_streams_count = 0;
+  base_streams_size = 0;
+
   header_already_read = false;
+  peak_tracked_memory = 0;
+  peak_rss = 0;
 
   max_recursion_depth_used = 0;
   max_recursion_depth_reached = false;
 }
 
+void ResultStatistics::add_stream_counts(const CResultStatistics& other) {
+  recompressed_streams_count += other.recompressed_streams_count;
+  recompressed_pdf_count += other.recompressed_pdf_count;
+  recompressed_pdf_count_8_bit += other.recompressed_pdf_count_8_bit;
+  recompressed_pdf_count_24_bit += other.recompressed_pdf_count_24_bit;
+  recompressed_zip_count += other.recompressed_zip_count;
+  recompressed_gzip_count += other.recompressed_gzip_count;
+  recompressed_png_count += other.recompressed_png_count;
+  recompressed_png_multi_count += other.recompressed_png_multi_count;
+  recompressed_gif_count += other.recompressed_gif_count;
+  recompressed_jpg_count += other.recompressed_jpg_count;
+  recompressed_jpg_prog_count += other.recompressed_jpg_prog_count;
+  recompressed_mp3_count += other.recompressed_mp3_count;
+  recompressed_swf_count += other.recompressed_swf_count;
+  recompressed_base64_count += other.recompressed_base64_count;
+  recompressed_bzip2_count += other.recompressed_bzip2_count;
+  recompressed_zlib_count += other.recompressed_zlib_count;
+  recompressed_brute_count += other.recompressed_brute_count;
+
+  decompressed_streams_count += other.decompressed_streams_count;
+  decompressed_pdf_count += other.decompressed_pdf_count;
+  decompressed_pdf_count_8_bit += other.decompressed_pdf_count_8_bit;
+  decompressed_pdf_count_24_bit += other.decompressed_pdf_count_24_bit;
+  decompressed_zip_count += other.decompressed_zip_count;
+  decompressed_gzip_count += other.decompressed_gzip_count;
+  decompressed_png_count += other.decompressed_png_count;
+  decompressed_png_multi_count += other.decompressed_png_multi_count;
+  decompressed_gif_count += other.decompressed_gif_count;
+  decompressed_jpg_count += other.decompressed_jpg_count;
+  decompressed_jpg_prog_count += other.decompressed_jpg_prog_count;
+  decompressed_mp3_count += other.decompressed_mp3_count;
+  decompressed_swf_count += other.decompressed_swf_count;
+  decompressed_base64_count += other.decompressed_base64_count;
+  decompressed_bzip2_count += other.decompressed_bzip2_count;
+  decompressed_zlib_count += other.decompressed_zlib_count;
+  decompressed_brute_count += other.decompressed_brute_count;
+
+  repeated_streams_count += other.repeated_streams_count;
+  repeated_streams_size += other.repeated_streams_size;
+  cached_streams_count += other.cached_streams_count;
+  base_streams_count += other.base_streams_count;
+  base_streams_size += other.base_streams_size;
+}
+
+void FormatProfile::Phase::copy_to(CProfilePhase& phase) const {
+  phase.count = count;
+  phase.wall_time_us = wall_time_us;
+  phase.cpu_time_us = cpu_time_us;
+}
+
+void FormatProfile::copy_to(CFormatProfile& profile) const {
+  profile.quick_check_hits = quick_check_hits;
+  profile.attempts = attempts;
+  profile.successes = successes;
+  profile.failures_no_stream = failures_no_stream;
+  profile.failures_error = failures_error;
+  profile.failures_verification = failures_verification;
+  attempt.copy_to(profile.attempt);
+  verify.copy_to(profile.verify);
+  recursion.copy_to(profile.recursion);
+  recompress.copy_to(profile.recompress);
+  profile.bytes_in = bytes_in;
+  profile.bytes_out = bytes_out;
+}
+
+const char* format_handler_name(SupportedFormats format) {
+  switch (format) {
+    case D_PDF: return "PDF";
+    case D_ZIP: return "ZIP";
+    case D_GZIP: return "GZip";
+    case D_PNG: return "PNG";
+    case D_MULTIPNG: return "PNG (multi)";
+    case D_GIF: return "GIF";
+    case D_JPG: return "JPG";
+    case D_SWF: return "SWF";
+    case D_BASE64: return "Base64";
+    case D_BZIP2: return "bZip2";
+    case D_MP3: return "MP3";
+    case D_REPEAT: return "Repeat";
+    case D_RAW: return "zLib (intense mode)";
+    case D_BRUTE: return "Brute mode";
+  }
+  return "Unknown";
+}
+
+// Arguments for the trace spans of work done on a stream
+std::string stream_trace_args(long long input_file_pos, SupportedFormats format, int recursion_depth) {
+  return make_cstyle_format_string("\"offset\": %lli, \"format\": \"%s\", \"depth\": %i", input_file_pos, format_handler_name(format), recursion_depth);
+}
+
 void PrecompSetInputStream(Precomp* precomp_mgr, PrecompIStream istream, const char* input_file_name) {
   precomp_mgr->input_file_name = input_file_name;
   precomp_mgr->set_input_stream(static_cast<std::istream*>(istream));
@@ -197,6 +304,22 @@ void PrecompSetInputFile(Precomp* precomp_mgr, FILE* fhandle, const char* input_
   precomp_mgr->input_file_name = input_file_name;
   precomp_mgr->set_input_stream(fhandle);
 }
+bool PrecompSetInputFilePath(Precomp* precomp_mgr, const char* input_file_name) {
+  precomp_mgr->input_file_name = input_file_name;
+  auto mapped_fin = MemoryMappedIStream::open(input_file_name);
+  if (mapped_fin) {
+    precomp_mgr->get_original_context()->fin = std::move(mapped_fin);
+    return true;
+  }
+  auto fin = new std::ifstream();
+  fin->open(input_file_name, std::ios_base::in | std::ios_base::binary);
+  if (!fin->is_open()) {
+    delete fin;
+    return false;
+  }
+  precomp_mgr->set_input_stream(fin);
+  return true;
+}
 
 void PrecompSetOutStream(Precomp* precomp_mgr, PrecompOStream ostream, const char* output_file_name) {
   precomp_mgr->output_file_name = output_file_name;
@@ -243,7 +366,7 @@ void PrecompSetGenericOutputStream(
   precomp_mgr->output_file_name = output_file_name;
   auto gen_ostream = std::make_unique<GenericOStreamLike>(backing_structure, write_func, put_func, tellp_func, seekp_func, eof_func, bad_func, clear_func);
   precomp_mgr->get_original_context()->fout = std::unique_ptr<ObservableOStream>(new ObservableOStreamWrapper(gen_ostream.release(), true));
-  
+  precomp_mgr->setup_output_stream();
 }
 
 const char* PrecompGetOutputFilename(Precomp* precomp_mgr) {
@@ -284,6 +407,20 @@ Switches::Switches(): CSwitches() {
   preflate_verify = false;
 
   max_recursion_depth = 10;
+
+  thread_count = 1;
+  segment_size = 0;
+  reorder_window = 64 * 1024 * 1024;
+  write_index = false;
+  readahead_buffer_count = 2;
+  readahead_buffer_size = 4 * 1024 * 1024;
+  memory_limit = 0;
+  dedup_window = 0;
+  uncompressed_buffer_size = 16 * 1024 * 1024;
+}
+
+unsigned int Switches::resolved_thread_count() const {
+  return thread_count != 0 ? thread_count : auto_detected_thread_count();
 }
 
 Switches::~Switches() {
@@ -320,6 +457,7 @@ std::unique_ptr<RecursionContext>&  Precomp::get_original_context() {
 
 Precomp::Precomp() {
   recursion_depth = 0;
+  install_preflate_hooks();
 }
 
 void Precomp::set_input_stdin() {
@@ -352,9 +490,12 @@ void Precomp::set_output_stdout() {
   this->get_original_context()->fout = std::move(new_fout);
 }
 
-void Precomp::register_output_observer_callbacks() {
+void Precomp::setup_output_stream() {
+  auto& orig_context = this->get_original_context();
+  orig_context->fout = std::make_unique<ObservableOStreamWrapper>(
+    new WriteBehindOStream(std::move(orig_context->fout), WRITE_BEHIND_BUFFER_SIZE, WRITE_BEHIND_BUFFER_COUNT), true);
   // Set write observer to update progress when writing to output file, based on how much of the input file we have read
-  this->get_original_context()->fout->register_observer(ObservableOStream::observable_methods::write_method, [this]()
+  orig_context->fout->register_observer(ObservableOStream::observable_methods::write_method, [this]()
   {
     this->call_progress_callback();
   });
@@ -366,7 +507,7 @@ void Precomp::set_output_stream(std::ostream* ostream, bool take_ownership) {
   else {
     orig_context->set_output_stream(ostream, take_ownership);
   }
-  register_output_observer_callbacks();
+  setup_output_stream();
 }
 
 void Precomp::set_output_stream(FILE* fhandle, bool take_ownership) {
@@ -375,7 +516,7 @@ void Precomp::set_output_stream(FILE* fhandle, bool take_ownership) {
   else {
     orig_context->set_output_stream(fhandle, take_ownership);
   }
-  register_output_observer_callbacks();
+  setup_output_stream();
 }
 
 void Precomp::set_progress_callback(std::function<void(float)> callback) {
@@ -383,6 +524,12 @@ void Precomp::set_progress_callback(std::function<void(float)> callback) {
 }
 void Precomp::call_progress_callback() {
   if (!this->progress_callback || !this->ctx) return;
+  // This gets called a lot from all over the place, there is no point in reporting progress more often than this
+  const long long now = get_time_ms();
+  if (now - last_progress_callback_time.load(std::memory_order_relaxed) < PROGRESS_CALLBACK_INTERVAL_MS) return;
+  std::lock_guard lock(progress_callback_mtx);
+  if (now - last_progress_callback_time.load(std::memory_order_relaxed) < PROGRESS_CALLBACK_INTERVAL_MS) return;
+  last_progress_callback_time.store(now, std::memory_order_relaxed);
   auto context_progress_range = this->ctx->global_max_percent - this->ctx->global_min_percent;
   auto inner_context_progress_percent = static_cast<float>(this->ctx->input_file_pos) / this->ctx->fin_length;
   this->progress_callback(this->ctx->global_min_percent + (context_progress_range * inner_context_progress_percent));
@@ -444,6 +591,44 @@ const std::vector<std::unique_ptr<PrecompFormatHandler>>& Precomp::get_format_ha
     return format_handlers;
 }
 
+unsigned char Precomp::handler_format_byte(SupportedFormats format) const {
+  for (const auto& formatHandler : format_handlers) {
+    const auto& header_bytes = formatHandler->get_header_bytes();
+    if (std::find(header_bytes.cbegin(), header_bytes.cend(), format) != header_bytes.cend()) return header_bytes[0];
+  }
+  return format;
+}
+
+FormatProfile& Precomp::get_format_profile(SupportedFormats format) {
+  return (*profile)[handler_format_byte(format)];
+}
+
+MemoryAccount& Precomp::get_memory_account(SupportedFormats format, int depth) {
+  return memory->get(handler_format_byte(format), depth);
+}
+
+PrecompMemoryAccounts::PrecompMemoryAccounts() {
+  for (auto& depth_accounts : handler_accounts) {
+    for (auto& account : depth_accounts) account.parent = &total;
+  }
+}
+
+MemoryAccount& PrecompMemoryAccounts::get(unsigned char format, int depth) {
+  return handler_accounts[format][std::clamp(depth, 0, PRECOMP_MEMORY_TRACKED_DEPTHS - 1)];
+}
+
+std::string PrecompMemoryAccounts::describe_current_usage() {
+  std::string description;
+  for (int format = 0; format < 256; format++) {
+    for (int depth = 0; depth < PRECOMP_MEMORY_TRACKED_DEPTHS; depth++) {
+      const long long current = handler_accounts[format][depth].current;
+      if (current <= 0) continue;
+      description += make_cstyle_format_string("  %s at depth %i: %lli KiB\n", format_handler_name(static_cast<SupportedFormats>(format)), depth, current / 1024);
+    }
+  }
+  return description;
+}
+
 bool Precomp::is_format_handler_active(SupportedFormats format_id) const {
     const auto itemIt = std::find_if(
         format_handlers.cbegin(), format_handlers.cend(),
@@ -469,14 +654,208 @@ void end_uncompressed_data(Precomp& precomp_mgr) {
   if (!precomp_mgr.ctx->uncompressed_length.has_value()) return;
 
   fout_fput_vlint(*precomp_mgr.ctx->fout, *precomp_mgr.ctx->uncompressed_length);
+  if (precomp_mgr.ctx->written_records.has_value()) precomp_mgr.ctx->written_records->back().original_length = *precomp_mgr.ctx->uncompressed_length;
 
-  // fast copy of uncompressed data
-  precomp_mgr.ctx->fin->seekg(precomp_mgr.ctx->uncompressed_pos, std::ios_base::beg);
-  fast_copy(*precomp_mgr.ctx->fin, *precomp_mgr.ctx->fout, *precomp_mgr.ctx->uncompressed_length);
+  auto& uncompressed_data = precomp_mgr.ctx->uncompressed_data;
+  if (static_cast<long long>(uncompressed_data.size()) == *precomp_mgr.ctx->uncompressed_length) {
+    precomp_mgr.ctx->fout->write(reinterpret_cast<const char*>(uncompressed_data.data()), uncompressed_data.size());
+    uncompressed_data.clear();
+  }
+  else {
+    // fast copy of uncompressed data, the block was too large to keep it in memory
+    precomp_mgr.ctx->fin->seekg(precomp_mgr.ctx->uncompressed_pos, std::ios_base::beg);
+    fast_copy(*precomp_mgr.ctx->fin, *precomp_mgr.ctx->fout, *precomp_mgr.ctx->uncompressed_length);
+  }
+  if (precomp_mgr.ctx->written_records.has_value()) {
+    auto& record = precomp_mgr.ctx->written_records->back();
+    record.pcf_length = static_cast<long long>(precomp_mgr.ctx->fout->tellp()) - record.pcf_pos;
+  }
 
   precomp_mgr.ctx->uncompressed_length = std::nullopt;
 }
 
+// Everything besides the data itself that can make a format handler give a different result
+std::string handler_settings(const Switches& switches) {
+  return make_cstyle_format_string("%i %i %i %i %i %u %llu %i", switches.pdf_bmp_mode, switches.prog_only, switches.use_mjpeg, switches.use_brunsli,
+    switches.use_packjpg_fallback, switches.min_ident_size, static_cast<unsigned long long>(switches.preflate_meta_block_size), switches.preflate_verify);
+}
+
+// Everything besides the data itself that can make the records written for streams different: what the handlers do, and for the streams found
+// on recursion, which handlers are used and how deep
+std::string pcf_record_settings(const Precomp& precomp_mgr) {
+  const auto& switches = precomp_mgr.switches;
+  auto settings = handler_settings(switches) + make_cstyle_format_string(" %i %i %i %i %i |", switches.max_recursion_depth,
+    switches.intense_mode, switches.intense_mode_depth_limit, switches.brute_mode, switches.brute_mode_depth_limit);
+  for (const auto& format_handler : precomp_mgr.get_format_handlers()) settings += make_cstyle_format_string(" %i", format_handler->get_header_bytes()[0]);
+  return settings;
+}
+
+// The PCF index goes after the records and is found through a fixed size trailer at the very end of the file: the index position as 8 big-endian bytes and these magic bytes.
+// It starts with the pcf_record_settings the records were written with, as a length and that many bytes. Each entry has a record's position and length on the original and on the PCF, if it's precompressed, and if so its format and if recursion was used on it,
+// followed by the SHA1s of the stream's original data (see PcfRecordInfo) as 20 bytes each, if the flags say so.
+constexpr std::array<char, 4> PCF_INDEX_MAGIC { 'P', 'I', 'D', 'X' };
+constexpr int PCF_INDEX_TRAILER_SIZE = 8 + PCF_INDEX_MAGIC.size();
+
+void fout_put_sha1(OStreamLike& fout, const std::string& sha1) {
+  for (size_t i = 0; i + 1 < sha1.size(); i += 2) {
+    fout.put(static_cast<char>(std::stoi(sha1.substr(i, 2), nullptr, 16)));
+  }
+}
+
+std::string fin_get_sha1(IStreamLike& fin) {
+  std::string sha1;
+  for (int i = 0; i < 20; i++) {
+    sha1 += make_cstyle_format_string("%02x", fin.get() & 0xFF);
+  }
+  return sha1;
+}
+
+// The SHA1s of the streams that don't have them yet are calculated from the original input, so they can be found again by later runs using this PCF as their base
+void write_pcf_index(OStreamLike& fout, const std::string& record_settings, std::vector<PcfRecordInfo>& records, IStreamLike& original) {
+  for (auto& record : records) {
+    if (!record.precompressed || record.format == D_REPEAT || record.original_sha1.has_value()) continue;
+    record.original_sha1 = calculate_input_sha1(original, record.original_pos, record.original_length);
+    if (record.original_length > PrecompBasePcf::KEY_SIZE) {
+      record.original_key_sha1 = calculate_input_sha1(original, record.original_pos, PrecompBasePcf::KEY_SIZE);
+    }
+  }
+
+  const unsigned long long index_pos = fout.tellp();
+  fout_fput_vlint(fout, record_settings.size());
+  fout.write(record_settings.data(), static_cast<std::streamsize>(record_settings.size()));
+  fout_fput_vlint(fout, records.size());
+  for (const auto& record : records) {
+    fout_fput_vlint(fout, record.original_pos);
+    fout_fput_vlint(fout, record.original_length);
+    fout_fput_vlint(fout, record.pcf_pos);
+    fout_fput_vlint(fout, record.pcf_length);
+    fout.put((record.precompressed ? 1 : 0) | (record.recursion_used ? 2 : 0) | (record.original_sha1.has_value() ? 4 : 0) | (record.original_key_sha1.has_value() ? 8 : 0));
+    if (record.precompressed) fout.put(record.format);
+    if (record.original_sha1.has_value()) fout_put_sha1(fout, *record.original_sha1);
+    if (record.original_key_sha1.has_value()) fout_put_sha1(fout, *record.original_key_sha1);
+  }
+  for (int i = 7; i >= 0; i--) {
+    fout.put(static_cast<char>((index_pos >> (i * 8)) & 0xFF));
+  }
+  fout.write(PCF_INDEX_MAGIC.data(), PCF_INDEX_MAGIC.size());
+}
+
+struct PcfIndex {
+  std::string record_settings;
+  std::vector<PcfRecordInfo> records;
+};
+
+// Needs a seekable input, leaves it positioned after the index
+PcfIndex read_pcf_index(IStreamLike& fin) {
+  fin.seekg(-PCF_INDEX_TRAILER_SIZE, std::ios_base::end);
+  std::array<unsigned char, PCF_INDEX_TRAILER_SIZE> trailer {};
+  fin.read(reinterpret_cast<char*>(trailer.data()), trailer.size());
+  if (fin.gcount() != PCF_INDEX_TRAILER_SIZE || !std::equal(PCF_INDEX_MAGIC.begin(), PCF_INDEX_MAGIC.end(), trailer.begin() + 8)) {
+    throw PrecompError(ERR_NO_PCF_INDEX);
+  }
+  unsigned long long index_pos = 0;
+  for (int i = 0; i < 8; i++) {
+    index_pos = (index_pos << 8) | trailer[i];
+  }
+
+  fin.seekg(index_pos, std::ios_base::beg);
+  PcfIndex index;
+  const long long record_settings_size = fin_fget_vlint(fin);
+  if (record_settings_size < 0 || record_settings_size > 4096) throw PrecompError(ERR_NO_PCF_INDEX);
+  index.record_settings.resize(static_cast<size_t>(record_settings_size));
+  fin.read(index.record_settings.data(), record_settings_size);
+  index.records.resize(fin_fget_vlint(fin));
+  for (auto& record : index.records) {
+    record.original_pos = fin_fget_vlint(fin);
+    record.original_length = fin_fget_vlint(fin);
+    record.pcf_pos = fin_fget_vlint(fin);
+    record.pcf_length = fin_fget_vlint(fin);
+    const int record_flags = fin.get();
+    record.precompressed = (record_flags & 1) != 0;
+    record.recursion_used = (record_flags & 2) != 0;
+    if (record.precompressed) record.format = fin.get();
+    if ((record_flags & 4) != 0) record.original_sha1 = fin_get_sha1(fin);
+    if ((record_flags & 8) != 0) record.original_key_sha1 = fin_get_sha1(fin);
+  }
+  if (!fin.good()) throw PrecompError(ERR_NO_PCF_INDEX);
+  return index;
+}
+
+PrecompBasePcf::PrecompBasePcf(const std::string& file_name) {
+  base_file.open(file_name, std::ios_base::in | std::ios_base::binary);
+  std::array<char, 7> header {};
+  fin.read(header.data(), header.size());
+  if (fin.gcount() != static_cast<std::streamsize>(header.size()) || header[0] != 'P' || header[1] != 'C' || header[2] != 'F' ||
+      header[3] != V_MAJOR || header[4] != V_MINOR || header[5] != V_MINOR2) {
+    throw PrecompError(ERR_BASE_PCF_UNUSABLE);
+  }
+  const int pcf_layout = static_cast<unsigned char>(header[6]);
+  if (pcf_layout != PCF_LAYOUT_RECORDS && pcf_layout != PCF_LAYOUT_DEDUP_RECORDS && pcf_layout != PCF_LAYOUT_BLOCKS) throw PrecompError(ERR_BASE_PCF_UNUSABLE);
+
+  PcfIndex index;
+  try {
+    index = read_pcf_index(fin);
+  }
+  catch (const PrecompError&) {
+    throw PrecompError(ERR_BASE_PCF_UNUSABLE);
+  }
+  record_settings = std::move(index.record_settings);
+  fin.seekg(0, std::ios_base::end);
+  const long long base_file_size = fin.tellg();
+  for (auto& record : index.records) {
+    // Repeats are just references to earlier records, and streams without a SHA1 can't be told unchanged
+    if (!record.precompressed || record.format == D_REPEAT || !record.original_sha1.has_value()) continue;
+    if (record.original_length <= 0 || record.pcf_pos < 0 || record.pcf_length <= 0 || record.pcf_pos + record.pcf_length > base_file_size) continue;
+    records.emplace(record.original_pos, std::move(record));
+  }
+  for (const auto& [original_pos, record] : records) {
+    if (record.original_length == KEY_SIZE) records_by_key.emplace(*record.original_sha1, &record);
+    else if (record.original_key_sha1.has_value()) records_by_key.emplace(*record.original_key_sha1, &record);
+  }
+}
+
+bool PrecompBasePcf::covers(long long pos) const {
+  auto it = records.upper_bound(pos);
+  if (it == records.begin()) return false;
+  --it;
+  return pos < it->second.original_pos + it->second.original_length;
+}
+
+const PcfRecordInfo* PrecompBasePcf::find(IStreamLike& input, long long pos, long long max_length) {
+  const auto unchanged = [&](const PcfRecordInfo& record) {
+    return record.original_length <= max_length && calculate_input_sha1(input, pos, record.original_length) == record.original_sha1;
+  };
+  const PcfRecordInfo* found = nullptr;
+  for (const long long record_pos : { pos + shift, pos }) {
+    const auto it = records.find(record_pos);
+    if (it != records.end() && unchanged(it->second)) {
+      found = &it->second;
+      break;
+    }
+    if (shift == 0) break;
+  }
+  if (found == nullptr && max_length >= KEY_SIZE && !records_by_key.empty()) {
+    const auto key = calculate_input_sha1(input, pos, KEY_SIZE);
+    if (key.has_value()) {
+      // If several streams start the same here, the longest one is taken
+      std::vector<const PcfRecordInfo*> candidates;
+      for (auto [it, end] = records_by_key.equal_range(*key); it != end; ++it) candidates.push_back(it->second);
+      std::sort(candidates.begin(), candidates.end(), [](const PcfRecordInfo* a, const PcfRecordInfo* b) { return a->original_length > b->original_length; });
+      const auto candidate = std::find_if(candidates.begin(), candidates.end(), [&](const PcfRecordInfo* record) { return unchanged(*record); });
+      if (candidate != candidates.end()) found = *candidate;
+    }
+  }
+  if (found != nullptr) shift = found->original_pos - pos;
+  return found;
+}
+
+void PrecompBasePcf::copy_record(const PcfRecordInfo& record, OStreamLike& output) {
+  fin.clear();
+  fin.seekg(record.pcf_pos, std::ios_base::beg);
+  fast_copy(fin, output, record.pcf_length);
+  if (fin.bad() || fin.eof()) throw PrecompError(ERR_BASE_PCF_UNUSABLE);
+}
+
 void write_header(Precomp& precomp_mgr) {
   // write the PCF file header, beware that this needs to be done before wrapping the output file with a CompressedOStreamBuffer
   char* input_file_name_without_path = new char[precomp_mgr.input_file_name.length() + 1];
@@ -488,8 +867,15 @@ void write_header(Precomp& precomp_mgr) {
   precomp_mgr.ctx->fout->put(V_MINOR);
   precomp_mgr.ctx->fout->put(V_MINOR2);
 
-  // compression-on-the-fly method used, 0, as OTF compression no longer supported
-  precomp_mgr.ctx->fout->put(0);
+  // PCF layout, this used to be the compression-on-the-fly method used, but OTF compression is no longer supported
+  PcfLayout pcf_layout = PCF_LAYOUT_RECORDS;
+  if (precomp_mgr.switches.segment_size != 0) {
+    pcf_layout = PCF_LAYOUT_BLOCKS;
+  }
+  else if (precomp_mgr.switches.dedup_window != 0) {
+    pcf_layout = PCF_LAYOUT_DEDUP_RECORDS;
+  }
+  precomp_mgr.ctx->fout->put(pcf_layout);
 
   // write input file name without path
   const char* last_backslash = strrchr(precomp_mgr.input_file_name.c_str(), PATH_DELIM);
@@ -502,6 +888,7 @@ void write_header(Precomp& precomp_mgr) {
 
   ostream_printf(*precomp_mgr.ctx->fout, input_file_name_without_path);
   precomp_mgr.ctx->fout->put(0);
+  if (pcf_layout == PCF_LAYOUT_DEDUP_RECORDS) fout_fput_vlint(*precomp_mgr.ctx->fout, precomp_mgr.switches.dedup_window);
 
   delete[] input_file_name_without_path;
 }
@@ -515,205 +902,1390 @@ struct recursion_result {
 };
 recursion_result recursion_compress(Precomp& precomp_mgr, long long compressed_bytes, long long decompressed_bytes, IStreamLike& tmpfile, std::string out_filename);
 
-int compress_file_impl(Precomp& precomp_mgr) {
-  precomp_mgr.ctx->comp_decomp_state = P_PRECOMPRESS;
-  if (precomp_mgr.recursion_depth == 0) {
-      write_header(precomp_mgr);
-      precomp_mgr.init_format_handlers();
-  }
+// Adds up to byte_count bytes starting at input_file_pos, whose contents are given in data, to the current uncompressed data block, starting a new one if needed.
+// Returns how many bytes were actually added, which might be less than requested if the block reached the maximum uncompressed_block_length and had to be dumped.
+long long add_uncompressed_data(Precomp& precomp_mgr, long long input_file_pos, const unsigned char* data, long long byte_count) {
+  if (!precomp_mgr.ctx->uncompressed_length.has_value()) {
+    precomp_mgr.ctx->uncompressed_length = 0;
+    precomp_mgr.ctx->uncompressed_pos = input_file_pos;
+    if (precomp_mgr.ctx->written_records.has_value()) {
+      precomp_mgr.ctx->written_records->push_back({ input_file_pos, 0, precomp_mgr.ctx->fout->tellp() });
+    }
 
-  const auto& format_handlers = precomp_mgr.get_format_handlers();
-  precomp_mgr.ctx->uncompressed_bytes_total = 0;
+    // uncompressed data
+    precomp_mgr.ctx->fout->put(0);
+  }
+  if (precomp_mgr.switches.uncompressed_block_length != 0) {
+    byte_count = std::min<long long>(byte_count, precomp_mgr.switches.uncompressed_block_length - *precomp_mgr.ctx->uncompressed_length);
+  }
+  // The block's data is kept for as long as all of it is and it fits in uncompressed_buffer_size, after that end_uncompressed_data reads it again from the input
+  auto& uncompressed_data = precomp_mgr.ctx->uncompressed_data;
+  if (static_cast<long long>(uncompressed_data.size()) == *precomp_mgr.ctx->uncompressed_length) {
+    if (static_cast<uintmax_t>(*precomp_mgr.ctx->uncompressed_length + byte_count) <= precomp_mgr.switches.uncompressed_buffer_size) {
+      uncompressed_data.insert(uncompressed_data.end(), data, data + byte_count);
+    }
+    else {
+      std::vector<unsigned char>().swap(uncompressed_data);
+    }
+  }
+  *precomp_mgr.ctx->uncompressed_length += byte_count;
+  precomp_mgr.ctx->uncompressed_bytes_total += byte_count;
+  // If there is a maximum uncompressed_block_length we dump the current uncompressed data as a single block, this makes it so anything waiting on data from Precomp
+  // can get some data to possibly process earlier
+  if (precomp_mgr.switches.uncompressed_block_length != 0 && precomp_mgr.ctx->uncompressed_length >= precomp_mgr.switches.uncompressed_block_length) {
+    end_uncompressed_data(precomp_mgr);
+  }
+  return byte_count;
+}
+
+// Attempts precompression with formatHandler at input_file_pos, returning nullptr if no stream could be precompressed there
+std::unique_ptr<precompression_result> attempt_stream_precompression(Precomp& precomp_mgr, PrecompFormatHandler& formatHandler, std::span<unsigned char> buffer, long long input_file_pos) {
+  auto& profile = precomp_mgr.get_format_profile(formatHandler.get_header_bytes()[0]);
+  profile.attempts++;
+  MemoryAccountScope memory_scope(&precomp_mgr.get_memory_account(formatHandler.get_header_bytes()[0], precomp_mgr.recursion_depth));
+  std::unique_ptr<precompression_result> result {};
+
+  const auto disk_cache = precomp_mgr.ctx->comp_decomp_state != P_ANALYZE && formatHandler.results_cacheable() ? precomp_mgr.disk_cache.get() : nullptr;
+  // The attempt's side effects are kept apart, so they can be stored in the cache along with the result
+  ResultStatistics statistics_before_attempt;
+  bool non_zlib_was_used_before_attempt = false;
+  if (disk_cache) {
+    auto hit = disk_cache->find(precomp_mgr, formatHandler.get_header_bytes()[0], input_file_pos);
+    if (hit.has_value()) {
+      precomp_mgr.statistics.add_stream_counts(hit->statistics);
+      precomp_mgr.statistics.cached_streams_count++;
+      if (hit->non_zlib_was_used) precomp_mgr.ctx->non_zlib_was_used = true;
+      if (!precomp_mgr.switches.verify_precompressed) profile.successes++;
+      return std::move(hit->result);
+    }
+    statistics_before_attempt = std::exchange(precomp_mgr.statistics, ResultStatistics());
+    non_zlib_was_used_before_attempt = std::exchange(precomp_mgr.ctx->non_zlib_was_used, false);
+  }
 
-  precomp_mgr.ctx->fin->seekg(0, std::ios_base::beg);
-  precomp_mgr.ctx->fin->read(reinterpret_cast<char*>(precomp_mgr.ctx->in_buf), IN_BUF_SIZE);
-  long long in_buf_pos = 0;
-  // This buffer will be fed to the format handlers so they can confirm if the current position is the beggining of a stream they support
-  std::span<unsigned char> checkbuf;
+  bool attempt_failed = false;
+  try {
+    ProfilePhaseTimer timer(profile.attempt);
+    TraceSpan span("precompress", "attempt", [&]() { return stream_trace_args(input_file_pos, formatHandler.get_header_bytes()[0], precomp_mgr.recursion_depth); });
+    result = formatHandler.attempt_precompression(precomp_mgr, buffer, input_file_pos);
+  }
+  catch (...) {  // TODO: print/record/report handler failed
+    attempt_failed = true;
+  }
+  if (disk_cache) {
+    const auto attempt_statistics = std::exchange(precomp_mgr.statistics, statistics_before_attempt);
+    precomp_mgr.statistics.add_stream_counts(attempt_statistics);
+    const bool attempt_non_zlib_was_used = std::exchange(precomp_mgr.ctx->non_zlib_was_used, precomp_mgr.ctx->non_zlib_was_used || non_zlib_was_used_before_attempt);
+    if (!attempt_failed && result && result->success) {
+      disk_cache->store(precomp_mgr, formatHandler.get_header_bytes()[0], input_file_pos, *result, attempt_statistics, attempt_non_zlib_was_used);
+    }
+  }
+  if (attempt_failed) {
+    profile.failures_error++;
+    return nullptr;
+  }
+  if (!result || !result->success) {
+    profile.failures_no_stream++;
+    return nullptr;
+  }
+  // With verification, it's only a success once verified
+  if (!precomp_mgr.switches.verify_precompressed) profile.successes++;
+  return result;
+}
 
-  precomp_mgr.ctx->anything_was_used = false;
-  precomp_mgr.ctx->non_zlib_was_used = false;
+// Writes a successfully precompressed (and if required, verified) stream found at input_file_pos to the output, recursing into it first if the format allows for it
+void write_precompressed_record(Precomp& precomp_mgr, const PrecompFormatHandler& formatHandler, std::unique_ptr<precompression_result>& result, long long input_file_pos) {
+  // Even if we need to recurse and recursion fails/doesn't find anything, we already know we are going to write this stream, which means we can as well write
+  // any pending uncompressed data now (might allow any pipe/code using the library waiting on data from Precomp to be able to work with it while we do recursive processing)
+  end_uncompressed_data(precomp_mgr);
 
-  for (long long input_file_pos = 0; input_file_pos < precomp_mgr.ctx->fin_length; input_file_pos++) {
-    precomp_mgr.ctx->input_file_pos = input_file_pos;
-    bool compressed_data_found = false;
+  auto& profile = precomp_mgr.get_format_profile(formatHandler.get_header_bytes()[0]);
+  profile.bytes_in += result->complete_original_size();
+  profile.bytes_out += result->precompressed_size;
+
+  // If the format allows for it, recurse inside the most likely newly decompressed data
+  if (formatHandler.recursion_allowed) {
+    auto recurse_tempfile_name = precomp_mgr.get_tempfile_name("recurse");
+    recursion_result r{};
+    try {
+      ProfilePhaseTimer timer(profile.recursion);
+      TraceSpan span("precompress", "recursion", [&]() { return stream_trace_args(input_file_pos, formatHandler.get_header_bytes()[0], precomp_mgr.recursion_depth); });
+      r = recursion_compress(precomp_mgr, result->original_size, result->precompressed_size, *result->precompressed_stream, recurse_tempfile_name);
+    }
+    catch (...) {}  // TODO: print/record/report handler failed
+    if (r.success) {
+      auto rec_tmpfile = new PrecompTmpFile();
+      rec_tmpfile->open(r.file_name, std::ios_base::in | std::ios_base::binary);
+      result->precompressed_stream = std::unique_ptr<IStreamLike>(rec_tmpfile);
+      result->recursion_filesize = r.file_length;
+      result->recursion_used = true;
+    }
+    else {
+      // ensure that the precompressed stream is ready to read from the start, as if recursion attempt never happened
+      result->precompressed_stream->seekg(0, std::ios_base::beg);
+    }
+  }
 
-    bool ignore_this_pos = false;
+  const long long record_pcf_pos = precomp_mgr.ctx->written_records.has_value() ? static_cast<long long>(precomp_mgr.ctx->fout->tellp()) : 0;
+  result->dump_to_outfile(*precomp_mgr.ctx->fout);
+  if (precomp_mgr.ctx->written_records.has_value()) {
+    precomp_mgr.ctx->written_records->push_back({
+      input_file_pos, result->complete_original_size(), record_pcf_pos, static_cast<long long>(precomp_mgr.ctx->fout->tellp()) - record_pcf_pos,
+      true, static_cast<unsigned char>(result->format), result->recursion_used
+    });
+  }
+}
 
-    if ((in_buf_pos + IN_BUF_SIZE) <= (input_file_pos + CHECKBUF_SIZE)) {
-      precomp_mgr.ctx->fin->seekg(input_file_pos, std::ios_base::beg);
-      precomp_mgr.ctx->fin->read(reinterpret_cast<char*>(precomp_mgr.ctx->in_buf), IN_BUF_SIZE);
-      in_buf_pos = input_file_pos;
+// Builds a lookup table with the first byte of every magic signature of the format handlers active at the current recursion depth.
+// If any active handler doesn't provide signatures (intense/brute mode), no prefiltering is possible and nothing is returned.
+std::optional<std::array<bool, 256>> build_candidate_prefilter(const Precomp& precomp_mgr) {
+  std::array<bool, 256> candidate_first_bytes{};
+  for (const auto& formatHandler : precomp_mgr.get_format_handlers()) {
+    if (formatHandler->depth_limit && precomp_mgr.recursion_depth > formatHandler->depth_limit) continue;
+    const auto signatures = formatHandler->get_magic_signatures();
+    if (signatures.empty()) return std::nullopt;
+    for (const auto& signature : signatures) {
+      if (signature.bytes.empty()) return std::nullopt;
+      const auto first_byte = static_cast<unsigned char>(signature.bytes[0]);
+      candidate_first_bytes[first_byte] = true;
+      if (signature.case_insensitive) {
+        candidate_first_bytes[static_cast<unsigned char>(tolower(first_byte))] = true;
+        candidate_first_bytes[static_cast<unsigned char>(toupper(first_byte))] = true;
+      }
     }
-    auto cb_pos = input_file_pos - in_buf_pos;
-    checkbuf = std::span(&precomp_mgr.ctx->in_buf[cb_pos], IN_BUF_SIZE - cb_pos);
-
-    ignore_this_pos = precomp_mgr.switches.ignore_set.find(input_file_pos) != precomp_mgr.switches.ignore_set.end();
+  }
+  return candidate_first_bytes;
+}
+
+// Returns the amount of bytes from the start of the buffer that can be skipped because no active format handler could possibly match on them
+long long skip_to_next_candidate(const std::array<bool, 256>& candidate_first_bytes, const unsigned char* buffer, long long buffer_size) {
+  long long i = 0;
+  // Unrolled, as this runs for pretty much every byte of mostly literal inputs
+  for (; i + 4 <= buffer_size; i += 4) {
+    if (candidate_first_bytes[buffer[i]]) return i;
+    if (candidate_first_bytes[buffer[i + 1]]) return i + 1;
+    if (candidate_first_bytes[buffer[i + 2]]) return i + 2;
+    if (candidate_first_bytes[buffer[i + 3]]) return i + 3;
+  }
+  for (; i < buffer_size; i++) {
+    if (candidate_first_bytes[buffer[i]]) return i;
+  }
+  return buffer_size;
+}
 
-    if (!ignore_this_pos) {
-      for (const auto& formatHandler : format_handlers) {
-        // Recursion depth check
-        if (formatHandler->depth_limit && precomp_mgr.recursion_depth > formatHandler->depth_limit) continue;
+// Creates a Precomp instance with the same switches (except the ignore list) and format handlers as precomp_mgr, for running work on another thread
+std::unique_ptr<Precomp> clone_precomp_settings(const Precomp& precomp_mgr) {
+  auto cloned_mgr = std::make_unique<Precomp>();
+  static_cast<CSwitches&>(cloned_mgr->switches) = static_cast<const CSwitches&>(precomp_mgr.switches);
+  if (precomp_mgr.switches.working_dir != nullptr) {
+    cloned_mgr->switches.working_dir = static_cast<char*>(malloc(strlen(precomp_mgr.switches.working_dir) + 1));
+    strcpy(cloned_mgr->switches.working_dir, precomp_mgr.switches.working_dir);
+  }
+  cloned_mgr->init_format_handlers();
+  cloned_mgr->profile = precomp_mgr.profile;
+  cloned_mgr->memory = precomp_mgr.memory;
+  cloned_mgr->failed_candidates = precomp_mgr.failed_candidates;
+  cloned_mgr->disk_cache = precomp_mgr.disk_cache;
+  return cloned_mgr;
+}
+
+// Lookahead precompression: a scout thread scans ahead of compress_file_impl's current position for positions where format handlers' quick_check succeeds, and worker
+// threads speculatively attempt precompression (and verification if enabled) there, each with its own Precomp instance and view of the input.
+// compress_file_impl still walks the input in order and decides which streams get written exactly like it would without lookahead, it just takes the already computed
+// result instead of attempting precompression right then, so the output is identical. Anything speculated on positions it skips over is discarded.
+// Only handlers whose results are cacheable are speculated on, the others' attempts depend on or change state of the handler instance, so they are always done by compress_file_impl.
+class PrecompLookahead {
+public:
+  struct Outcome {
+    // Null if precompression or verification failed
+    std::unique_ptr<precompression_result> result;
+    // Side effects the attempt had on the worker's Precomp instance, which need to be applied to the main one when taking the outcome
+    ResultStatistics statistics;
+    bool non_zlib_was_used = false;
+  };
+
+private:
+  struct Job {
+    long long input_file_pos;
+    size_t handler_index;
+    // Chunk of the input the scout read, starting somewhere before input_file_pos and with at least IN_BUF_SIZE bytes from it, shared by all jobs on the chunk
+    std::shared_ptr<std::vector<unsigned char>> window;
+    size_t window_offset;
+    bool started = false;
+    bool done = false;
+    std::optional<Outcome> outcome;
+  };
+
+  // How much the scout reads and scans at a time, and how far ahead of compress_file_impl it can get
+  static constexpr long long SCAN_WINDOW_SIZE = 1024 * 1024;
+  static constexpr long long MAX_LOOKAHEAD_DISTANCE = 64 * 1024 * 1024;
+
+  Precomp& precomp_mgr;
+  RecursionContext& ctx;
+  std::unique_ptr<IStreamLike> original_fin;
+  std::unique_ptr<SharedIStream> shared_fin;
+  const std::array<bool, 256> candidate_first_bytes;
+  const long long fin_length;
+  // compress_file_impl gives handlers a buffer that might have stale data after the end of the input on positions closer than IN_BUF_SIZE to it,
+  // which we can't replicate, so we just don't speculate there
+  const long long scan_limit;
+  const size_t max_pending_jobs;
+
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::deque<std::shared_ptr<Job>> jobs;
+  long long current_pos = 0;
+  long long scanned_until = 0;
+  bool scout_finished = false;
+  bool stopping = false;
+
+  std::thread scout_thread;
+  std::vector<std::thread> worker_threads;
+
+  std::unique_ptr<Precomp> make_worker_precomp() {
+    auto worker_mgr = clone_precomp_settings(precomp_mgr);
+    worker_mgr->ctx->fin = std::make_unique<SharedIStreamView>(shared_fin.get());
+    worker_mgr->ctx->fin_length = fin_length;
+    return worker_mgr;
+  }
 
-        // Position blacklist check
-        bool ignore_this_position = false;
-        const SupportedFormats& formatTag = formatHandler->get_header_bytes()[0];
-        auto ignoreListIt = precomp_mgr.ctx->ignore_offsets.find(formatTag);
-        if (ignoreListIt != precomp_mgr.ctx->ignore_offsets.cend()) {
-          auto& ignore_offsets_set = (*ignoreListIt).second;
-          if (!ignore_offsets_set.empty()) {
-            auto first = ignore_offsets_set.begin();
-            while (*first < input_file_pos) {
-              ignore_offsets_set.erase(first);
-              if (ignore_offsets_set.empty()) break;
-              first = ignore_offsets_set.begin();
-            }
+  bool queue_job(std::shared_ptr<Job>&& job) {
+    std::unique_lock lock(mtx);
+    cv.wait(lock, [this]() { return stopping || jobs.size() < max_pending_jobs; });
+    if (stopping) return false;
+    if (job->input_file_pos >= current_pos) {
+      jobs.push_back(std::move(job));
+      cv.notify_all();
+    }
+    return true;
+  }
 
-            if (!ignore_offsets_set.empty()) {
-              if (*first == input_file_pos) {
-                ignore_this_position = true;
-                ignore_offsets_set.erase(first);
-              }
+  void scout() {
+    const auto scout_mgr = make_worker_precomp();
+    const auto& format_handlers = scout_mgr->get_format_handlers();
+    const auto input_id = reinterpret_cast<uintptr_t>(scout_mgr->ctx->fin.get());
+    OffsetCursorSet ignore_positions(precomp_mgr.switches.ignore_set);
+    long long window_pos = 0;
+    while (window_pos < scan_limit) {
+      {
+        std::unique_lock lock(mtx);
+        cv.wait(lock, [&]() { return stopping || window_pos - current_pos < MAX_LOOKAHEAD_DISTANCE; });
+        if (stopping) break;
+        // No point in scanning anything compress_file_impl already went past
+        window_pos = std::max(window_pos, current_pos);
+      }
+      const long long window_end = std::min(window_pos + SCAN_WINDOW_SIZE, scan_limit);
+      if (window_pos >= window_end) break;
+      auto window = std::make_shared<std::vector<unsigned char>>(window_end - window_pos + IN_BUF_SIZE);
+      scout_mgr->ctx->fin->seekg(window_pos, std::ios_base::beg);
+      scout_mgr->ctx->fin->read(reinterpret_cast<char*>(window->data()), window->size());
+      if (scout_mgr->ctx->fin->gcount() != static_cast<std::streamsize>(window->size())) break;
+
+      long long pos = window_pos;
+      while (true) {
+        pos += skip_to_next_candidate(candidate_first_bytes, window->data() + (pos - window_pos), window_end - pos);
+        if (pos >= window_end) break;
+        // Streams the base PCF has are most likely unchanged and copied from it, so precompressing them is probably wasted work
+        const bool base_covered = precomp_mgr.base_pcf && precomp_mgr.base_pcf->covers(pos);
+        if (!ignore_positions.contains(pos) && !base_covered) {
+          const auto buffer = std::span(window->data() + (pos - window_pos), IN_BUF_SIZE);
+          for (size_t handler_index = 0; handler_index < format_handlers.size(); handler_index++) {
+            // Handlers with state of their own (like MP3 suppressing streams after a failure) would only get it on the worker's instance, not on the main one
+            if (!format_handlers[handler_index]->results_cacheable()) continue;
+            bool quick_check_result = false;
+            try {
+              quick_check_result = format_handlers[handler_index]->quick_check(buffer, input_id, pos);
             }
+            catch (...) {}
+            if (!quick_check_result) continue;
+
+            auto job = std::make_shared<Job>();
+            job->input_file_pos = pos;
+            job->handler_index = handler_index;
+            job->window = window;
+            job->window_offset = pos - window_pos;
+            if (!queue_job(std::move(job))) break;
           }
-          if (ignore_this_position) continue;
         }
+        pos++;
+        std::unique_lock lock(mtx);
+        if (stopping) break;
+        scanned_until = pos;
+        cv.notify_all();
+      }
+      window_pos = window_end;
+    }
 
-        bool quick_check_result = false;
-        try {
-          quick_check_result = formatHandler->quick_check(checkbuf, reinterpret_cast<uintptr_t>(precomp_mgr.ctx->fin.get()), input_file_pos);
-        }
-        catch (...) {}  // TODO: print/record/report handler failed
-        if (!quick_check_result) continue;
+    std::unique_lock lock(mtx);
+    scout_finished = true;
+    cv.notify_all();
+  }
 
-        std::unique_ptr<precompression_result> result {};
-        try {
-          result = formatHandler->attempt_precompression(precomp_mgr, checkbuf, input_file_pos);
-        }
-        catch (...) {}  // TODO: print/record/report handler failed
-        if (!result || !result->success) continue;
-
-        // If verification is enabled, we attempt to recompress the stream right now, and reject it if anything fails or data doesn't match
-        // Note that this is done before recursion for 2 reasons:
-        //  1) why bother recursing a stream we might reject
-        //  2) verification would be much more complicated as we would need to prevent recursing on recompression which would lead to verifying some streams MANY times
-        if (precomp_mgr.switches.verify_precompressed) {
-          bool verification_success = false;
-          try {
-            verification_success = verify_precompressed_result(precomp_mgr, result, input_file_pos);
-          }
-          catch (...) {}  // TODO: print/record/report handler failed
-          if (!verification_success) continue;
-          // ensure that the precompressed stream is ready to read from the start, as if verification never happened
-          result->precompressed_stream->seekg(0, std::ios_base::beg);
-        }
+  std::optional<Outcome> run_job(Precomp& worker_mgr, const Job& job) {
+    const auto& formatHandler = worker_mgr.get_format_handlers()[job.handler_index];
+    worker_mgr.statistics = ResultStatistics();
+    worker_mgr.ctx->non_zlib_was_used = false;
+    worker_mgr.ctx->input_file_pos = job.input_file_pos;
 
-        // We got successful stream and if required it was verified, even if we need to recurse and recursion fails/doesn't find anything, we already know we are
-        // going to write this stream, which means we can as well write any pending uncompressed data now
-        // (might allow any pipe/code using the library waiting on data from Precomp to be able to work with it while we do recursive processing)
-        end_uncompressed_data(precomp_mgr);
+    Outcome outcome;
+    outcome.result = attempt_stream_precompression(worker_mgr, *formatHandler, std::span(job.window->data() + job.window_offset, IN_BUF_SIZE), job.input_file_pos);
 
-        // If the format allows for it, recurse inside the most likely newly decompressed data
-        if (formatHandler->recursion_allowed) {
-            auto recurse_tempfile_name = precomp_mgr.get_tempfile_name("recurse");
-            recursion_result r{};
-            try {
-              r = recursion_compress(precomp_mgr, result->original_size, result->precompressed_size, *result->precompressed_stream, recurse_tempfile_name);
-            }
-            catch (...) {}  // TODO: print/record/report handler failed
-            if (r.success) {
-                auto rec_tmpfile = new PrecompTmpFile();
-                rec_tmpfile->open(r.file_name, std::ios_base::in | std::ios_base::binary);
-                result->precompressed_stream = std::unique_ptr<IStreamLike>(rec_tmpfile);
-                result->recursion_filesize = r.file_length;
-                result->recursion_used = true;
-            }
-            else {
-                // ensure that the precompressed stream is ready to read from the start, as if recursion attempt never happened
-                result->precompressed_stream->seekg(0, std::ios_base::beg);
-            }
+    if (outcome.result && worker_mgr.switches.verify_precompressed) {
+      long long input_file_pos = job.input_file_pos;
+      const bool verification_success = verify_precompressed_result(worker_mgr, outcome.result, input_file_pos);
+      if (!verification_success) {
+        outcome.result = nullptr;
+      }
+      else {
+        try {
+          outcome.result->precompressed_stream->seekg(0, std::ios_base::beg);
         }
-        
-        result->dump_to_outfile(*precomp_mgr.ctx->fout);
+        // Let compress_file_impl attempt it again by itself and deal with this
+        catch (...) { return std::nullopt; }
+      }
+    }
 
-        // start new uncompressed data
+    outcome.statistics = worker_mgr.statistics;
+    outcome.non_zlib_was_used = worker_mgr.ctx->non_zlib_was_used;
+    return outcome;
+  }
 
-        // set input file pointer after recompressed data
-        input_file_pos += result->complete_original_size() - 1;
-        compressed_data_found = result->success;
-        break;
+  void worker() {
+    const auto worker_mgr = make_worker_precomp();
+    while (true) {
+      std::shared_ptr<Job> job;
+      {
+        std::unique_lock lock(mtx);
+        cv.wait(lock, [&]() {
+          if (stopping) return true;
+          const auto job_it = std::find_if(jobs.begin(), jobs.end(), [](const std::shared_ptr<Job>& queued_job) { return !queued_job->started; });
+          if (job_it == jobs.end()) return false;
+          job = *job_it;
+          return true;
+        });
+        if (stopping) return;
+        job->started = true;
       }
+
+      auto outcome = run_job(*worker_mgr, *job);
+
+      std::unique_lock lock(mtx);
+      job->outcome = std::move(outcome);
+      job->done = true;
+      cv.notify_all();
+    }
+  }
+
+public:
+  PrecompLookahead(Precomp& precomp_mgr_, const std::array<bool, 256>& candidate_first_bytes_, unsigned int thread_count)
+    : precomp_mgr(precomp_mgr_), ctx(*precomp_mgr_.ctx), candidate_first_bytes(candidate_first_bytes_), fin_length(precomp_mgr_.ctx->fin_length),
+      scan_limit(precomp_mgr_.ctx->fin_length - IN_BUF_SIZE), max_pending_jobs(thread_count * 4) {
+    // From now on the input is read from through SharedIStreamViews, both here and on all the threads, until we give the original input stream back
+    const auto fin_pos = ctx.fin->tellg();
+    original_fin = std::move(ctx.fin);
+    shared_fin = std::make_unique<SharedIStream>(original_fin.get());
+    ctx.fin = std::make_unique<SharedIStreamView>(shared_fin.get(), fin_pos);
+
+    scout_thread = std::thread(&PrecompLookahead::scout, this);
+    for (unsigned int i = 0; i < thread_count; i++) {
+      worker_threads.emplace_back(&PrecompLookahead::worker, this);
     }
+  }
 
-    if (!compressed_data_found) {
-      if (!precomp_mgr.ctx->uncompressed_length.has_value()) {
-        precomp_mgr.ctx->uncompressed_length = 0;
-        precomp_mgr.ctx->uncompressed_pos = input_file_pos;
+  ~PrecompLookahead() {
+    {
+      std::unique_lock lock(mtx);
+      stopping = true;
+      cv.notify_all();
+    }
+    scout_thread.join();
+    for (auto& worker_thread : worker_threads) {
+      worker_thread.join();
+    }
+    ctx.fin = std::move(original_fin);
+  }
 
-        // uncompressed data
-        precomp_mgr.ctx->fout->put(0);
+  // Lets the scout move on and discards any speculation before input_file_pos, which compress_file_impl won't need anymore
+  void advance(long long input_file_pos) {
+    std::unique_lock lock(mtx);
+    current_pos = input_file_pos;
+    while (!jobs.empty() && jobs.front()->input_file_pos < current_pos) jobs.pop_front();
+    cv.notify_all();
+  }
+
+  // Gets the outcome of attempting precompression with the given handler at input_file_pos, waiting for it if it's being worked on.
+  // If nothing was speculated there, nothing is returned and compress_file_impl has to attempt the precompression by itself.
+  std::optional<Outcome> take(long long input_file_pos, size_t handler_index) {
+    if (input_file_pos >= scan_limit) return std::nullopt;
+    std::unique_lock lock(mtx);
+    current_pos = input_file_pos;
+    std::shared_ptr<Job> job;
+    while (true) {
+      // Jobs are queued in order, anything before the requested one is either behind us or for a handler that already got its chance here
+      while (!jobs.empty() && (jobs.front()->input_file_pos < input_file_pos || (jobs.front()->input_file_pos == input_file_pos && jobs.front()->handler_index < handler_index))) {
+        jobs.pop_front();
       }
-      (*precomp_mgr.ctx->uncompressed_length)++;
-      precomp_mgr.ctx->uncompressed_bytes_total++;
-      // If there is a maximum uncompressed_block_length we dump the current uncompressed data as a single block, this makes it so anything waiting on data from Precomp
-      // can get some data to possibly process earlier
-      if (precomp_mgr.switches.uncompressed_block_length != 0 && precomp_mgr.ctx->uncompressed_length >= precomp_mgr.switches.uncompressed_block_length) {
-        end_uncompressed_data(precomp_mgr);
+      if (!jobs.empty() && jobs.front()->input_file_pos == input_file_pos && jobs.front()->handler_index == handler_index) {
+        job = jobs.front();
+        jobs.pop_front();
+        break;
       }
+      if (scout_finished || scanned_until > input_file_pos) break;
+      // The scout might be waiting for jobs we just discarded to make room for new ones
+      cv.notify_all();
+      cv.wait(lock);
     }
+    cv.notify_all();
+    // If no worker got to it yet it's faster to just attempt it right away than waiting
+    if (!job || !job->started) return std::nullopt;
+    TraceSpan span("wait", "lookahead wait");
+    cv.wait(lock, [&]() { return job->done; });
+    return std::move(job->outcome);
   }
+};
 
-  end_uncompressed_data(precomp_mgr);
+// Precompression side of PCF_LAYOUT_DEDUP_RECORDS: numbers the streams written on the top level and remembers where the latest ones were on the input, so a stream
+// repeating one of them can be recognized by looking up its first bytes and comparing the input, instead of attempting precompression on it again.
+// Streams forgotten because of the window are still kept around (just not used anymore) so the state can be taken back to an earlier point with restore.
+class StreamDedupIndex {
+public:
+  struct State {
+    size_t stream_count = 0;
+    size_t first_remembered = 0;
+    long long remembered_size = 0;
+  };
+
+  struct Repeat {
+    long long distance;
+    long long length;
+  };
+
+private:
+  // Streams are looked up by a hash of this many bytes at their start
+  static constexpr long long KEY_SIZE = 64;
+
+  struct Stream {
+    long long input_pos;
+    long long length;
+    size_t key;
+  };
+
+  long long window_size;
+  std::vector<Stream> streams;
+  std::unordered_multimap<size_t, size_t> streams_by_key;
+  State state;
+
+  static size_t key(const unsigned char* first_bytes) {
+    return std::hash<std::string_view>()(std::string_view(reinterpret_cast<const char*>(first_bytes), KEY_SIZE));
+  }
 
-  precomp_mgr.ctx->fout = nullptr; // To close the outfile TODO: maybe we should just make sure the whole last context gets destroyed if at recursion_depth == 0?
+public:
+  explicit StreamDedupIndex(long long window_size_) : window_size(window_size_) {}
 
-  return (precomp_mgr.ctx->anything_was_used || precomp_mgr.ctx->non_zlib_was_used) ? RETURN_SUCCESS : RETURN_NOTHING_DECOMPRESSED;
-}
+  const State& get_state() const { return state; }
 
-int wrap_with_exception_catch(std::function<int()> func)
-{
-  // Didn't want to wrap those big functions on a try catch, and also didn't want to leak out our exceptions to the outside, because we want to mantain a C API
-  try
-  {
-    return func();
+  void restore(const State& earlier_state) {
+    while (streams.size() > earlier_state.stream_count) {
+      auto [it, end] = streams_by_key.equal_range(streams.back().key);
+      while (it->second != streams.size() - 1) ++it;
+      streams_by_key.erase(it);
+      streams.pop_back();
+    }
+    state = earlier_state;
   }
-  catch (const PrecompError& exc)
-  {
-    return exc.error_code;
+
+  // Numbers the stream at input_pos, remembering it if it's not too small or big, first_bytes has its data
+  void add(long long input_pos, long long length, const unsigned char* first_bytes) {
+    if (!dedup_window_remembers(length, window_size)) return;
+    streams.push_back({ input_pos, length, key(first_bytes) });
+    streams_by_key.emplace(streams.back().key, streams.size() - 1);
+    state.stream_count = streams.size();
+    state.remembered_size += length;
+    while (state.remembered_size > window_size) {
+      state.remembered_size -= streams[state.first_remembered].length;
+      state.first_remembered++;
+    }
   }
-  catch (const std::exception& exc)
-  {
-    return ERR_GENERIC_OR_UNKNOWN;
+
+  // Looks for a remembered stream the data at input_pos repeats, first_bytes has the data there. The newest one is preferred, so references stay short.
+  std::optional<Repeat> find_repeat(RecursionContext& ctx, std::span<const unsigned char> mapped_input, long long input_pos, const unsigned char* first_bytes) const {
+    if (input_pos + KEY_SIZE > static_cast<long long>(ctx.fin_length)) return std::nullopt;
+    std::vector<size_t> candidates;
+    auto [it, end] = streams_by_key.equal_range(key(first_bytes));
+    for (; it != end; ++it) {
+      const auto& stream = streams[it->second];
+      if (it->second >= state.first_remembered && input_pos + stream.length <= static_cast<long long>(ctx.fin_length)) candidates.push_back(it->second);
+    }
+    std::sort(candidates.rbegin(), candidates.rend());
+    for (const auto index : candidates) {
+      const auto& stream = streams[index];
+      if (input_ranges_equal(ctx, mapped_input, stream.input_pos, input_pos, stream.length)) return Repeat{ static_cast<long long>(streams.size() - index), stream.length };
+    }
+    return std::nullopt;
+  }
+
+private:
+  static bool input_ranges_equal(RecursionContext& ctx, std::span<const unsigned char> mapped_input, long long pos1, long long pos2, long long length) {
+    if (pos2 + length <= static_cast<long long>(mapped_input.size())) {
+      return std::memcmp(mapped_input.data() + pos1, mapped_input.data() + pos2, length) == 0;
+    }
+    std::vector<char> data1(std::min<long long>(CHUNK, length));
+    std::vector<char> data2(data1.size());
+    for (long long compared = 0; compared < length;) {
+      const long long chunk_size = std::min<long long>(data1.size(), length - compared);
+      ctx.fin->seekg(pos1 + compared, std::ios_base::beg);
+      ctx.fin->read(data1.data(), chunk_size);
+      if (ctx.fin->gcount() != chunk_size) return false;
+      ctx.fin->seekg(pos2 + compared, std::ios_base::beg);
+      ctx.fin->read(data2.data(), chunk_size);
+      if (ctx.fin->gcount() != chunk_size || std::memcmp(data1.data(), data2.data(), chunk_size) != 0) return false;
+      compared += chunk_size;
+    }
+    return true;
+  }
+};
+
+// Writes a D_REPEAT record for a stream at input_pos that repeats an earlier one, see PCF_LAYOUT_DEDUP_RECORDS
+void write_repeat_record(Precomp& precomp_mgr, const StreamDedupIndex::Repeat& repeat, long long input_pos) {
+  end_uncompressed_data(precomp_mgr);
+  const long long record_pcf_pos = precomp_mgr.ctx->written_records.has_value() ? static_cast<long long>(precomp_mgr.ctx->fout->tellp()) : 0;
+  precomp_mgr.ctx->fout->put(1);
+  precomp_mgr.ctx->fout->put(D_REPEAT);
+  fout_fput_vlint(*precomp_mgr.ctx->fout, repeat.distance);
+  if (precomp_mgr.ctx->written_records.has_value()) {
+    precomp_mgr.ctx->written_records->push_back({
+      input_pos, repeat.length, record_pcf_pos, static_cast<long long>(precomp_mgr.ctx->fout->tellp()) - record_pcf_pos, true, D_REPEAT, false
+    });
   }
+  precomp_mgr.statistics.repeated_streams_count++;
+  precomp_mgr.statistics.repeated_streams_size += repeat.length;
 }
 
-int compress_file(Precomp& precomp_mgr)
-{
-  return wrap_with_exception_catch([&]() { return compress_file_impl(precomp_mgr); });
+// Writes the record the base PCF has for the stream at input_pos, just as it is there
+void write_base_record(Precomp& precomp_mgr, const PcfRecordInfo& base_record, long long input_pos) {
+  end_uncompressed_data(precomp_mgr);
+  const long long record_pcf_pos = precomp_mgr.ctx->written_records.has_value() ? static_cast<long long>(precomp_mgr.ctx->fout->tellp()) : 0;
+  precomp_mgr.base_pcf->copy_record(base_record, *precomp_mgr.ctx->fout);
+  if (precomp_mgr.ctx->written_records.has_value()) {
+    auto record = base_record;
+    record.original_pos = input_pos;
+    record.pcf_pos = record_pcf_pos;
+    precomp_mgr.ctx->written_records->push_back(std::move(record));
+  }
+  precomp_mgr.ctx->non_zlib_was_used = true;
+  precomp_mgr.statistics.base_streams_count++;
+  precomp_mgr.statistics.base_streams_size += base_record.original_length;
 }
 
-class RecursionPasstroughStream : public PasstroughStream {
-  int recompression_code;
+// Asynchronous verification: instead of waiting for an accepted stream to be verified, compress_file_impl hands it to a verifier thread and goes on scanning past it
+// as if verification succeeded, buffering everything it outputs meanwhile. Once verification succeeds the stream and the buffered output are written for real, if it fails
+// the buffered output is discarded and compress_file_impl is taken back to the stream's position, to go on exactly as if the stream had been rejected right away.
+// Only one stream is verified at a time, if another one needs verification while the previous one is still pending, compress_file_impl waits for it.
+class PrecompAsyncVerifier {
 public:
-  std::unique_ptr<RecursionContext> ctx;
+  // Where compress_file_impl has to go back to after a stream failed verification, and the first handler to try there
+  struct Rewind {
+    long long input_file_pos;
+    size_t handler_index;
+  };
+
+private:
+  struct Speculation {
+    const PrecompFormatHandler* format_handler;
+    long long input_file_pos;
+    size_t handler_index;
+    std::unique_ptr<precompression_result> result;
+
+    // compress_file_impl state right after the stream was precompressed, to go back to if verification fails
+    ResultStatistics statistics;
+    bool anything_was_used;
+    bool non_zlib_was_used;
+    std::unordered_map<SupportedFormats, OffsetCursorSet> ignore_offsets;
+    long long uncompressed_pos;
+    std::optional<long long> uncompressed_length;
+    std::vector<unsigned char> uncompressed_data;
+    long long uncompressed_bytes_total;
+    size_t written_records_count;
+    StreamDedupIndex::State dedup_state;
+    long long base_pcf_shift = 0;
+
+    // The actual output, while the verification is pending everything is written to output_buffer instead
+    std::unique_ptr<ObservableOStream> fout;
+    std::unique_ptr<SpillingOStream> output_buffer;
+
+    // Set by the verifier thread
+    std::atomic<bool> done = false;
+    bool verification_success = false;
+    ResultStatistics verification_statistics;
+  };
+
+  // Past this much buffered output compress_file_impl waits for the verification instead of going on
+  static constexpr long long MAX_BUFFERED_OUTPUT = 64 * 1024 * 1024;
+
+  Precomp& precomp_mgr;
+  RecursionContext& ctx;
+  StreamDedupIndex* dedup_index;
+  PrecompBasePcf* base_pcf;
+  // Buffered output past switches.reorder_window goes to a temporary file
+  SpillBudget output_buffer_budget;
+  std::unique_ptr<IStreamLike> original_fin;
+  std::unique_ptr<SharedIStream> shared_fin;
+  std::unique_ptr<Precomp> verifier_mgr;
+
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::unique_ptr<Speculation> pending;
+  bool job_queued = false;
+  bool stopping = false;
+  std::thread verifier_thread;
+
+  void verifier() {
+    while (true) {
+      Speculation* job;
+      {
+        std::unique_lock lock(mtx);
+        cv.wait(lock, [this]() { return stopping || job_queued; });
+        if (stopping) return;
+        job_queued = false;
+        job = pending.get();
+      }
 
-  RecursionPasstroughStream(std::unique_ptr<RecursionContext>&& ctx_);
-  ~RecursionPasstroughStream() override {}
+      verifier_mgr->statistics = ResultStatistics();
+      verifier_mgr->ctx->input_file_pos = job->input_file_pos;
+      long long input_file_pos = job->input_file_pos;
+      const bool verification_success = verify_precompressed_result(*verifier_mgr, job->result, input_file_pos);
 
-  int get_recursion_return_code(bool throw_on_failure = true);
-};
-std::unique_ptr<RecursionPasstroughStream> recursion_decompress(RecursionContext& context, long long recursion_data_length);
+      std::unique_lock lock(mtx);
+      job->verification_success = verification_success;
+      job->verification_statistics = verifier_mgr->statistics;
+      job->done = true;
+      cv.notify_all();
+    }
+  }
 
-class PenaltyBytesPatchedOStream : public OStreamLike {
-  OStreamLike* ostream = nullptr;
-  uint64_t next_pos = 0;
-  std::queue<std::tuple<uint32_t, unsigned char>>* penalty_bytes = nullptr;
 public:
-  PenaltyBytesPatchedOStream(OStreamLike* _ostream, std::queue<std::tuple<uint32_t, unsigned char>>* _penalty_bytes) : ostream(_ostream), penalty_bytes(_penalty_bytes) {}
+  PrecompAsyncVerifier(Precomp& precomp_mgr_, StreamDedupIndex* dedup_index_, PrecompBasePcf* base_pcf_)
+    : precomp_mgr(precomp_mgr_), ctx(*precomp_mgr_.ctx), dedup_index(dedup_index_), base_pcf(base_pcf_),
+      output_buffer_budget(static_cast<long long>(std::min<uintmax_t>(precomp_mgr_.switches.reorder_window, std::numeric_limits<long long>::max()))) {
+    // From now on the input is read from through SharedIStreamViews, both here and on the verifier thread, until we give the original input stream back
+    const auto fin_pos = ctx.fin->tellg();
+    original_fin = std::move(ctx.fin);
+    shared_fin = std::make_unique<SharedIStream>(original_fin.get());
+    ctx.fin = std::make_unique<SharedIStreamView>(shared_fin.get(), fin_pos);
+
+    verifier_mgr = clone_precomp_settings(precomp_mgr);
+    verifier_mgr->ctx->fin = std::make_unique<SharedIStreamView>(shared_fin.get());
+    verifier_mgr->ctx->fin_length = ctx.fin_length;
+    verifier_thread = std::thread(&PrecompAsyncVerifier::verifier, this);
+  }
 
-  PenaltyBytesPatchedOStream& write(const char* buf, std::streamsize count) override {
-    auto chunk_last_post = next_pos + count - 1;
-    // If no penalty_bytes at all, or left, or any that apply to the data about to be written, just use the original ostream, unpatched
+  ~PrecompAsyncVerifier() {
+    {
+      std::unique_lock lock(mtx);
+      stopping = true;
+      cv.notify_all();
+    }
+    verifier_thread.join();
+    if (pending) ctx.fout = std::move(pending->fout);
+    ctx.fin = std::move(original_fin);
+  }
+
+  bool has_pending() const { return pending != nullptr; }
+
+  // Whether compress_file_impl should finish the pending verification right away, because it's already done or too much output is being held back by it
+  bool should_finish() const {
+    return pending && (pending->done || static_cast<long long>(pending->output_buffer->tellp()) > MAX_BUFFERED_OUTPUT);
+  }
+
+  // Starts verifying a stream compress_file_impl just precompressed with the handler_index-th format handler, which from now on goes on as if it was accepted
+  void start(const PrecompFormatHandler& format_handler, long long input_file_pos, size_t handler_index, std::unique_ptr<precompression_result>&& result) {
+    auto speculation = std::make_unique<Speculation>();
+    speculation->format_handler = &format_handler;
+    speculation->input_file_pos = input_file_pos;
+    speculation->handler_index = handler_index;
+    speculation->result = std::move(result);
+
+    speculation->statistics = precomp_mgr.statistics;
+    speculation->anything_was_used = ctx.anything_was_used;
+    speculation->non_zlib_was_used = ctx.non_zlib_was_used;
+    // Only what's from the stream on is needed to go back to it, what's before it was already consumed
+    for (const auto& [format, offsets] : ctx.ignore_offsets) speculation->ignore_offsets[format] = offsets.tail(input_file_pos);
+    speculation->uncompressed_pos = ctx.uncompressed_pos;
+    speculation->uncompressed_length = ctx.uncompressed_length;
+    speculation->uncompressed_data = std::move(ctx.uncompressed_data);
+    ctx.uncompressed_data.clear();
+    speculation->uncompressed_bytes_total = ctx.uncompressed_bytes_total;
+    speculation->written_records_count = ctx.written_records.has_value() ? ctx.written_records->size() : 0;
+    if (dedup_index) speculation->dedup_state = dedup_index->get_state();
+    if (base_pcf) speculation->base_pcf_shift = base_pcf->get_shift();
+
+    speculation->fout = std::move(ctx.fout);
+    speculation->output_buffer = std::make_unique<SpillingOStream>(output_buffer_budget, precomp_mgr.get_tempfile_name("verification_output_buffer"));
+    ctx.fout = std::make_unique<ObservableOStreamWrapper>(speculation->output_buffer.get(), false);
+    // The uncompressed data pending before the stream is written along with it, anything after the stream starts a new block on the buffer
+    ctx.uncompressed_length = std::nullopt;
+
+    std::unique_lock lock(mtx);
+    pending = std::move(speculation);
+    job_queued = true;
+    cv.notify_all();
+  }
+
+  // Waits for the pending verification. If it succeeded the stream and everything after it is written to the actual output, if it failed everything is undone
+  // and where compress_file_impl needs to go back to is returned.
+  std::optional<Rewind> finish() {
+    std::unique_ptr<Speculation> speculation;
+    {
+      TraceSpan span("wait", "verification wait");
+      std::unique_lock lock(mtx);
+      cv.wait(lock, [this]() { return pending->done.load(); });
+      speculation = std::move(pending);
+    }
+    ctx.fout = std::move(speculation->fout);
+
+    if (!speculation->verification_success) {
+      precomp_mgr.statistics = speculation->statistics;
+      precomp_mgr.statistics.add_stream_counts(speculation->verification_statistics);
+      ctx.anything_was_used = speculation->anything_was_used;
+      ctx.non_zlib_was_used = speculation->non_zlib_was_used;
+      // Restored entry by entry, as compress_file_impl keeps pointers to them
+      for (auto& [format, offsets] : ctx.ignore_offsets) offsets = OffsetCursorSet();
+      for (auto& [format, offsets] : speculation->ignore_offsets) ctx.ignore_offsets[format] = std::move(offsets);
+      ctx.uncompressed_pos = speculation->uncompressed_pos;
+      ctx.uncompressed_length = speculation->uncompressed_length;
+      ctx.uncompressed_data = std::move(speculation->uncompressed_data);
+      ctx.uncompressed_bytes_total = speculation->uncompressed_bytes_total;
+      if (ctx.written_records.has_value()) ctx.written_records->resize(speculation->written_records_count);
+      if (dedup_index) dedup_index->restore(speculation->dedup_state);
+      if (base_pcf) base_pcf->restore_shift(speculation->base_pcf_shift);
+      return Rewind{ speculation->input_file_pos, speculation->handler_index + 1 };
+    }
+    precomp_mgr.statistics.add_stream_counts(speculation->verification_statistics);
+
+    // Records logged meanwhile have positions relative to the start of the buffer, they are added back once we know where the buffer ends up
+    std::vector<PcfRecordInfo> buffered_records;
+    if (ctx.written_records.has_value()) {
+      buffered_records.assign(ctx.written_records->begin() + speculation->written_records_count, ctx.written_records->end());
+      ctx.written_records->resize(speculation->written_records_count);
+    }
+    const long long buffered_uncompressed_pos = ctx.uncompressed_pos;
+    const auto buffered_uncompressed_length = ctx.uncompressed_length;
+    auto buffered_uncompressed_data = std::move(ctx.uncompressed_data);
+    ctx.uncompressed_pos = speculation->uncompressed_pos;
+    ctx.uncompressed_length = speculation->uncompressed_length;
+    ctx.uncompressed_data = std::move(speculation->uncompressed_data);
+    // Recursion gets its progress range from the context position, so for that matter we are back at the stream
+    const long long current_input_file_pos = ctx.input_file_pos;
+    ctx.input_file_pos = speculation->input_file_pos;
+
+    speculation->result->precompressed_stream->seekg(0, std::ios_base::beg);
+    write_precompressed_record(precomp_mgr, *speculation->format_handler, speculation->result, speculation->input_file_pos);
+
+    ctx.input_file_pos = current_input_file_pos;
+    ctx.uncompressed_pos = buffered_uncompressed_pos;
+    ctx.uncompressed_length = buffered_uncompressed_length;
+    ctx.uncompressed_data = std::move(buffered_uncompressed_data);
+
+    const long long output_buffer_size = speculation->output_buffer->tellp();
+    if (ctx.written_records.has_value()) {
+      const long long buffer_pcf_pos = ctx.fout->tellp();
+      for (auto& record : buffered_records) {
+        record.pcf_pos += buffer_pcf_pos;
+        ctx.written_records->push_back(record);
+      }
+    }
+    fast_copy(speculation->output_buffer->input(), *ctx.fout, output_buffer_size);
+    return std::nullopt;
+  }
+};
+
+// Reads the input ahead on a background thread for compress_file_impl's buffer refills, while the format handlers keep reading it as usual through a SharedIStreamView
+class PrecompReadAhead {
+  RecursionContext& ctx;
+  std::unique_ptr<IStreamLike> original_fin;
+  std::unique_ptr<SharedIStream> shared_fin;
+
+public:
+  std::unique_ptr<ReadAheadIStream> scan_fin;
+
+  explicit PrecompReadAhead(Precomp& precomp_mgr) : ctx(*precomp_mgr.ctx) {
+    const auto fin_pos = ctx.fin->tellg();
+    original_fin = std::move(ctx.fin);
+    shared_fin = std::make_unique<SharedIStream>(original_fin.get());
+    ctx.fin = std::make_unique<SharedIStreamView>(shared_fin.get(), fin_pos);
+    scan_fin = std::make_unique<ReadAheadIStream>(
+      std::make_unique<SharedIStreamView>(shared_fin.get()), precomp_mgr.switches.readahead_buffer_size, precomp_mgr.switches.readahead_buffer_count);
+  }
+
+  ~PrecompReadAhead() {
+    scan_fin = nullptr;
+    ctx.fin = std::move(original_fin);
+  }
+};
+
+int compress_file_impl(Precomp& precomp_mgr) {
+  precomp_mgr.ctx->comp_decomp_state = P_PRECOMPRESS;
+  if (precomp_mgr.recursion_depth == 0 && precomp_mgr.switches.write_index && !precomp_mgr.ctx->written_records.has_value()) {
+    precomp_mgr.ctx->written_records.emplace();
+  }
+
+  const auto& format_handlers = precomp_mgr.get_format_handlers();
+  precomp_mgr.ctx->uncompressed_bytes_total = 0;
+
+  // If the input is memory mapped the buffer is just a window into the mapped data, only positions too close to its end to have a full buffer are read into in_buf.
+  // There the data on in_buf after the end of the input is left as it was, as it is with regular streams, because handlers might look at it.
+  const auto mapped_input = precomp_mgr.ctx->fin->mapped_data();
+  // Otherwise, on the top level the buffer refills are read ahead, so we don't have to wait for them while the input is slow to read
+  std::unique_ptr<PrecompReadAhead> read_ahead;
+  if (precomp_mgr.recursion_depth == 0 && mapped_input.empty() && precomp_mgr.switches.readahead_buffer_count > 0) {
+    read_ahead = std::make_unique<PrecompReadAhead>(precomp_mgr);
+  }
+  const unsigned char* in_buf_data = precomp_mgr.ctx->in_buf;
+  long long in_buf_pos = 0;
+  const auto fill_in_buf = [&](long long pos) {
+    in_buf_pos = pos;
+    if (pos + IN_BUF_SIZE <= static_cast<long long>(mapped_input.size())) {
+      in_buf_data = mapped_input.data() + pos;
+      return;
+    }
+    if (in_buf_data != precomp_mgr.ctx->in_buf) {
+      std::memcpy(precomp_mgr.ctx->in_buf, in_buf_data, IN_BUF_SIZE);
+      in_buf_data = precomp_mgr.ctx->in_buf;
+    }
+    auto& scan_fin = read_ahead ? *read_ahead->scan_fin : *precomp_mgr.ctx->fin;
+    scan_fin.seekg(pos, std::ios_base::beg);
+    scan_fin.read(reinterpret_cast<char*>(precomp_mgr.ctx->in_buf), IN_BUF_SIZE);
+  };
+  fill_in_buf(0);
+  // This buffer will be fed to the format handlers so they can confirm if the current position is the beggining of a stream they support
+  std::span<unsigned char> checkbuf;
+
+  precomp_mgr.ctx->anything_was_used = false;
+  precomp_mgr.ctx->non_zlib_was_used = false;
+
+  const auto candidate_prefilter = build_candidate_prefilter(precomp_mgr);
+
+  // Lookahead is only used on the top level, recursion is done while the lookahead threads keep working on it. It also depends on the candidate prefilter,
+  // as without it (intense/brute mode) there are just way too many candidate positions and handlers can have state from one position to the next.
+  std::unique_ptr<PrecompLookahead> lookahead;
+  if (precomp_mgr.recursion_depth == 0 && precomp_mgr.switches.thread_count != 1 && candidate_prefilter.has_value()) {
+    const unsigned int thread_count = precomp_mgr.switches.resolved_thread_count();
+    lookahead = std::make_unique<PrecompLookahead>(precomp_mgr, *candidate_prefilter, thread_count);
+  }
+  // Repeated streams are only looked for on the top level, see PCF_LAYOUT_DEDUP_RECORDS
+  std::unique_ptr<StreamDedupIndex> dedup_index;
+  if (precomp_mgr.recursion_depth == 0 && precomp_mgr.switches.dedup_window != 0 && precomp_mgr.switches.segment_size == 0) {
+    dedup_index = std::make_unique<StreamDedupIndex>(static_cast<long long>(std::min<uintmax_t>(precomp_mgr.switches.dedup_window, std::numeric_limits<long long>::max())));
+  }
+  // The base PCF's records are for streams on the top level input, and only fit in PCFs made with the same switches
+  PrecompBasePcf* base_pcf = precomp_mgr.recursion_depth == 0 ? precomp_mgr.base_pcf.get() : nullptr;
+  if (base_pcf && base_pcf->get_record_settings() != pcf_record_settings(precomp_mgr)) {
+    print_to_log(PRECOMP_NORMAL_LOG, "Base PCF was made with different switches, none of its streams will be copied\n");
+    base_pcf = nullptr;
+  }
+  // Streams found here are verified on another thread while we go on, also only on the top level, so there is a single place to go back to if verification fails
+  std::unique_ptr<PrecompAsyncVerifier> async_verifier;
+  if (precomp_mgr.recursion_depth == 0 && precomp_mgr.switches.thread_count != 1 && precomp_mgr.switches.verify_precompressed) {
+    async_verifier = std::make_unique<PrecompAsyncVerifier>(precomp_mgr, dedup_index.get(), base_pcf);
+  }
+
+  OffsetCursorSet ignore_positions(precomp_mgr.switches.ignore_set);
+  // Each handler's blacklisted positions, the map entries are created right away so they stay put even if handlers add more formats to it later on
+  std::vector<OffsetCursorSet*> handler_ignore_offsets;
+  std::vector<FormatProfile*> handler_profiles;
+  for (const auto& formatHandler : format_handlers) {
+    handler_ignore_offsets.push_back(&precomp_mgr.ctx->ignore_offsets[formatHandler->get_header_bytes()[0]]);
+    handler_profiles.push_back(&precomp_mgr.get_format_profile(formatHandler->get_header_bytes()[0]));
+  }
+
+  long long input_file_pos = 0;
+  // After a stream fails asynchronous verification we get back to its position, only trying the handlers after the one that precompressed it
+  size_t first_handler_index = 0;
+  const auto rewind = [&](const PrecompAsyncVerifier::Rewind& rewind_to) {
+    input_file_pos = rewind_to.input_file_pos;
+    first_handler_index = rewind_to.handler_index;
+    fill_in_buf(input_file_pos);
+    if (lookahead) lookahead->advance(input_file_pos);
+  };
+
+  for (;; input_file_pos++) {
+    // The pending verification also needs to be finished before we are done, as we might have to go back
+    const bool input_end = input_file_pos >= precomp_mgr.ctx->fin_length;
+    if (async_verifier && (async_verifier->should_finish() || (input_end && async_verifier->has_pending()))) {
+      const auto rewind_to = async_verifier->finish();
+      if (rewind_to.has_value()) rewind(*rewind_to);
+    }
+    if (input_file_pos >= precomp_mgr.ctx->fin_length) break;
+    precomp_mgr.ctx->input_file_pos = input_file_pos;
+    bool compressed_data_found = false;
+
+    bool ignore_this_pos = false;
+
+    if ((in_buf_pos + IN_BUF_SIZE) <= (input_file_pos + CHECKBUF_SIZE)) {
+      fill_in_buf(input_file_pos);
+      if (lookahead) lookahead->advance(input_file_pos);
+    }
+    auto cb_pos = input_file_pos - in_buf_pos;
+    // Handlers only read from it, the span is not const just because of their signatures
+    checkbuf = std::span(const_cast<unsigned char*>(in_buf_data) + cb_pos, IN_BUF_SIZE - cb_pos);
+
+    // Jump straight to the next position where any format handler could match, accounting all the bytes in between as uncompressed data at once
+    if (candidate_prefilter.has_value()) {
+      const long long scan_end = std::min<long long>(in_buf_pos + IN_BUF_SIZE - CHECKBUF_SIZE, precomp_mgr.ctx->fin_length);
+      const long long skip_length = skip_to_next_candidate(*candidate_prefilter, checkbuf.data(), scan_end - input_file_pos);
+      if (skip_length > 0) {
+        input_file_pos += add_uncompressed_data(precomp_mgr, input_file_pos, checkbuf.data(), skip_length) - 1;
+        continue;
+      }
+    }
+
+    ignore_this_pos = ignore_positions.contains(input_file_pos);
+
+    bool rewound = false;
+    bool repeat_checked = false;
+    bool base_checked = false;
+    if (!ignore_this_pos) {
+      for (size_t handler_index = std::exchange(first_handler_index, 0); handler_index < format_handlers.size(); handler_index++) {
+        const auto& formatHandler = format_handlers[handler_index];
+        // Recursion depth check
+        if (formatHandler->depth_limit && precomp_mgr.recursion_depth > formatHandler->depth_limit) continue;
+
+        // Position blacklist check
+        if (handler_ignore_offsets[handler_index]->consume(input_file_pos)) continue;
+
+        bool quick_check_result = false;
+        try {
+          quick_check_result = formatHandler->quick_check(checkbuf, reinterpret_cast<uintptr_t>(precomp_mgr.ctx->fin.get()), input_file_pos);
+        }
+        catch (...) {}  // TODO: print/record/report handler failed
+        if (!quick_check_result) continue;
+        handler_profiles[handler_index]->quick_check_hits++;
+
+        // A stream we already wrote might be repeated here, which if so we can just reference without any handler having to look at it
+        if (dedup_index && !std::exchange(repeat_checked, true)) {
+          const auto repeat = dedup_index->find_repeat(*precomp_mgr.ctx, mapped_input, input_file_pos, checkbuf.data());
+          if (repeat.has_value()) {
+            write_repeat_record(precomp_mgr, *repeat, input_file_pos);
+            dedup_index->add(input_file_pos, repeat->length, checkbuf.data());
+            input_file_pos += repeat->length - 1;
+            compressed_data_found = true;
+            break;
+          }
+        }
+        // Otherwise the base PCF might have it, if it didn't change since, in which case its record is copied without any handler having to look at it either
+        if (base_pcf && !std::exchange(base_checked, true)) {
+          const auto base_record = base_pcf->find(*precomp_mgr.ctx->fin, input_file_pos, precomp_mgr.ctx->fin_length - input_file_pos);
+          if (base_record != nullptr) {
+            write_base_record(precomp_mgr, *base_record, input_file_pos);
+            if (dedup_index) dedup_index->add(input_file_pos, base_record->original_length, checkbuf.data());
+            input_file_pos += base_record->original_length - 1;
+            compressed_data_found = true;
+            break;
+          }
+        }
+
+        std::unique_ptr<precompression_result> result {};
+        // If a lookahead worker already attempted precompression here (and verification if enabled), just use that as if we had just done it ourselves
+        auto speculative_outcome = lookahead ? lookahead->take(input_file_pos, handler_index) : std::nullopt;
+        if (speculative_outcome.has_value()) {
+          precomp_mgr.statistics.add_stream_counts(speculative_outcome->statistics);
+          if (speculative_outcome->non_zlib_was_used) precomp_mgr.ctx->non_zlib_was_used = true;
+          result = std::move(speculative_outcome->result);
+          if (!result) continue;
+        }
+        else {
+          result = attempt_stream_precompression(precomp_mgr, *formatHandler, checkbuf, input_file_pos);
+          if (!result) continue;
+
+          // If verification is enabled, we attempt to recompress the stream right now, and reject it if anything fails or data doesn't match
+          // Note that this is done before recursion for 2 reasons:
+          //  1) why bother recursing a stream we might reject
+          //  2) verification would be much more complicated as we would need to prevent recursing on recompression which would lead to verifying some streams MANY times
+          if (precomp_mgr.switches.verify_precompressed && async_verifier) {
+            if (async_verifier->has_pending()) {
+              const auto rewind_to = async_verifier->finish();
+              if (rewind_to.has_value()) {
+                rewind(*rewind_to);
+                rewound = true;
+                break;
+              }
+            }
+            const long long stream_size = result->complete_original_size();
+            async_verifier->start(*formatHandler, input_file_pos, handler_index, std::move(result));
+            if (dedup_index) dedup_index->add(input_file_pos, stream_size, checkbuf.data());
+            input_file_pos += stream_size - 1;
+            compressed_data_found = true;
+            break;
+          }
+          if (precomp_mgr.switches.verify_precompressed) {
+            const bool verification_success = verify_precompressed_result(precomp_mgr, result, input_file_pos);
+            if (!verification_success) continue;
+            // ensure that the precompressed stream is ready to read from the start, as if verification never happened
+            result->precompressed_stream->seekg(0, std::ios_base::beg);
+          }
+        }
+
+        if (dedup_index) dedup_index->add(input_file_pos, result->complete_original_size(), checkbuf.data());
+        write_precompressed_record(precomp_mgr, *formatHandler, result, input_file_pos);
+
+        // start new uncompressed data
+
+        // set input file pointer after recompressed data
+        input_file_pos += result->complete_original_size() - 1;
+        compressed_data_found = result->success;
+        break;
+      }
+    }
+
+    if (rewound) {
+      // Start over at the position we went back to
+      input_file_pos--;
+      continue;
+    }
+    if (!compressed_data_found) {
+      add_uncompressed_data(precomp_mgr, input_file_pos, checkbuf.data(), 1);
+    }
+  }
+
+  async_verifier = nullptr;
+  lookahead = nullptr;
+  read_ahead = nullptr;
+  end_uncompressed_data(precomp_mgr);
+
+  if (precomp_mgr.recursion_depth == 0 && precomp_mgr.switches.write_index) {
+    // Uncompressed data of length 0 ends the records, so the index isn't taken as more of them
+    precomp_mgr.ctx->fout->put(0);
+    fout_fput_vlint(*precomp_mgr.ctx->fout, 0);
+    write_pcf_index(*precomp_mgr.ctx->fout, pcf_record_settings(precomp_mgr), *precomp_mgr.ctx->written_records, *precomp_mgr.ctx->fin);
+  }
+
+  precomp_mgr.ctx->fout = nullptr; // To close the outfile TODO: maybe we should just make sure the whole last context gets destroyed if at recursion_depth == 0?
+
+  return (precomp_mgr.ctx->anything_was_used || precomp_mgr.ctx->non_zlib_was_used) ? RETURN_SUCCESS : RETURN_NOTHING_DECOMPRESSED;
+}
+
+int wrap_with_exception_catch(std::function<int()> func)
+{
+  // Didn't want to wrap those big functions on a try catch, and also didn't want to leak out our exceptions to the outside, because we want to mantain a C API
+  try
+  {
+    return func();
+  }
+  catch (const PrecompError& exc)
+  {
+    return exc.error_code;
+  }
+  catch (const std::exception& exc)
+  {
+    return ERR_GENERIC_OR_UNKNOWN;
+  }
+}
+
+int compress_file(Precomp& precomp_mgr)
+{
+  return wrap_with_exception_catch([&]() { return compress_file_impl(precomp_mgr); });
+}
+
+// Rough single thread throughput of each format handler's precompression and of its verification, in MiB/s of the larger of a stream's original and precompressed sizes,
+// as measured with precomp_bench. They are only meant to tell apart a run that takes minutes from one that takes hours, not to be precise.
+struct AnalysisThroughput {
+  double precompress_mib_per_s;
+  double verify_mib_per_s;
+};
+
+AnalysisThroughput analysis_throughput(SupportedFormats format) {
+  switch (format) {
+  case D_JPG: return { 6.4, 13 };
+  case D_MP3: return { 15, 15.5 };
+  case D_GIF: return { 12.5, 18.5 };
+  case D_BZIP2: return { 9.5, 10.5 };
+  case D_BASE64: return { 12.5, 130 };
+  default: return { 4.5, 16 };  // everything deflate based, where preflate does most of the work
+  }
+}
+
+long long estimate_stream_time_us(const Precomp& precomp_mgr, SupportedFormats format, long long original_size, long long precompressed_size) {
+  const auto throughput = analysis_throughput(format);
+  const double mib = static_cast<double>(std::max(original_size, precompressed_size)) / (1024 * 1024);
+  double seconds = mib / throughput.precompress_mib_per_s;
+  if (precomp_mgr.switches.verify_precompressed) seconds += mib / throughput.verify_mib_per_s;
+  return static_cast<long long>(seconds * 1000000);
+}
+
+// Dry run of compress_file_impl: the same scan and quick checks, but handlers see the P_ANALYZE state and skip the expensive part of precompression
+// (preflate, packJPG...), just confirming the stream and giving its size. Nothing is written, and there is no recursion, lookahead or verification.
+int analyze_file_impl(Precomp& precomp_mgr) {
+  auto& ctx = *precomp_mgr.ctx;
+  ctx.comp_decomp_state = P_ANALYZE;
+  precomp_mgr.analysis = {};
+  const auto start_time = std::chrono::steady_clock::now();
+  std::chrono::steady_clock::duration stream_time {};
+
+  const auto& format_handlers = precomp_mgr.get_format_handlers();
+  const auto mapped_input = ctx.fin->mapped_data();
+  const unsigned char* in_buf_data = ctx.in_buf;
+  long long in_buf_pos = 0;
+  const auto fill_in_buf = [&](long long pos) {
+    in_buf_pos = pos;
+    if (pos + IN_BUF_SIZE <= static_cast<long long>(mapped_input.size())) {
+      in_buf_data = mapped_input.data() + pos;
+      return;
+    }
+    if (in_buf_data != ctx.in_buf) {
+      std::memcpy(ctx.in_buf, in_buf_data, IN_BUF_SIZE);
+      in_buf_data = ctx.in_buf;
+    }
+    ctx.fin->seekg(pos, std::ios_base::beg);
+    ctx.fin->read(reinterpret_cast<char*>(ctx.in_buf), IN_BUF_SIZE);
+  };
+  fill_in_buf(0);
+
+  const auto candidate_prefilter = build_candidate_prefilter(precomp_mgr);
+  OffsetCursorSet ignore_positions(precomp_mgr.switches.ignore_set);
+  std::vector<OffsetCursorSet*> handler_ignore_offsets;
+  for (const auto& formatHandler : format_handlers) {
+    handler_ignore_offsets.push_back(&ctx.ignore_offsets[formatHandler->get_header_bytes()[0]]);
+  }
+
+  const long long fin_length = static_cast<long long>(ctx.fin_length);
+  for (long long input_file_pos = 0; input_file_pos < fin_length; input_file_pos++) {
+    ctx.input_file_pos = input_file_pos;
+    if ((in_buf_pos + IN_BUF_SIZE) <= (input_file_pos + CHECKBUF_SIZE)) {
+      fill_in_buf(input_file_pos);
+      precomp_mgr.call_progress_callback();
+    }
+    auto cb_pos = input_file_pos - in_buf_pos;
+    const auto checkbuf = std::span(const_cast<unsigned char*>(in_buf_data) + cb_pos, IN_BUF_SIZE - cb_pos);
+
+    if (candidate_prefilter.has_value()) {
+      const long long scan_end = std::min<long long>(in_buf_pos + IN_BUF_SIZE - CHECKBUF_SIZE, fin_length);
+      const long long skip_length = skip_to_next_candidate(*candidate_prefilter, checkbuf.data(), scan_end - input_file_pos);
+      if (skip_length > 0) {
+        input_file_pos += skip_length - 1;
+        continue;
+      }
+    }
+    if (ignore_positions.contains(input_file_pos)) continue;
+
+    for (size_t handler_index = 0; handler_index < format_handlers.size(); handler_index++) {
+      const auto& formatHandler = format_handlers[handler_index];
+      if (handler_ignore_offsets[handler_index]->consume(input_file_pos)) continue;
+
+      bool quick_check_result = false;
+      try {
+        quick_check_result = formatHandler->quick_check(checkbuf, reinterpret_cast<uintptr_t>(ctx.fin.get()), input_file_pos);
+      }
+      catch (...) {}
+      if (!quick_check_result) continue;
+      const auto format = formatHandler->get_header_bytes()[0];
+      auto& format_analysis = precomp_mgr.analysis[format];
+      format_analysis.candidates++;
+      precomp_mgr.get_format_profile(format).quick_check_hits++;
+
+      // Failed attempts cost about as much on a real run, as it gives up on them just as early, so only the time spent on streams is left out of the scan time
+      const auto stream_start_time = std::chrono::steady_clock::now();
+      const auto result = attempt_stream_precompression(precomp_mgr, *formatHandler, checkbuf, input_file_pos);
+      if (!result) continue;
+      stream_time += std::chrono::steady_clock::now() - stream_start_time;
+
+      const long long original_size = result->complete_original_size();
+      const long long stream_time_us = estimate_stream_time_us(precomp_mgr, format, original_size, result->precompressed_size);
+      format_analysis.streams++;
+      format_analysis.original_bytes += original_size;
+      format_analysis.estimated_precompressed_bytes += result->precompressed_size;
+      format_analysis.estimated_time_us += stream_time_us;
+      format_analysis.largest_stream_time_us = std::max<uintmax_t>(format_analysis.largest_stream_time_us, stream_time_us);
+
+      input_file_pos += original_size - 1;
+      break;
+    }
+  }
+
+  precomp_mgr.analysis_scan_time_us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_time - stream_time).count();
+  return RETURN_SUCCESS;
+}
+
+int vlint_size(unsigned long long v) {
+  int size = 1;
+  while (v >= 128) {
+    v = (v >> 7) - 1;
+    size++;
+  }
+  return size;
+}
+
+struct PrecompressedSegment {
+  long long start_pos;
+  // Where the last record of the segment ends, which is past the segment's nominal end if a stream crossed it
+  long long end_pos;
+  std::vector<PcfRecordInfo> records;
+  std::unique_ptr<PrecompTmpFile> records_data;
+  long long records_data_size;
+  ResultStatistics statistics;
+  bool anything_was_used;
+  bool non_zlib_was_used;
+};
+
+// Precompresses the segment_length bytes of the input starting at start_pos on its own Precomp instance, as if they were a whole file without a PCF header.
+// Everything after the segment is still visible to the format handlers, so streams starting in the segment are precompressed in full even if they cross its end.
+PrecompressedSegment precompress_segment(const Precomp& precomp_mgr, SharedIStream& shared_fin, long long start_pos, long long segment_length, long long fin_length) {
+  PrecompressedSegment segment;
+  segment.start_pos = start_pos;
+  SharedIStreamView segment_fin(&shared_fin, start_pos);
+
+  auto segment_mgr = clone_precomp_settings(precomp_mgr);
+  // The segments are already running in parallel, lookahead threads on top of that would just fight for the same cores
+  segment_mgr->switches.thread_count = 1;
+  segment_mgr->switches.segment_size = 0;
+  segment_mgr->switches.write_index = false;
+  segment_mgr->switches.dedup_window = 0;
+  for (auto it = precomp_mgr.switches.ignore_set.lower_bound(start_pos); it != precomp_mgr.switches.ignore_set.end() && *it < start_pos + segment_length; ++it) {
+    segment_mgr->switches.ignore_set.insert(*it - start_pos);
+  }
+
+  segment_mgr->ctx->fin = std::make_unique<IStreamLikeView>(&segment_fin, fin_length);
+  segment_mgr->ctx->fin_length = segment_length;
+  segment.records_data = std::make_unique<PrecompTmpFile>();
+  const auto records_data_filename = segment_mgr->get_tempfile_name("segment");
+  segment.records_data->open(records_data_filename, std::ios_base::in | std::ios_base::out | std::ios_base::app | std::ios_base::binary);
+  segment_mgr->ctx->fout = std::make_unique<ObservableOStreamWrapper>(segment.records_data.get(), false);
+  segment_mgr->ctx->written_records.emplace();
+
+  const auto ret_code = compress_file(*segment_mgr);
+  if (ret_code != RETURN_SUCCESS && ret_code != RETURN_NOTHING_DECOMPRESSED) throw PrecompError(ret_code);
+
+  segment.records = std::move(*segment_mgr->ctx->written_records);
+  segment.end_pos = segment.records.empty() ? start_pos : start_pos + segment.records.back().original_pos + segment.records.back().original_length;
+  segment.records_data->close();
+  segment.records_data_size = std::filesystem::file_size(records_data_filename);
+  segment.records_data->reopen();
+  segment.statistics = segment_mgr->statistics;
+  segment.anything_was_used = segment_mgr->ctx->anything_was_used;
+  segment.non_zlib_was_used = segment_mgr->ctx->non_zlib_was_used;
+  return segment;
+}
+
+// Writes a segment as a PCF block, leaving out everything before cut_pos, which a previous segment already covered with a stream that crossed into this one.
+// If cut_pos falls in the middle of one of the segment's records, the rest of that record is stored as uncompressed data taken from the input.
+// Entries for the written records are added to index_records if given.
+void write_segment_block(Precomp& precomp_mgr, IStreamLike& fin, PrecompressedSegment& segment, long long cut_pos, std::vector<PcfRecordInfo>* index_records) {
+  auto& fout = *precomp_mgr.ctx->fout;
+  const long long relative_cut_pos = cut_pos - segment.start_pos;
+  size_t first_record = 0;
+  while (first_record < segment.records.size() && segment.records[first_record].original_pos + segment.records[first_record].original_length <= relative_cut_pos) {
+    first_record++;
+  }
+  long long literal_prefix_length = 0;
+  if (first_record < segment.records.size() && segment.records[first_record].original_pos < relative_cut_pos) {
+    literal_prefix_length = segment.records[first_record].original_pos + segment.records[first_record].original_length - relative_cut_pos;
+    first_record++;
+  }
+  const long long records_data_pos = first_record < segment.records.size() ? segment.records[first_record].pcf_pos : segment.records_data_size;
+  const long long records_data_length = segment.records_data_size - records_data_pos;
+
+  long long block_length = records_data_length;
+  if (literal_prefix_length > 0) block_length += 1 + vlint_size(literal_prefix_length) + literal_prefix_length;
+
+  fout_fput_vlint(fout, segment.end_pos - cut_pos);
+  fout_fput_vlint(fout, block_length);
+  if (literal_prefix_length > 0) {
+    if (index_records != nullptr) {
+      index_records->push_back({ cut_pos, literal_prefix_length, fout.tellp(), 1 + vlint_size(literal_prefix_length) + literal_prefix_length });
+    }
+    fout.put(0);
+    fout_fput_vlint(fout, literal_prefix_length);
+    fin.seekg(cut_pos, std::ios_base::beg);
+    fast_copy(fin, fout, literal_prefix_length);
+  }
+  if (index_records != nullptr) {
+    const long long records_data_pcf_pos = fout.tellp();
+    for (size_t i = first_record; i < segment.records.size(); i++) {
+      auto record = segment.records[i];
+      record.original_pos += segment.start_pos;
+      record.pcf_pos = records_data_pcf_pos + record.pcf_pos - records_data_pos;
+      index_records->push_back(record);
+    }
+  }
+  segment.records_data->seekg(records_data_pos, std::ios_base::beg);
+  fast_copy(*segment.records_data, fout, records_data_length);
+}
+
+// Segmented precompression: the input is split into segments of switches.segment_size bytes that are precompressed independently on their own threads.
+// Each is written as a block with its original and PCF lengths, so it can be recompressed without looking at any other, and the blocks end with a 0 original length.
+// A stream crossing a segment's end is kept whole by that segment, and the next ones are trimmed to start where it ends.
+int compress_segments_impl(Precomp& precomp_mgr) {
+  auto& ctx = *precomp_mgr.ctx;
+  ctx.comp_decomp_state = P_PRECOMPRESS;
+  const long long fin_length = ctx.fin_length;
+  const long long segment_size = static_cast<long long>(std::min<uintmax_t>(precomp_mgr.switches.segment_size, std::numeric_limits<long long>::max()));
+  const unsigned int thread_count = precomp_mgr.switches.resolved_thread_count();
+  // Every segment waiting to be written holds its precompressed data on a temporary file, so don't get too far ahead of the writing
+  const size_t max_pending_segments = thread_count * 2;
+
+  SharedIStream shared_fin(ctx.fin.get());
+  SharedIStreamView fin(&shared_fin);
+  long long next_segment_pos = 0;
+  long long covered_until = 0;
+  std::optional<std::vector<PcfRecordInfo>> index_records;
+  if (precomp_mgr.switches.write_index) index_records.emplace();
+  {
+    OrderedJobPool<PrecompressedSegment> segment_pool(thread_count);
+    while (segment_pool.pending() > 0 || next_segment_pos < fin_length) {
+      while (next_segment_pos < fin_length && segment_pool.pending() < max_pending_segments) {
+        const long long segment_pos = next_segment_pos;
+        const long long segment_length = std::min(segment_size, fin_length - segment_pos);
+        next_segment_pos += segment_length;
+        // Already known to be entirely covered by a stream from a previous segment
+        if (segment_pos + segment_length <= covered_until) continue;
+        segment_pool.add([&precomp_mgr, &shared_fin, segment_pos, segment_length, fin_length]() {
+          return precompress_segment(precomp_mgr, shared_fin, segment_pos, segment_length, fin_length);
+        });
+      }
+      if (segment_pool.pending() == 0) continue;
+
+      auto segment = segment_pool.take();
+      if (segment.end_pos <= covered_until) continue;
+      print_to_log(PRECOMP_DEBUG_LOG, "Writing segment block from %lli to %lli\n", std::max(covered_until, segment.start_pos), segment.end_pos);
+      write_segment_block(precomp_mgr, fin, segment, std::max(covered_until, segment.start_pos), index_records ? &*index_records : nullptr);
+      covered_until = segment.end_pos;
+      ctx.input_file_pos = covered_until;
+
+      precomp_mgr.statistics.add_stream_counts(segment.statistics);
+      precomp_mgr.statistics.max_recursion_depth_used = std::max(precomp_mgr.statistics.max_recursion_depth_used, segment.statistics.max_recursion_depth_used);
+      if (segment.statistics.max_recursion_depth_reached) precomp_mgr.statistics.max_recursion_depth_reached = true;
+      if (segment.anything_was_used) ctx.anything_was_used = true;
+      if (segment.non_zlib_was_used) ctx.non_zlib_was_used = true;
+    }
+  }
+  fout_fput_vlint(*ctx.fout, 0);
+  if (index_records.has_value()) write_pcf_index(*ctx.fout, pcf_record_settings(precomp_mgr), *index_records, *ctx.fin);
+
+  ctx.fout = nullptr; // To close the outfile
+
+  return (ctx.anything_was_used || ctx.non_zlib_was_used) ? RETURN_SUCCESS : RETURN_NOTHING_DECOMPRESSED;
+}
+
+class RecursionPasstroughStream : public PasstroughStream {
+  int recompression_code;
+public:
+  std::unique_ptr<RecursionContext> ctx;
+
+  RecursionPasstroughStream(std::unique_ptr<RecursionContext>&& ctx_);
+  ~RecursionPasstroughStream() override {}
+
+  int get_recursion_return_code(bool throw_on_failure = true);
+};
+std::unique_ptr<RecursionPasstroughStream> recursion_decompress(RecursionContext& context, long long recursion_data_length);
+
+class PenaltyBytesPatchedOStream : public OStreamLike {
+  OStreamLike* ostream = nullptr;
+  uint64_t next_pos = 0;
+  std::queue<std::tuple<uint32_t, unsigned char>>* penalty_bytes = nullptr;
+public:
+  PenaltyBytesPatchedOStream(OStreamLike* _ostream, std::queue<std::tuple<uint32_t, unsigned char>>* _penalty_bytes) : ostream(_ostream), penalty_bytes(_penalty_bytes) {}
+
+  PenaltyBytesPatchedOStream& write(const char* buf, std::streamsize count) override {
+    auto chunk_last_post = next_pos + count - 1;
+    // If no penalty_bytes at all, or left, or any that apply to the data about to be written, just use the original ostream, unpatched
     if (!penalty_bytes || penalty_bytes->empty() || std::get<0>(penalty_bytes->front()) > chunk_last_post) {
       ostream->write(buf, count);
     }
@@ -754,13 +2326,119 @@ public:
   void clear() override { ostream->clear(); }
 };
 
+PrecompFormatHandler* find_recompression_handler(const std::vector<std::unique_ptr<PrecompFormatHandler>>& format_handlers, unsigned char headertype) {
+  for (const auto& formatHandler : format_handlers) {
+    for (const auto& formatHandlerHeaderByte: formatHandler->get_header_bytes()) {
+      if (headertype == formatHandlerHeaderByte) return formatHandler.get();
+    }
+  }
+  return nullptr;
+}
+
+// Recompresses a precompressed stream whose format header was just read, reading its data from precomp_ctx.fin and writing the original stream to precomp_ctx.fout
+void recompress_record(RecursionContext& precomp_ctx, PrecompFormatHandler& formatHandler, PrecompFormatHeaderData& format_hdr_data, SupportedFormats formatHandlerHeaderByte,
+                       const PrecompFormatHandler::Tools& handler_tools) {
+  std::optional<ProfilePhaseTimer> timer;
+  MemoryAccount* memory_account = nullptr;
+  if (!precomp_ctx.verifying) {
+    auto& profile = precomp_ctx.precomp.get_format_profile(formatHandlerHeaderByte);
+    profile.bytes_in += format_hdr_data.precompressed_size;
+    profile.bytes_out += format_hdr_data.original_size;
+    timer.emplace(profile.recompress);
+    memory_account = &precomp_ctx.precomp.get_memory_account(formatHandlerHeaderByte, precomp_ctx.depth);
+  }
+  MemoryAccountScope memory_scope(memory_account);
+  TraceSpan span("recompress", "recompress", [&]() {
+    return make_cstyle_format_string("\"format\": \"%s\", \"depth\": %i, \"verifying\": %s", format_handler_name(formatHandlerHeaderByte), precomp_ctx.depth, precomp_ctx.verifying ? "true" : "false");
+  });
+
+  formatHandler.write_pre_recursion_data(precomp_ctx, format_hdr_data);
+
+  OStreamLike* output = precomp_ctx.fout.get();
+  // If there are penalty_bytes we get a patched ostream which will patch the needed bytes transparently while writing to the ostream
+  std::unique_ptr<PenaltyBytesPatchedOStream> patched_ostream{};
+  if (!format_hdr_data.penalty_bytes.empty()) {
+    patched_ostream = std::make_unique<PenaltyBytesPatchedOStream>(precomp_ctx.fout.get(), &format_hdr_data.penalty_bytes);
+    output = patched_ostream.get();
+  }
+
+  if (format_hdr_data.recursion_data_size > 0) {
+    auto recurse_passthrough_input = recursion_decompress(precomp_ctx, format_hdr_data.recursion_data_size);
+    formatHandler.recompress(*recurse_passthrough_input, *output, format_hdr_data, formatHandlerHeaderByte, handler_tools);
+    recurse_passthrough_input->get_recursion_return_code();
+  }
+  else {
+    formatHandler.recompress(*precomp_ctx.fin, *output, format_hdr_data, formatHandlerHeaderByte, handler_tools);
+  }
+}
+
+PrecompFormatHandler::Tools make_recompression_tools(Precomp& precomp) {
+  return PrecompFormatHandler::Tools(
+    [&precomp]() { precomp.call_progress_callback(); },
+    [&precomp](std::string name, bool append_tag) { return precomp.get_tempfile_name(name, append_tag); }
+  );
+}
+
+// Recompression side of PCF_LAYOUT_DEDUP_RECORDS: numbers the streams like StreamDedupIndex did and keeps the original data of the latest ones for D_REPEAT records
+class StreamDedupCache {
+  long long window_size;
+  std::deque<std::shared_ptr<std::vector<char>>> streams;
+  long long first_number = 0;
+  long long remembered_size = 0;
+
+public:
+  explicit StreamDedupCache(long long window_size_) : window_size(window_size_) {}
+
+  // How much data to copy from a stream being recompressed at most, anything bigger isn't remembered anyway
+  long long max_stream_size() const { return window_size; }
+
+  void add(std::shared_ptr<std::vector<char>> data) {
+    if (!data || !dedup_window_remembers(data->size(), window_size)) return;
+    remembered_size += data->size();
+    streams.push_back(std::move(data));
+    while (remembered_size > window_size) {
+      remembered_size -= streams.front()->size();
+      streams.pop_front();
+      first_number++;
+    }
+  }
+
+  // The stream a D_REPEAT record read from fin references
+  std::shared_ptr<std::vector<char>> read_repeat(IStreamLike& fin) const {
+    const long long distance = fin_fget_vlint(fin);
+    const long long number = first_number + static_cast<long long>(streams.size()) - distance;
+    if (distance <= 0 || number < first_number) throw PrecompError(ERR_DURING_RECOMPRESSION);
+    return streams[number - first_number];
+  }
+};
+
+// Recompresses a record with recompress_record, also giving dedup_cache the original data if there is one
+void recompress_record_for_dedup(RecursionContext& precomp_ctx, StreamDedupCache* dedup_cache, PrecompFormatHandler& formatHandler, PrecompFormatHeaderData& format_hdr_data,
+                                 SupportedFormats formatHandlerHeaderByte, const PrecompFormatHandler::Tools& handler_tools) {
+  if (!dedup_cache) {
+    recompress_record(precomp_ctx, formatHandler, format_hdr_data, formatHandlerHeaderByte, handler_tools);
+    return;
+  }
+  auto original_fout = std::move(precomp_ctx.fout);
+  CopyingOStream copying_output(original_fout.get(), dedup_cache->max_stream_size());
+  precomp_ctx.fout = std::make_unique<ObservableOStreamWrapper>(&copying_output, false);
+  try {
+    recompress_record(precomp_ctx, formatHandler, format_hdr_data, formatHandlerHeaderByte, handler_tools);
+  }
+  catch (...) {
+    precomp_ctx.fout = std::move(original_fout);
+    throw;
+  }
+  precomp_ctx.fout = std::move(original_fout);
+  dedup_cache->add(copying_output.get_copy());
+}
+
 int decompress_file_impl(RecursionContext& precomp_ctx) {
   precomp_ctx.comp_decomp_state = P_RECOMPRESS;
   const auto& format_handlers = precomp_ctx.precomp.get_format_handlers();
-  const auto handler_tools = PrecompFormatHandler::Tools(
-    [&precomp = precomp_ctx.precomp]() { precomp.call_progress_callback(); },
-    [&precomp = precomp_ctx.precomp](std::string name, bool append_tag) { return precomp.get_tempfile_name(name, append_tag); }
-  );
+  const auto handler_tools = make_recompression_tools(precomp_ctx.precomp);
+  std::unique_ptr<StreamDedupCache> dedup_cache;
+  if (precomp_ctx.dedup_window != 0) dedup_cache = std::make_unique<StreamDedupCache>(precomp_ctx.dedup_window);
 
   long long fin_pos = precomp_ctx.fin->tellg();
 
@@ -780,41 +2458,180 @@ int decompress_file_impl(RecursionContext& precomp_ctx) {
     }
     else { // decompressed data, recompress
       const unsigned char headertype = precomp_ctx.fin->get();
+      const auto formatHandler = find_recompression_handler(format_handlers, headertype);
+      if (headertype == D_REPEAT && dedup_cache) {
+        const auto repeated_stream = dedup_cache->read_repeat(*precomp_ctx.fin);
+        precomp_ctx.fout->write(repeated_stream->data(), repeated_stream->size());
+        dedup_cache->add(repeated_stream);
+      }
+      else if (formatHandler != nullptr) {
+        const auto formatHandlerHeaderByte = static_cast<SupportedFormats>(headertype);
+        auto format_hdr_data = formatHandler->read_format_header(precomp_ctx, header1, formatHandlerHeaderByte);
+        recompress_record_for_dedup(precomp_ctx, dedup_cache.get(), *formatHandler, *format_hdr_data, formatHandlerHeaderByte, handler_tools);
+      }
+    }
   
-      bool handlerFound = false;
-      for (const auto& formatHandler : format_handlers) {
-        for (const auto& formatHandlerHeaderByte: formatHandler->get_header_bytes()) {
-          if (headertype == formatHandlerHeaderByte) {
-            auto format_hdr_data = formatHandler->read_format_header(precomp_ctx, header1, formatHandlerHeaderByte);
-            formatHandler->write_pre_recursion_data(precomp_ctx, *format_hdr_data);
-
-            OStreamLike* output = precomp_ctx.fout.get();
-            // If there are penalty_bytes we get a patched ostream which will patch the needed bytes transparently while writing to the ostream
-            std::unique_ptr<PenaltyBytesPatchedOStream> patched_ostream{};
-            if (!format_hdr_data->penalty_bytes.empty()) {
-              patched_ostream = std::make_unique<PenaltyBytesPatchedOStream>(precomp_ctx.fout.get(), &format_hdr_data->penalty_bytes);
-              output = patched_ostream.get();
-            }
+    fin_pos = precomp_ctx.fin->tellg();
+  }
 
-            if (format_hdr_data->recursion_data_size > 0) {
-              auto recurse_passthrough_input = recursion_decompress(precomp_ctx, format_hdr_data->recursion_data_size);
-              formatHandler->recompress(*recurse_passthrough_input, *output, *format_hdr_data, formatHandlerHeaderByte, handler_tools);
-              recurse_passthrough_input->get_recursion_return_code();
-            }
-            else {
-              formatHandler->recompress(*precomp_ctx.fin, *output, *format_hdr_data, formatHandlerHeaderByte, handler_tools);
-            }
-            handlerFound = true;
-            break;
-          }
+  return RETURN_SUCCESS;
+}
+
+// Output of a record recompressed by decompress_file_pipelined_impl, or a chunk of uncompressed data waiting for its turn in memory
+struct PipelinedRecordOutput {
+  std::unique_ptr<WrappedIOStream<std::stringstream>> chunk_data;
+  std::unique_ptr<SpillingOStream> recompressed_data;
+  long long size = 0;
+
+  IStreamLike& input() { return chunk_data ? static_cast<IStreamLike&>(*chunk_data) : recompressed_data->input(); }
+};
+
+// Pipelined recompression: records are read in order on this thread, recompressed on a pool of threads, and written in order as the oldest one finishes.
+// Precompressed data is read ahead for at most switches.reorder_window bytes past the oldest record not yet written, so bigger records go through temporary files.
+// Recompressed records waiting for their turn also keep at most that much in memory between all of them, past that they go to temporary files as well.
+// Records whose data size can't be known from their format header alone are recompressed right here once everything before them was written.
+// As records are read sequentially and only ever copied from fin, this works the same on non-seekable input.
+int decompress_file_pipelined_impl(RecursionContext& precomp_ctx, unsigned int thread_count) {
+  precomp_ctx.comp_decomp_state = P_RECOMPRESS;
+  Precomp& precomp = precomp_ctx.precomp;
+  const auto& format_handlers = precomp.get_format_handlers();
+  const auto handler_tools = make_recompression_tools(precomp);
+  const long long reorder_window = static_cast<long long>(std::clamp<uintmax_t>(precomp.switches.reorder_window, 1, std::numeric_limits<long long>::max()));
+  // Each pending record costs a job even if tiny, past this many more read ahead wouldn't keep the threads any busier
+  const size_t max_pending_records = thread_count * 64;
+
+  std::unique_ptr<StreamDedupCache> dedup_cache;
+  if (precomp_ctx.dedup_window != 0) dedup_cache = std::make_unique<StreamDedupCache>(precomp_ctx.dedup_window);
+
+  SpillBudget recompressed_data_budget(reorder_window);
+  OrderedJobPool<std::shared_ptr<PipelinedRecordOutput>> record_pool(thread_count);
+  // The pending records in the same order as they were added to the pool, with the bytes of read ahead data each one holds in memory,
+  // and whether it's a precompressed stream, whose output dedup_cache might need
+  struct PendingRecord {
+    long long read_ahead_size;
+    bool stream;
+  };
+  std::deque<PendingRecord> pending_records;
+  long long read_ahead_size = 0;
+
+  const auto write_oldest_record = [&]() {
+    const auto record = record_pool.take();
+    if (dedup_cache && pending_records.front().stream && record->size <= dedup_cache->max_stream_size()) {
+      auto stream_data = std::make_shared<std::vector<char>>(record->size);
+      record->input().read(stream_data->data(), record->size);
+      precomp_ctx.fout->write(stream_data->data(), record->size);
+      dedup_cache->add(std::move(stream_data));
+    }
+    else {
+      fast_copy(record->input(), *precomp_ctx.fout, record->size);
+    }
+    read_ahead_size -= pending_records.front().read_ahead_size;
+    pending_records.pop_front();
+  };
+  const auto make_room = [&](long long size) {
+    while (!pending_records.empty() && (read_ahead_size + size > reorder_window || pending_records.size() >= max_pending_records)) {
+      write_oldest_record();
+    }
+  };
+  const auto add_record = [&](long long size, bool stream, std::function<std::shared_ptr<PipelinedRecordOutput>()>&& func) {
+    record_pool.add(std::move(func));
+    pending_records.push_back({ size, stream });
+    read_ahead_size += size;
+  };
+
+  while (precomp_ctx.fin->good()) {
+    const std::byte header1 = static_cast<std::byte>(precomp_ctx.fin->get());
+    if (!precomp_ctx.fin->good()) break;
+
+    if (header1 == std::byte{ 0 }) { // uncompressed data
+      long long uncompressed_data_length = fin_fget_vlint(*precomp_ctx.fin);
+      if (uncompressed_data_length == 0) break; // end of PCF file, used by bZip2 compress-on-the-fly
+
+      // Nothing to wait for, straight to the output, otherwise it has to wait its turn in memory
+      while (uncompressed_data_length > 0) {
+        if (pending_records.empty()) {
+          fast_copy(*precomp_ctx.fin, *precomp_ctx.fout, uncompressed_data_length);
+          break;
         }
-        if (handlerFound) break;
+        const long long chunk_length = std::min(uncompressed_data_length, reorder_window);
+        make_room(chunk_length);
+        if (pending_records.empty()) continue;
+
+        auto chunk = std::make_shared<PipelinedRecordOutput>();
+        chunk->chunk_data = std::make_unique<WrappedIOStream<std::stringstream>>();
+        fast_copy(*precomp_ctx.fin, *chunk->chunk_data, chunk_length);
+        chunk->size = chunk_length;
+        add_record(chunk_length, false, [chunk]() { return chunk; });
+        uncompressed_data_length -= chunk_length;
       }
+      continue;
     }
-  
-    fin_pos = precomp_ctx.fin->tellg();
+
+    const unsigned char headertype = precomp_ctx.fin->get();
+    // Repeats are written right away, once the stream they repeat was, as it has to be in dedup_cache
+    if (headertype == D_REPEAT && dedup_cache) {
+      while (!pending_records.empty()) write_oldest_record();
+      const auto repeated_stream = dedup_cache->read_repeat(*precomp_ctx.fin);
+      precomp_ctx.fout->write(repeated_stream->data(), repeated_stream->size());
+      dedup_cache->add(repeated_stream);
+      continue;
+    }
+    const auto formatHandler = find_recompression_handler(format_handlers, headertype);
+    if (formatHandler == nullptr) continue;
+    const auto formatHandlerHeaderByte = static_cast<SupportedFormats>(headertype);
+    std::shared_ptr<PrecompFormatHeaderData> format_hdr_data = formatHandler->read_format_header(precomp_ctx, header1, formatHandlerHeaderByte);
+
+    const auto data_size = format_hdr_data->recursion_data_size > 0 ? format_hdr_data->recursion_data_size : formatHandler->get_precompressed_data_size(*format_hdr_data);
+    if (!data_size.has_value()) {
+      while (!pending_records.empty()) write_oldest_record();
+      recompress_record_for_dedup(precomp_ctx, dedup_cache.get(), *formatHandler, *format_hdr_data, formatHandlerHeaderByte, handler_tools);
+      continue;
+    }
+
+    const long long record_data_size = static_cast<long long>(*data_size);
+    const bool in_memory = record_data_size <= reorder_window;
+    make_room(in_memory ? record_data_size : 0);
+    std::shared_ptr<std::vector<char>> record_data;
+    std::shared_ptr<PrecompTmpFile> record_data_file;
+    if (in_memory) {
+      record_data = std::make_shared<std::vector<char>>(record_data_size);
+      precomp_ctx.fin->read(record_data->data(), record_data_size);
+      if (precomp_ctx.fin->gcount() != record_data_size) throw PrecompError(ERR_DURING_RECOMPRESSION);
+    }
+    else {
+      record_data_file = std::make_shared<PrecompTmpFile>();
+      record_data_file->open(precomp.get_tempfile_name("pipelined_record"), std::ios_base::in | std::ios_base::out | std::ios_base::app | std::ios_base::binary);
+      fast_copy(*precomp_ctx.fin, *record_data_file, record_data_size);
+      record_data_file->close();
+      record_data_file->reopen();
+    }
+
+    add_record(in_memory ? record_data_size : 0, true, [&precomp, &precomp_ctx, &handler_tools, &recompressed_data_budget, formatHandler, formatHandlerHeaderByte, format_hdr_data, record_data, record_data_file, record_data_size]() {
+      RecursionContext record_ctx(precomp_ctx.global_min_percent, precomp_ctx.global_max_percent, precomp);
+      record_ctx.comp_decomp_state = P_RECOMPRESS;
+      record_ctx.verifying = precomp_ctx.verifying;
+      record_ctx.depth = precomp_ctx.depth;
+      record_ctx.fin_length = record_data_size;
+      auto record = std::make_shared<PipelinedRecordOutput>();
+      if (record_data) {
+        record_ctx.fin = memiostream::make(reinterpret_cast<unsigned char*>(record_data->data()), reinterpret_cast<unsigned char*>(record_data->data()) + record_data->size());
+      }
+      else {
+        record_ctx.fin = std::make_unique<IStreamLikeView>(record_data_file.get(), record_data_size);
+      }
+      record->recompressed_data = std::make_unique<SpillingOStream>(recompressed_data_budget, precomp.get_tempfile_name("pipelined_record_recompressed"));
+      record_ctx.fout = std::make_unique<ObservableOStreamWrapper>(record->recompressed_data.get(), false);
+
+      recompress_record(record_ctx, *formatHandler, *format_hdr_data, formatHandlerHeaderByte, handler_tools);
+
+      record_ctx.fout = nullptr;
+      record->size = record->recompressed_data->tellp();
+      return record;
+    });
   }
 
+  while (!pending_records.empty()) write_oldest_record();
+
   return RETURN_SUCCESS;
 }
 
@@ -823,6 +2640,58 @@ int decompress_file(RecursionContext& precomp_ctx)
   return wrap_with_exception_catch([&]() { return decompress_file_impl(precomp_ctx); });
 }
 
+// Recompresses a PCF with the PCF_LAYOUT_BLOCKS layout. Each block is copied to a temporary file as it's read, so the input doesn't need to be seekable,
+// and recompressed on its own thread, the results are written in order.
+int decompress_blocks_impl(Precomp& precomp_mgr) {
+  auto& ctx = *precomp_mgr.ctx;
+  ctx.comp_decomp_state = P_RECOMPRESS;
+  const unsigned int thread_count = precomp_mgr.switches.resolved_thread_count();
+  const size_t max_pending_blocks = thread_count * 2;
+
+  OrderedJobPool<std::shared_ptr<PrecompTmpFile>> block_pool(thread_count);
+  bool blocks_left = true;
+  while (blocks_left || block_pool.pending() > 0) {
+    if (blocks_left && block_pool.pending() < max_pending_blocks) {
+      const long long original_length = fin_fget_vlint(*ctx.fin);
+      if (original_length == 0 || !ctx.fin->good()) {
+        blocks_left = false;
+        continue;
+      }
+      const long long block_length = fin_fget_vlint(*ctx.fin);
+
+      auto block_data = std::make_shared<PrecompTmpFile>();
+      block_data->open(precomp_mgr.get_tempfile_name("block"), std::ios_base::in | std::ios_base::out | std::ios_base::app | std::ios_base::binary);
+      fast_copy(*ctx.fin, *block_data, block_length);
+      block_data->close();
+      block_data->reopen();
+
+      block_pool.add([&precomp_mgr, block_data, block_length, original_length]() {
+        RecursionContext block_ctx(0, 100, precomp_mgr);
+        block_ctx.fin = std::make_unique<IStreamLikeView>(block_data.get(), block_length);
+        block_ctx.fin_length = block_length;
+        auto block_output = std::make_shared<PrecompTmpFile>();
+        const auto block_output_filename = precomp_mgr.get_tempfile_name("block_recompressed");
+        block_output->open(block_output_filename, std::ios_base::in | std::ios_base::out | std::ios_base::app | std::ios_base::binary);
+        block_ctx.fout = std::make_unique<ObservableOStreamWrapper>(block_output.get(), false);
+
+        const auto ret_code = decompress_file(block_ctx);
+        if (ret_code != RETURN_SUCCESS) throw PrecompError(ret_code);
+        block_output->close();
+        if (static_cast<long long>(std::filesystem::file_size(block_output_filename)) != original_length) throw PrecompError(ERR_DURING_RECOMPRESSION);
+        block_output->reopen();
+        return block_output;
+      });
+      continue;
+    }
+
+    const auto block_output = block_pool.take();
+    const auto block_output_length = std::filesystem::file_size(block_output->file_path);
+    fast_copy(*block_output, *ctx.fout, block_output_length);
+  }
+
+  return RETURN_SUCCESS;
+}
+
 void read_header(Precomp& precomp_mgr) {
   if (precomp_mgr.statistics.header_already_read) throw std::runtime_error("Attempted to read the input stream header twice");
   unsigned char hdr[3];
@@ -842,7 +2711,10 @@ void read_header(Precomp& precomp_mgr) {
   }
 
   precomp_mgr.ctx->fin->read(reinterpret_cast<char*>(hdr), 1);
-  if (hdr[0] != 0) throw PrecompError(
+  if (hdr[0] == PCF_LAYOUT_BLOCKS || hdr[0] == PCF_LAYOUT_DEDUP_RECORDS) {
+    precomp_mgr.pcf_layout = static_cast<PcfLayout>(hdr[0]);
+  }
+  else if (hdr[0] != PCF_LAYOUT_RECORDS) throw PrecompError(
     ERR_PCF_HEADER_INCOMPATIBLE_VERSION,
     "OTF compression no longer supported, use original Precomp and use the -nn conversion option to get an uncompressed Precomp stream that should work here"
   );
@@ -853,6 +2725,9 @@ void read_header(Precomp& precomp_mgr) {
     c = precomp_mgr.ctx->fin->get();
     if (c != 0) header_filename += c;
   } while (c != 0);
+  if (precomp_mgr.pcf_layout == PCF_LAYOUT_DEDUP_RECORDS) {
+    precomp_mgr.ctx->dedup_window = fin_fget_vlint(*precomp_mgr.ctx->fin);
+  }
 
   if (precomp_mgr.output_file_name.empty()) {
     precomp_mgr.output_file_name = header_filename;
@@ -892,7 +2767,8 @@ void print_to_terminal(const char* fmt, ...) {
   print_to_console(str);
 }
 
-RecursionContext& recursion_push(RecursionContext& precomp_ctx, long long recurse_stream_length) {
+// Creates a context for recursing into the next recurse_stream_length bytes of precomp_ctx, without touching the Precomp instance's context stack
+std::unique_ptr<RecursionContext> make_recursion_context(RecursionContext& precomp_ctx, long long recurse_stream_length) {
   auto context_progress_range = precomp_ctx.global_max_percent - precomp_ctx.global_min_percent;
   auto current_context_progress_percent = static_cast<float>(precomp_ctx.input_file_pos) / precomp_ctx.fin_length;
   auto recursion_end_progress_percent = static_cast<float>(precomp_ctx.input_file_pos + recurse_stream_length) / precomp_ctx.fin_length;
@@ -900,9 +2776,17 @@ RecursionContext& recursion_push(RecursionContext& precomp_ctx, long long recurs
   auto new_minimum = precomp_ctx.global_min_percent + (context_progress_range * current_context_progress_percent);
   auto new_maximum = precomp_ctx.global_min_percent + (context_progress_range * recursion_end_progress_percent);
 
+  auto new_ctx = std::make_unique<RecursionContext>(new_minimum, new_maximum, precomp_ctx.precomp);
+  new_ctx->verifying = precomp_ctx.verifying;
+  new_ctx->depth = precomp_ctx.depth + 1;
+  return new_ctx;
+}
+
+RecursionContext& recursion_push(RecursionContext& precomp_ctx, long long recurse_stream_length) {
   Precomp& precomp_mgr = precomp_ctx.precomp;
+  auto new_ctx = make_recursion_context(precomp_ctx, recurse_stream_length);
   precomp_mgr.recursion_contexts_stack.push_back(std::move(precomp_mgr.ctx));
-  precomp_mgr.ctx = std::make_unique<RecursionContext>(new_minimum, new_maximum, precomp_mgr);
+  precomp_mgr.ctx = std::move(new_ctx);
   return *precomp_mgr.ctx;
 }
 
@@ -911,48 +2795,66 @@ void recursion_pop(Precomp& precomp_mgr) {
   precomp_mgr.recursion_contexts_stack.pop_back();
 }
 
-bool verify_precompressed_result(Precomp& precomp_mgr, const std::unique_ptr<precompression_result>& result, long long& input_file_pos) {
-    // Stupid way to have a new RecursionContext for verification, will probably make progress percentages freak out even more than they already do
-    recursion_push(*precomp_mgr.ctx, 0);
-    auto new_ctx = std::move(precomp_mgr.ctx);
-    recursion_pop(precomp_mgr);
-
-    // Dump precompressed data including format headers
-    // TODO: We should be able to use a PassthroughStream here to avoid having to dump a temporary file, I tried it and it failed, didn't want to spend more
-    // time on it right now, but might be worth it to do this optimization later.
-    std::unique_ptr<PrecompTmpFile> verify_tmp_precompressed = std::make_unique<PrecompTmpFile>();
-    auto verify_precompressed_filename = precomp_mgr.get_tempfile_name("verify_precompressed");
-    verify_tmp_precompressed->open(verify_precompressed_filename, std::ios_base::in | std::ios_base::out | std::ios_base::app | std::ios_base::binary);
-    result->dump_to_outfile(*verify_tmp_precompressed);
-
-    // Set it as the input on the context, we will do what ammounts essentially to run Precomp -r on it as it's on its own pretty much
-    // a PCf file without the PCF header, if that makes sense
-    verify_tmp_precompressed->close();
-    auto precompressed_size = std::filesystem::file_size(verify_precompressed_filename.c_str());
-    new_ctx->fin_length = precompressed_size;
-    verify_tmp_precompressed->reopen();
-    new_ctx->fin = std::make_unique<IStreamLikeView>(verify_tmp_precompressed.get(), precompressed_size);
-
-    // Set output to a stream that calculates it's SHA1 sum without actually writting anything anywhere
-    auto sha1_ostream = Sha1Ostream();
-    new_ctx->fout = std::make_unique<ObservableOStreamWrapper>(&sha1_ostream, false);
-
-    int verify_result = decompress_file(*new_ctx);
-    if (verify_result != RETURN_SUCCESS) return false;
+bool verify_precompressed_stream(Precomp& precomp_mgr, const std::unique_ptr<precompression_result>& result, long long& input_file_pos) {
+    // New RecursionContext for verification, will probably make progress percentages freak out even more than they already do
+    auto new_ctx = make_recursion_context(*precomp_mgr.ctx, 0);
+    new_ctx->verifying = true;
+
+    // The context input is the PCF record for the result, what ammounts essentially to running Precomp -r on it as it's on its own pretty much a PCF file without
+    // the PCF header. Only the record header is serialized to memory, the precompressed data is read right from the result's stream unless it needs some transformation.
+    auto record_input = std::make_unique<ChainedIStream>();
+    auto record_header = std::make_unique<WrappedIOStream<std::stringstream>>();
+    if (result->precompressed_data_is_verbatim()) {
+      result->dump_record_header_to_outfile(*record_header);
+      const long long record_header_size = record_header->tellp();
+      record_input->add_part(std::move(record_header), record_header_size);
+      result->precompressed_stream->seekg(0, std::ios_base::beg);
+      record_input->add_part(std::make_unique<IStreamLikeView>(result->precompressed_stream.get(), result->precompressed_size), result->precompressed_size);
+    }
+    else {
+      result->dump_to_outfile(*record_header);
+      const long long record_size = record_header->tellp();
+      record_input->add_part(std::move(record_header), record_size);
+    }
+    new_ctx->fin_length = record_input->size();
+    new_ctx->fin = std::move(record_input);
 
-    // Okay at this point we supposedly recompressed the input data successfully, verify data exactly matches original
-    auto recompressed_size = sha1_ostream.tellp();
-    auto recompressed_data_sha1 = sha1_ostream.get_digest();
+    // Recompressed data is compared against the original as it's produced, without writting anything anywhere, the first mismatching byte aborts the recompression
+    precomp_mgr.ctx->fin->seekg(input_file_pos, std::ios_base::beg);
+    auto original_data_view = IStreamLikeView(precomp_mgr.ctx->fin.get(), result->complete_original_size() + input_file_pos);
+    auto compare_ostream = CompareOStream(&original_data_view);
+    new_ctx->fout = std::make_unique<ObservableOStreamWrapper>(&compare_ostream, false);
 
-    // Validate that the recompressed_size is what we expect
-    if (recompressed_size != result->complete_original_size()) return false;
+    int verify_result = decompress_file(*new_ctx);
+    if (verify_result != RETURN_SUCCESS || !compare_ostream.matched()) return false;
 
-    precomp_mgr.ctx->fin->seekg(input_file_pos, std::ios_base::beg);
-    auto original_data_view = IStreamLikeView(precomp_mgr.ctx->fin.get(), recompressed_size + input_file_pos);
-    auto original_data_sha1 = calculate_sha1(original_data_view, 0);
+    // Okay at this point we recompressed the input data successfully and all of it matched, validate that we got all of it
+    return compare_ostream.tellp() == result->complete_original_size();
+}
 
-    if (original_data_sha1 != recompressed_data_sha1) return false;
-    return true;
+bool verify_precompressed_result(Precomp& precomp_mgr, const std::unique_ptr<precompression_result>& result, long long& input_file_pos) {
+  auto& profile = precomp_mgr.get_format_profile(static_cast<SupportedFormats>(static_cast<unsigned char>(result->format)));
+  // Everything recompressed while verifying counts as this handler's memory, even the streams nested in it
+  MemoryAccountScope memory_scope(&precomp_mgr.get_memory_account(static_cast<SupportedFormats>(static_cast<unsigned char>(result->format)), precomp_mgr.recursion_depth));
+  const long long stream_pos = input_file_pos;
+  bool verification_success = false;
+  try {
+    ProfilePhaseTimer timer(profile.verify);
+    TraceSpan span("precompress", "verify", [&]() {
+      return stream_trace_args(input_file_pos, static_cast<SupportedFormats>(static_cast<unsigned char>(result->format)), precomp_mgr.recursion_depth);
+    });
+    verification_success = verify_precompressed_stream(precomp_mgr, result, input_file_pos);
+  }
+  // A failure is only a stream that isn't precompressed, but it shouldn't go unnoticed
+  catch (const std::exception& exc) {
+    print_to_log(PRECOMP_DEBUG_LOG, "Verification of stream at position %lli failed with an error: %s\n", stream_pos, exc.what());
+  }
+  catch (...) {
+    print_to_log(PRECOMP_DEBUG_LOG, "Verification of stream at position %lli failed with an unknown error\n", stream_pos);
+  }
+  if (verification_success) profile.successes++;
+  else profile.failures_verification++;
+  return verification_success;
 }
 
 recursion_result recursion_compress(Precomp& precomp_mgr, long long compressed_bytes, long long decompressed_bytes, IStreamLike& tmpfile, std::string out_filename) {
@@ -1038,13 +2940,9 @@ int RecursionPasstroughStream::get_recursion_return_code(bool throw_on_failure)
 
 std::unique_ptr<RecursionPasstroughStream> recursion_decompress(RecursionContext& context, long long recursion_data_length) {
   auto original_pos = context.fin->tellg();
-  auto& precomp_mgr = context.precomp;
 
-  // This is just a way for getting a new context, as we are not going to really use our context stack for decompression.
-  // Is pretty dumb, could be made more straightforward but works for now
-  recursion_push(context, recursion_data_length);
-  auto new_ctx = std::move(precomp_mgr.ctx);
-  recursion_pop(precomp_mgr);
+  // We don't use the Precomp instance's context stack for decompression, as several records might be getting recompressed at once on different threads
+  auto new_ctx = make_recursion_context(context, recursion_data_length);
 
   long long recursion_end_pos = original_pos + recursion_data_length;
   new_ctx->fin_length = recursion_data_length;
@@ -1094,7 +2992,8 @@ int32_t fin_fget32(IStreamLike& input) {
   return result;
 }
 long long fin_fget_vlint(IStreamLike& input) {
-  unsigned char c;
+  // Not unsigned char, so reaching the end of the input stops the loop too (the value is meaningless then, callers can tell by eof())
+  std::istream::int_type c;
   long long v = 0, o = 0, s = 0;
   while ((c = input.get()) >= 128) {
     v += (((long long)(c & 127)) << s);
@@ -1104,6 +3003,315 @@ long long fin_fget_vlint(IStreamLike& input) {
   return v + o + (((long long)c) << s);
 }
 
+std::optional<size_t> FailedCandidateCache::hash_input(IStreamLike& input, long long pos, long long length) {
+  const auto digest = calculate_input_digest(input, pos, length);
+  if (!digest.has_value()) return std::nullopt;
+  return static_cast<size_t>(*digest);
+}
+
+std::optional<FailedCandidateCache::Verdict> FailedCandidateCache::find(SupportedFormats format, IStreamLike& input, long long pos, long long min_length, long long max_length) {
+  if (max_length < MIN_CANDIDATE_SIZE) return std::nullopt;
+  const auto key = hash_input(input, pos, KEY_SIZE);
+  if (!key.has_value()) return std::nullopt;
+  std::vector<Entry> candidates;
+  {
+    std::unique_lock lock(mtx);
+    auto [it, end] = entries.equal_range(*key);
+    for (; it != end; ++it) {
+      if (it->second.format == format && it->second.length >= min_length && it->second.length <= max_length) candidates.push_back(it->second);
+    }
+  }
+  for (const auto& candidate : candidates) {
+    if (hash_input(input, pos, candidate.length) == candidate.hash) return candidate.verdict;
+  }
+  return std::nullopt;
+}
+
+void FailedCandidateCache::add(SupportedFormats format, IStreamLike& input, long long pos, long long length, Verdict verdict) {
+  if (length < MIN_CANDIDATE_SIZE) return;
+  const auto key = hash_input(input, pos, KEY_SIZE);
+  const auto hash = hash_input(input, pos, length);
+  if (!key.has_value() || !hash.has_value()) return;
+
+  std::unique_lock lock(mtx);
+  if (entries_order.size() >= MAX_ENTRIES) {
+    const auto [oldest_key, oldest_id] = entries_order.front();
+    entries_order.pop_front();
+    auto [it, end] = entries.equal_range(oldest_key);
+    while (it != end && it->second.id != oldest_id) ++it;
+    if (it != end) entries.erase(it);
+  }
+  entries.emplace(*key, Entry{ next_id, format, length, *hash, verdict });
+  entries_order.emplace_back(*key, next_id);
+  next_id++;
+}
+
+// A result taken from a PrecompDiskCache entry, which has the record header the format handler wrote for it back then
+class cached_precompression_result : public precompression_result {
+public:
+  std::string record_header;
+
+  explicit cached_precompression_result(SupportedFormats format) : precompression_result(format) {}
+
+  void dump_record_header_to_outfile(OStreamLike& outfile) const override {
+    // Recursion is attempted after taking the result from the cache, and every format keeps its flag on the first byte of the header
+    outfile.put(static_cast<char>(static_cast<std::byte>(record_header[0]) | (recursion_used ? std::byte{ 0b10000000 } : std::byte{ 0b0 })));
+    outfile.write(record_header.data() + 1, static_cast<std::streamsize>(record_header.size()) - 1);
+  }
+};
+
+// The statistics counters format handlers update when attempting precompression, in the order PrecompDiskCache entries have them
+static constexpr unsigned int CResultStatistics::* CACHED_STATISTICS_COUNTERS[] = {
+  &CResultStatistics::recompressed_streams_count, &CResultStatistics::recompressed_pdf_count, &CResultStatistics::recompressed_pdf_count_8_bit,
+  &CResultStatistics::recompressed_pdf_count_24_bit, &CResultStatistics::recompressed_zip_count, &CResultStatistics::recompressed_gzip_count,
+  &CResultStatistics::recompressed_png_count, &CResultStatistics::recompressed_png_multi_count, &CResultStatistics::recompressed_gif_count,
+  &CResultStatistics::recompressed_jpg_count, &CResultStatistics::recompressed_jpg_prog_count, &CResultStatistics::recompressed_mp3_count,
+  &CResultStatistics::recompressed_swf_count, &CResultStatistics::recompressed_base64_count, &CResultStatistics::recompressed_bzip2_count,
+  &CResultStatistics::recompressed_zlib_count, &CResultStatistics::recompressed_brute_count,
+  &CResultStatistics::decompressed_streams_count, &CResultStatistics::decompressed_pdf_count, &CResultStatistics::decompressed_pdf_count_8_bit,
+  &CResultStatistics::decompressed_pdf_count_24_bit, &CResultStatistics::decompressed_zip_count, &CResultStatistics::decompressed_gzip_count,
+  &CResultStatistics::decompressed_png_count, &CResultStatistics::decompressed_png_multi_count, &CResultStatistics::decompressed_gif_count,
+  &CResultStatistics::decompressed_jpg_count, &CResultStatistics::decompressed_jpg_prog_count, &CResultStatistics::decompressed_mp3_count,
+  &CResultStatistics::decompressed_swf_count, &CResultStatistics::decompressed_base64_count, &CResultStatistics::decompressed_bzip2_count,
+  &CResultStatistics::decompressed_zlib_count, &CResultStatistics::decompressed_brute_count,
+};
+static constexpr char CACHE_ENTRY_MAGIC[4] = { 'P', 'C', 'D', 'C' };
+
+// Entries are named after the length and SHA1 of the stream, and written to a temporary file named after the entry followed by a random tag first.
+// Entries of CACHE_VERSION 2 were named after a 16 digit XXH64 instead, those are still recognized (with no SHA1) so trim() removes them.
+bool parse_cache_entry_name(const std::string& name, long long& length, std::optional<std::string>& sha1, bool& temporary) {
+  const auto separator = name.find('_');
+  if (separator == std::string::npos || separator == 0 || separator > 18) return false;
+  if (!std::all_of(name.begin(), name.begin() + separator, [](char c) { return c >= '0' && c <= '9'; })) return false;
+  const auto digest_end = std::find(name.begin() + separator + 1, name.end(), '.');
+  const auto digest_size = static_cast<size_t>(digest_end - name.begin()) - separator - 1;
+  if (digest_size != 16 && digest_size != 40) return false;
+  if (!std::all_of(name.begin() + separator + 1, digest_end, [](char c) { return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'); })) return false;
+  const auto suffix_pos = separator + 1 + digest_size;
+  temporary = name.size() != suffix_pos;
+  if (temporary && (name.size() != suffix_pos + 13 || name.compare(suffix_pos + 9, 4, ".tmp") != 0)) return false;
+  length = std::stoll(name.substr(0, separator));
+  sha1 = digest_size == 40 ? std::optional(name.substr(separator + 1, 40)) : std::nullopt;
+  return true;
+}
+
+PrecompDiskCache::PrecompDiskCache(const std::filesystem::path& cache_dir, uintmax_t size_limit_)
+  : version_dir(cache_dir / make_cstyle_format_string("v%i.%i.%i-%i", V_MAJOR, V_MINOR, V_MINOR2, CACHE_VERSION)), size_limit(size_limit_) {}
+
+std::filesystem::path PrecompDiskCache::key_dir(const Precomp& precomp_mgr, SupportedFormats handler_format, long long pos) const {
+  const auto settings = make_cstyle_format_string("%i ", handler_format) + handler_settings(precomp_mgr.switches);
+  const auto key_data_sha1 = calculate_input_sha1(*precomp_mgr.ctx->fin, pos, KEY_SIZE);
+  if (!key_data_sha1.has_value()) return {};
+
+  Sha1Ostream sha1;
+  sha1.write(settings.c_str(), static_cast<std::streamsize>(settings.size() + 1));
+  sha1.write(key_data_sha1->data(), static_cast<std::streamsize>(key_data_sha1->size()));
+  const auto key = sha1.get_digest();
+  return version_dir / key.substr(0, 2) / key.substr(2, 14);
+}
+
+std::optional<PrecompDiskCache::Hit> PrecompDiskCache::read_entry(Precomp& precomp_mgr, const std::filesystem::path& path, long long length) {
+  std::error_code ec;
+  const auto entry_size = std::filesystem::file_size(path, ec);
+  if (ec) return std::nullopt;
+  std::ifstream entry_file(path, std::ios_base::in | std::ios_base::binary);
+  WrappedIStream entry(&entry_file, false);
+  std::array<char, sizeof(CACHE_ENTRY_MAGIC)> magic{};
+  entry.read(magic.data(), magic.size());
+  if (entry.gcount() != static_cast<std::streamsize>(magic.size()) || !std::equal(magic.begin(), magic.end(), CACHE_ENTRY_MAGIC)) return std::nullopt;
+
+  Hit hit;
+  const long long counters_count = fin_fget_vlint(entry);
+  if (counters_count != static_cast<long long>(std::size(CACHED_STATISTICS_COUNTERS))) return std::nullopt;
+  for (const auto counter : CACHED_STATISTICS_COUNTERS) {
+    hit.statistics.*counter = static_cast<unsigned int>(fin_fget_vlint(entry));
+  }
+  hit.non_zlib_was_used = entry.get() != 0;
+  auto result = std::make_unique<cached_precompression_result>(static_cast<SupportedFormats>(static_cast<unsigned char>(entry.get())));
+  result->original_size = fin_fget_vlint(entry);
+  result->original_size_extra = length - result->original_size;
+  result->precompressed_size = fin_fget_vlint(entry);
+  const long long record_header_size = fin_fget_vlint(entry);
+  // Anything that doesn't add up means the entry is damaged
+  if (entry.eof() || record_header_size <= 0 || static_cast<uintmax_t>(record_header_size) > entry_size) return std::nullopt;
+  result->record_header.resize(record_header_size);
+  entry.read(result->record_header.data(), record_header_size);
+  if (entry.bad() || entry.eof() || result->original_size < 0 || result->original_size > length || result->precompressed_size < 0 ||
+      static_cast<uintmax_t>(entry.tellg()) + result->precompressed_size != entry_size) {
+    return std::nullopt;
+  }
+  result->flags = static_cast<std::byte>(result->record_header[0]);
+
+  if (result->precompressed_size <= MAX_IO_BUFFER_SIZE) {
+    std::vector<char> precompressed_data(result->precompressed_size);
+    entry.read(precompressed_data.data(), result->precompressed_size);
+    if (entry.gcount() != result->precompressed_size) return std::nullopt;
+    result->precompressed_stream = memiostream::make(std::move(precompressed_data));
+  }
+  else {
+    auto tmpfile = std::make_unique<PrecompTmpFile>();
+    tmpfile->open(precomp_mgr.get_tempfile_name("cached"), std::ios_base::in | std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+    fast_copy(entry, *tmpfile, result->precompressed_size);
+    tmpfile->close();
+    tmpfile->open(tmpfile->file_path, std::ios_base::in | std::ios_base::binary);
+    result->precompressed_stream = std::move(tmpfile);
+  }
+  result->success = true;
+  hit.result = std::move(result);
+  return hit;
+}
+
+std::optional<PrecompDiskCache::Hit> PrecompDiskCache::find(Precomp& precomp_mgr, SupportedFormats handler_format, long long pos) const {
+  auto& input = *precomp_mgr.ctx->fin;
+  const long long max_length = precomp_mgr.ctx->fin_length - pos;
+  if (max_length < MIN_STREAM_SIZE) return std::nullopt;
+  const auto dir = key_dir(precomp_mgr, handler_format, pos);
+  std::error_code ec;
+  if (dir.empty() || !std::filesystem::is_directory(dir, ec)) return std::nullopt;
+
+  // If several streams starting here are cached, the longest one is taken
+  std::vector<std::tuple<long long, std::string, std::filesystem::path>> candidates;
+  for (auto it = std::filesystem::directory_iterator(dir, ec); !ec && it != std::filesystem::directory_iterator(); it.increment(ec)) {
+    long long length;
+    std::optional<std::string> sha1;
+    bool temporary;
+    if (!parse_cache_entry_name(it->path().filename().string(), length, sha1, temporary) || temporary || !sha1.has_value() || length > max_length) continue;
+    candidates.emplace_back(length, std::move(*sha1), it->path());
+  }
+  std::sort(candidates.begin(), candidates.end(), [](const auto& a, const auto& b) { return std::get<0>(a) > std::get<0>(b); });
+
+  for (const auto& [length, sha1, path] : candidates) {
+    if (calculate_input_sha1(input, pos, length) != sha1) continue;
+    std::optional<Hit> hit;
+    try {
+      hit = read_entry(precomp_mgr, path, length);
+    }
+    catch (...) {}  // Damaged entries are just ignored
+    if (!hit.has_value()) continue;
+
+    // Used again, so it's the last entry to go when trimming
+    std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), ec);
+    print_to_log(PRECOMP_DEBUG_LOG, "Precompressed stream taken from cache at position %lli, length %lli\n", pos, length);
+    return hit;
+  }
+  return std::nullopt;
+}
+
+void PrecompDiskCache::store(Precomp& precomp_mgr, SupportedFormats handler_format, long long pos, precompression_result& result, const CResultStatistics& statistics, bool non_zlib_was_used) const {
+  const long long length = result.complete_original_size();
+  if (length < MIN_STREAM_SIZE || !result.precompressed_data_is_verbatim()) return;
+  // An entry taking up most of the cache would just push everything else out of it
+  if (static_cast<uintmax_t>(length + result.precompressed_size) > size_limit / 4) return;
+
+  std::filesystem::path temporary_path;
+  try {
+    const auto dir = key_dir(precomp_mgr, handler_format, pos);
+    const auto sha1 = calculate_input_sha1(*precomp_mgr.ctx->fin, pos, length);
+    if (dir.empty() || !sha1.has_value()) return;
+    std::error_code ec;
+    std::filesystem::create_directories(dir, ec);
+    const auto entry_path = dir / (std::to_string(length) + "_" + *sha1);
+    if (ec || std::filesystem::exists(entry_path, ec)) return;
+    temporary_path = dir / (entry_path.filename().string() + "." + temp_files_tag() + ".tmp");
+
+    std::ostringstream record_header_stream;
+    WrappedOStream record_header(&record_header_stream, false);
+    result.dump_record_header_to_outfile(record_header);
+    const auto record_header_data = record_header_stream.str();
+
+    std::ofstream entry_file(temporary_path, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+    WrappedOStream entry(&entry_file, false);
+    entry.write(CACHE_ENTRY_MAGIC, sizeof(CACHE_ENTRY_MAGIC));
+    fout_fput_vlint(entry, std::size(CACHED_STATISTICS_COUNTERS));
+    for (const auto counter : CACHED_STATISTICS_COUNTERS) {
+      fout_fput_vlint(entry, statistics.*counter);
+    }
+    entry.put(non_zlib_was_used ? 1 : 0);
+    entry.put(result.format);
+    fout_fput_vlint(entry, result.original_size);
+    fout_fput_vlint(entry, result.precompressed_size);
+    fout_fput_vlint(entry, record_header_data.size());
+    entry.write(record_header_data.data(), static_cast<std::streamsize>(record_header_data.size()));
+
+    auto& precompressed_stream = *result.precompressed_stream;
+    precompressed_stream.seekg(0, std::ios_base::beg);
+    std::vector<char> chunk(std::min<long long>(CHUNK, result.precompressed_size));
+    bool copied = true;
+    for (long long written = 0; written < result.precompressed_size && copied; written += CHUNK) {
+      const long long chunk_size = std::min<long long>(CHUNK, result.precompressed_size - written);
+      precompressed_stream.read(chunk.data(), chunk_size);
+      copied = precompressed_stream.gcount() == chunk_size;
+      entry.write(chunk.data(), chunk_size);
+    }
+    precompressed_stream.clear();
+    precompressed_stream.seekg(0, std::ios_base::beg);
+    entry_file.close();
+
+    // Renaming is atomic, so other runs either see the whole entry or nothing at all
+    if (copied && entry_file.good()) std::filesystem::rename(temporary_path, entry_path, ec);
+    if (!copied || !entry_file.good() || ec) std::filesystem::remove(temporary_path, ec);
+  }
+  // The cache is just an optimization, failing to store an entry is no reason to fail precompression
+  catch (...) {
+    std::error_code ec;
+    if (!temporary_path.empty()) std::filesystem::remove(temporary_path, ec);
+  }
+}
+
+void PrecompDiskCache::trim() const {
+  struct CachedFile {
+    std::filesystem::file_time_type last_use;
+    uintmax_t size;
+    std::filesystem::path path;
+  };
+  // Temporary files this old belong to runs that didn't get to finish writing them
+  constexpr auto STALE_TEMPORARY_FILE_AGE = std::chrono::hours(1);
+  const auto now = std::filesystem::file_time_type::clock::now();
+
+  std::vector<CachedFile> entries;
+  std::vector<std::filesystem::path> removed_files;
+  uintmax_t total_size = 0;
+  std::error_code ec;
+  // Only files named like entries, where entries go, are ever touched, whatever else is in the directory is left alone
+  for (auto it = std::filesystem::recursive_directory_iterator(version_dir.parent_path(), std::filesystem::directory_options::skip_permission_denied, ec);
+       !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+    std::error_code file_ec;
+    long long length;
+    std::optional<std::string> sha1;
+    bool temporary;
+    if (it.depth() != 3 || !it->is_regular_file(file_ec) || !parse_cache_entry_name(it->path().filename().string(), length, sha1, temporary)) continue;
+    const auto last_use = it->last_write_time(file_ec);
+    const auto size = it->file_size(file_ec);
+    if (file_ec) continue;
+
+    if (temporary) {
+      if (now - last_use > STALE_TEMPORARY_FILE_AGE) removed_files.push_back(it->path());
+    }
+    else if (it->path().parent_path().parent_path().parent_path() != version_dir) {
+      removed_files.push_back(it->path());
+    }
+    else {
+      entries.push_back({ last_use, size, it->path() });
+      total_size += size;
+    }
+  }
+
+  std::sort(entries.begin(), entries.end(), [](const CachedFile& a, const CachedFile& b) { return a.last_use < b.last_use; });
+  for (const auto& entry : entries) {
+    if (total_size <= size_limit) break;
+    removed_files.push_back(entry.path);
+    total_size -= entry.size;
+  }
+
+  for (const auto& path : removed_files) {
+    // Another run might have removed it already, and the directories it was in are removed too if nothing else is left in them (if there is, that just fails)
+    std::filesystem::remove(path, ec);
+    std::filesystem::remove(path.parent_path(), ec);
+    std::filesystem::remove(path.parent_path().parent_path(), ec);
+    std::filesystem::remove(path.parent_path().parent_path().parent_path(), ec);
+  }
+}
+
 std::tuple<long long, std::vector<std::tuple<uint32_t, char>>> compare_files_penalty(Precomp& precomp_mgr, IStreamLike& original, IStreamLike& candidate, long long original_size) {
   unsigned char input_bytes1[COMP_CHUNK];
   unsigned char input_bytes2[COMP_CHUNK];
@@ -1120,31 +3328,41 @@ std::tuple<long long, std::vector<std::tuple<uint32_t, char>>> compare_files_pen
     candidate.read(reinterpret_cast<char*>(input_bytes2), COMP_CHUNK);
     long long candidate_chunk_size = candidate.gcount();
 
-    uint32_t i;
-    for (i = 0; i < original_chunk_size && pos < original_size; i++, pos++) {
+    const long long chunk_end = std::min<long long>(original_chunk_size, original_size - pos);
+    const long long comparable_size = std::min(chunk_end, candidate_chunk_size);
+    long long i = 0;
+    while (i < chunk_end) {
+      // identical runs are skipped in one go, only the mismatching bytes and the ones past the end of the candidate are looked at one by one
+      if (i < comparable_size) {
+        const size_t matched = find_first_mismatch(input_bytes1 + i, input_bytes2 + i, static_cast<size_t>(comparable_size - i));
+        i += matched;
+        pos += matched;
+        if (i == chunk_end) break;
+      }
+
       // if we ran out of candidate, it might still be possible to recover the original file if we can fill the whole end with penalty bytes,
       // and of course if we find a mismatching byte we must patch it with a penalty byte
-      if (i + 1 > candidate_chunk_size || input_bytes1[i] != input_bytes2[i]) {  // should not be out of bounds on input_bytes2 because of short-circuit evaluation
-        // if penalty_bytes_size gets too large, stop
-        // penalty_bytes will be larger than 1/6th of stream? bail, why 1/6th? beats me, but this is roughly equivalent to what Precomp v0.4.8 was doing,
-        // only much much simpler
-        if (static_cast<double>(penalty_bytes.size() + 1) >= static_cast<double>(original_size) * (1.0 / 6)) {
-          endNow = true;
-          break;
-        }
-
-        // stop, if penalty_bytes len gets too big
-        if ((penalty_bytes.size() + 1) * 5 >= MAX_PENALTY_BYTES) {  // 4 bytes = position uint32, 1 byte = patch byte
-          endNow = true;
-          break;
-        }
+      // if penalty_bytes_size gets too large, stop
+      // penalty_bytes will be larger than 1/6th of stream? bail, why 1/6th? beats me, but this is roughly equivalent to what Precomp v0.4.8 was doing,
+      // only much much simpler
+      if (static_cast<double>(penalty_bytes.size() + 1) >= static_cast<double>(original_size) * (1.0 / 6)) {
+        endNow = true;
+        break;
+      }
 
-        // add the penalty byte
-        penalty_bytes.emplace_back(pos, input_bytes1[i]);
-        if (endNow) break;
+      // stop, if penalty_bytes len gets too big
+      if ((penalty_bytes.size() + 1) * 5 >= MAX_PENALTY_BYTES) {  // 4 bytes = position uint32, 1 byte = patch byte
+        endNow = true;
+        break;
       }
+
+      // add the penalty byte
+      penalty_bytes.emplace_back(pos, input_bytes1[i]);
+      i++;
+      pos++;
     }
-    if (pos == original_size) endNow = true;
+    // the original ending early would otherwise leave us looping forever
+    if (pos == original_size || original_chunk_size == 0) endNow = true;
   } while (!endNow);
 
   return { pos, penalty_bytes };
@@ -1161,14 +3379,224 @@ void PrecompSwitchesSetIgnoreList(CSwitches* precomp_switches, const long long*
 CRecursionContext* PrecompGetRecursionContext(Precomp* precomp_mgr) { return precomp_mgr->ctx.get(); }
 CResultStatistics* PrecompGetResultStatistics(Precomp* precomp_mgr) { return &precomp_mgr->statistics; }
 
+void PrecompSetTraceFile(Precomp* precomp_mgr, const char* trace_file_name) {
+  precomp_mgr->trace_file_name = trace_file_name != nullptr ? trace_file_name : "";
+}
+
+void PrecompSetCacheDir(Precomp* precomp_mgr, const char* cache_dir, uintmax_t size_limit) {
+  precomp_mgr->disk_cache = cache_dir != nullptr ? std::make_shared<PrecompDiskCache>(cache_dir, size_limit) : nullptr;
+}
+
+int PrecompSetBasePcf(Precomp* precomp_mgr, const char* base_pcf_file_name) {
+  precomp_mgr->base_pcf = nullptr;
+  if (base_pcf_file_name == nullptr) return RETURN_SUCCESS;
+  return wrap_with_exception_catch([&]() {
+    precomp_mgr->base_pcf = std::make_unique<PrecompBasePcf>(base_pcf_file_name);
+    return RETURN_SUCCESS;
+  });
+}
+
+// The first format byte of the handler that has the given one among its format bytes, which is what its counters are kept by
+std::optional<SupportedFormats> handler_first_format(const Precomp& precomp_mgr, unsigned char format) {
+  for (const auto& handler : precomp_mgr.get_format_handlers()) {
+    const auto& header_bytes = handler->get_header_bytes();
+    if (std::find(header_bytes.cbegin(), header_bytes.cend(), format) != header_bytes.cend()) return header_bytes[0];
+  }
+  return std::nullopt;
+}
+
+bool PrecompGetFormatProfile(Precomp* precomp_mgr, unsigned char format, CFormatProfile* profile, const char** format_name) {
+  const auto handler_format = handler_first_format(*precomp_mgr, format);
+  if (!handler_format.has_value()) return false;
+  if (profile != nullptr) (*precomp_mgr->profile)[*handler_format].copy_to(*profile);
+  if (format_name != nullptr) *format_name = format_handler_name(*handler_format);
+  return true;
+}
+
+bool PrecompGetFormatAnalysis(Precomp* precomp_mgr, unsigned char format, CFormatAnalysis* analysis, const char** format_name) {
+  const auto handler_format = handler_first_format(*precomp_mgr, format);
+  if (!handler_format.has_value()) return false;
+  if (analysis != nullptr) *analysis = precomp_mgr->analysis[*handler_format];
+  if (format_name != nullptr) *format_name = format_handler_name(*handler_format);
+  return true;
+}
+
+uintmax_t PrecompEstimateRuntime(Precomp* precomp_mgr, unsigned int thread_count) {
+  if (thread_count == 0) thread_count = auto_detected_thread_count();
+  uintmax_t streams_time_us = 0;
+  uintmax_t largest_stream_time_us = 0;
+  for (const auto& format_analysis : precomp_mgr->analysis) {
+    streams_time_us += format_analysis.estimated_time_us;
+    largest_stream_time_us = std::max(largest_stream_time_us, format_analysis.largest_stream_time_us);
+  }
+  // Lookahead works on different streams at once, but a single stream is still precompressed by a single thread
+  return precomp_mgr->analysis_scan_time_us + std::max(streams_time_us / thread_count, largest_stream_time_us);
+}
+
+uintmax_t PrecompGetMemoryPeak(Precomp* precomp_mgr, unsigned char format, unsigned int depth) {
+  if (depth >= PRECOMP_MEMORY_TRACKED_DEPTHS) depth = PRECOMP_MEMORY_TRACKED_DEPTHS - 1;
+  return precomp_mgr->memory->get(format, static_cast<int>(depth)).peak;
+}
+
+// Records a trace while it exists if a trace file was set for the Precomp instance, writing it out at the end
+class PrecompTraceSession {
+  const Precomp& precomp_mgr;
+  std::unique_ptr<TraceRecorder> recorder;
+  std::optional<TraceSpan> span;
+
+public:
+  PrecompTraceSession(const Precomp& precomp_mgr_, const char* operation_name) : precomp_mgr(precomp_mgr_) {
+    if (precomp_mgr.trace_file_name.empty()) return;
+    recorder = std::make_unique<TraceRecorder>();
+    if (!recorder->start()) {
+      print_to_log(PRECOMP_NORMAL_LOG, "Another trace is already being recorded, not tracing this %s\n", operation_name);
+      recorder = nullptr;
+      return;
+    }
+    span.emplace("operation", operation_name);
+  }
+  ~PrecompTraceSession() {
+    if (!recorder) return;
+    span = std::nullopt;
+    recorder->stop();
+    if (!recorder->write(precomp_mgr.trace_file_name)) {
+      print_to_log(PRECOMP_NORMAL_LOG, "Couldn't write trace file %s\n", precomp_mgr.trace_file_name.c_str());
+    }
+  }
+  PrecompTraceSession(const PrecompTraceSession&) = delete;
+  PrecompTraceSession& operator=(const PrecompTraceSession&) = delete;
+};
+
+// Sets up the memory limit diagnostic while it exists, recording the memory peaks in the statistics at the end
+class PrecompMemorySession {
+  Precomp& precomp_mgr;
+
+public:
+  explicit PrecompMemorySession(Precomp& precomp_mgr_) : precomp_mgr(precomp_mgr_) {
+    auto& total = precomp_mgr.memory->total;
+    total.limit = static_cast<long long>(precomp_mgr.switches.memory_limit);
+    total.limit_exceeded = false;
+    if (total.limit == 0) return;
+    auto* memory = precomp_mgr.memory.get();
+    total.on_limit_exceeded = [memory]() {
+      print_to_log(PRECOMP_NORMAL_LOG, "\nMemory limit of %lli KiB exceeded, %lli KiB held (peak RSS so far: %lli KiB) by:\n%s",
+        memory->total.limit / 1024, memory->total.current.load() / 1024, get_peak_rss_bytes() / 1024, memory->describe_current_usage().c_str());
+    };
+  }
+  ~PrecompMemorySession() {
+    precomp_mgr.statistics.peak_tracked_memory = precomp_mgr.memory->total.peak;
+    precomp_mgr.statistics.peak_rss = get_peak_rss_bytes();
+  }
+  PrecompMemorySession(const PrecompMemorySession&) = delete;
+  PrecompMemorySession& operator=(const PrecompMemorySession&) = delete;
+};
+
 int PrecompPrecompress(Precomp* precomp_mgr) {
-  return compress_file(*precomp_mgr);
+  PrecompTraceSession trace_session(*precomp_mgr, "precompress");
+  PrecompMemorySession memory_session(*precomp_mgr);
+  return wrap_with_exception_catch([&]() {
+    write_header(*precomp_mgr);
+    precomp_mgr->init_format_handlers();
+    const int result = precomp_mgr->switches.segment_size != 0 ? compress_segments_impl(*precomp_mgr) : compress_file_impl(*precomp_mgr);
+    if (precomp_mgr->disk_cache) precomp_mgr->disk_cache->trim();
+    return result;
+  });
+}
+
+int PrecompAnalyze(Precomp* precomp_mgr) {
+  PrecompTraceSession trace_session(*precomp_mgr, "analyze");
+  PrecompMemorySession memory_session(*precomp_mgr);
+  return wrap_with_exception_catch([&]() {
+    precomp_mgr->init_format_handlers();
+    return analyze_file_impl(*precomp_mgr);
+  });
 }
 
 int PrecompRecompress(Precomp* precomp_mgr) {
+  PrecompTraceSession trace_session(*precomp_mgr, "recompress");
+  PrecompMemorySession memory_session(*precomp_mgr);
   if (!precomp_mgr->statistics.header_already_read) read_header(*precomp_mgr);
   precomp_mgr->init_format_handlers(true);
-  return decompress_file(*precomp_mgr->ctx);
+  int ret_code;
+  if (precomp_mgr->pcf_layout == PCF_LAYOUT_BLOCKS) {
+    ret_code = wrap_with_exception_catch([&]() { return decompress_blocks_impl(*precomp_mgr); });
+  }
+  else if (precomp_mgr->switches.thread_count != 1) {
+    ret_code = wrap_with_exception_catch([&]() { return decompress_file_pipelined_impl(*precomp_mgr->ctx, precomp_mgr->switches.resolved_thread_count()); });
+  }
+  else {
+    ret_code = decompress_file(*precomp_mgr->ctx);
+  }
+  // The output is written behind, so make sure all of it is there by the time we return
+  precomp_mgr->get_original_context()->fout->flush();
+  return ret_code;
+}
+
+int restore_range_impl(Precomp& precomp_mgr, unsigned long long original_pos, unsigned long long length) {
+  auto& ctx = *precomp_mgr.ctx;
+  ctx.comp_decomp_state = P_RECOMPRESS;
+  const auto records = read_pcf_index(*ctx.fin).records;
+  const unsigned long long range_end = length > std::numeric_limits<unsigned long long>::max() - original_pos ? std::numeric_limits<unsigned long long>::max() : original_pos + length;
+
+  // Repeats are restored from the stream they repeat, found by numbering the streams the same way recompression does (see PCF_LAYOUT_DEDUP_RECORDS)
+  std::vector<size_t> numbered_records;
+  if (ctx.dedup_window != 0) {
+    for (size_t i = 0; i < records.size(); i++) {
+      if (records[i].precompressed && dedup_window_remembers(records[i].original_length, ctx.dedup_window)) numbered_records.push_back(i);
+    }
+  }
+  const auto repeated_record = [&](size_t record_index) -> const PcfRecordInfo& {
+    while (records[record_index].format == D_REPEAT) {
+      const auto number = std::lower_bound(numbered_records.begin(), numbered_records.end(), record_index) - numbered_records.begin();
+      ctx.fin->seekg(records[record_index].pcf_pos + 2, std::ios_base::beg);
+      const long long distance = fin_fget_vlint(*ctx.fin);
+      if (distance <= 0 || distance > number) throw PrecompError(ERR_DURING_RECOMPRESSION);
+      record_index = numbered_records[number - distance];
+    }
+    return records[record_index];
+  };
+
+  for (size_t record_index = 0; record_index < records.size(); record_index++) {
+    const auto& record = records[record_index];
+    const unsigned long long record_start = record.original_pos;
+    const unsigned long long record_end = record_start + record.original_length;
+    if (record_end <= original_pos || record_start >= range_end) continue;
+    const unsigned long long skip_length = original_pos > record_start ? original_pos - record_start : 0;
+    const unsigned long long restore_length = std::min(record_end, range_end) - record_start - skip_length;
+
+    if (!record.precompressed) {
+      // Uncompressed data is right there after its header
+      ctx.fin->seekg(record.pcf_pos + 1 + vlint_size(record.original_length) + skip_length, std::ios_base::beg);
+      fast_copy(*ctx.fin, *ctx.fout, restore_length);
+      continue;
+    }
+
+    print_to_log(PRECOMP_DEBUG_LOG, "Restoring %llu bytes from stream at original position %lli\n", restore_length, record.original_pos);
+    const auto& stream_record = record.format == D_REPEAT && ctx.dedup_window != 0 ? repeated_record(record_index) : record;
+    ctx.fin->seekg(stream_record.pcf_pos, std::ios_base::beg);
+    RecursionContext record_ctx(0, 100, precomp_mgr);
+    record_ctx.fin = std::make_unique<IStreamLikeView>(ctx.fin.get(), stream_record.pcf_pos + stream_record.pcf_length);
+    record_ctx.fin_length = stream_record.pcf_length;
+    RangeOStream range_output(ctx.fout.get(), skip_length, restore_length);
+    record_ctx.fout = std::make_unique<ObservableOStreamWrapper>(&range_output, false);
+    const auto ret_code = decompress_file(record_ctx);
+    if (ret_code != RETURN_SUCCESS) throw PrecompError(ret_code);
+  }
+
+  return RETURN_SUCCESS;
+}
+
+int PrecompRestoreRange(Precomp* precomp_mgr, unsigned long long original_pos, unsigned long long length) {
+  PrecompTraceSession trace_session(*precomp_mgr, "restore range");
+  PrecompMemorySession memory_session(*precomp_mgr);
+  return wrap_with_exception_catch([&]() {
+    if (!precomp_mgr->statistics.header_already_read) read_header(*precomp_mgr);
+    precomp_mgr->init_format_handlers(true);
+    const auto ret_code = restore_range_impl(*precomp_mgr, original_pos, length);
+    // The output is written behind, so make sure all of it is there by the time we return
+    precomp_mgr->ctx->fout->flush();
+    return ret_code;
+  });
 }
 
 int PrecompReadHeader(Precomp* precomp_mgr, bool seek_to_beg) {
@@ -1181,3 +3609,4 @@ int PrecompReadHeader(Precomp* precomp_mgr, bool seek_to_beg) {
   }
   return 0;
 }
+
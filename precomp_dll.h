@@ -12,11 +12,17 @@
 
 #include <cstdio>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <mutex>
 #include <queue>
 #include <vector>
 #include <set>
 #include <string>
 #include <fstream>
+#include <filesystem>
 #include <memory>
 #include <optional>
 #include <span>
@@ -36,6 +42,8 @@ enum SupportedFormats {
   D_BASE64 = 8,
   D_BZIP2 = 9,
   D_MP3 = 10,
+  // Not an actual format, marks records that repeat an earlier stream (see PCF_LAYOUT_DEDUP_RECORDS)
+  D_REPEAT = 11,
   D_RAW = 255,
   D_BRUTE = 254,
 };
@@ -53,11 +61,76 @@ class EXPORT Switches: public CSwitches {
 
     Switches();
     ~Switches();
+
+    // thread_count, with 0 replaced by the amount of threads the hardware supports
+    unsigned int resolved_thread_count() const;
 };
 
 class ResultStatistics: public CResultStatistics {
 public:
   ResultStatistics();
+
+  // Adds up the stream counters from other, which can be negative (wrapped around) for counters that got decremented
+  void add_stream_counts(const CResultStatistics& other);
+};
+
+// Profiling counters for a format handler, see CFormatProfile. These get updated from every thread working for a Precomp instance, so they are all atomic.
+struct FormatProfile {
+  struct Phase {
+    std::atomic<uintmax_t> count = 0;
+    std::atomic<uintmax_t> wall_time_us = 0;
+    std::atomic<uintmax_t> cpu_time_us = 0;
+
+    void copy_to(CProfilePhase& phase) const;
+  };
+
+  std::atomic<uintmax_t> quick_check_hits = 0;
+  std::atomic<uintmax_t> attempts = 0;
+  std::atomic<uintmax_t> successes = 0;
+  std::atomic<uintmax_t> failures_no_stream = 0;
+  std::atomic<uintmax_t> failures_error = 0;
+  std::atomic<uintmax_t> failures_verification = 0;
+  Phase attempt;
+  Phase verify;
+  Phase recursion;
+  Phase recompress;
+  std::atomic<uintmax_t> bytes_in = 0;
+  std::atomic<uintmax_t> bytes_out = 0;
+
+  void copy_to(CFormatProfile& profile) const;
+};
+// Indexed by the first format byte of each format handler
+using PrecompProfile = std::array<FormatProfile, 256>;
+
+// Memory accounts for everything done for a Precomp instance: one for each format handler (by first format byte) and recursion depth, which all add up
+// to the total, along with the buffers Precomp itself keeps
+class PrecompMemoryAccounts {
+public:
+  MemoryAccount total;
+  std::array<std::array<MemoryAccount, PRECOMP_MEMORY_TRACKED_DEPTHS>, 256> handler_accounts;
+
+  PrecompMemoryAccounts();
+  MemoryAccount& get(unsigned char format, int depth);
+  // Lists every handler account currently holding memory
+  std::string describe_current_usage();
+};
+
+// Adds the wall and CPU time from its construction to its destruction to a profiling phase
+class ProfilePhaseTimer {
+  FormatProfile::Phase& phase;
+  std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+  long long start_cpu_time_us = get_thread_cpu_time_us();
+
+public:
+  explicit ProfilePhaseTimer(FormatProfile::Phase& phase_) : phase(phase_) {}
+  ~ProfilePhaseTimer() {
+    const auto wall_time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_time);
+    phase.count++;
+    phase.wall_time_us += wall_time.count();
+    phase.cpu_time_us += std::max(0LL, get_thread_cpu_time_us() - start_cpu_time_us);
+  }
+  ProfilePhaseTimer(const ProfilePhaseTimer&) = delete;
+  ProfilePhaseTimer& operator=(const ProfilePhaseTimer&) = delete;
 };
 
 //input buffer
@@ -67,8 +140,48 @@ constexpr auto DIV3CHUNK = 262143;
 // CHECKBUF is a subsection of the IN_BUF, from the current position onwards, format support modules should only read this section of the IN_BUF
 constexpr auto CHECKBUF_SIZE = 4096;
 constexpr auto COMP_CHUNK = 512;
+// The final output is written on a background thread through a few buffers of this size
+constexpr auto WRITE_BEHIND_BUFFER_SIZE = 4 * 1024 * 1024;
+constexpr auto WRITE_BEHIND_BUFFER_COUNT = 4;
+// Minimum time between progress callback calls
+constexpr auto PROGRESS_CALLBACK_INTERVAL_MS = 50;
 constexpr auto MAX_IO_BUFFER_SIZE = 64 * 1024 * 1024;
 
+// Layout of the data after the PCF header, stored on the byte that used to hold the compression-on-the-fly method, which is no longer supported.
+// Values used by the original Precomp for that are avoided so we don't misread their PCF files.
+enum PcfLayout : unsigned char {
+  // Just records (uncompressed data or precompressed streams) until the end of the file
+  PCF_LAYOUT_RECORDS = 0,
+  // Records too, but the header ends with the dedup window size as a vlint, and streams repeating one of the latest ones are stored as D_REPEAT records.
+  // Every precompressed record of at least DEDUP_MIN_STREAM_SIZE bytes and at most the dedup window (original size) is numbered in order, D_REPEAT records included,
+  // and the latest ones adding up to at most the dedup window are remembered. A D_REPEAT record has just the vlint distance back to the number of the stream it repeats.
+  PCF_LAYOUT_DEDUP_RECORDS = 64,
+  // The input was split in segments that were precompressed independently, each one is stored as a block with its original length, the length of its records
+  // and the records, until a block with an original length of 0
+  PCF_LAYOUT_BLOCKS = 128,
+};
+
+// Streams smaller than this aren't worth keeping track of for PCF_LAYOUT_DEDUP_RECORDS, and are left out of the numbering
+constexpr long long DEDUP_MIN_STREAM_SIZE = 1024;
+inline bool dedup_window_remembers(long long stream_size, long long dedup_window) {
+  return stream_size >= DEDUP_MIN_STREAM_SIZE && stream_size <= dedup_window;
+}
+
+// Where a record written to a PCF is, both on the original input and on the PCF
+struct PcfRecordInfo {
+  long long original_pos;
+  long long original_length;
+  long long pcf_pos;
+  long long pcf_length = 0;
+  // Uncompressed data records are not precompressed, and have no format
+  bool precompressed = false;
+  unsigned char format = 0;
+  bool recursion_used = false;
+  // SHA1 of the original data of streams, and of its first PrecompBasePcf::KEY_SIZE bytes for longer ones, empty until the PCF index is written
+  std::optional<std::string> original_sha1 = std::nullopt;
+  std::optional<std::string> original_key_sha1 = std::nullopt;
+};
+
 class Precomp;
 class RecursionContext: public CRecursionContext {
 public:
@@ -78,7 +191,7 @@ public:
 
   // Ignore offsets can be set for any Format handler, so that if for example, we failed to precompress a deflate stream inside a ZIP file, we don't attempt to precompress
   // it again, which is destined to fail, by using the intense mode (ZLIB) format handler.
-  std::unordered_map<SupportedFormats, std::set<long long>> ignore_offsets;
+  std::unordered_map<SupportedFormats, OffsetCursorSet> ignore_offsets;
 
   std::unique_ptr<IStreamLike> fin = std::make_unique<WrappedIStream>(new std::ifstream(), true);
   void set_input_stream(std::istream* istream, bool take_ownership = true);
@@ -97,7 +210,60 @@ public:
   // Uncompressed data info
   long long uncompressed_pos;
   std::optional<long long> uncompressed_length = std::nullopt;
+  // The uncompressed data itself, kept as the input is scanned so it doesn't have to be read again to write it, unless it's larger than uncompressed_buffer_size.
+  // Only complete if its size is uncompressed_length, otherwise it's empty and the data is read again from the input.
+  std::vector<unsigned char> uncompressed_data;
   long long uncompressed_bytes_total = 0;
+
+  // If set, every record written to fout during precompression gets logged here
+  std::optional<std::vector<PcfRecordInfo>> written_records;
+  // Set for the contexts used to verify precompressed streams (and any recursion inside them), so those recompressions aren't profiled as such
+  bool verifying = false;
+  // How many contexts this one is nested in, for tracing
+  int depth = 0;
+  // Set by read_header on the top level context of PCFs with the PCF_LAYOUT_DEDUP_RECORDS layout, 0 otherwise
+  long long dedup_window = 0;
+};
+
+// Remembers candidates format handlers already failed on, so an identical candidate found again (at another offset, recursion depth, or on another thread)
+// can be rejected right away instead of going through the same expensive failure. Candidates are told apart by the format, and the length and a hash of the data
+// the failure depended on, and looked up by a hash of their first bytes. Only the latest MAX_ENTRIES failures are kept.
+class FailedCandidateCache {
+public:
+  // Sizes the handler got to before failing, which it needs to report the failure just like the first time
+  struct Verdict {
+    long long compressed_size = 0;
+    long long decompressed_size = 0;
+  };
+
+private:
+  static constexpr long long KEY_SIZE = 64;
+  static constexpr size_t MAX_ENTRIES = 1 << 16;
+
+  struct Entry {
+    unsigned long long id;
+    SupportedFormats format;
+    long long length;
+    size_t hash;
+    Verdict verdict;
+  };
+
+  std::mutex mtx;
+  std::unordered_multimap<size_t, Entry> entries;
+  // Keys of the entries from oldest to newest, with their ids to tell them apart from newer entries with the same key
+  std::deque<std::pair<size_t, unsigned long long>> entries_order;
+  unsigned long long next_id = 0;
+
+  static std::optional<size_t> hash_input(IStreamLike& input, long long pos, long long length);
+
+public:
+  // Failures whose data is smaller than this are cheap enough to just go through again
+  static constexpr long long MIN_CANDIDATE_SIZE = 1024;
+
+  // Looks for a failure of format on the data of input at pos, where the candidate is between min_length and max_length bytes long
+  std::optional<Verdict> find(SupportedFormats format, IStreamLike& input, long long pos, long long min_length, long long max_length);
+  // Records that format failed on the length bytes of input at pos, and only depended on those
+  void add(SupportedFormats format, IStreamLike& input, long long pos, long long length, Verdict verdict);
 };
 
 class precompression_result
@@ -125,7 +291,11 @@ public:
     bool recursion_used = false;
     long long recursion_filesize = 0;
 
-    virtual void dump_to_outfile(OStreamLike& outfile) const;
+    // Writes everything that precedes the precompressed data on the PCF record, handlers with extra header data override this
+    virtual void dump_record_header_to_outfile(OStreamLike& outfile) const;
+    // Whether dump_precompressed_data_to_outfile writes precompressed_stream as is, so the record can be read without copying the data
+    virtual bool precompressed_data_is_verbatim() const { return !recursion_used; }
+    void dump_to_outfile(OStreamLike& outfile) const;
     virtual long long complete_original_size() const { return original_size_extra + original_size; }
 };
 
@@ -144,6 +314,89 @@ public:
   unsigned long long recursion_data_size = 0;
 };
 
+// Persistent cache of precompression results in a directory, shared by later runs (even several at once) so they can take the results for streams
+// they have in common with earlier ones instead of precompressing them again. An entry is a successful result of a format handler, before recursion,
+// along with the side effects the attempt had on the statistics, and is keyed by the stream's original data and the switches that affect how it's precompressed.
+// Entries are looked up by a hash of the handler, those switches and the stream's first bytes, then told apart by the stream's length and the SHA1 of all its data.
+// They are written to a temporary file renamed into place, so other runs never see partial entries, and once the cache grows over its size limit, the least
+// recently used entries are removed by trim(). Entries are kept in a directory named after CACHE_VERSION and the library's version, so when either changes
+// the old entries are just never found again, and trim() removes them.
+class PrecompDiskCache {
+public:
+  // Bump whenever the entry layout changes, or a format handler changes the results it gives in a way the library's version doesn't account for
+  static constexpr int CACHE_VERSION = 3;
+
+  struct Hit {
+    std::unique_ptr<precompression_result> result;
+    ResultStatistics statistics;
+    bool non_zlib_was_used = false;
+  };
+
+private:
+  // Streams smaller than this are cheaper to precompress again than to look up
+  static constexpr long long MIN_STREAM_SIZE = 4096;
+  // Lots of streams start the same (JPG tables, archive headers...), so the key covers as much as every cached stream has
+  static constexpr long long KEY_SIZE = MIN_STREAM_SIZE;
+
+  std::filesystem::path version_dir;
+  uintmax_t size_limit;
+
+  std::filesystem::path key_dir(const Precomp& precomp_mgr, SupportedFormats handler_format, long long pos) const;
+  // Returns nothing if the entry is damaged
+  static std::optional<Hit> read_entry(Precomp& precomp_mgr, const std::filesystem::path& path, long long length);
+
+public:
+  PrecompDiskCache(const std::filesystem::path& cache_dir, uintmax_t size_limit_);
+
+  // Looks for a result of the handler identified by handler_format for a stream at pos on precomp_mgr's current input
+  std::optional<Hit> find(Precomp& precomp_mgr, SupportedFormats handler_format, long long pos) const;
+  // Stores the result of the handler identified by handler_format for the stream at pos, along with the statistics the attempt added up and whether it set non_zlib_was_used.
+  // The result's precompressed stream is left at its start.
+  void store(Precomp& precomp_mgr, SupportedFormats handler_format, long long pos, precompression_result& result, const CResultStatistics& statistics, bool non_zlib_was_used) const;
+  // Removes the entries of other versions, and the least recently used ones until the cache is within its size limit
+  void trim() const;
+};
+
+// An earlier PCF of (a previous version of) the input, precompressed with the write_index switch, whose records are copied as they are for the streams still there unchanged,
+// so only new or changed data goes through the format handlers. Records are only taken if the SHA1 of their original data, which the index has, matches the input.
+// They are looked up by their position on the original, shifted as much as the last record taken was, so after data was inserted or removed before them they are
+// found again once one of them is. Streams at least KEY_SIZE bytes long are also looked up by the SHA1 of their first KEY_SIZE bytes, which is how such shifts are found.
+class PrecompBasePcf {
+public:
+  static constexpr long long KEY_SIZE = 4096;
+
+private:
+  std::ifstream base_file;
+  WrappedIStream fin { &base_file, false };
+  // Only records of streams that can be copied on their own, by their original position
+  std::map<long long, PcfRecordInfo> records;
+  std::unordered_multimap<std::string, const PcfRecordInfo*> records_by_key;
+  long long shift = 0;
+  std::string record_settings;
+
+public:
+  // Throws ERR_BASE_PCF_UNUSABLE if the file isn't a PCF with an index, made by this version
+  explicit PrecompBasePcf(const std::string& file_name);
+
+  // The switches that affect records it was made with, see pcf_record_settings. Its records can't be copied to PCFs made with others.
+  const std::string& get_record_settings() const { return record_settings; }
+  // How much the last record taken was shifted by, to go back to it after taking records that were undone
+  long long get_shift() const { return shift; }
+  void restore_shift(long long shift_) { shift = shift_; }
+
+  // Whether pos is inside any of the streams, where they were on the earlier input
+  bool covers(long long pos) const;
+  // Looks for a stream that is at pos on the input, taking at most max_length bytes
+  const PcfRecordInfo* find(IStreamLike& input, long long pos, long long max_length);
+  void copy_record(const PcfRecordInfo& record, OStreamLike& output);
+};
+
+// Magic bytes that any stream supported by a format handler starts with, used to quickly find positions worth calling quick_check on
+struct MagicSignature {
+  std::string bytes;
+  bool case_insensitive = false;
+};
+
 class PrecompFormatHandler;
 extern std::map<SupportedFormats, std::function<PrecompFormatHandler*()>> registeredHandlerFactoryFunctions;
 
@@ -176,6 +429,16 @@ public:
     // might have already seen part of the data on the buffer_chunk, like insane/brute deflate handlers that use an histogram to detect false positives.
     virtual bool quick_check(const std::span<unsigned char> buffer_chunk, uintptr_t current_input_id, const long long original_input_pos) = 0;
 
+    // Format handlers whose quick_check can only ever succeed at positions starting with some fixed magic bytes should declare them here.
+    // If all active format handlers do so, Precomp can skip straight to the positions where at least one of them might match instead of calling every quick_check
+    // on every single byte. Handlers that can't be prefiltered like that (for example intense/brute mode) must return an empty vector, which disables the prefilter.
+    virtual std::vector<MagicSignature> get_magic_signatures() const { return {}; }
+
+    // Whether the results of attempt_precompression only depend on the stream's data and the switches (see PrecompDiskCache), so they can be taken from the cache
+    // or attempted speculatively on another instance of the handler (see PrecompLookahead).
+    // Handlers whose attempts depend on or change some state of theirs, or that are cheap enough that looking them up isn't worth it, should return false.
+    virtual bool results_cacheable() const { return true; }
+
     // The main precompression entrypoint, you are given full access to Precomp instance which in turn gives you access to the current context and input/output streams.
     // You should however if possible not output anything to the output stream directly or otherwise mess with the Precomp instance or current context unless strictly necessary,
     // ideally the format handler should just read from the context's input stream, precompress the data, and return a precompression_result, without touching much else.
@@ -185,13 +448,16 @@ public:
     // recompress method is guaranteed to get the PrecompFormatHeaderData gotten from read_format_header(), so you can, and probably should, downcast to a derived class
     // with your extra format header data, provided you are using and returned such an instance from read_format_header()
     virtual void recompress(IStreamLike& precompressed_input, OStreamLike& recompressed_stream, PrecompFormatHeaderData& precomp_hdr_data, SupportedFormats precomp_hdr_format, const Tools& tools) = 0;
+    // How many bytes of precompressed data recompress() will read after the format header, if that can be known from the header alone, which lets that data be read
+    // ahead so several streams can be recompressed at once. Not used if the stream has recursion data, as that's known to be recursion_data_size bytes instead.
+    virtual std::optional<unsigned long long> get_precompressed_data_size(const PrecompFormatHeaderData& precomp_hdr_data) { return precomp_hdr_data.precompressed_size; }
     // Any data that must be written before the actual stream's data, where recursion can occur, must be written here as this is executed before recompress()
     // Such data should be things like Zip/ZLib or any other compression/container headers.
     virtual void write_pre_recursion_data(RecursionContext& context, PrecompFormatHeaderData& precomp_hdr_data) {}
 
     // Each format handler is associated with at least one header byte which is outputted to the PCF file when writting the precompressed data
     // If there is more than one supported header byte for the handler, keep in mind that the handler will still be identified by the first one on the vector
-    const std::vector<SupportedFormats>& get_header_bytes() { return header_bytes; }
+    const std::vector<SupportedFormats>& get_header_bytes() const { return header_bytes; }
 
     // Subclasses should register themselves here, as the available PrecompFormatHandlers will be queried and the instances created when we create Precomp instances.
     // If you fail to register the PrecompFormatHandler here then it won't be available and any attempt to set it up for precompression, or of recompressing any file that uses your
@@ -207,27 +473,52 @@ public:
 
 class Precomp {
   std::function<void(float)> progress_callback;
+  // Streams can be recompressed on several threads at once, but the callback shouldn't need to care about that
+  std::mutex progress_callback_mtx;
+  std::atomic<long long> last_progress_callback_time = 0;
   void set_input_stdin();
   void set_output_stdout();
-  void register_output_observer_callbacks();
   std::vector<std::unique_ptr<PrecompFormatHandler>> format_handlers {};
+  // Handlers with several format bytes are identified by their first one
+  unsigned char handler_format_byte(SupportedFormats format) const;
 
 public:
   explicit Precomp();
 
   Switches switches;
   ResultStatistics statistics;
+  // Shared with any Precomp instances cloned to work on other threads for this one, so it adds up everything done for it
+  std::shared_ptr<PrecompProfile> profile = std::make_shared<PrecompProfile>();
+  // Profiling counters of the format handler for the given format byte
+  FormatProfile& get_format_profile(SupportedFormats format);
+  // Shared with cloned instances just like profile
+  std::shared_ptr<PrecompMemoryAccounts> memory = std::make_shared<PrecompMemoryAccounts>();
+  // Shared with cloned instances too, as any of them might find the same candidates
+  std::shared_ptr<FailedCandidateCache> failed_candidates = std::make_shared<FailedCandidateCache>();
+  // Set by PrecompSetCacheDir, also shared with cloned instances
+  std::shared_ptr<PrecompDiskCache> disk_cache;
+  // Set by PrecompSetBasePcf, only used on the top level of the precompression, so it isn't shared with cloned instances
+  std::unique_ptr<PrecompBasePcf> base_pcf;
+  // Memory account of the format handler for the given format byte at the given recursion depth
+  MemoryAccount& get_memory_account(SupportedFormats format, int depth);
+  // Results of the last analysis (dry run), indexed by the first format byte of each format handler, and how long its scan took leaving the streams aside
+  std::array<CFormatAnalysis, 256> analysis {};
+  long long analysis_scan_time_us = 0;
   std::unique_ptr<RecursionContext> ctx = std::make_unique<RecursionContext>(0, 100, *this);
   std::vector<std::unique_ptr<RecursionContext>> recursion_contexts_stack;
 
   std::string input_file_name;
   std::string output_file_name;
+  std::string trace_file_name;
+  PcfLayout pcf_layout = PCF_LAYOUT_RECORDS;
   // Useful so we can easily get (for example) info on the original input/output streams at any time
   std::unique_ptr<RecursionContext>& get_original_context();
   void set_input_stream(std::istream* istream, bool take_ownership = true);
   void set_input_stream(FILE* fhandle, bool take_ownership = true);
   void set_output_stream(std::ostream* ostream, bool take_ownership = true);
   void set_output_stream(FILE* fhandle, bool take_ownership = true);
+  // Puts the write behind buffering in front of the final output and registers the observers to update progress while writing to it
+  void setup_output_stream();
 
   void set_progress_callback(std::function<void(float)> callback);
   void call_progress_callback();
@@ -1,10 +1,22 @@
 #include "precomp_io.h"
 #include "precomp_utils.h"
 
+#include <algorithm>
 #include <array>
+#include <cstring>
 #include <filesystem>
 #include <memory>
 
+#ifndef __unix
+#define NOMINMAX  // So std::min and std::max can be used without windows.h macros getting in the way
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 std::string get_sha1_hash(boost::uuids::detail::sha1& s) {
     unsigned int hash[5];
     s.get_digest(hash);
@@ -20,23 +32,6 @@ std::string get_sha1_hash(boost::uuids::detail::sha1& s) {
     return std::string(buf);
 }
 
-std::string calculate_sha1(IStreamLike& file1, unsigned int pos1) {
-    std::vector<unsigned char> input_bytes1;
-    input_bytes1.resize(CHUNK);
-    long long size1;
-    boost::uuids::detail::sha1 s;
-
-    file1.seekg(pos1, std::ios_base::beg);
-
-    do {
-        file1.read(reinterpret_cast<char*>(input_bytes1.data()), CHUNK);
-        size1 = file1.gcount();
-        s.process_bytes(input_bytes1.data(), size1);
-    } while (size1 == CHUNK);
-
-    return get_sha1_hash(s);
-}
-
 Sha1Ostream& Sha1Ostream::write(const char* buf, std::streamsize count) {
     s.process_bytes(reinterpret_cast<const unsigned char*>(buf), count);
     dataLength += count;
@@ -58,10 +53,159 @@ Sha1Ostream& Sha1Ostream::seekp(std::ostream::off_type offset, std::ios_base::se
     throw std::runtime_error("Can't seek on Sha1Ostream");
 }
 
+RangeOStream& RangeOStream::write(const char* buf, std::streamsize count) {
+  const uint64_t write_start = std::max(current_pos, range_start);
+  const uint64_t write_end = std::min(current_pos + count, range_end);
+  if (write_start < write_end) ostream->write(buf + (write_start - current_pos), write_end - write_start);
+  current_pos += count;
+  return *this;
+}
+
+RangeOStream& RangeOStream::put(char chr) {
+  return write(&chr, 1);
+}
+
+RangeOStream& RangeOStream::seekp(std::ostream::off_type offset, std::ios_base::seekdir dir) {
+  throw std::runtime_error("Can't seek on RangeOStream");
+}
+
 std::string Sha1Ostream::get_digest() {
     return get_sha1_hash(s);
 }
 
+CopyingOStream& CopyingOStream::write(const char* buf, std::streamsize count) {
+  ostream->write(buf, count);
+  dataLength += count;
+  if (dataLength <= max_copy_size) {
+    copy->insert(copy->end(), buf, buf + count);
+  }
+  else if (!copy->empty()) {
+    copy->clear();
+    copy->shrink_to_fit();
+  }
+  return *this;
+}
+
+CopyingOStream& CopyingOStream::put(char chr) {
+  return write(&chr, 1);
+}
+
+CopyingOStream& CopyingOStream::seekp(std::ostream::off_type offset, std::ios_base::seekdir dir) {
+  throw std::runtime_error("Can't seek on CopyingOStream");
+}
+
+bool SpillBudget::take(long long size) {
+  if (used.fetch_add(size) + size > limit) {
+    used -= size;
+    return false;
+  }
+  if (account != nullptr) account->add(size);
+  return true;
+}
+
+void SpillBudget::release(long long size) {
+  used -= size;
+  if (account != nullptr) account->add(-size);
+}
+
+void SpillingOStream::spill() {
+  file_data = std::make_unique<PrecompTmpFile>();
+  file_data->open(spill_file_name, std::ios_base::in | std::ios_base::out | std::ios_base::app | std::ios_base::binary);
+  file_data->write(memory_data.data(), static_cast<std::streamsize>(memory_data.size()));
+  std::vector<char>().swap(memory_data);
+  budget.release(memory_budget_taken);
+  memory_budget_taken = 0;
+}
+
+SpillingOStream& SpillingOStream::write(const char* buf, std::streamsize count) {
+  if (!file_data) {
+    const long long needed_budget = static_cast<long long>(memory_data.size()) + count - memory_budget_taken;
+    if (needed_budget > 0) {
+      const long long budget_step = std::max<long long>(needed_budget, BUDGET_STEP);
+      if (budget.take(budget_step)) memory_budget_taken += budget_step;
+      else if (budget.take(needed_budget)) memory_budget_taken += needed_budget;
+      else spill();
+    }
+  }
+  if (file_data) file_data->write(buf, count);
+  else memory_data.insert(memory_data.end(), buf, buf + count);
+  dataLength += count;
+  return *this;
+}
+
+SpillingOStream& SpillingOStream::put(char chr) {
+  return write(&chr, 1);
+}
+
+SpillingOStream& SpillingOStream::seekp(std::ostream::off_type offset, std::ios_base::seekdir dir) {
+  throw std::runtime_error("Can't seek on SpillingOStream");
+}
+
+IStreamLike& SpillingOStream::input() {
+  if (file_data) {
+    file_data->close();
+    file_data->reopen();
+    return *file_data;
+  }
+  memory_input = memiostream::make(reinterpret_cast<unsigned char*>(memory_data.data()), reinterpret_cast<unsigned char*>(memory_data.data()) + memory_data.size());
+  return *memory_input;
+}
+
+void ChainedIStream::add_part(std::unique_ptr<IStreamLike>&& istream, long long size) {
+  parts.push_back({ std::move(istream), total_size, size });
+  total_size += size;
+}
+
+ChainedIStream& ChainedIStream::read(char* buff, std::streamsize count) {
+  _gcount = 0;
+  while (count > 0 && current_part < parts.size()) {
+    auto& part = parts[current_part];
+    const long long part_remaining = part.start_pos + part.size - current_stream_pos;
+    if (part_remaining <= 0) {
+      current_part++;
+      if (current_part < parts.size()) parts[current_part].istream->seekg(0, std::ios_base::beg);
+      continue;
+    }
+    const std::streamsize to_read = std::min<long long>(count, part_remaining);
+    part.istream->read(buff + _gcount, to_read);
+    const auto part_gcount = part.istream->gcount();
+    _gcount += part_gcount;
+    current_stream_pos += part_gcount;
+    count -= part_gcount;
+    if (part_gcount < to_read) {
+      // A part ended before its declared size, the chain can't go on from here
+      _bad = true;
+      break;
+    }
+  }
+  if (count > 0) _eof = true;
+  return *this;
+}
+
+std::istream::int_type ChainedIStream::get() {
+  unsigned char chr[1];
+  read(reinterpret_cast<char*>(&chr[0]), 1);
+  return _gcount == 1 ? chr[0] : EOF;
+}
+
+ChainedIStream& ChainedIStream::seekg(std::istream::off_type offset, std::ios_base::seekdir dir) {
+  long long new_pos = offset;
+  if (dir == std::ios_base::cur) new_pos += current_stream_pos;
+  else if (dir == std::ios_base::end) new_pos = total_size - offset;
+  if (new_pos < 0 || new_pos > total_size) throw std::runtime_error("Can't seek outside of a ChainedIStream");
+
+  _eof = false;
+  current_stream_pos = new_pos;
+  current_part = 0;
+  while (current_part + 1 < parts.size() && new_pos >= parts[current_part].start_pos + parts[current_part].size) current_part++;
+  if (current_part < parts.size()) {
+    auto& part = parts[current_part];
+    part.istream->clear();
+    part.istream->seekg(new_pos - part.start_pos, std::ios_base::beg);
+  }
+  return *this;
+}
+
 size_t ostream_printf(OStreamLike& out, const std::string& str) {
   for (char character : str) {
     out.put(character);
@@ -240,6 +384,80 @@ FILEIStream& FILEIStream::seekg(std::istream::off_type offset, std::ios_base::se
 }
 std::istream::pos_type FILEIStream::tellg() { return std::ftell(file_ptr); }
 
+std::unique_ptr<MemoryMappedIStream> MemoryMappedIStream::open(const std::string& file_path) {
+  auto istream = std::unique_ptr<MemoryMappedIStream>(new MemoryMappedIStream());
+#ifndef __unix
+  HANDLE file_handle = CreateFileA(file_path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (file_handle == INVALID_HANDLE_VALUE) return nullptr;
+  istream->file_handle = file_handle;
+  LARGE_INTEGER file_size;
+  if (GetFileType(file_handle) != FILE_TYPE_DISK || !GetFileSizeEx(file_handle, &file_size) || file_size.QuadPart == 0) return nullptr;
+  // Copy on write pages, so even if something writes to the data the file is never modified
+  HANDLE mapping_handle = CreateFileMappingA(file_handle, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+  if (mapping_handle == nullptr) return nullptr;
+  istream->mapping_handle = mapping_handle;
+  void* mapping = MapViewOfFile(mapping_handle, FILE_MAP_COPY, 0, 0, 0);
+  if (mapping == nullptr) return nullptr;
+  istream->data = static_cast<unsigned char*>(mapping);
+  istream->size = file_size.QuadPart;
+#else
+  const int fd = ::open(file_path.c_str(), O_RDONLY);
+  if (fd == -1) return nullptr;
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode) || file_stat.st_size == 0) {
+    ::close(fd);
+    return nullptr;
+  }
+  // Private mapping, so even if something writes to the data the file is never modified
+  void* mapping = mmap(nullptr, file_stat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  // The mapping stays valid after closing the file descriptor
+  ::close(fd);
+  if (mapping == MAP_FAILED) return nullptr;
+  madvise(mapping, file_stat.st_size, MADV_SEQUENTIAL);
+  istream->data = static_cast<unsigned char*>(mapping);
+  istream->size = file_stat.st_size;
+#endif
+  return istream;
+}
+MemoryMappedIStream::~MemoryMappedIStream() {
+#ifndef __unix
+  if (data != nullptr) UnmapViewOfFile(data);
+  if (mapping_handle != nullptr) CloseHandle(mapping_handle);
+  if (file_handle != nullptr) CloseHandle(file_handle);
+#else
+  if (data != nullptr) munmap(data, size);
+#endif
+}
+MemoryMappedIStream& MemoryMappedIStream::read(char* buff, std::streamsize count) {
+  _gcount = 0;
+  if (_eof) return *this;
+  const long long available = std::max<long long>(size - current_pos, 0);
+  _gcount = std::min<long long>(count, available);
+  std::memcpy(buff, data + current_pos, _gcount);
+  current_pos += _gcount;
+  if (_gcount < count) _eof = true;
+  return *this;
+}
+std::istream::int_type MemoryMappedIStream::get() {
+  unsigned char chr[1];
+  read(reinterpret_cast<char*>(&chr[0]), 1);
+  return _gcount == 1 ? chr[0] : EOF;
+}
+MemoryMappedIStream& MemoryMappedIStream::seekg(std::istream::off_type offset, std::ios_base::seekdir dir) {
+  // Like WrappedIStream, seeking is allowed after reaching the end of the file
+  _eof = false;
+  if (dir == std::ios_base::beg) {
+    current_pos = offset;
+  }
+  else if (dir == std::ios_base::end) {
+    current_pos = size + offset;
+  }
+  else {
+    current_pos += offset;
+  }
+  return *this;
+}
+
 WrappedIStream::WrappedIStream(std::istream* stream, bool take_ownership) : WrappedStream(stream, take_ownership) { }
 bool WrappedIStream::eof() { return WrappedStream::eof(); }
 bool WrappedIStream::good() { return WrappedStream::good(); }
@@ -300,6 +518,11 @@ void IStreamLikeView::clear() {
   _eof = false;
   istream->clear();
 }
+std::span<const unsigned char> IStreamLikeView::mapped_data() {
+  const auto data = istream->mapped_data();
+  if (data.empty() || final_allowed_stream_pos > static_cast<long long>(data.size())) return {};
+  return data.subspan(starting_stream_pos, final_allowed_stream_pos - starting_stream_pos);
+}
 IStreamLikeView& IStreamLikeView::seekg(std::istream::off_type offset, std::ios_base::seekdir dir) {
   if (bad()) {
     throw std::runtime_error(make_cstyle_format_string("Input stream went bad"));
@@ -318,17 +541,318 @@ IStreamLikeView& IStreamLikeView::seekg(std::istream::off_type offset, std::ios_
   return *this;
 }
 
-void ObservableStreamBase::register_observer(observable_methods method, std::function<void()> callback) {
-  method_observers[method] = callback;
+SharedIStreamView::SharedIStreamView(SharedIStream* shared_istream_, long long starting_stream_pos) : shared_istream(shared_istream_), current_stream_pos(starting_stream_pos) {}
+SharedIStreamView::~SharedIStreamView() {
+  std::lock_guard lock(shared_istream->mtx);
+  if (shared_istream->last_reader == this) shared_istream->last_reader = nullptr;
+}
+void SharedIStreamView::acquire_stream() {
+  if (shared_istream->last_reader == this) return;
+  shared_istream->istream->seekg(current_stream_pos, std::ios_base::beg);
+  shared_istream->last_reader = this;
+}
+SharedIStreamView& SharedIStreamView::read(char* buff, std::streamsize count) {
+  std::lock_guard lock(shared_istream->mtx);
+  acquire_stream();
+  shared_istream->istream->read(buff, count);
+  _gcount = shared_istream->istream->gcount();
+  _eof = shared_istream->istream->eof();
+  _bad = shared_istream->istream->bad();
+  current_stream_pos += _gcount;
+  return *this;
+}
+std::istream::int_type SharedIStreamView::get() {
+  std::lock_guard lock(shared_istream->mtx);
+  acquire_stream();
+  auto chr = shared_istream->istream->get();
+  _gcount = shared_istream->istream->gcount();
+  _eof = shared_istream->istream->eof();
+  _bad = shared_istream->istream->bad();
+  current_stream_pos += _gcount;
+  return chr;
+}
+std::streamsize SharedIStreamView::gcount() { return _gcount; }
+// Like a std::istream, we report failure after reading past the end of the stream
+std::istream::pos_type SharedIStreamView::tellg() { return _eof ? -1 : current_stream_pos; }
+bool SharedIStreamView::eof() { return _eof; }
+bool SharedIStreamView::good() { return !_eof && !_bad; }
+bool SharedIStreamView::bad() { return _bad; }
+void SharedIStreamView::clear() {
+  _eof = false;
+  _bad = false;
+  std::lock_guard lock(shared_istream->mtx);
+  if (shared_istream->last_reader == this) shared_istream->istream->clear();
+}
+SharedIStreamView& SharedIStreamView::seekg(std::istream::off_type offset, std::ios_base::seekdir dir) {
+  if (bad()) {
+    throw std::runtime_error(make_cstyle_format_string("Input stream went bad"));
+  }
+  _eof = false;
+  std::lock_guard lock(shared_istream->mtx);
+  if (dir == std::ios_base::beg) {
+    current_stream_pos = offset;
+  }
+  else if (dir == std::ios_base::cur) {
+    current_stream_pos += offset;
+  }
+  else {
+    shared_istream->istream->seekg(offset, dir);
+    current_stream_pos = shared_istream->istream->tellg();
+    shared_istream->last_reader = this;
+    return *this;
+  }
+  // Seeking is deferred until the next read, so when only one thread is actively reading we don't pay for any extra seeks
+  if (shared_istream->last_reader == this) shared_istream->last_reader = nullptr;
+  return *this;
 }
-void ObservableStreamBase::notify_observer(observable_methods method) {
-  auto observer_callback = method_observers[method];
-  if (observer_callback) observer_callback();
+
+ReadAheadIStream::ReadAheadIStream(std::unique_ptr<IStreamLike>&& istream_, size_t block_size_, size_t max_blocks_)
+  : istream(std::move(istream_)), block_size(block_size_), max_blocks(max_blocks_) {
+  current_stream_pos = istream->tellg();
+  istream->seekg(0, std::ios_base::end);
+  stream_size = istream->tellg();
+  istream->seekg(current_stream_pos, std::ios_base::beg);
+  fetch_pos = current_stream_pos;
+  fetch_thread = std::thread(&ReadAheadIStream::fetch, this);
+}
+ReadAheadIStream::~ReadAheadIStream() {
+  {
+    std::lock_guard lock(mtx);
+    stopping = true;
+    cv.notify_all();
+  }
+  fetch_thread.join();
+}
+
+void ReadAheadIStream::fetch() {
+  // Where the wrapped stream is positioned, so we only seek it after a restart
+  long long istream_pos = fetch_pos;
+  std::unique_lock lock(mtx);
+  while (true) {
+    cv.wait(lock, [&]() { return stopping || (!fetch_eof && blocks.size() < max_blocks); });
+    if (stopping) return;
+    const auto block_generation = generation;
+    Block block { fetch_pos, std::vector<char>(block_size) };
+    lock.unlock();
+
+    std::streamsize read_amount = 0;
+    bool read_bad = false;
+    try {
+      if (block.pos != istream_pos) istream->seekg(block.pos, std::ios_base::beg);
+      istream->read(block.data.data(), block_size);
+      read_amount = istream->gcount();
+      read_bad = istream->bad();
+      if (istream->eof()) istream->clear();
+    }
+    catch (const std::exception&) {
+      read_bad = true;
+    }
+    istream_pos = block.pos + read_amount;
+
+    lock.lock();
+    if (block_generation != generation) continue;
+    block.data.resize(read_amount);
+    fetch_pos += read_amount;
+    fetch_eof = read_bad || read_amount < static_cast<std::streamsize>(block_size);
+    fetch_bad = read_bad;
+    if (read_amount > 0) blocks.push_back(std::move(block));
+    cv.notify_all();
+  }
+}
+
+void ReadAheadIStream::restart_from(long long pos) {
+  blocks.clear();
+  fetch_pos = pos;
+  fetch_eof = false;
+  fetch_bad = false;
+  generation++;
+  cv.notify_all();
+}
+
+ReadAheadIStream& ReadAheadIStream::read(char* buff, std::streamsize count) {
+  _gcount = 0;
+  std::unique_lock lock(mtx);
+  while (count > 0) {
+    // As reading goes forward blocks before the current position are not needed anymore, which makes room for the next ones
+    bool dropped_blocks = false;
+    while (!blocks.empty() && blocks.front().pos + static_cast<long long>(blocks.front().data.size()) <= current_stream_pos) {
+      blocks.pop_front();
+      dropped_blocks = true;
+    }
+    if (dropped_blocks) cv.notify_all();
+
+    if (!blocks.empty() && blocks.front().pos <= current_stream_pos) {
+      const auto& block = blocks.front();
+      const long long block_offset = current_stream_pos - block.pos;
+      const long long copy_amount = std::min<long long>(count, block.data.size() - block_offset);
+      std::memcpy(buff, block.data.data() + block_offset, copy_amount);
+      buff += copy_amount;
+      count -= copy_amount;
+      _gcount += copy_amount;
+      current_stream_pos += copy_amount;
+      continue;
+    }
+    // Past the buffered data, unless it's too far ahead the block we need is either being read right now or we are at the end of the stream
+    if (blocks.empty() && current_stream_pos >= fetch_pos && (fetch_eof || current_stream_pos < fetch_pos + static_cast<long long>(block_size))) {
+      if (fetch_eof) {
+        _eof = true;
+        break;
+      }
+      TraceSpan span("wait", "read ahead wait");
+      cv.wait(lock, [&]() { return !blocks.empty() || fetch_eof; });
+      continue;
+    }
+    restart_from(current_stream_pos);
+  }
+  return *this;
+}
+std::istream::int_type ReadAheadIStream::get() {
+  char chr;
+  read(&chr, 1);
+  return _gcount == 1 ? static_cast<unsigned char>(chr) : EOF;
+}
+bool ReadAheadIStream::bad() {
+  std::lock_guard lock(mtx);
+  return fetch_bad && blocks.empty() && current_stream_pos == fetch_pos;
+}
+ReadAheadIStream& ReadAheadIStream::seekg(std::istream::off_type offset, std::ios_base::seekdir dir) {
+  // Seeking only moves our position, reading ahead restarts from it on the next read if the data there isn't buffered
+  _eof = false;
+  if (dir == std::ios_base::beg) {
+    current_stream_pos = offset;
+  }
+  else if (dir == std::ios_base::cur) {
+    current_stream_pos += offset;
+  }
+  else {
+    current_stream_pos = stream_size + offset;
+  }
+  return *this;
+}
+
+WriteBehindOStream::WriteBehindOStream(std::unique_ptr<OStreamLike>&& ostream_, size_t buffer_size_, size_t max_pending_buffers_)
+  : ostream(std::move(ostream_)), buffer_size(buffer_size_), max_pending_buffers(max_pending_buffers_) {
+  base_pos = ostream->tellp();
+  current_buffer.reserve(buffer_size);
+  write_thread = std::thread(&WriteBehindOStream::write_pending, this);
+}
+WriteBehindOStream::~WriteBehindOStream() {
+  submit_current_buffer();
+  {
+    std::lock_guard lock(mtx);
+    stopping = true;
+    cv.notify_all();
+  }
+  write_thread.join();
+  ostream->flush();
+}
+
+void WriteBehindOStream::write_pending() {
+  std::unique_lock lock(mtx);
+  while (true) {
+    cv.wait(lock, [&]() { return stopping || !pending_buffers.empty(); });
+    // When stopping we still write everything that's pending
+    if (pending_buffers.empty()) return;
+    auto buffer = std::move(pending_buffers.front());
+    pending_buffers.pop_front();
+    writing = true;
+    lock.unlock();
+
+    bool buffer_write_bad;
+    try {
+      ostream->write(buffer.data(), buffer.size());
+      buffer_write_bad = ostream->bad();
+    }
+    catch (const std::exception&) {
+      buffer_write_bad = true;
+    }
+    buffer.clear();
+
+    lock.lock();
+    writing = false;
+    write_bad = write_bad || buffer_write_bad;
+    free_buffers.push_back(std::move(buffer));
+    cv.notify_all();
+  }
+}
+
+void WriteBehindOStream::submit_current_buffer() {
+  if (current_buffer.empty()) return;
+  std::unique_lock lock(mtx);
+  if (pending_buffers.size() >= max_pending_buffers) {
+    TraceSpan span("wait", "write behind wait");
+    cv.wait(lock, [&]() { return pending_buffers.size() < max_pending_buffers; });
+  }
+  pending_buffers.push_back(std::move(current_buffer));
+  if (!free_buffers.empty()) {
+    current_buffer = std::move(free_buffers.back());
+    free_buffers.pop_back();
+  }
+  else {
+    current_buffer = std::vector<char>();
+    current_buffer.reserve(buffer_size);
+  }
+  cv.notify_all();
+}
+
+void WriteBehindOStream::wait_until_written() {
+  submit_current_buffer();
+  TraceSpan span("wait", "write behind flush");
+  std::unique_lock lock(mtx);
+  cv.wait(lock, [&]() { return pending_buffers.empty() && !writing; });
+}
+
+bool WriteBehindOStream::bad() {
+  std::lock_guard lock(mtx);
+  return write_bad;
+}
+void WriteBehindOStream::clear() {
+  wait_until_written();
+  std::lock_guard lock(mtx);
+  write_bad = false;
+  ostream->clear();
+}
+
+WriteBehindOStream& WriteBehindOStream::write(const char* buf, std::streamsize count) {
+  while (count > 0) {
+    const auto copy_amount = std::min<std::streamsize>(count, buffer_size - current_buffer.size());
+    current_buffer.insert(current_buffer.end(), buf, buf + copy_amount);
+    buf += copy_amount;
+    count -= copy_amount;
+    written_size += copy_amount;
+    if (current_buffer.size() >= buffer_size) submit_current_buffer();
+  }
+  return *this;
+}
+WriteBehindOStream& WriteBehindOStream::put(char chr) {
+  current_buffer.push_back(chr);
+  written_size++;
+  if (current_buffer.size() >= buffer_size) submit_current_buffer();
+  return *this;
+}
+void WriteBehindOStream::flush() {
+  wait_until_written();
+  ostream->flush();
+}
+WriteBehindOStream& WriteBehindOStream::seekp(std::ostream::off_type offset, std::ios_base::seekdir dir) {
+  wait_until_written();
+  ostream->seekp(offset, dir);
+  base_pos = ostream->tellp();
+  written_size = 0;
+  return *this;
+}
+
+void ObservableStreamBase::register_observer(observable_methods method, std::function<void()> callback) {
+  method_observers[method] = std::move(callback);
 }
 
 ObservableOStream& ObservableOStream::write(const char* buf, std::streamsize count) {
   internal_write(buf, count);
-  notify_observer(write_method);
+  unnotified_write_size += count;
+  if (unnotified_write_size >= WRITE_NOTIFY_INTERVAL) {
+    unnotified_write_size = 0;
+    notify_observer(write_method);
+  }
   return *this;
 }
 ObservableOStream& ObservableOStream::put(char chr) {
@@ -360,6 +884,7 @@ bool WrappedFStream::is_open() { return wrapped_iostream->is_open(); }
 void WrappedFStream::close() { wrapped_iostream->close(); }
 
 void WrappedFStream::reopen() {
+  TraceSpan span("io", "file reopen");
   if (wrapped_iostream->is_open()) wrapped_iostream->close();
   open(file_path, mode);
 }
@@ -371,6 +896,7 @@ void WrappedFStream::resize(long long size) {
 
 PrecompTmpFile::PrecompTmpFile() : WrappedFStream() {}
 PrecompTmpFile::~PrecompTmpFile() {
+  TraceSpan span("io", "temp file remove");
   WrappedFStream::close();
   std::remove(file_path.c_str());
 }
@@ -442,6 +968,7 @@ std::unique_ptr<memiostream> memiostream::make(unsigned char* begin, unsigned ch
 void fast_copy(IStreamLike& file1, OStreamLike& file2, long long bytecount) {
   constexpr auto COPY_BUF_SIZE = 512;
   if (bytecount == 0) return;
+  TraceSpan span("io", "copy", [bytecount]() { return make_cstyle_format_string("\"bytes\": %lli", bytecount); });
 
   long long i;
   auto remaining_bytes = (bytecount % COPY_BUF_SIZE);
@@ -459,12 +986,23 @@ void fast_copy(IStreamLike& file1, OStreamLike& file2, long long bytecount) {
 }
 
 void dump_to_file(IStreamLike& istream, std::string filename, long long bytecount) {
+  TraceSpan span("io", "dump to file", [bytecount]() { return make_cstyle_format_string("\"bytes\": %lli", bytecount); });
   WrappedFStream ftempout;
   ftempout.open(filename, std::ios_base::out | std::ios_base::binary);
   fast_copy(istream, ftempout, bytecount);
   ftempout.close();
 }
 
+std::unique_ptr<memiostream> make_input_memstream(IStreamLike& orig_input, std::span<unsigned char> buffer, long long buffer_pos) {
+  const auto mapped_input = orig_input.mapped_data();
+  // The buffer might have stale data after the end of the input, only if it doesn't we can use the mapped data instead and get the same results
+  if (buffer_pos + static_cast<long long>(buffer.size()) <= static_cast<long long>(mapped_input.size())) {
+    auto begin = const_cast<unsigned char*>(mapped_input.data());
+    return memiostream::make(begin + buffer_pos, begin + mapped_input.size());
+  }
+  return memiostream::make(buffer.data(), buffer.data() + buffer.size());
+}
+
 bool read_with_memstream_buffer(IStreamLike& orig_input, std::unique_ptr<memiostream>& memstream_buf, char* target_buf, int minimum_gcount, long long& cur_pos) {
   memstream_buf->read(target_buf, minimum_gcount);
   if (memstream_buf->gcount() == minimum_gcount) {
@@ -575,7 +1113,10 @@ PasstroughStream& PasstroughStream::read(char* buff, std::streamsize count) {
 
             data_needed_cv.notify_one();
             //print_to_log(PRECOMP_NORMAL_LOG, "\n\n%p: WAITING FOR DATA AVAILABLE FOR READ!\n\n", static_cast<void*>(this));
-            data_available_cv.wait(lock);
+            {
+                TraceSpan span("wait", "passthrough wait for writer");
+                data_available_cv.wait(lock);
+            }
             //print_to_log(PRECOMP_NORMAL_LOG, "\n\n%p: WOKE UP FROM WAITING FOR DATA AVAILABLE FOR READ!\n\n", static_cast<void*>(this));
 
             // now that we are back from getting more data, recalculate the iteration_read_count
@@ -629,7 +1170,10 @@ PasstroughStream& PasstroughStream::write(const char* buf, std::streamsize count
         //print_to_log(PRECOMP_NORMAL_LOG, "\n\n%p: WAITING FOR MORE DATA NEEDED FOR WRITE!\n\n", static_cast<void*>(this));
         if (data_available()) {
             data_available_cv.notify_one();
-            data_needed_cv.wait(lock);
+            {
+                TraceSpan span("wait", "passthrough wait for reader");
+                data_needed_cv.wait(lock);
+            }
             // Check if data is actually needed or we were woken up to be terminated
             if (write_eof || read_eof) {
                 if (std::this_thread::get_id() != owner_thread_id) throw std::runtime_error("Some non owning thread attempted to write to an EOF'd PasstroughStream");
@@ -2,17 +2,20 @@
 #define PRECOMP_IO_H
 
 #include "../boost/uuid/detail/sha1.hpp"
+#include "precomp_utils.h"
 
 #include <memory>
 #include <fstream>
 #include <functional>
-#include <map>
+#include <array>
+#include <atomic>
 #include <span>
 #include <vector>
 #include <optional>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <deque>
 
 #ifndef __unix
 #define PATH_DELIM '\\'
@@ -47,6 +50,8 @@ public:
   virtual std::streamsize gcount() = 0;
   virtual IStreamLike& seekg(std::istream::off_type offset, std::ios_base::seekdir dir) = 0;
   virtual std::istream::pos_type tellg() = 0;
+  // If all the stream's data is in memory, as with a memory mapped file, this gives direct access to it so it can be used without copying it anywhere
+  virtual std::span<const unsigned char> mapped_data() { return {}; }
 };
 
 class OStreamLike: public StreamLikeCommon {
@@ -236,6 +241,38 @@ public:
   std::istream::pos_type tellg() override;
 };
 
+// Reads a whole regular file mapped to memory, so reading is just copying from memory and handlers can access the data directly through mapped_data()
+class MemoryMappedIStream : public IStreamLike {
+  unsigned char* data = nullptr;
+  long long size = 0;
+  long long current_pos = 0;
+  std::streamsize _gcount = 0;
+  bool _eof = false;
+#ifndef __unix
+  void* file_handle = nullptr;
+  void* mapping_handle = nullptr;
+#endif
+
+  MemoryMappedIStream() = default;
+public:
+  // Returns nullptr if the file can't be mapped (pipes and other non regular files, empty files, not enough address space), so some other stream is to be used
+  static std::unique_ptr<MemoryMappedIStream> open(const std::string& file_path);
+  ~MemoryMappedIStream() override;
+
+  bool eof() override { return _eof; }
+  bool good() override { return !_eof; }
+  bool bad() override { return false; }
+  void clear() override { _eof = false; }
+
+  MemoryMappedIStream& read(char* buff, std::streamsize count) override;
+  std::istream::int_type get() override;
+  std::streamsize gcount() override { return _gcount; }
+  MemoryMappedIStream& seekg(std::istream::off_type offset, std::ios_base::seekdir dir) override;
+  // Like an ifstream, tellg fails after a read went past the end of the file
+  std::istream::pos_type tellg() override { return _eof ? -1 : current_pos; }
+  std::span<const unsigned char> mapped_data() override { return { data, static_cast<size_t>(size) }; }
+};
+
 class WrappedIStream : public WrappedStream<std::istream>, public IStreamLike {
 public:
   WrappedIStream(std::istream* stream, bool take_ownership);
@@ -275,6 +312,135 @@ public:
   void clear() override;
 
   IStreamLikeView& seekg(std::istream::off_type offset, std::ios_base::seekdir dir) override;
+  std::span<const unsigned char> mapped_data() override;
+};
+
+// Allows several threads to read from the same IStreamLike concurrently through SharedIStreamViews.
+// Each view keeps track of its own position, and every operation on the wrapped stream is done while holding the mutex, seeking to the view's position
+// first if some other view used the stream in the meantime, so as long as only one view is being actively used no extra seeking happens at all.
+class SharedIStreamView;
+class SharedIStream {
+  friend class SharedIStreamView;
+  IStreamLike* istream;
+  std::mutex mtx;
+  const SharedIStreamView* last_reader = nullptr;
+public:
+  explicit SharedIStream(IStreamLike* istream_) : istream(istream_) {}
+};
+
+class SharedIStreamView : public IStreamLike {
+  SharedIStream* shared_istream;
+  long long current_stream_pos;
+  std::streamsize _gcount = 0;
+  bool _eof = false;
+  bool _bad = false;
+
+  // Must be called while holding the shared mutex, ensures the wrapped stream is positioned where this view expects it to be
+  void acquire_stream();
+public:
+  explicit SharedIStreamView(SharedIStream* shared_istream_, long long starting_stream_pos = 0);
+  ~SharedIStreamView() override;
+
+  SharedIStreamView& read(char* buff, std::streamsize count) override;
+  std::istream::int_type get() override;
+  std::streamsize gcount() override;
+  std::istream::pos_type tellg() override;
+  bool eof() override;
+  bool good() override;
+  bool bad() override;
+  void clear() override;
+
+  SharedIStreamView& seekg(std::istream::off_type offset, std::ios_base::seekdir dir) override;
+  // The mapped data is only read, so it can be accessed concurrently without locking
+  std::span<const unsigned char> mapped_data() override { return shared_istream->istream->mapped_data(); }
+};
+
+// Reads the wrapped stream sequentially on a background thread into a few large buffers, so reading from it (mostly) sequentially doesn't wait on the wrapped stream.
+// Seeking to data that is still buffered is free, seeking anywhere else throws away the buffers and starts reading ahead from the new position.
+// The wrapped stream is only used by the background thread, so it shouldn't be used by anything else, a SharedIStreamView can be used to share it.
+class ReadAheadIStream : public IStreamLike {
+  struct Block {
+    long long pos;
+    std::vector<char> data;
+  };
+  std::unique_ptr<IStreamLike> istream;
+  const size_t block_size;
+  const size_t max_blocks;
+  long long stream_size;
+
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::deque<Block> blocks;
+  // Where the background thread reads the next block from, the buffered blocks are always contiguous and end there
+  long long fetch_pos;
+  bool fetch_eof = false;
+  bool fetch_bad = false;
+  // Changes each time reading ahead restarts somewhere else, so a block that was being read when that happened is thrown away
+  unsigned int generation = 0;
+  bool stopping = false;
+  std::thread fetch_thread;
+
+  long long current_stream_pos;
+  std::streamsize _gcount = 0;
+  bool _eof = false;
+
+  void fetch();
+  // Must be called while holding the mutex
+  void restart_from(long long pos);
+public:
+  ReadAheadIStream(std::unique_ptr<IStreamLike>&& istream_, size_t block_size_, size_t max_blocks_);
+  ~ReadAheadIStream() override;
+
+  ReadAheadIStream& read(char* buff, std::streamsize count) override;
+  std::istream::int_type get() override;
+  std::streamsize gcount() override { return _gcount; }
+  std::istream::pos_type tellg() override { return _eof ? -1 : current_stream_pos; }
+  bool eof() override { return _eof; }
+  bool good() override { return !_eof && !bad(); }
+  bool bad() override;
+  void clear() override { _eof = false; }
+
+  ReadAheadIStream& seekg(std::istream::off_type offset, std::ios_base::seekdir dir) override;
+};
+
+// Gathers writes into large buffers which a background thread writes to the wrapped stream, so writing doesn't wait on the wrapped stream.
+// Flushing and seeking wait until everything buffered so far has been written, as does destroying it.
+class WriteBehindOStream : public OStreamLike {
+  std::unique_ptr<OStreamLike> ostream;
+  const size_t buffer_size;
+  const size_t max_pending_buffers;
+  std::vector<char> current_buffer;
+  // Position of the wrapped stream when we started buffering, and how much was written to us since then
+  long long base_pos;
+  long long written_size = 0;
+
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::deque<std::vector<char>> pending_buffers;
+  // Already written buffers, kept so we don't need to allocate new ones all the time
+  std::vector<std::vector<char>> free_buffers;
+  bool writing = false;
+  bool write_bad = false;
+  bool stopping = false;
+  std::thread write_thread;
+
+  void write_pending();
+  void submit_current_buffer();
+  void wait_until_written();
+public:
+  WriteBehindOStream(std::unique_ptr<OStreamLike>&& ostream_, size_t buffer_size_, size_t max_pending_buffers_);
+  ~WriteBehindOStream() override;
+
+  bool eof() override { return false; }
+  bool good() override { return !bad(); }
+  bool bad() override;
+  void clear() override;
+
+  WriteBehindOStream& write(const char* buf, std::streamsize count) override;
+  WriteBehindOStream& put(char chr) override;
+  void flush() override;
+  std::ostream::pos_type tellp() override { return base_pos < 0 ? -1 : base_pos + written_size; }
+  WriteBehindOStream& seekp(std::ostream::off_type offset, std::ios_base::seekdir dir) override;
 };
 
 // With this we can get notified whenever we write to the ostream, useful for registering callbacks to update progress without littering our code with calls for it
@@ -285,16 +451,23 @@ public:
     put_method,
     flush_method,
     tellp_method,
-    seekp_method
+    seekp_method,
+    observable_methods_count
   };
 
   void register_observer(observable_methods method, std::function<void()> callback);
 protected:
-  std::map<observable_methods, std::function<void()>> method_observers = { {write_method, {}} };
-  void notify_observer(observable_methods method);
+  std::array<std::function<void()>, observable_methods_count> method_observers;
+  void notify_observer(observable_methods method) {
+    const auto& observer_callback = method_observers[method];
+    if (observer_callback) observer_callback();
+  }
 };
 
 class ObservableOStream: public OStreamLike, public ObservableStreamBase {
+  // Writes are only notified once every so many bytes were written, otherwise small writes (like all the little PCF headers) would notify way too often
+  static constexpr std::streamsize WRITE_NOTIFY_INTERVAL = 64 * 1024;
+  std::streamsize unnotified_write_size = 0;
 protected:
   virtual void internal_write(const char* buf, std::streamsize count) = 0;
   virtual void internal_put(char chr) = 0;
@@ -431,6 +604,8 @@ void fast_copy(IStreamLike& file1, OStreamLike& file2, long long bytecount);
 
 void dump_to_file(IStreamLike& istream, std::string filename, long long bytecount);
 
+// Makes the memstream for read_with_memstream_buffer from a buffer with the input's data at buffer_pos, if the input is memory mapped it spans all the data to its end instead
+std::unique_ptr<memiostream> make_input_memstream(IStreamLike& orig_input, std::span<unsigned char> buffer, long long buffer_pos);
 bool read_with_memstream_buffer(IStreamLike& orig_input, std::unique_ptr<memiostream>& memstream_buf, char* target_buf, int minimum_gcount, long long& cur_pos);
 // This makes a temporary stream for use as input, reusing checkbuf or copying from original_input to mem if the stream is small enough, or to a temp file if larger
 // copy_to_temp is so you can use a custom way of copying to the temporary stream, in case you need to skip some data or something like that, if not provided, fast_copy will be used
@@ -442,8 +617,6 @@ std::unique_ptr<IStreamLike> make_temporary_stream(
 
 constexpr auto CHUNK = 262144; // 256 KB buffersize
 
-std::string calculate_sha1(IStreamLike& file1, unsigned int pos1);
-
 // This Ostream will process any written data to compute a SHA1 digest, but otherwise discards any data that goes through it, useful for data verification purposes
 class Sha1Ostream : public OStreamLike {
     boost::uuids::detail::sha1 s;
@@ -463,6 +636,130 @@ public:
     std::string get_digest();
 };
 
+// Passes to the wrapped ostream only the written bytes whose position falls in [range_start, range_start + range_length), the rest is discarded
+class RangeOStream : public OStreamLike {
+  OStreamLike* ostream;
+  uint64_t range_start;
+  uint64_t range_end;
+  uint64_t current_pos = 0;
+public:
+  RangeOStream(OStreamLike* ostream_, uint64_t range_start_, uint64_t range_length) : ostream(ostream_), range_start(range_start_), range_end(range_start_ + range_length) {}
+
+  RangeOStream& write(const char* buf, std::streamsize count) override;
+  RangeOStream& put(char chr) override;
+  void flush() override { ostream->flush(); }
+  std::ostream::pos_type tellp() override { return current_pos; }
+  RangeOStream& seekp(std::ostream::off_type offset, std::ios_base::seekdir dir) override;
+
+  bool eof() override { return ostream->eof(); }
+  bool good() override { return ostream->good(); }
+  bool bad() override { return ostream->bad(); }
+  void clear() override { ostream->clear(); }
+};
+
+// Passes everything written to it to the wrapped ostream, also keeping a copy in memory unless more than max_copy_size bytes get written
+class CopyingOStream : public OStreamLike {
+  OStreamLike* ostream;
+  uint64_t max_copy_size;
+  std::shared_ptr<std::vector<char>> copy = std::make_shared<std::vector<char>>();
+  uint64_t dataLength = 0;
+public:
+  CopyingOStream(OStreamLike* ostream_, uint64_t max_copy_size_) : ostream(ostream_), max_copy_size(max_copy_size_) {}
+
+  CopyingOStream& write(const char* buf, std::streamsize count) override;
+  CopyingOStream& put(char chr) override;
+  void flush() override { ostream->flush(); }
+  std::ostream::pos_type tellp() override { return ostream->tellp(); }
+  CopyingOStream& seekp(std::ostream::off_type offset, std::ios_base::seekdir dir) override;
+
+  bool eof() override { return ostream->eof(); }
+  bool good() override { return ostream->good(); }
+  bool bad() override { return ostream->bad(); }
+  void clear() override { ostream->clear(); }
+
+  // Everything written so far, or nullptr if it was too much to keep
+  std::shared_ptr<std::vector<char>> get_copy() const { return dataLength <= max_copy_size ? copy : nullptr; }
+};
+
+// How many bytes a group of SpillingOStreams can keep in memory between all of them
+class SpillBudget {
+  std::atomic<long long> used = 0;
+  const long long limit;
+  // What is taken is added here too, so it counts against the memory limit diagnostic
+  MemoryAccount* account;
+public:
+  explicit SpillBudget(long long limit_, MemoryAccount* account_ = current_memory_account()) : limit(limit_), account(account_) {}
+
+  // Returns false, taking nothing, if it would go over the limit
+  bool take(long long size);
+  void release(long long size);
+};
+
+// Keeps everything written to it in memory for as long as its SpillBudget allows, then moves it to a temporary file and keeps writing there.
+// Once everything is written, input() gives it back from the start.
+class SpillingOStream : public OStreamLike {
+  // Budget is taken this much at a time, so small writes don't each go through the shared counter
+  static constexpr long long BUDGET_STEP = 64 * 1024;
+
+  SpillBudget& budget;
+  std::string spill_file_name;
+  std::vector<char> memory_data;
+  long long memory_budget_taken = 0;
+  std::unique_ptr<PrecompTmpFile> file_data;
+  std::unique_ptr<IStreamLike> memory_input;
+  long long dataLength = 0;
+
+  void spill();
+public:
+  SpillingOStream(SpillBudget& budget_, std::string spill_file_name_) : budget(budget_), spill_file_name(std::move(spill_file_name_)) {}
+  ~SpillingOStream() override { budget.release(memory_budget_taken); }
+
+  SpillingOStream& write(const char* buf, std::streamsize count) override;
+  SpillingOStream& put(char chr) override;
+  void flush() override {}
+  std::ostream::pos_type tellp() override { return dataLength; }
+  SpillingOStream& seekp(std::ostream::off_type offset, std::ios_base::seekdir dir) override;
+
+  bool eof() override { return false; }
+  bool good() override { return !file_data || file_data->good(); }
+  bool bad() override { return file_data && file_data->bad(); }
+  void clear() override { if (file_data) file_data->clear(); }
+
+  bool spilled() const { return file_data != nullptr; }
+  // No more writing after this
+  IStreamLike& input();
+};
+
+// Reads several IStreamLikes of known sizes one after the other as if they were a single stream, each part must be positioned at its start when added
+class ChainedIStream : public IStreamLike {
+  struct Part {
+    std::unique_ptr<IStreamLike> istream;
+    long long start_pos;
+    long long size;
+  };
+  std::vector<Part> parts;
+  size_t current_part = 0;
+  long long current_stream_pos = 0;
+  long long total_size = 0;
+  std::streamsize _gcount = 0;
+  bool _eof = false;
+  bool _bad = false;
+public:
+  void add_part(std::unique_ptr<IStreamLike>&& istream, long long size);
+  long long size() const { return total_size; }
+
+  ChainedIStream& read(char* buff, std::streamsize count) override;
+  std::istream::int_type get() override;
+  std::streamsize gcount() override { return _gcount; }
+  ChainedIStream& seekg(std::istream::off_type offset, std::ios_base::seekdir dir) override;
+  std::istream::pos_type tellg() override { return current_stream_pos; }
+
+  bool eof() override { return _eof; }
+  bool good() override { return !_eof && !_bad; }
+  bool bad() override { return _bad; }
+  void clear() override { _eof = false; }
+};
+
 /*
 * A PasstroughStream is a stream takes a function that takes an OStreamLike, and runs it on another thread, buffering up to a given amount of the written data in memory.
 * When the buffer is filled, the thread will stop execution until you read some from the Passthrough stream, read data is immediately discarded from the buffer, and
@@ -1,13 +1,18 @@
 #include "precomp_utils.h"
 
+#include <algorithm>
+#include <fstream>
+#include <mutex>
 #include <random>
 #include <sstream>
 
 #ifndef __unix
 #include <conio.h>
 #include <windows.h>
+#include <psapi.h>
 #else
 #include <time.h>
+#include <sys/resource.h>
 #include <sys/time.h>
 #endif
 #ifndef _WIN32
@@ -25,11 +30,54 @@
 #endif // _GLIBCXX_HAS_GTHREADS
 #endif
 
+std::atomic<TraceRecorder*> TraceRecorder::active_recorder = nullptr;
+
+bool TraceRecorder::start() {
+  TraceRecorder* expected = nullptr;
+  return active_recorder.compare_exchange_strong(expected, this, std::memory_order_acq_rel);
+}
+
+void TraceRecorder::stop() {
+  TraceRecorder* expected = this;
+  active_recorder.compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel);
+}
+
+long long TraceRecorder::now_us() const {
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_time).count();
+}
+
+void TraceRecorder::add(const char* category, const char* name, long long start_us, long long duration_us, std::string&& args) {
+  // Small sequential ids are way easier to follow on the trace viewer than the actual thread ids
+  static std::atomic<unsigned int> next_thread_id = 1;
+  thread_local unsigned int thread_id = next_thread_id++;
+
+  std::unique_lock lock(mtx);
+  events.push_back({ category, name, start_us, duration_us, thread_id, std::move(args) });
+}
+
+bool TraceRecorder::write(const std::string& file_path) {
+  std::ofstream trace_file(file_path, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+  if (!trace_file.is_open()) return false;
+
+  std::unique_lock lock(mtx);
+  trace_file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+  for (size_t i = 0; i < events.size(); i++) {
+    const auto& event = events[i];
+    trace_file << "{\"cat\": \"" << event.category << "\", \"name\": \"" << event.name << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << event.thread_id
+      << ", \"ts\": " << event.start_us << ", \"dur\": " << event.duration_us << ", \"args\": {" << event.args << "}}" << (i + 1 < events.size() ? ",\n" : "\n");
+  }
+  trace_file << "]}\n";
+  return trace_file.good();
+}
+
 std::string temp_files_tag() {
   // Generate a random 8digit tag for the temp files of a recursion level, so they don't overwrite each other
   static std::random_device rd;
   static std::mt19937 gen(rd());
   static std::uniform_int_distribution<> dis(0, 15);
+  // Temp files might be created from several threads at once when using lookahead precompression
+  static std::mutex mtx;
+  std::lock_guard lock(mtx);
 
   std::stringstream ss;
   ss << std::hex;
@@ -46,6 +94,77 @@ unsigned int auto_detected_thread_count() {
   return threads;
 }
 
+void MemoryAccount::add(long long bytes) {
+  const long long new_current = current += bytes;
+  long long old_peak = peak;
+  while (new_current > old_peak && !peak.compare_exchange_weak(old_peak, new_current)) {}
+  if (limit != 0 && new_current > limit && !limit_exceeded.exchange(true) && on_limit_exceeded) on_limit_exceeded();
+  if (parent != nullptr) parent->add(bytes);
+}
+
+thread_local MemoryAccount* thread_memory_account = nullptr;
+
+MemoryAccount* current_memory_account() { return thread_memory_account; }
+
+MemoryAccountScope::MemoryAccountScope(MemoryAccount* account) : previous_account(thread_memory_account), changed(account != nullptr) {
+  if (changed) thread_memory_account = account;
+}
+MemoryAccountScope::~MemoryAccountScope() {
+  if (changed) thread_memory_account = previous_account;
+}
+
+TrackedMemory& TrackedMemory::operator=(TrackedMemory&& other) noexcept {
+  if (this != &other) {
+    set_size(0);
+    account = other.account;
+    size = std::exchange(other.size, 0);
+  }
+  return *this;
+}
+
+void TrackedMemory::set_size(long long new_size) {
+  if (account != nullptr && new_size != size) account->add(new_size - size);
+  size = new_size;
+}
+
+void OffsetCursorSet::insert(long long offset) {
+  // Offsets are mostly added in increasing order
+  if (offsets.empty() || offset > offsets.back()) {
+    offsets.push_back(offset);
+    return;
+  }
+  const auto it = std::lower_bound(offsets.begin(), offsets.end(), offset);
+  if (*it == offset) return;
+  if (static_cast<size_t>(it - offsets.begin()) < cursor) cursor++;
+  offsets.insert(it, offset);
+}
+
+bool OffsetCursorSet::contains(long long offset) {
+  if (cursor > 0 && offsets[cursor - 1] >= offset) {
+    cursor = std::lower_bound(offsets.begin(), offsets.begin() + cursor, offset) - offsets.begin();
+  }
+  while (cursor < offsets.size() && offsets[cursor] < offset) cursor++;
+  return cursor < offsets.size() && offsets[cursor] == offset;
+}
+
+bool OffsetCursorSet::consume(long long offset) {
+  while (cursor < offsets.size() && offsets[cursor] < offset) cursor++;
+  const bool found = cursor < offsets.size() && offsets[cursor] == offset;
+  if (found) cursor++;
+  // Drop the offsets behind the cursor once they are most of the vector, so it doesn't keep growing
+  if (cursor >= 1024 && cursor * 2 >= offsets.size()) {
+    offsets.erase(offsets.begin(), offsets.begin() + cursor);
+    cursor = 0;
+  }
+  return found;
+}
+
+OffsetCursorSet OffsetCursorSet::tail(long long offset) const {
+  OffsetCursorSet result;
+  result.offsets.assign(std::lower_bound(offsets.begin(), offsets.end(), offset), offsets.end());
+  return result;
+}
+
 #ifndef _WIN32
 int ttyfd = -1;
 #endif
@@ -109,6 +228,10 @@ std::string precomp_error_msg(int error_nr, const char* extra_info) {
   }
   case ERR_BROTLI_NO_LONGER_SUPPORTED:
     return "Precompressed stream has a precompressed JPG using Brunsli with Brotli metadata compression, Brotli is no longer supported by precomp";
+  case ERR_NO_PCF_INDEX:
+    return "Input stream has no PCF index, it has to be precompressed with -index to restore only part of it";
+  case ERR_BASE_PCF_UNUSABLE:
+    return "Base PCF can't be used, it has to be precompressed with -index by this Precomp version";
   default:
     return "Unknown error";
   }
@@ -126,3 +249,34 @@ long long get_time_ms() {
   return (t.tv_sec * 1000) + (t.tv_usec / 1000);
 #endif
 }
+
+long long get_peak_rss_bytes() {
+#ifndef __unix
+  PROCESS_MEMORY_COUNTERS counters;
+  if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+  return counters.PeakWorkingSetSize;
+#else
+  rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+  return usage.ru_maxrss;
+#else
+  // In KiB everywhere else
+  return static_cast<long long>(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+long long get_thread_cpu_time_us() {
+#ifndef __unix
+  FILETIME creation_time, exit_time, kernel_time, user_time;
+  if (!GetThreadTimes(GetCurrentThread(), &creation_time, &exit_time, &kernel_time, &user_time)) return 0;
+  // FILETIMEs are in 100 nanosecond units
+  const auto to_100ns = [](const FILETIME& time) { return (static_cast<long long>(time.dwHighDateTime) << 32) | time.dwLowDateTime; };
+  return (to_100ns(kernel_time) + to_100ns(user_time)) / 10;
+#else
+  timespec t;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t) != 0) return 0;
+  return (static_cast<long long>(t.tv_sec) * 1000000) + (t.tv_nsec / 1000);
+#endif
+}
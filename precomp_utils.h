@@ -1,13 +1,230 @@
 #ifndef PRECOMP_UTILS_H
 #define PRECOMP_UTILS_H
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
 #include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 
 std::string temp_files_tag();
 
 unsigned int auto_detected_thread_count();
 
+// Records spans of work as Chrome trace_event JSON, which can be opened with Perfetto (or chrome://tracing) to see what every thread was doing at any time.
+// Spans come from all over the place, including threads that don't know which Precomp instance they are working for, so there is a single active recorder per process.
+class TraceRecorder {
+  struct Event {
+    const char* category;
+    const char* name;
+    long long start_us;
+    long long duration_us;
+    unsigned int thread_id;
+    std::string args;
+  };
+
+  static std::atomic<TraceRecorder*> active_recorder;
+
+  std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+  std::mutex mtx;
+  std::vector<Event> events;
+
+public:
+  // The recorder spans are added to, nullptr if nothing is being traced
+  static TraceRecorder* active() { return active_recorder.load(std::memory_order_acquire); }
+  // Makes this the active recorder, fails if there is already another one
+  bool start();
+  // Stops recording, anything still running on other threads must have finished by now as it might still be adding spans to this recorder otherwise
+  void stop();
+
+  long long now_us() const;
+  void add(const char* category, const char* name, long long start_us, long long duration_us, std::string&& args);
+  bool write(const std::string& file_path);
+};
+
+// Adds a span from its construction to its destruction to the active TraceRecorder, if any. Names and categories must be string literals.
+// Arguments are given as a JSON object's members (for example "\"offset\": 1234"), and are only formatted if actually tracing.
+class TraceSpan {
+  TraceRecorder* recorder = TraceRecorder::active();
+  const char* category;
+  const char* name;
+  long long start_us = recorder != nullptr ? recorder->now_us() : 0;
+  std::string args;
+
+public:
+  TraceSpan(const char* category_, const char* name_) : category(category_), name(name_) {}
+  template <typename F>
+  TraceSpan(const char* category_, const char* name_, F&& make_args) : category(category_), name(name_) {
+    if (recorder != nullptr) args = make_args();
+  }
+  ~TraceSpan() {
+    if (recorder != nullptr) recorder->add(category, name, start_us, recorder->now_us() - start_us, std::move(args));
+  }
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+};
+
+// Runs jobs on a fixed amount of threads, handing out their results in the same order the jobs were added.
+// Exceptions thrown by a job are rethrown when taking its result. Jobs that weren't started yet when the pool is destroyed are just dropped.
+template <typename T>
+class OrderedJobPool {
+  struct Job {
+    std::function<T()> func;
+    std::optional<T> result;
+    std::exception_ptr exception;
+    bool done = false;
+  };
+
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::deque<std::shared_ptr<Job>> jobs;  // every job not yet taken, in order
+  std::deque<std::shared_ptr<Job>> queued_jobs;  // jobs not yet started
+  bool stopping = false;
+  std::vector<std::thread> threads;
+
+  void worker() {
+    while (true) {
+      std::shared_ptr<Job> job;
+      {
+        std::unique_lock lock(mtx);
+        cv.wait(lock, [this]() { return stopping || !queued_jobs.empty(); });
+        if (stopping) return;
+        job = std::move(queued_jobs.front());
+        queued_jobs.pop_front();
+      }
+
+      try {
+        job->result = job->func();
+      }
+      catch (...) {
+        job->exception = std::current_exception();
+      }
+
+      std::unique_lock lock(mtx);
+      job->done = true;
+      cv.notify_all();
+    }
+  }
+
+public:
+  explicit OrderedJobPool(unsigned int thread_count) {
+    for (unsigned int i = 0; i < thread_count; i++) {
+      threads.emplace_back(&OrderedJobPool::worker, this);
+    }
+  }
+
+  ~OrderedJobPool() {
+    {
+      std::unique_lock lock(mtx);
+      stopping = true;
+      cv.notify_all();
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  }
+
+  void add(std::function<T()>&& func) {
+    auto job = std::make_shared<Job>();
+    job->func = std::move(func);
+    std::unique_lock lock(mtx);
+    jobs.push_back(job);
+    queued_jobs.push_back(std::move(job));
+    cv.notify_all();
+  }
+
+  // Amount of jobs added whose result was not taken yet
+  size_t pending() {
+    std::unique_lock lock(mtx);
+    return jobs.size();
+  }
+
+  // Waits for the oldest job not yet taken to finish and returns its result
+  T take() {
+    std::unique_lock lock(mtx);
+    auto job = std::move(jobs.front());
+    jobs.pop_front();
+    if (!job->done) {
+      TraceSpan span("wait", "wait for ordered job");
+      cv.wait(lock, [&job]() { return job->done; });
+    }
+    if (job->exception) std::rethrow_exception(job->exception);
+    return std::move(*job->result);
+  }
+};
+
+// Memory held by the biggest buffers allocated for something (like a format handler at some recursion depth), and the most it ever held at once.
+// Everything added to an account is added to its parent too, if it has one. If the account has a limit, on_limit_exceeded is called the first time it's exceeded.
+class MemoryAccount {
+public:
+  MemoryAccount* parent = nullptr;
+  std::atomic<long long> current = 0;
+  std::atomic<long long> peak = 0;
+  long long limit = 0;
+  std::function<void()> on_limit_exceeded;
+  std::atomic<bool> limit_exceeded = false;
+
+  void add(long long bytes);
+};
+
+// The account the memory allocated by the calling thread is added to, nullptr if none
+MemoryAccount* current_memory_account();
+
+// Sets the calling thread's current memory account while it exists. Does nothing if the account is nullptr.
+class MemoryAccountScope {
+  MemoryAccount* previous_account;
+  bool changed;
+public:
+  explicit MemoryAccountScope(MemoryAccount* account);
+  ~MemoryAccountScope();
+  MemoryAccountScope(const MemoryAccountScope&) = delete;
+  MemoryAccountScope& operator=(const MemoryAccountScope&) = delete;
+};
+
+// The size of a buffer, kept added to a memory account (by default the current one of the thread creating it) until destroyed
+class TrackedMemory {
+  MemoryAccount* account;
+  long long size = 0;
+public:
+  explicit TrackedMemory(MemoryAccount* account_ = current_memory_account()) : account(account_) {}
+  ~TrackedMemory() { set_size(0); }
+  TrackedMemory(const TrackedMemory&) = delete;
+  TrackedMemory& operator=(const TrackedMemory&) = delete;
+  // Moving it along with the buffer it tracks keeps the buffer on the account it was first added to
+  TrackedMemory(TrackedMemory&& other) noexcept : account(other.account), size(std::exchange(other.size, 0)) {}
+  TrackedMemory& operator=(TrackedMemory&& other) noexcept;
+
+  void set_size(long long new_size);
+};
+
+// Sorted set of offsets for code that looks them up in increasing order, as compress_file_impl does with input positions.
+// A cursor remembers where the last lookup ended up, so looking up the next position costs a single comparison unless it's in the set.
+// Looking up an earlier position than the last one is allowed, it's just slower.
+class OffsetCursorSet {
+  std::vector<long long> offsets;
+  size_t cursor = 0;
+public:
+  OffsetCursorSet() = default;
+  explicit OffsetCursorSet(const std::set<long long>& offsets_) : offsets(offsets_.begin(), offsets_.end()) {}
+
+  void insert(long long offset);
+  bool contains(long long offset);
+  // Like contains, but the offset and every one before it are removed from the set
+  bool consume(long long offset);
+  // Copy with just the offsets from this one on, with its cursor at the start
+  OffsetCursorSet tail(long long offset) const;
+};
+
 // This is to be able to print to the console during stdout mode, as prints would get mixed with actual data otherwise, and not be displayed anyway
 void print_to_console(const std::string& format);
 
@@ -52,6 +269,8 @@ constexpr auto ERR_DURING_RECOMPRESSION = 19;
 constexpr auto ERR_NO_PCF_HEADER = 20;
 constexpr auto ERR_PCF_HEADER_INCOMPATIBLE_VERSION = 21;
 constexpr auto ERR_BROTLI_NO_LONGER_SUPPORTED = 22;
+constexpr auto ERR_NO_PCF_INDEX = 23;
+constexpr auto ERR_BASE_PCF_UNUSABLE = 24;
 
 class PrecompError: public std::exception {
 public:
@@ -64,4 +283,8 @@ public:
 std::string precomp_error_msg(int error_nr, const char* extra_info = nullptr);
 
 long long get_time_ms();
+// CPU time used so far by the calling thread, in microseconds
+long long get_thread_cpu_time_us();
+// The most physical memory the process ever used at once (peak resident set size), in bytes, 0 if it can't be known
+long long get_peak_rss_bytes();
 #endif // PRECOMP_UTILS_H